@@ -277,6 +277,35 @@ class async_node_hash_map {
     return iterator(std::move(iterators), std::move(end_iterators), p);
   }
 
+  // Inserts the given value only if the key is not already in the map. Unlike
+  // insert_or_assign(), an existing value is never overwritten, which makes it
+  // suitable for filling the map from a slower backing store concurrently with
+  // writers. Returns an iterator to the value in the map and whether the
+  // insertion took place.
+  template <class K = key_type, class V = mapped_type>
+  std::pair<iterator, bool> try_emplace(const key_arg<K>& key, V&& value) {
+    const int p = get_partition(key);
+    auto [iterators, end_iterators] = get_begin_and_end_iterators();
+    absl::MutexLock l(partitioned_mu_[p].get());
+    // A buffered update implies the key is already in the map, see
+    // insert_or_assign_impl(), so flush it to return the up-to-date value.
+    if (aggregator_ != nullptr) {
+      if (partitioned_update_buffer_[p].find(key) !=
+          partitioned_update_buffer_[p].end()) {
+        auto aggregated_value = aggregator_(partitioned_update_buffer_[p][key]);
+        partitioned_hash_maps_[p]->insert_or_assign(
+            key, std::move(aggregated_value));
+        partitioned_update_buffer_[p].erase(key);
+      }
+    }
+    auto pair =
+        partitioned_hash_maps_[p]->try_emplace(key, std::forward<V>(value));
+    iterators[p] = std::move(pair.first);
+    end_iterators[p] = partitioned_hash_maps_[p]->end();
+    return {iterator(std::move(iterators), std::move(end_iterators), p),
+            pair.second};
+  }
+
   // Checks if the given key is already in the partitioned hash maps.
   template <class K = key_type>
   bool contains(const key_arg<K>& key) const {
@@ -285,6 +314,16 @@ class async_node_hash_map {
     return partitioned_hash_maps_[p]->contains(key);
   }
 
+  // Erases the given key and its buffered updates, returns the number of
+  // erased elements. Iterators to the erased element are invalidated.
+  template <class K = key_type>
+  size_t erase(const key_arg<K>& key) {
+    const int p = get_partition(key);
+    absl::MutexLock l(partitioned_mu_[p].get());
+    partitioned_update_buffer_[p].erase(key);
+    return partitioned_hash_maps_[p]->erase(key);
+  }
+
   // The API of operator [].
   template <class K = key_type, K* = nullptr>
   Value& operator[](key_arg<K>&& key) {
@@ -121,6 +121,56 @@ TEST(AsyncNodeHashTest, SinglePartition_WithAggregator) {
   EXPECT_EQ("v6,v7,v8,v9,v10", map["first"]);
 }
 
+TEST(AsyncNodeHashTest, TryEmplace) {
+  auto aggregator = [](const std::deque<std::string>& values) -> std::string {
+    return absl::StrJoin(values, ",");
+  };
+  async_node_hash_map<std::string, std::string> map(/*num_partitions=*/3,
+                                                    /*max_write_buffer_size=*/5,
+                                                    aggregator);
+  // Inserts a new key.
+  auto result = map.try_emplace("first", std::string("v1"));
+  EXPECT_TRUE(result.second);
+  EXPECT_EQ("v1", result.first->second);
+  EXPECT_EQ(1, map.size());
+
+  // An existing value is never overwritten.
+  result = map.try_emplace("first", std::string("v2"));
+  EXPECT_FALSE(result.second);
+  EXPECT_EQ("v1", result.first->second);
+
+  // Buffered updates are flushed before returning the existing value.
+  map.insert_or_assign("first", "v3");
+  map.insert_or_assign("first", "v4");
+  result = map.try_emplace("first", std::string("v5"));
+  EXPECT_FALSE(result.second);
+  EXPECT_EQ("v3,v4", result.first->second);
+  EXPECT_EQ(1, map.size());
+}
+
+TEST(AsyncNodeHashTest, Erase) {
+  auto aggregator = [](const std::deque<std::string>& values) -> std::string {
+    return absl::StrJoin(values, ",");
+  };
+  async_node_hash_map<std::string, std::string> map(/*num_partitions=*/3,
+                                                    /*max_write_buffer_size=*/5,
+                                                    aggregator);
+  map.insert_or_assign("first", "v1");
+  map.insert_or_assign("second", "v2");
+  EXPECT_EQ(0, map.erase("third"));
+  EXPECT_EQ(1, map.erase("first"));
+  EXPECT_FALSE(map.contains("first"));
+  EXPECT_EQ(1, map.size());
+
+  // Buffered updates are erased with the key.
+  map.insert_or_assign("second", "v3");
+  map.insert_or_assign("second", "v4");
+  EXPECT_EQ(1, map.erase("second"));
+  EXPECT_TRUE(map.empty());
+  map.insert_or_assign("second", "v5");
+  EXPECT_EQ("v5", map["second"]);
+}
+
 TEST(AsyncNodeHashTest, MultiplePartition_NoAggregator) {
   async_node_hash_map<std::string, std::string> map(/*num_partitions=*/5,
                                                     /*max_write_buffer_size=*/5,
@@ -0,0 +1,405 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/compressed_block_file.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "research/carls/base/io_rate_limiter.h"
+#include "research/carls/base/status_helper.h"
+#include "research/carls/base/thread_bundle.h"
+#include "tensorflow/core/lib/hash/crc32c.h"
+#include "tensorflow/core/platform/cpu_info.h"
+#include "tensorflow/core/platform/snappy.h"
+#include "zlib.h"  // third_party
+
+namespace carls {
+namespace {
+
+// Magic number at the end of a compressed block file.
+constexpr uint64_t kMagic = 0x6b636f6c62736c63;  // "clsblock"
+// Size of the footer: index size followed by the magic number.
+constexpr size_t kFooterSize = 16;
+constexpr int kDefaultBlockSize = 1 << 20;
+
+void EncodeFixed64(uint64_t value, std::string* output) {
+  for (int i = 0; i < 8; ++i) {
+    output->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+uint64_t DecodeFixed64(const char* input) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i) {
+    value |= static_cast<uint64_t>(static_cast<unsigned char>(input[i]))
+             << (8 * i);
+  }
+  return value;
+}
+
+void EncodeVarint64(uint64_t value, std::string* output) {
+  while (value >= 0x80) {
+    output->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  output->push_back(static_cast<char>(value));
+}
+
+// Decodes a varint from the front of `input`, returns false if it is corrupt.
+bool DecodeVarint64(absl::string_view* input, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && !input->empty(); shift += 7) {
+    const unsigned char byte = static_cast<unsigned char>(input->front());
+    input->remove_prefix(1);
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+absl::Status Compress(const CompressedBlockFileOptions& options,
+                      absl::string_view input, std::string* output) {
+  switch (options.compression()) {
+    case CompressedBlockFileOptions::NONE:
+      output->assign(input.data(), input.size());
+      return absl::OkStatus();
+    case CompressedBlockFileOptions::SNAPPY:
+      if (!tensorflow::port::Snappy_Compress(input.data(), input.size(),
+                                             output)) {
+        return absl::InternalError("Snappy compression is not supported.");
+      }
+      return absl::OkStatus();
+    case CompressedBlockFileOptions::ZLIB: {
+      uLongf output_size = compressBound(input.size());
+      output->resize(output_size);
+      const int level = options.zlib_compression_level() > 0
+                            ? options.zlib_compression_level()
+                            : Z_DEFAULT_COMPRESSION;
+      const int result = compress2(
+          reinterpret_cast<Bytef*>(&(*output)[0]), &output_size,
+          reinterpret_cast<const Bytef*>(input.data()), input.size(), level);
+      if (result != Z_OK) {
+        return absl::InternalError(
+            absl::StrCat("Zlib compression failed with error: ", result));
+      }
+      output->resize(output_size);
+      return absl::OkStatus();
+    }
+    default:
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unknown compression: ", options.compression()));
+  }
+}
+
+absl::Status Uncompress(CompressedBlockFileOptions::Compression compression,
+                        absl::string_view input, size_t uncompressed_size,
+                        std::string* output) {
+  switch (compression) {
+    case CompressedBlockFileOptions::NONE:
+      output->assign(input.data(), input.size());
+      break;
+    case CompressedBlockFileOptions::SNAPPY: {
+      size_t output_size = 0;
+      if (!tensorflow::port::Snappy_GetUncompressedLength(
+              input.data(), input.size(), &output_size) ||
+          output_size != uncompressed_size) {
+        return absl::InternalError("Corrupted snappy block.");
+      }
+      output->resize(output_size);
+      if (!tensorflow::port::Snappy_Uncompress(input.data(), input.size(),
+                                               &(*output)[0])) {
+        return absl::InternalError("Corrupted snappy block.");
+      }
+      break;
+    }
+    case CompressedBlockFileOptions::ZLIB: {
+      uLongf output_size = uncompressed_size;
+      output->resize(output_size);
+      const int result =
+          uncompress(reinterpret_cast<Bytef*>(&(*output)[0]), &output_size,
+                     reinterpret_cast<const Bytef*>(input.data()),
+                     input.size());
+      if (result != Z_OK) {
+        return absl::InternalError(
+            absl::StrCat("Zlib decompression failed with error: ", result));
+      }
+      output->resize(output_size);
+      break;
+    }
+    default:
+      return absl::InvalidArgumentError(
+          absl::StrCat("Unknown compression: ", compression));
+  }
+  if (output->size() != uncompressed_size) {
+    return absl::InternalError(absl::StrCat(
+        "Inconsistent block size: ", output->size(), " vs ", uncompressed_size));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+// static
+absl::Status CompressedBlockFileWriter::Open(
+    const std::string& filepath, const CompressedBlockFileOptions& options,
+    std::unique_ptr<CompressedBlockFileWriter>* writer) {
+  CHECK(writer != nullptr);
+  if (!CompressedBlockFileOptions::Compression_IsValid(options.compression())) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Unknown compression: ", options.compression()));
+  }
+  if (options.block_size() < 0 || options.parallelism() < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid options: ", options.DebugString()));
+  }
+  if (options.zlib_compression_level() < 0 ||
+      options.zlib_compression_level() > 9) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid zlib_compression_level: ",
+                     options.zlib_compression_level()));
+  }
+  std::unique_ptr<tensorflow::WritableFile> file;
+  RET_CHECK_OK(ToAbslStatus(
+      tensorflow::Env::Default()->NewWritableFile(filepath, &file)))
+      << "Creating file failed: " << filepath;
+  writer->reset(new CompressedBlockFileWriter(options, std::move(file)));
+  return absl::OkStatus();
+}
+
+CompressedBlockFileWriter::CompressedBlockFileWriter(
+    const CompressedBlockFileOptions& options,
+    std::unique_ptr<tensorflow::WritableFile> file)
+    : options_(options),
+      block_size_(options.block_size() > 0 ? options.block_size()
+                                           : kDefaultBlockSize),
+      parallelism_(options.parallelism() > 0
+                       ? options.parallelism()
+                       : tensorflow::port::MaxParallelism()),
+      file_(std::move(file)) {
+  index_.set_compression(options.compression());
+}
+
+CompressedBlockFileWriter::~CompressedBlockFileWriter() {
+  if (!closed_) {
+    const auto status = Close();
+    if (!status.ok()) {
+      LOG(ERROR) << "Closing compressed block file failed: " << status;
+    }
+  }
+}
+
+absl::Status CompressedBlockFileWriter::Append(absl::string_view record) {
+  if (closed_) {
+    return absl::FailedPreconditionError("File is already closed.");
+  }
+  if (pending_blocks_.empty() || pending_blocks_.back().size() >= block_size_) {
+    if (pending_blocks_.size() >= static_cast<size_t>(parallelism_)) {
+      RET_CHECK_OK(WritePendingBlocks());
+    }
+    pending_blocks_.emplace_back();
+    pending_blocks_.back().reserve(block_size_);
+    pending_num_records_.push_back(0);
+  }
+  std::string& block = pending_blocks_.back();
+  EncodeVarint64(record.size(), &block);
+  block.append(record.data(), record.size());
+  ++pending_num_records_.back();
+  return absl::OkStatus();
+}
+
+absl::Status CompressedBlockFileWriter::WritePendingBlocks() {
+  const int num_blocks = pending_blocks_.size();
+  std::vector<std::string> compressed_blocks(num_blocks);
+  std::vector<absl::Status> statuses(num_blocks);
+  if (num_blocks == 1) {
+    statuses[0] = Compress(options_, pending_blocks_[0], &compressed_blocks[0]);
+  } else {
+    ThreadBundle bundle;
+    for (int i = 0; i < num_blocks; ++i) {
+      bundle.Add([this, i, &compressed_blocks, &statuses]() {
+        statuses[i] =
+            Compress(options_, pending_blocks_[i], &compressed_blocks[i]);
+      });
+    }
+    bundle.JoinAll();
+  }
+
+  // Blocks are appended in their original order.
+  for (int i = 0; i < num_blocks; ++i) {
+    RET_CHECK_OK(statuses[i]);
+    const std::string& compressed = compressed_blocks[i];
+    ThrottleFileWrite(compressed.size());
+    RET_CHECK_OK(ToAbslStatus(file_->Append(compressed)))
+        << "Appending file failed.";
+    auto* block = index_.add_block();
+    block->set_offset(offset_);
+    block->set_compressed_size(compressed.size());
+    block->set_uncompressed_size(pending_blocks_[i].size());
+    block->set_num_records(pending_num_records_[i]);
+    block->set_crc32c(
+        tensorflow::crc32c::Value(compressed.data(), compressed.size()));
+    index_.set_num_records(index_.num_records() + pending_num_records_[i]);
+    offset_ += compressed.size();
+  }
+  pending_blocks_.clear();
+  pending_num_records_.clear();
+  return absl::OkStatus();
+}
+
+absl::Status CompressedBlockFileWriter::Close() {
+  if (closed_) {
+    return absl::FailedPreconditionError("File is already closed.");
+  }
+  closed_ = true;
+  RET_CHECK_OK(WritePendingBlocks());
+  std::string footer;
+  RET_CHECK_TRUE(index_.SerializeToString(&footer))
+      << "Serializing index failed.";
+  EncodeFixed64(footer.size(), &footer);
+  EncodeFixed64(kMagic, &footer);
+  ThrottleFileWrite(footer.size());
+  RET_CHECK_OK(ToAbslStatus(file_->Append(footer)))
+      << "Appending file failed.";
+  RET_CHECK_OK(ToAbslStatus(file_->Close())) << "Closing file failed.";
+  return absl::OkStatus();
+}
+
+// static
+absl::Status CompressedBlockFileReader::Open(
+    const std::string& filepath,
+    std::unique_ptr<CompressedBlockFileReader>* reader) {
+  CHECK(reader != nullptr);
+  std::unique_ptr<tensorflow::ReadOnlyMemoryRegion> file;
+  RET_CHECK_OK(ToAbslStatus(
+      tensorflow::Env::Default()->NewReadOnlyMemoryRegionFromFile(filepath,
+                                                                  &file)))
+      << "Reading file failed: " << filepath;
+  const char* data = static_cast<const char*>(file->data());
+  const uint64_t length = file->length();
+  if (length < kFooterSize || DecodeFixed64(data + length - 8) != kMagic) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Not a compressed block file: ", filepath));
+  }
+  const uint64_t index_size = DecodeFixed64(data + length - kFooterSize);
+  if (index_size > length - kFooterSize) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Corrupted index size in: ", filepath));
+  }
+  const uint64_t index_offset = length - kFooterSize - index_size;
+  CompressedBlockFileIndex index;
+  if (!index.ParseFromArray(data + index_offset, index_size)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Corrupted index in: ", filepath));
+  }
+  for (const auto& block : index.block()) {
+    if (block.offset() < 0 || block.compressed_size() < 0 ||
+        static_cast<uint64_t>(block.offset() + block.compressed_size()) >
+            index_offset) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Invalid block in: ", filepath, ", ", block.DebugString()));
+    }
+  }
+  reader->reset(new CompressedBlockFileReader(std::move(file), index));
+  return absl::OkStatus();
+}
+
+CompressedBlockFileReader::CompressedBlockFileReader(
+    std::unique_ptr<tensorflow::ReadOnlyMemoryRegion> file,
+    CompressedBlockFileIndex index)
+    : file_(std::move(file)), index_(std::move(index)) {}
+
+absl::Status CompressedBlockFileReader::ReadBlock(
+    int block_index, std::string* block_data,
+    std::vector<absl::string_view>* records) const {
+  CHECK(block_data != nullptr);
+  CHECK(records != nullptr);
+  if (block_index < 0 || block_index >= num_blocks()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Block index out of range: ", block_index));
+  }
+  const auto& block = index_.block(block_index);
+  const absl::string_view compressed(
+      static_cast<const char*>(file_->data()) + block.offset(),
+      block.compressed_size());
+  if (tensorflow::crc32c::Value(compressed.data(), compressed.size()) !=
+      block.crc32c()) {
+    return absl::DataLossError(
+        absl::StrCat("Checksum mismatch for block ", block_index));
+  }
+  RET_CHECK_OK(Uncompress(index_.compression(), compressed,
+                          block.uncompressed_size(), block_data));
+
+  records->clear();
+  records->reserve(block.num_records());
+  absl::string_view input(*block_data);
+  while (!input.empty()) {
+    uint64_t size = 0;
+    if (!DecodeVarint64(&input, &size) || size > input.size()) {
+      return absl::DataLossError(
+          absl::StrCat("Corrupted record in block ", block_index));
+    }
+    records->push_back(input.substr(0, size));
+    input.remove_prefix(size);
+  }
+  if (records->size() != static_cast<size_t>(block.num_records())) {
+    return absl::DataLossError(absl::StrCat(
+        "Inconsistent number of records in block ", block_index, ": ",
+        records->size(), " vs ", block.num_records()));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status CompressedBlockFileReader::ForEachBlock(
+    int parallelism, const BlockFunction& fn) const {
+  if (parallelism <= 0) {
+    parallelism = tensorflow::port::MaxParallelism();
+  }
+  const int num_workers = std::min(parallelism, num_blocks());
+  std::atomic<int> next_block(0);
+  absl::Mutex mu;
+  absl::Status first_error;
+  auto worker = [this, &fn, &next_block, &mu, &first_error]() {
+    std::string block_data;
+    std::vector<absl::string_view> records;
+    for (int i = next_block++; i < num_blocks(); i = next_block++) {
+      absl::Status status = ReadBlock(i, &block_data, &records);
+      if (status.ok()) {
+        status = fn(i, records);
+      }
+      if (!status.ok()) {
+        absl::MutexLock lock(&mu);
+        if (first_error.ok()) first_error = status;
+        // Stops the other workers from reading more blocks.
+        next_block = num_blocks();
+        return;
+      }
+    }
+  };
+  if (num_workers <= 1) {
+    worker();
+  } else {
+    ThreadBundle bundle;
+    for (int i = 0; i < num_workers; ++i) {
+      bundle.Add(worker);
+    }
+    bundle.JoinAll();
+  }
+  return first_error;
+}
+
+}  // namespace carls
@@ -0,0 +1,133 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_COMPRESSED_BLOCK_FILE_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_COMPRESSED_BLOCK_FILE_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "research/carls/base/compressed_block_file.pb.h"  // proto to pb
+#include "tensorflow/core/platform/env.h"
+
+namespace carls {
+
+// A compressed block file stores a sequence of records in blocks that are
+// compressed independently, followed by an index of the blocks:
+//
+//   [block 0] ... [block N-1] [CompressedBlockFileIndex] [index size] [magic]
+//
+// Blocks are compressed and decompressed in parallel, and each block can be
+// read on its own through the index. It is used for writing large checkpoints.
+//
+// Example Usage:
+//
+//   std::unique_ptr<CompressedBlockFileWriter> writer;
+//   RET_CHECK_OK(CompressedBlockFileWriter::Open(filepath, options, &writer));
+//   for (...) {
+//     RET_CHECK_OK(writer->Append(record));
+//   }
+//   RET_CHECK_OK(writer->Close());
+//
+//   std::unique_ptr<CompressedBlockFileReader> reader;
+//   RET_CHECK_OK(CompressedBlockFileReader::Open(filepath, &reader));
+//   RET_CHECK_OK(reader->ForEachBlock(/*parallelism=*/0, fn));
+//
+class CompressedBlockFileWriter {
+ public:
+  // Creates a writer of the given file, existing file is overwritten.
+  static absl::Status Open(const std::string& filepath,
+                           const CompressedBlockFileOptions& options,
+                           std::unique_ptr<CompressedBlockFileWriter>* writer);
+
+  CompressedBlockFileWriter(const CompressedBlockFileWriter&) = delete;
+  CompressedBlockFileWriter& operator=(const CompressedBlockFileWriter&) =
+      delete;
+
+  // Calls Close() if it has not been called yet.
+  ~CompressedBlockFileWriter();
+
+  // Appends a record to the file.
+  absl::Status Append(absl::string_view record);
+
+  // Writes the remaining blocks and the index, then closes the file.
+  // It is illegal to Append() new records after calling Close().
+  absl::Status Close();
+
+ private:
+  CompressedBlockFileWriter(const CompressedBlockFileOptions& options,
+                            std::unique_ptr<tensorflow::WritableFile> file);
+
+  // Compresses the pending blocks in parallel and appends them to the file.
+  absl::Status WritePendingBlocks();
+
+  const CompressedBlockFileOptions options_;
+  const size_t block_size_;
+  const int parallelism_;
+  std::unique_ptr<tensorflow::WritableFile> file_;
+  // Uncompressed blocks that are not yet written, the last one is the block
+  // being filled.
+  std::vector<std::string> pending_blocks_;
+  std::vector<int64_t> pending_num_records_;
+  // Index of the blocks written so far.
+  CompressedBlockFileIndex index_;
+  int64_t offset_ = 0;
+  bool closed_ = false;
+};
+
+// Reads a file written by CompressedBlockFileWriter.
+class CompressedBlockFileReader {
+ public:
+  // Function called on the records of a block. The records are only valid
+  // during the call.
+  using BlockFunction = std::function<absl::Status(
+      int block_index, const std::vector<absl::string_view>& records)>;
+
+  // Opens the given file and reads its index.
+  static absl::Status Open(const std::string& filepath,
+                           std::unique_ptr<CompressedBlockFileReader>* reader);
+
+  // Returns the index of the blocks.
+  const CompressedBlockFileIndex& index() const { return index_; }
+
+  // Returns the number of blocks in the file.
+  int num_blocks() const { return index_.block_size(); }
+
+  // Reads the given block. `records` points into `block_data`.
+  absl::Status ReadBlock(int block_index, std::string* block_data,
+                         std::vector<absl::string_view>* records) const;
+
+  // Reads all the blocks with up to `parallelism` blocks decompressed at the
+  // same time, and calls `fn` on each of them. `fn` may be called concurrently
+  // and in any order of the blocks. Returns the first error of reading or
+  // from `fn`. If `parallelism` <= 0, it uses the number of CPUs.
+  absl::Status ForEachBlock(int parallelism, const BlockFunction& fn) const;
+
+ private:
+  CompressedBlockFileReader(
+      std::unique_ptr<tensorflow::ReadOnlyMemoryRegion> file,
+      CompressedBlockFileIndex index);
+
+  std::unique_ptr<tensorflow::ReadOnlyMemoryRegion> file_;
+  const CompressedBlockFileIndex index_;
+};
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_COMPRESSED_BLOCK_FILE_H_
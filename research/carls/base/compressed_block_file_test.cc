@@ -0,0 +1,178 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/compressed_block_file.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "research/carls/base/file_helper.h"
+
+namespace carls {
+namespace {
+
+using ::testing::TempDir;
+
+void WriteRecords(const std::string& filepath,
+                  const CompressedBlockFileOptions& options, int num_records) {
+  std::unique_ptr<CompressedBlockFileWriter> writer;
+  ASSERT_TRUE(CompressedBlockFileWriter::Open(filepath, options, &writer).ok());
+  for (int i = 0; i < num_records; ++i) {
+    ASSERT_TRUE(writer->Append(absl::StrCat("record_", i)).ok());
+  }
+  ASSERT_TRUE(writer->Close().ok());
+}
+
+class CompressedBlockFileTest
+    : public ::testing::TestWithParam<CompressedBlockFileOptions::Compression> {
+};
+
+TEST_P(CompressedBlockFileTest, WriteAndRead) {
+  const std::string filepath =
+      JoinPath(TempDir(), absl::StrCat("write_and_read_", GetParam()));
+  CompressedBlockFileOptions options;
+  options.set_compression(GetParam());
+  options.set_block_size(100);
+  options.set_parallelism(3);
+  WriteRecords(filepath, options, 1000);
+
+  std::unique_ptr<CompressedBlockFileReader> reader;
+  ASSERT_TRUE(CompressedBlockFileReader::Open(filepath, &reader).ok());
+  EXPECT_EQ(GetParam(), reader->index().compression());
+  EXPECT_EQ(1000, reader->index().num_records());
+  EXPECT_LT(1, reader->num_blocks());
+
+  // Random access of a block.
+  std::string block_data;
+  std::vector<absl::string_view> records;
+  ASSERT_TRUE(reader->ReadBlock(0, &block_data, &records).ok());
+  ASSERT_FALSE(records.empty());
+  EXPECT_EQ("record_0", records[0]);
+  EXPECT_FALSE(
+      reader->ReadBlock(reader->num_blocks(), &block_data, &records).ok());
+
+  // Reads all the blocks in parallel.
+  absl::Mutex mu;
+  std::vector<std::vector<std::string>> blocks(reader->num_blocks());
+  ASSERT_TRUE(reader
+                  ->ForEachBlock(
+                      /*parallelism=*/4,
+                      [&mu, &blocks](
+                          int block_index,
+                          const std::vector<absl::string_view>& records) {
+                        absl::MutexLock lock(&mu);
+                        for (const auto& record : records) {
+                          blocks[block_index].emplace_back(record);
+                        }
+                        return absl::OkStatus();
+                      })
+                  .ok());
+  int i = 0;
+  for (const auto& block : blocks) {
+    for (const auto& record : block) {
+      EXPECT_EQ(absl::StrCat("record_", i++), record);
+    }
+  }
+  EXPECT_EQ(1000, i);
+}
+
+INSTANTIATE_TEST_SUITE_P(AllCompressions, CompressedBlockFileTest,
+                         ::testing::Values(CompressedBlockFileOptions::NONE,
+                                           CompressedBlockFileOptions::SNAPPY,
+                                           CompressedBlockFileOptions::ZLIB));
+
+TEST(CompressedBlockFileWriterTest, EmptyFile) {
+  const std::string filepath = JoinPath(TempDir(), "empty_file");
+  WriteRecords(filepath, CompressedBlockFileOptions(), 0);
+
+  std::unique_ptr<CompressedBlockFileReader> reader;
+  ASSERT_TRUE(CompressedBlockFileReader::Open(filepath, &reader).ok());
+  EXPECT_EQ(0, reader->num_blocks());
+  EXPECT_TRUE(reader
+                  ->ForEachBlock(0,
+                                 [](int, const std::vector<absl::string_view>&) {
+                                   return absl::InternalError("Not called.");
+                                 })
+                  .ok());
+}
+
+TEST(CompressedBlockFileWriterTest, InvalidOptions) {
+  std::unique_ptr<CompressedBlockFileWriter> writer;
+  CompressedBlockFileOptions options;
+  options.set_block_size(-1);
+  EXPECT_FALSE(CompressedBlockFileWriter::Open(
+                   JoinPath(TempDir(), "invalid"), options, &writer)
+                   .ok());
+
+  options.Clear();
+  options.set_zlib_compression_level(10);
+  EXPECT_FALSE(CompressedBlockFileWriter::Open(
+                   JoinPath(TempDir(), "invalid"), options, &writer)
+                   .ok());
+}
+
+TEST(CompressedBlockFileWriterTest, AppendAfterClose) {
+  std::unique_ptr<CompressedBlockFileWriter> writer;
+  ASSERT_TRUE(CompressedBlockFileWriter::Open(
+                  JoinPath(TempDir(), "append_after_close"),
+                  CompressedBlockFileOptions(), &writer)
+                  .ok());
+  ASSERT_TRUE(writer->Close().ok());
+  EXPECT_FALSE(writer->Append("record").ok());
+}
+
+TEST(CompressedBlockFileReaderTest, ErrorFromBlockFunction) {
+  const std::string filepath = JoinPath(TempDir(), "error_from_block_function");
+  CompressedBlockFileOptions options;
+  options.set_block_size(10);
+  WriteRecords(filepath, options, 100);
+
+  std::unique_ptr<CompressedBlockFileReader> reader;
+  ASSERT_TRUE(CompressedBlockFileReader::Open(filepath, &reader).ok());
+  const auto status = reader->ForEachBlock(
+      /*parallelism=*/2, [](int block_index,
+                            const std::vector<absl::string_view>& records) {
+        if (block_index == 5) return absl::InternalError("Bad block.");
+        return absl::OkStatus();
+      });
+  EXPECT_EQ("Bad block.", status.message());
+}
+
+TEST(CompressedBlockFileReaderTest, CorruptedFile) {
+  const std::string filepath = JoinPath(TempDir(), "corrupted_file");
+  CompressedBlockFileOptions options;
+  options.set_compression(CompressedBlockFileOptions::ZLIB);
+  WriteRecords(filepath, options, 100);
+
+  std::string content;
+  ASSERT_TRUE(ReadFileString(filepath, &content).ok());
+  content[0] ^= 0xff;
+  ASSERT_TRUE(WriteFileString(filepath, content, /*can_overwrite=*/true).ok());
+  std::unique_ptr<CompressedBlockFileReader> reader;
+  ASSERT_TRUE(CompressedBlockFileReader::Open(filepath, &reader).ok());
+  std::string block_data;
+  std::vector<absl::string_view> records;
+  EXPECT_EQ(absl::StatusCode::kDataLoss,
+            reader->ReadBlock(0, &block_data, &records).code());
+
+  // Not a compressed block file.
+  ASSERT_TRUE(
+      WriteFileString(filepath, "some text", /*can_overwrite=*/true).ok());
+  EXPECT_FALSE(CompressedBlockFileReader::Open(filepath, &reader).ok());
+}
+
+}  // namespace
+}  // namespace carls
@@ -15,6 +15,10 @@ limitations under the License.
 
 #include "research/carls/base/embedding_helper.h"
 
+#include <cmath>
+
+#include "research/carls/base/embedding_kernels.h"
+
 namespace carls {
 
 InMemoryEmbeddingVector::InMemoryEmbeddingVector(
@@ -55,78 +59,100 @@ tensorflow::Tensor ToTensorFlowTensor(const EmbeddingVectorProto& proto) {
   return output;
 }
 
-template <>
-bool ComputeCosineSimilarity(const Eigen::VectorXf& first,
-                             const Eigen::VectorXf& second, float* result) {
+namespace {
+
+// Shared implementation of the ComputeCosineSimilarity specializations on the
+// raw values.
+bool CosineSimilarity(const float* first, int first_size, const float* second,
+                      int second_size, float* result) {
   if (result == nullptr) {
     return false;
   }
-  if (first.size() != second.size() || first.size() == 0) {
+  if (first_size != second_size || first_size == 0) {
     return false;
   }
-  const float norm = first.norm() * second.norm();
+  const auto& kernels = GetEmbeddingKernels(first_size);
+  const float norm = std::sqrt(kernels.squared_norm(first, first_size)) *
+                     std::sqrt(kernels.squared_norm(second, second_size));
   if (std::abs(norm) < 1e-6) {
     return false;
   }
-  *result = first.dot(second) / norm;
+  *result = kernels.dot(first, second, first_size) / norm;
+  return true;
+}
+
+// Shared implementation of the ComputeDotProduct specializations on the raw
+// values.
+bool DotProduct(const float* first, int first_size, const float* second,
+                int second_size, float* result) {
+  if (result == nullptr) {
+    return false;
+  }
+  if (first_size != second_size || first_size == 0) {
+    return false;
+  }
+  *result = GetEmbeddingKernels(first_size).dot(first, second, first_size);
   return true;
 }
 
+}  // namespace
+
+template <>
+bool ComputeCosineSimilarity(const Eigen::VectorXf& first,
+                             const Eigen::VectorXf& second, float* result) {
+  return CosineSimilarity(first.data(), first.size(), second.data(),
+                          second.size(), result);
+}
+
 template <>
 bool ComputeCosineSimilarity(const EmbeddingVectorProto& first,
                              const EmbeddingVectorProto& second,
                              float* result) {
-  return ComputeCosineSimilarity(ToInMemoryEmbeddingVector(first).vec,
-                                 ToInMemoryEmbeddingVector(second).vec, result);
+  return CosineSimilarity(first.value().data(), first.value_size(),
+                          second.value().data(), second.value_size(), result);
 }
 
 template <>
 bool ComputeCosineSimilarity(const Eigen::VectorXf& first,
                              const EmbeddingVectorProto& second,
                              float* result) {
-  return ComputeCosineSimilarity(first, ToInMemoryEmbeddingVector(second).vec,
-                                 result);
+  return CosineSimilarity(first.data(), first.size(), second.value().data(),
+                          second.value_size(), result);
 }
 
 template <>
 bool ComputeCosineSimilarity(const EmbeddingVectorProto& first,
                              const Eigen::VectorXf& second, float* result) {
-  return ComputeCosineSimilarity(ToInMemoryEmbeddingVector(first).vec, second,
-                                 result);
+  return CosineSimilarity(first.value().data(), first.value_size(),
+                          second.data(), second.size(), result);
 }
 
 template <>
 bool ComputeDotProduct(const Eigen::VectorXf& first,
                        const Eigen::VectorXf& second, float* result) {
-  if (result == nullptr) {
-    return false;
-  }
-  if (first.size() != second.size() || first.size() == 0) {
-    return false;
-  }
-  *result = first.dot(second);
-  return true;
+  return DotProduct(first.data(), first.size(), second.data(), second.size(),
+                    result);
 }
 
 template <>
 bool ComputeDotProduct(const EmbeddingVectorProto& first,
                        const EmbeddingVectorProto& second, float* result) {
-  return ComputeDotProduct(ToInMemoryEmbeddingVector(first).vec,
-                           ToInMemoryEmbeddingVector(second).vec, result);
+  return DotProduct(first.value().data(), first.value_size(),
+                    second.value().data(), second.value_size(), result);
 }
 
 template <>
 bool ComputeDotProduct(const Eigen::VectorXf& first,
                        const EmbeddingVectorProto& second, float* result) {
-  return ComputeDotProduct(first, ToInMemoryEmbeddingVector(second).vec,
-                           result);
+  return DotProduct(first.data(), first.size(), second.value().data(),
+                    second.value_size(), result);
 }
 
 template <>
 bool ComputeDotProduct(const EmbeddingVectorProto& first,
                        const Eigen::VectorXf& second, float* result) {
-  return ComputeDotProduct(ToInMemoryEmbeddingVector(first).vec, second,
-                           result);
+  return DotProduct(first.value().data(), first.value_size(), second.data(),
+                    second.size(), result);
 }
 
 }  // namespace carls
@@ -0,0 +1,106 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/embedding_kernels.h"
+
+#include "third_party/eigen3/Eigen/Core"
+
+namespace carls {
+namespace {
+
+// kDim is either a positive compile-time dimension or Eigen::Dynamic. Eigen
+// maps accept a runtime size in both cases, and for the fixed-size ones it
+// must match kDim.
+template <int kDim>
+using ConstVecMap = Eigen::Map<const Eigen::Matrix<float, kDim, 1>>;
+template <int kDim>
+using VecMap = Eigen::Map<Eigen::Matrix<float, kDim, 1>>;
+
+template <int kDim>
+float Dot(const float* a, const float* b, int dimension) {
+  return ConstVecMap<kDim>(a, dimension).dot(ConstVecMap<kDim>(b, dimension));
+}
+
+template <int kDim>
+float SquaredNorm(const float* a, int dimension) {
+  return ConstVecMap<kDim>(a, dimension).squaredNorm();
+}
+
+template <int kDim>
+float SquaredDistance(const float* a, const float* b, int dimension) {
+  return (ConstVecMap<kDim>(a, dimension) - ConstVecMap<kDim>(b, dimension))
+      .squaredNorm();
+}
+
+template <int kDim>
+void SgdUpdate(const float* var, const float* grad, float learning_rate,
+               int dimension, float* output) {
+  VecMap<kDim>(output, dimension) =
+      ConstVecMap<kDim>(var, dimension) -
+      learning_rate * ConstVecMap<kDim>(grad, dimension);
+}
+
+template <int kDim>
+void AdagradUpdate(const float* var, const float* grad, float learning_rate,
+                   int dimension, float* accum, float* output) {
+  ConstVecMap<kDim> g(grad, dimension);
+  VecMap<kDim> acc(accum, dimension);
+  acc.array() += g.array().square();
+  VecMap<kDim>(output, dimension) =
+      ConstVecMap<kDim>(var, dimension).array() -
+      learning_rate * g.array() / acc.array().sqrt();
+}
+
+template <int kDim>
+constexpr EmbeddingKernels MakeKernels() {
+  return EmbeddingKernels{kDim == Eigen::Dynamic ? 0 : kDim,
+                          &Dot<kDim>,
+                          &SquaredNorm<kDim>,
+                          &SquaredDistance<kDim>,
+                          &SgdUpdate<kDim>,
+                          &AdagradUpdate<kDim>};
+}
+
+constexpr EmbeddingKernels kGenericKernels = MakeKernels<Eigen::Dynamic>();
+
+// Dispatch table of the specialized dimensions. Keep sorted.
+constexpr EmbeddingKernels kSpecializedKernels[] = {
+    MakeKernels<8>(),   MakeKernels<16>(),  MakeKernels<32>(),
+    MakeKernels<64>(),  MakeKernels<128>(), MakeKernels<256>(),
+    MakeKernels<512>(),
+};
+
+}  // namespace
+
+const EmbeddingKernels& GetEmbeddingKernels(const int dimension) {
+  for (const auto& kernels : kSpecializedKernels) {
+    if (kernels.specialized_dimension == dimension) {
+      return kernels;
+    }
+  }
+  return kGenericKernels;
+}
+
+const EmbeddingKernels& GetGenericEmbeddingKernels() { return kGenericKernels; }
+
+std::vector<int> SpecializedEmbeddingDimensions() {
+  std::vector<int> dimensions;
+  for (const auto& kernels : kSpecializedKernels) {
+    dimensions.push_back(kernels.specialized_dimension);
+  }
+  return dimensions;
+}
+
+}  // namespace carls
@@ -0,0 +1,74 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_EMBEDDING_KERNELS_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_EMBEDDING_KERNELS_H_
+
+#include <vector>
+
+namespace carls {
+
+// A table of vector kernels on raw float arrays of a fixed embedding
+// dimension. For the common embedding sizes (8, 16, 32, 64, 128, 256 and 512)
+// the kernels are compiled with the dimension as a template constant so that
+// the loops can be fully vectorized/unrolled; any other dimension uses the
+// generic kernels.
+//
+// Callers are expected to look up the kernels once (e.g., when a session or
+// optimizer is created from DynamicEmbeddingConfig.embedding_dimension) and
+// keep the returned reference, which is valid for the lifetime of the program.
+//
+// Every pointer argument must point to at least `dimension` floats.
+struct EmbeddingKernels {
+  // Dimension the kernels were specialized for, or 0 for the generic kernels.
+  int specialized_dimension;
+
+  // Returns sum_i a[i] * b[i].
+  float (*dot)(const float* a, const float* b, int dimension);
+
+  // Returns sum_i a[i] * a[i].
+  float (*squared_norm)(const float* a, int dimension);
+
+  // Returns sum_i (a[i] - b[i])^2.
+  float (*squared_distance)(const float* a, const float* b, int dimension);
+
+  // SGD update: output[i] = var[i] - learning_rate * grad[i].
+  // `output` may alias `var`.
+  void (*sgd_update)(const float* var, const float* grad, float learning_rate,
+                     int dimension, float* output);
+
+  // Adagrad update:
+  //   accum[i] += grad[i]^2
+  //   output[i] = var[i] - learning_rate * grad[i] / sqrt(accum[i])
+  // `output` may alias `var`.
+  void (*adagrad_update)(const float* var, const float* grad,
+                         float learning_rate, int dimension, float* accum,
+                         float* output);
+};
+
+// Returns the kernels for the given embedding dimension. The lookup is cheap
+// but callers on a hot path should still cache the result.
+const EmbeddingKernels& GetEmbeddingKernels(int dimension);
+
+// Returns the kernels that work for any dimension. Mostly useful for tests and
+// benchmarks comparing against the specialized versions.
+const EmbeddingKernels& GetGenericEmbeddingKernels();
+
+// Returns the list of dimensions that have specialized kernels.
+std::vector<int> SpecializedEmbeddingDimensions();
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_EMBEDDING_KERNELS_H_
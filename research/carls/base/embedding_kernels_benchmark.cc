@@ -0,0 +1,90 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Compares the dimension-specialized embedding kernels against the generic
+// ones, e.g.,
+//   bazel run -c opt //research/carls/base:embedding_kernels_benchmark
+
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "research/carls/base/embedding_kernels.h"
+
+namespace carls {
+namespace {
+
+const EmbeddingKernels& Kernels(const benchmark::State& state) {
+  const int dim = state.range(0);
+  return state.range(1) ? GetEmbeddingKernels(dim)
+                        : GetGenericEmbeddingKernels();
+}
+
+// Args are {dimension, specialized}.
+void KernelArgs(benchmark::internal::Benchmark* b) {
+  for (int dim : SpecializedEmbeddingDimensions()) {
+    b->Args({dim, 0});
+    b->Args({dim, 1});
+  }
+}
+
+void BM_Dot(benchmark::State& state) {
+  const int dim = state.range(0);
+  const auto& kernels = Kernels(state);
+  std::vector<float> a(dim, 0.5f), b(dim, 0.25f);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(kernels.dot(a.data(), b.data(), dim));
+  }
+  state.SetItemsProcessed(state.iterations() * dim);
+}
+BENCHMARK(BM_Dot)->Apply(KernelArgs);
+
+void BM_SquaredDistance(benchmark::State& state) {
+  const int dim = state.range(0);
+  const auto& kernels = Kernels(state);
+  std::vector<float> a(dim, 0.5f), b(dim, 0.25f);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(kernels.squared_distance(a.data(), b.data(), dim));
+  }
+  state.SetItemsProcessed(state.iterations() * dim);
+}
+BENCHMARK(BM_SquaredDistance)->Apply(KernelArgs);
+
+void BM_SgdUpdate(benchmark::State& state) {
+  const int dim = state.range(0);
+  const auto& kernels = Kernels(state);
+  std::vector<float> var(dim, 0.5f), grad(dim, 1e-6f);
+  for (auto _ : state) {
+    kernels.sgd_update(var.data(), grad.data(), 0.1f, dim, var.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * dim);
+}
+BENCHMARK(BM_SgdUpdate)->Apply(KernelArgs);
+
+void BM_AdagradUpdate(benchmark::State& state) {
+  const int dim = state.range(0);
+  const auto& kernels = Kernels(state);
+  std::vector<float> var(dim, 0.5f), grad(dim, 1e-6f), accum(dim, 0.1f);
+  for (auto _ : state) {
+    kernels.adagrad_update(var.data(), grad.data(), 0.1f, dim, accum.data(),
+                           var.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * dim);
+}
+BENCHMARK(BM_AdagradUpdate)->Apply(KernelArgs);
+
+}  // namespace
+}  // namespace carls
@@ -0,0 +1,99 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/embedding_kernels.h"
+
+#include <cmath>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace carls {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::FloatNear;
+using ::testing::Pointwise;
+
+std::vector<float> MakeVector(const int dimension, const float offset) {
+  std::vector<float> result(dimension);
+  for (int i = 0; i < dimension; ++i) {
+    result[i] = std::sin(i + offset);
+  }
+  return result;
+}
+
+class EmbeddingKernelsTest : public ::testing::TestWithParam<int> {};
+
+TEST_P(EmbeddingKernelsTest, MatchesReferenceImplementation) {
+  const int dim = GetParam();
+  const auto& kernels = GetEmbeddingKernels(dim);
+  const std::vector<float> a = MakeVector(dim, 0.5f);
+  const std::vector<float> b = MakeVector(dim, 1.7f);
+
+  float dot = 0, norm = 0, dist = 0;
+  for (int i = 0; i < dim; ++i) {
+    dot += a[i] * b[i];
+    norm += a[i] * a[i];
+    dist += (a[i] - b[i]) * (a[i] - b[i]);
+  }
+  const float tolerance = 1e-4f * dim;
+  EXPECT_NEAR(dot, kernels.dot(a.data(), b.data(), dim), tolerance);
+  EXPECT_NEAR(norm, kernels.squared_norm(a.data(), dim), tolerance);
+  EXPECT_NEAR(dist, kernels.squared_distance(a.data(), b.data(), dim),
+              tolerance);
+
+  // SGD.
+  std::vector<float> expected(dim), output(dim);
+  for (int i = 0; i < dim; ++i) {
+    expected[i] = a[i] - 0.1f * b[i];
+  }
+  kernels.sgd_update(a.data(), b.data(), 0.1f, dim, output.data());
+  EXPECT_THAT(output, Pointwise(FloatNear(1e-6), expected));
+
+  // Adagrad, with output aliasing the variable.
+  std::vector<float> var = a;
+  std::vector<float> accum(dim, 0.1f);
+  std::vector<float> expected_accum(dim);
+  for (int i = 0; i < dim; ++i) {
+    expected_accum[i] = 0.1f + b[i] * b[i];
+    expected[i] = a[i] - 0.1f * b[i] / std::sqrt(expected_accum[i]);
+  }
+  kernels.adagrad_update(var.data(), b.data(), 0.1f, dim, accum.data(),
+                         var.data());
+  EXPECT_THAT(accum, Pointwise(FloatNear(1e-6), expected_accum));
+  EXPECT_THAT(var, Pointwise(FloatNear(1e-6), expected));
+}
+
+// Covers every specialized dimension and a few that use the generic kernels.
+INSTANTIATE_TEST_SUITE_P(AllDimensions, EmbeddingKernelsTest,
+                         ::testing::Values(1, 7, 8, 16, 32, 33, 64, 128, 256,
+                                           512, 1000));
+
+TEST(EmbeddingKernelsDispatchTest, SelectsSpecializedKernels) {
+  EXPECT_THAT(SpecializedEmbeddingDimensions(),
+              ElementsAre(8, 16, 32, 64, 128, 256, 512));
+  for (int dim : SpecializedEmbeddingDimensions()) {
+    EXPECT_EQ(dim, GetEmbeddingKernels(dim).specialized_dimension);
+    EXPECT_NE(&GetGenericEmbeddingKernels(), &GetEmbeddingKernels(dim));
+  }
+  EXPECT_EQ(0, GetEmbeddingKernels(7).specialized_dimension);
+  EXPECT_EQ(&GetGenericEmbeddingKernels(), &GetEmbeddingKernels(7));
+  EXPECT_EQ(&GetGenericEmbeddingKernels(), &GetEmbeddingKernels(0));
+}
+
+}  // namespace
+}  // namespace carls
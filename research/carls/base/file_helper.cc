@@ -15,15 +15,25 @@ limitations under the License.
 
 #include "research/carls/base/file_helper.h"
 
+#include <algorithm>
 #include <string>
 
 #include "absl/status/status.h"
 #include "absl/strings/string_view.h"
+#include "research/carls/base/io_rate_limiter.h"
 #include "research/carls/base/status_helper.h"
 #include "tensorflow/core/platform/env.h"
 #include "tensorflow/core/public/version.h"
 
 namespace carls {
+namespace {
+
+// Size of the pieces of a file written at a time, so that a rate limited write
+// proceeds steadily instead of in one burst.
+constexpr size_t kWriteChunkSize = 1 << 20;
+
+}  // namespace
+
 namespace internal {
 
 bool IsAbsolutePath(absl::string_view path) {
@@ -100,7 +110,12 @@ absl::Status WriteFileString(const std::string& filepath,
                                      tf_status.message()));
 #endif
   }
-  tf_status = file->Append(content);
+  for (size_t offset = 0; offset < content.size() && tf_status.ok();
+       offset += kWriteChunkSize) {
+    const absl::string_view chunk = content.substr(offset, kWriteChunkSize);
+    ThrottleFileWrite(chunk.size());
+    tf_status = file->Append(chunk);
+  }
   if (!tf_status.ok()) {
     return absl::Status(absl::StatusCode::kInternal,
 #if TF_GRAPH_DEF_VERSION < 1467
@@ -159,4 +174,16 @@ absl::Status RecursivelyCreateDir(const std::string& dirname) {
   return carls::ToAbslStatus(env->RecursivelyCreateDir(dirname));
 }
 
+absl::Status RecursivelyDeleteDir(const std::string& dirname) {
+  tensorflow::Env* env = tensorflow::Env::Default();
+  int64_t undeleted_files = 0;
+  int64_t undeleted_dirs = 0;
+  RET_CHECK_OK(carls::ToAbslStatus(
+      env->DeleteRecursively(dirname, &undeleted_files, &undeleted_dirs)));
+  RET_CHECK_TRUE(undeleted_files == 0 && undeleted_dirs == 0)
+      << "Failed to delete " << undeleted_files << " files and "
+      << undeleted_dirs << " directories in " << dirname;
+  return absl::OkStatus();
+}
+
 }  // namespace carls
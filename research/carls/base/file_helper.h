@@ -84,6 +84,9 @@ std::pair<absl::string_view, absl::string_view> SplitPath(
 // Creates a path if it doesn't exist.
 absl::Status RecursivelyCreateDir(const std::string& dirname);
 
+// Deletes a directory and all its content.
+absl::Status RecursivelyDeleteDir(const std::string& dirname);
+
 }  // namespace carls
 
 #endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_FILE_HELPER_H_
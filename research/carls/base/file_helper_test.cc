@@ -55,6 +55,16 @@ TEST(FileHelperTest, IsDirectory) {
   EXPECT_TRUE(IsDirectory(dirname).ok());
 }
 
+TEST(FileHelperTest, RecursivelyDeleteDir) {
+  const std::string dirname = JoinPath(TempDir(), "/deleted_dir");
+  ASSERT_TRUE(RecursivelyCreateDir(JoinPath(dirname, "subdir")).ok());
+  ASSERT_TRUE(WriteFileString(JoinPath(dirname, "subdir/data"), "data",
+                              /*can_overwrite=*/true)
+                  .ok());
+  ASSERT_TRUE(RecursivelyDeleteDir(dirname).ok());
+  EXPECT_FALSE(IsDirectory(dirname).ok());
+}
+
 TEST(FileHelperTest, Basename) {
   EXPECT_EQ("", Basename("/hello/"));
   EXPECT_EQ("hello", Basename("/hello"));
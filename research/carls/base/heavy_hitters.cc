@@ -0,0 +1,90 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/heavy_hitters.h"
+
+#include <cmath>
+
+#include <glog/logging.h>
+
+namespace carls {
+
+HeavyHitters::HeavyHitters(const size_t capacity) : capacity_(capacity) {
+  CHECK_GT(capacity_, 0);
+}
+
+void HeavyHitters::Add(absl::string_view key, const int64_t count) {
+  if (count <= 0) {
+    return;
+  }
+  total_count_ += count;
+  auto iter = counts_.find(key);
+  if (iter != counts_.end()) {
+    ordered_.erase({iter->second, iter->first});
+    iter->second += count;
+    ordered_.emplace(iter->second, iter->first);
+    return;
+  }
+  int64_t base_count = 0;
+  if (counts_.size() >= capacity_) {
+    // Replaces the key of the smallest count.
+    auto smallest = ordered_.begin();
+    base_count = smallest->first;
+    counts_.erase(smallest->second);
+    ordered_.erase(smallest);
+  }
+  const std::string key_str(key);
+  counts_[key_str] = base_count + count;
+  ordered_.emplace(base_count + count, key_str);
+}
+
+std::vector<std::pair<std::string, int64_t>> HeavyHitters::TopKeys(
+    const double min_fraction, const size_t max_keys) const {
+  std::vector<std::pair<std::string, int64_t>> results;
+  const double min_count = min_fraction * total_count_;
+  for (auto iter = ordered_.rbegin();
+       iter != ordered_.rend() && results.size() < max_keys; ++iter) {
+    if (iter->first < min_count) {
+      break;
+    }
+    results.emplace_back(iter->second, iter->first);
+  }
+  return results;
+}
+
+int64_t HeavyHitters::EstimateCount(absl::string_view key) const {
+  auto iter = counts_.find(key);
+  return iter == counts_.end() ? 0 : iter->second;
+}
+
+void HeavyHitters::Decay(const double factor) {
+  CHECK_GE(factor, 0);
+  CHECK_LE(factor, 1);
+  std::set<std::pair<int64_t, std::string>> ordered;
+  total_count_ = std::floor(total_count_ * factor);
+  for (auto iter = counts_.begin(); iter != counts_.end();) {
+    const int64_t count = std::floor(iter->second * factor);
+    if (count == 0) {
+      counts_.erase(iter++);
+      continue;
+    }
+    iter->second = count;
+    ordered.emplace(count, iter->first);
+    ++iter;
+  }
+  ordered_ = std::move(ordered);
+}
+
+}  // namespace carls
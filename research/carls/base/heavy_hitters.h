@@ -0,0 +1,71 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_HEAVY_HITTERS_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_HEAVY_HITTERS_H_
+
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+
+namespace carls {
+
+// Finds the most frequent keys of a stream in bounded memory, using the
+// Space-Saving algorithm (Metwally et al., 2005). At most `capacity` keys are
+// tracked. A new key replaces the key of the smallest count and inherits its
+// count as the error, so the count of a key is never underestimated and is
+// overestimated by at most total_count / capacity.
+//
+// This class is not thread-safe.
+class HeavyHitters {
+ public:
+  explicit HeavyHitters(size_t capacity);
+
+  // Adds `count` occurrences of `key`.
+  void Add(absl::string_view key, int64_t count = 1);
+
+  // Returns the keys whose estimated count is at least `min_fraction` of the
+  // total count, by decreasing count, up to `max_keys` of them.
+  std::vector<std::pair<std::string, int64_t>> TopKeys(double min_fraction,
+                                                       size_t max_keys) const;
+
+  // Returns the estimated count of `key`, 0 if it is not tracked.
+  int64_t EstimateCount(absl::string_view key) const;
+
+  // Multiplies all the counts by `factor` in [0, 1], so that the old
+  // occurrences weigh less than the new ones. Keys whose count drops to 0 are
+  // removed.
+  void Decay(double factor);
+
+  int64_t total_count() const { return total_count_; }
+
+  size_t size() const { return counts_.size(); }
+
+ private:
+  const size_t capacity_;
+  int64_t total_count_ = 0;
+  // Maps from the tracked keys to their counts.
+  absl::flat_hash_map<std::string, int64_t> counts_;
+  // The tracked keys ordered by count, for finding the smallest one.
+  std::set<std::pair<int64_t, std::string>> ordered_;
+};
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_HEAVY_HITTERS_H_
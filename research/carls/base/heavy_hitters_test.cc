@@ -0,0 +1,102 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/heavy_hitters.h"
+
+#include <random>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+
+namespace carls {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Pair;
+
+TEST(HeavyHittersTest, ExactBelowCapacity) {
+  HeavyHitters heavy_hitters(/*capacity=*/10);
+  heavy_hitters.Add("a", 5);
+  heavy_hitters.Add("b");
+  heavy_hitters.Add("c", 3);
+  heavy_hitters.Add("a");
+  heavy_hitters.Add("d", 0);
+  EXPECT_EQ(10, heavy_hitters.total_count());
+  EXPECT_EQ(3, heavy_hitters.size());
+  EXPECT_EQ(6, heavy_hitters.EstimateCount("a"));
+  EXPECT_EQ(0, heavy_hitters.EstimateCount("d"));
+  EXPECT_THAT(heavy_hitters.TopKeys(/*min_fraction=*/0, /*max_keys=*/10),
+              ElementsAre(Pair("a", 6), Pair("c", 3), Pair("b", 1)));
+  EXPECT_THAT(heavy_hitters.TopKeys(/*min_fraction=*/0.3, /*max_keys=*/10),
+              ElementsAre(Pair("a", 6), Pair("c", 3)));
+  EXPECT_THAT(heavy_hitters.TopKeys(/*min_fraction=*/0, /*max_keys=*/1),
+              ElementsAre(Pair("a", 6)));
+}
+
+TEST(HeavyHittersTest, ReplacesSmallestCount) {
+  HeavyHitters heavy_hitters(/*capacity=*/2);
+  heavy_hitters.Add("a", 5);
+  heavy_hitters.Add("b", 2);
+  // "c" replaces "b" and inherits its count.
+  heavy_hitters.Add("c");
+  EXPECT_EQ(2, heavy_hitters.size());
+  EXPECT_EQ(0, heavy_hitters.EstimateCount("b"));
+  EXPECT_EQ(3, heavy_hitters.EstimateCount("c"));
+  EXPECT_EQ(8, heavy_hitters.total_count());
+}
+
+TEST(HeavyHittersTest, FindsHotKeysInSkewedStream) {
+  HeavyHitters heavy_hitters(/*capacity=*/50);
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int> cold_key(0, 9999);
+  std::uniform_int_distribution<int> percent(0, 99);
+  // 30% of the reads go to "hot0" and 10% to "hot1", the rest are spread over
+  // 10000 keys.
+  for (int i = 0; i < 100000; ++i) {
+    const int p = percent(rng);
+    if (p < 30) {
+      heavy_hitters.Add("hot0");
+    } else if (p < 40) {
+      heavy_hitters.Add("hot1");
+    } else {
+      heavy_hitters.Add(absl::StrCat("cold", cold_key(rng)));
+    }
+  }
+  const auto top_keys =
+      heavy_hitters.TopKeys(/*min_fraction=*/0.05, /*max_keys=*/10);
+  ASSERT_EQ(2, top_keys.size());
+  EXPECT_EQ("hot0", top_keys[0].first);
+  EXPECT_EQ("hot1", top_keys[1].first);
+  // Never underestimated.
+  EXPECT_GE(top_keys[0].second, 29000);
+  EXPECT_GE(top_keys[1].second, 9000);
+}
+
+TEST(HeavyHittersTest, Decay) {
+  HeavyHitters heavy_hitters(/*capacity=*/10);
+  heavy_hitters.Add("a", 8);
+  heavy_hitters.Add("b", 1);
+  heavy_hitters.Decay(0.5);
+  EXPECT_EQ(4, heavy_hitters.total_count());
+  EXPECT_EQ(4, heavy_hitters.EstimateCount("a"));
+  EXPECT_EQ(1, heavy_hitters.size());
+  heavy_hitters.Add("c", 6);
+  EXPECT_THAT(heavy_hitters.TopKeys(/*min_fraction=*/0, /*max_keys=*/10),
+              ElementsAre(Pair("c", 6), Pair("a", 4)));
+}
+
+}  // namespace
+}  // namespace carls
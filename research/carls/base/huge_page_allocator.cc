@@ -0,0 +1,109 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/huge_page_allocator.h"
+
+#include <sys/mman.h>
+
+#include <cstdint>
+
+namespace carls {
+namespace {
+
+// Maps anonymous memory with given extra flags, returns nullptr on failure.
+void* MapAnonymous(size_t size, int flags) {
+  void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+// Maps `size` bytes aligned to kHugePageSize, which is required for the kernel
+// to back them by transparent huge pages.
+void* MapAligned(size_t size) {
+  void* ptr = MapAnonymous(size + kHugePageSize, 0);
+  if (ptr == nullptr) {
+    return nullptr;
+  }
+  // Trims the unaligned head and the tail of the over-sized mapping.
+  const uintptr_t start = reinterpret_cast<uintptr_t>(ptr);
+  const uintptr_t aligned =
+      (start + kHugePageSize - 1) & ~(uintptr_t{kHugePageSize} - 1);
+  if (aligned > start) {
+    munmap(ptr, aligned - start);
+  }
+  const uintptr_t end = start + size + kHugePageSize;
+  if (end > aligned + size) {
+    munmap(reinterpret_cast<void*>(aligned + size), end - aligned - size);
+  }
+  return reinterpret_cast<void*>(aligned);
+}
+
+}  // namespace
+
+size_t RoundUpToHugePageSize(size_t size) {
+  return (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+}
+
+void* AllocateHugePages(size_t size, HugePagePolicy policy,
+                        HugePagePolicy* backing) {
+  size = RoundUpToHugePageSize(size);
+  if (size == 0) {
+    return nullptr;
+  }
+#ifdef MAP_HUGETLB
+  if (policy == HugePagePolicy::kExplicit) {
+    void* ptr = MapAnonymous(size, MAP_HUGETLB);
+    if (ptr != nullptr) {
+      if (backing != nullptr) {
+        *backing = HugePagePolicy::kExplicit;
+      }
+      return ptr;
+    }
+    VLOG(1) << "No huge pages reserved for " << size
+            << " bytes, falling back to transparent huge pages.";
+  }
+#endif
+  void* ptr = MapAligned(size);
+  if (ptr == nullptr) {
+    return nullptr;
+  }
+  // madvise() only fails if the kernel does not support transparent huge
+  // pages, in which case the regular pages are used.
+  HugePagePolicy applied = HugePagePolicy::kNone;
+  if (policy == HugePagePolicy::kNone) {
+#ifdef MADV_NOHUGEPAGE
+    madvise(ptr, size, MADV_NOHUGEPAGE);
+#endif
+  } else {
+#ifdef MADV_HUGEPAGE
+    if (madvise(ptr, size, MADV_HUGEPAGE) == 0) {
+      applied = HugePagePolicy::kTransparent;
+    }
+#endif
+  }
+  if (backing != nullptr) {
+    *backing = applied;
+  }
+  return ptr;
+}
+
+void FreeHugePages(void* ptr, size_t size) {
+  if (ptr == nullptr) {
+    return;
+  }
+  munmap(ptr, RoundUpToHugePageSize(size));
+}
+
+}  // namespace carls
@@ -0,0 +1,119 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_HUGE_PAGE_ALLOCATOR_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_HUGE_PAGE_ALLOCATOR_H_
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include <glog/logging.h>
+
+namespace carls {
+
+// How the pages of a large allocation are backed. Random access into a table
+// of several GB touches a different 4KB page almost every time, backing it by
+// 2MB pages cuts the dTLB misses of the lookups.
+enum class HugePagePolicy {
+  // Regular pages, transparent huge pages are disabled for the allocation.
+  kNone = 0,
+  // Regular pages advised with MADV_HUGEPAGE, so that the kernel backs them by
+  // transparent huge pages when it can.
+  kTransparent = 1,
+  // Pages from the reserved huge page pool (MAP_HUGETLB). Falls back to
+  // kTransparent if the pool is not configured or exhausted.
+  kExplicit = 2,
+};
+
+// The huge page size assumed for the allocations, i.e., the default one on
+// x86-64 and arm64.
+constexpr size_t kHugePageSize = size_t{2} << 20;
+
+// Returns `size` rounded up to a multiple of kHugePageSize.
+size_t RoundUpToHugePageSize(size_t size);
+
+// Maps at least `size` bytes of zero-initialized memory aligned to
+// kHugePageSize, backed according to `policy`. Outputs the policy actually
+// applied into `backing` if it is not null. Returns nullptr if the memory
+// cannot be mapped.
+void* AllocateHugePages(size_t size, HugePagePolicy policy,
+                        HugePagePolicy* backing = nullptr);
+
+// Unmaps the memory returned by AllocateHugePages() for the same `size`.
+void FreeHugePages(void* ptr, size_t size);
+
+// An STL allocator for the large contiguous structures, e.g., embedding
+// arenas or memory matrices. Allocations of at least kHugePageSize bytes are
+// mapped by AllocateHugePages(), smaller ones come from operator new since
+// they would waste most of a huge page.
+//
+// Example:
+//   HugePageVector<float> table(
+//       num_rows * dim, 0.0f,
+//       HugePageAllocator<float>(HugePagePolicy::kExplicit));
+template <typename T>
+class HugePageAllocator {
+ public:
+  using value_type = T;
+
+  explicit HugePageAllocator(
+      HugePagePolicy policy = HugePagePolicy::kTransparent)
+      : policy_(policy) {}
+  template <typename U>
+  HugePageAllocator(const HugePageAllocator<U>& other)  // NOLINT
+      : policy_(other.policy()) {}
+
+  T* allocate(size_t n) {
+    const size_t size = n * sizeof(T);
+    if (size < kHugePageSize) {
+      return static_cast<T*>(::operator new(size));
+    }
+    void* ptr = AllocateHugePages(size, policy_);
+    CHECK(ptr != nullptr) << "Failed to map " << size << " bytes.";
+    return static_cast<T*>(ptr);
+  }
+
+  void deallocate(T* ptr, size_t n) {
+    const size_t size = n * sizeof(T);
+    if (size < kHugePageSize) {
+      ::operator delete(ptr);
+      return;
+    }
+    FreeHugePages(ptr, size);
+  }
+
+  HugePagePolicy policy() const { return policy_; }
+
+ private:
+  HugePagePolicy policy_;
+};
+
+template <typename T, typename U>
+bool operator==(const HugePageAllocator<T>& a, const HugePageAllocator<U>& b) {
+  return a.policy() == b.policy();
+}
+
+template <typename T, typename U>
+bool operator!=(const HugePageAllocator<T>& a, const HugePageAllocator<U>& b) {
+  return !(a == b);
+}
+
+template <typename T>
+using HugePageVector = std::vector<T, HugePageAllocator<T>>;
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_HUGE_PAGE_ALLOCATOR_H_
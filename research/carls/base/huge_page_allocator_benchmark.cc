@@ -0,0 +1,162 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Measures random embedding lookups from a large table backed by regular,
+// transparent huge or explicit huge pages, e.g.,
+//   bazel run -c opt //research/carls/base:huge_page_allocator_benchmark
+//
+// Besides the throughput, it reports the dTLB load misses per looked up row
+// when the perf counters are available (see perf_event_paranoid).
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "research/carls/base/huge_page_allocator.h"
+
+namespace carls {
+namespace {
+
+constexpr int kEmbeddingDimension = 64;
+constexpr int kBatchSize = 256;
+constexpr int kNumIndices = 1 << 16;
+
+// Counts the dTLB load misses of the calling thread.
+class DtlbMissCounter {
+ public:
+  DtlbMissCounter() {
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(__NR_perf_event_open, &attr, /*pid=*/0, /*cpu=*/-1,
+                  /*group_fd=*/-1, /*flags=*/0);
+  }
+  ~DtlbMissCounter() {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  bool available() const { return fd_ >= 0; }
+
+  void Start() {
+    ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  // Stops counting and returns the misses since Start().
+  int64_t Stop() {
+    ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+    int64_t count = 0;
+    if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+      return 0;
+    }
+    return count;
+  }
+
+ private:
+  int fd_;
+};
+
+const char* PolicyName(HugePagePolicy policy) {
+  switch (policy) {
+    case HugePagePolicy::kNone:
+      return "regular pages";
+    case HugePagePolicy::kTransparent:
+      return "transparent huge pages";
+    case HugePagePolicy::kExplicit:
+      return "explicit huge pages";
+  }
+  return "";
+}
+
+// Args are {table size in MB, HugePagePolicy}.
+void TableArgs(benchmark::internal::Benchmark* b) {
+  for (int table_mb : {64, 1024}) {
+    for (int policy : {0, 1, 2}) {
+      b->Args({table_mb, policy});
+    }
+  }
+}
+
+// Sums the embeddings of kBatchSize random rows, i.e., the access pattern of
+// a DynamicEmbeddingLookup with a sum combiner.
+void BM_RandomLookup(benchmark::State& state) {
+  const int64_t table_size = state.range(0) << 20;
+  const auto policy = static_cast<HugePagePolicy>(state.range(1));
+  const int64_t num_rows = table_size / (kEmbeddingDimension * sizeof(float));
+
+  HugePagePolicy backing;
+  float* table = static_cast<float*>(
+      AllocateHugePages(table_size, policy, &backing));
+  if (table == nullptr) {
+    state.SkipWithError("Failed to allocate the table.");
+    return;
+  }
+  // Touches every page so that page faults are not measured.
+  for (int64_t i = 0; i < num_rows * kEmbeddingDimension; ++i) {
+    table[i] = 1e-3f * (i % 1000);
+  }
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<int64_t> distribution(0, num_rows - 1);
+  std::vector<int64_t> indices(kNumIndices);
+  for (auto& index : indices) {
+    index = distribution(rng);
+  }
+
+  std::vector<float> output(kEmbeddingDimension);
+  DtlbMissCounter counter;
+  if (counter.available()) {
+    counter.Start();
+  }
+  int offset = 0;
+  for (auto _ : state) {
+    std::fill(output.begin(), output.end(), 0.0f);
+    for (int i = 0; i < kBatchSize; ++i) {
+      const float* row = table + indices[offset] * kEmbeddingDimension;
+      offset = (offset + 1) % kNumIndices;
+      for (int j = 0; j < kEmbeddingDimension; ++j) {
+        output[j] += row[j];
+      }
+    }
+    benchmark::DoNotOptimize(output.data());
+  }
+  const int64_t num_lookups = state.iterations() * kBatchSize;
+  if (counter.available()) {
+    state.counters["dtlb_misses_per_row"] =
+        static_cast<double>(counter.Stop()) / num_lookups;
+    state.SetLabel(PolicyName(backing));
+  } else {
+    state.SetLabel(std::string(PolicyName(backing)) + ", no perf counters");
+  }
+  state.SetItemsProcessed(num_lookups);
+  FreeHugePages(table, table_size);
+}
+BENCHMARK(BM_RandomLookup)->Apply(TableArgs);
+
+}  // namespace
+}  // namespace carls
@@ -0,0 +1,98 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/huge_page_allocator.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace carls {
+namespace {
+
+using ::testing::AnyOf;
+
+TEST(HugePageAllocatorTest, RoundUpToHugePageSize) {
+  EXPECT_EQ(0, RoundUpToHugePageSize(0));
+  EXPECT_EQ(kHugePageSize, RoundUpToHugePageSize(1));
+  EXPECT_EQ(kHugePageSize, RoundUpToHugePageSize(kHugePageSize));
+  EXPECT_EQ(2 * kHugePageSize, RoundUpToHugePageSize(kHugePageSize + 1));
+}
+
+TEST(HugePageAllocatorTest, AllocateHugePages) {
+  const size_t size = 3 * kHugePageSize + 100;
+  for (auto policy : {HugePagePolicy::kNone, HugePagePolicy::kTransparent,
+                      HugePagePolicy::kExplicit}) {
+    HugePagePolicy backing;
+    char* ptr = static_cast<char*>(AllocateHugePages(size, policy, &backing));
+    ASSERT_TRUE(ptr != nullptr);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(ptr) % kHugePageSize);
+    switch (policy) {
+      case HugePagePolicy::kNone:
+        EXPECT_EQ(HugePagePolicy::kNone, backing);
+        break;
+      case HugePagePolicy::kTransparent:
+        EXPECT_THAT(backing, AnyOf(HugePagePolicy::kNone,
+                                   HugePagePolicy::kTransparent));
+        break;
+      case HugePagePolicy::kExplicit:
+        // Depends on the huge pages reserved on the machine.
+        EXPECT_THAT(backing,
+                    AnyOf(HugePagePolicy::kNone, HugePagePolicy::kTransparent,
+                          HugePagePolicy::kExplicit));
+        break;
+    }
+    // The memory is zero-initialized and writable up to the rounded size.
+    EXPECT_EQ(0, ptr[0]);
+    EXPECT_EQ(0, ptr[size - 1]);
+    std::memset(ptr, 1, RoundUpToHugePageSize(size));
+    FreeHugePages(ptr, size);
+  }
+}
+
+TEST(HugePageAllocatorTest, HugePageVector) {
+  // A small vector growing past kHugePageSize moves from operator new to the
+  // mapped pages.
+  HugePageVector<int64_t> values;
+  const int64_t num_values = 2 * kHugePageSize / sizeof(int64_t);
+  for (int64_t i = 0; i < num_values; ++i) {
+    values.push_back(i);
+  }
+  for (int64_t i = 0; i < num_values; ++i) {
+    ASSERT_EQ(i, values[i]);
+  }
+  values.resize(10);
+  values.shrink_to_fit();
+  EXPECT_EQ(9, values.back());
+
+  HugePageVector<float> table(
+      kHugePageSize, 0.5f, HugePageAllocator<float>(HugePagePolicy::kNone));
+  EXPECT_EQ(HugePagePolicy::kNone, table.get_allocator().policy());
+  EXPECT_FLOAT_EQ(0.5f, table[kHugePageSize - 1]);
+}
+
+TEST(HugePageAllocatorTest, Equality) {
+  HugePageAllocator<float> transparent;
+  HugePageAllocator<int> explicit_pages(HugePagePolicy::kExplicit);
+  EXPECT_EQ(HugePagePolicy::kTransparent, transparent.policy());
+  EXPECT_TRUE(transparent == HugePageAllocator<int>());
+  EXPECT_TRUE(transparent != explicit_pages);
+  EXPECT_TRUE(HugePageAllocator<float>(explicit_pages) == explicit_pages);
+}
+
+}  // namespace
+}  // namespace carls
@@ -0,0 +1,88 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/io_rate_limiter.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+#include "absl/time/clock.h"
+
+namespace carls {
+namespace {
+
+// The limiter of the current thread, set by ScopedIoRateLimit.
+thread_local IoRateLimiter* current_limiter = nullptr;
+
+}  // namespace
+
+IoRateLimiter::IoRateLimiter(const double bytes_per_second,
+                             const int64_t burst_bytes)
+    : bytes_per_second_(bytes_per_second),
+      burst_bytes_(burst_bytes),
+      tokens_(burst_bytes),
+      last_refill_time_(absl::Now()) {
+  CHECK_GT(bytes_per_second, 0);
+  CHECK_GE(burst_bytes, 0);
+}
+
+void IoRateLimiter::Acquire(const int64_t num_bytes) {
+  absl::Duration wait_time;
+  {
+    absl::MutexLock l(&mu_);
+    const absl::Time now = absl::Now();
+    tokens_ = std::min(
+        burst_bytes_,
+        tokens_ + absl::ToDoubleSeconds(now - last_refill_time_) *
+                      bytes_per_second_);
+    last_refill_time_ = now;
+    tokens_ -= num_bytes;
+    total_bytes_ += num_bytes;
+    if (tokens_ < 0) {
+      // Later callers see the debt and wait longer, so the concurrent writers
+      // share the rate.
+      wait_time = absl::Seconds(-tokens_ / bytes_per_second_);
+      total_wait_time_ += wait_time;
+    }
+  }
+  if (wait_time > absl::ZeroDuration()) {
+    absl::SleepFor(wait_time);
+  }
+}
+
+int64_t IoRateLimiter::TotalBytes() const {
+  absl::MutexLock l(&mu_);
+  return total_bytes_;
+}
+
+absl::Duration IoRateLimiter::TotalWaitTime() const {
+  absl::MutexLock l(&mu_);
+  return total_wait_time_;
+}
+
+ScopedIoRateLimit::ScopedIoRateLimit(IoRateLimiter* limiter)
+    : previous_limiter_(current_limiter) {
+  current_limiter = limiter;
+}
+
+ScopedIoRateLimit::~ScopedIoRateLimit() { current_limiter = previous_limiter_; }
+
+void ThrottleFileWrite(const int64_t num_bytes) {
+  if (current_limiter != nullptr && num_bytes > 0) {
+    current_limiter->Acquire(num_bytes);
+  }
+}
+
+}  // namespace carls
@@ -0,0 +1,94 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_IO_RATE_LIMITER_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_IO_RATE_LIMITER_H_
+
+#include <cstdint>
+
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace carls {
+
+// A token bucket limiting the rate of the bytes written to files, e.g., by a
+// checkpoint running in the background of a server, so that it does not
+// saturate the disk used for serving.
+//
+// The bucket holds up to `burst_bytes` tokens and is refilled at
+// `bytes_per_second`. A write larger than the available tokens takes them
+// anyway and waits until the debt is paid back, so a write larger than the
+// bucket is still allowed.
+//
+// This class is thread-safe.
+class IoRateLimiter {
+ public:
+  // REQUIRED: bytes_per_second > 0 and burst_bytes >= 0.
+  IoRateLimiter(double bytes_per_second, int64_t burst_bytes);
+
+  // Takes `num_bytes` tokens from the bucket, and blocks until the bucket is
+  // no longer in debt.
+  void Acquire(int64_t num_bytes);
+
+  // Returns the total bytes acquired and the total time spent waiting.
+  int64_t TotalBytes() const;
+  absl::Duration TotalWaitTime() const;
+
+  double bytes_per_second() const { return bytes_per_second_; }
+
+ private:
+  const double bytes_per_second_;
+  const double burst_bytes_;
+
+  mutable absl::Mutex mu_;
+  // Number of tokens in the bucket, negative while in debt.
+  double tokens_ ABSL_GUARDED_BY(mu_);
+  absl::Time last_refill_time_ ABSL_GUARDED_BY(mu_);
+  int64_t total_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+  absl::Duration total_wait_time_ ABSL_GUARDED_BY(mu_);
+};
+
+// Makes the file writes of the current thread, i.e., WriteFileString() and
+// CompressedBlockFileWriter, acquire their bytes from `limiter` during the
+// lifetime of this object. A null limiter disables the rate limiting.
+//
+// Example Usage:
+//
+//   IoRateLimiter limiter(/*bytes_per_second=*/64 << 20,
+//                         /*burst_bytes=*/4 << 20);
+//   {
+//     ScopedIoRateLimit scoped_limit(&limiter);
+//     knowledge_bank->Export(dir, subdir, &path);
+//   }
+//
+class ScopedIoRateLimit {
+ public:
+  explicit ScopedIoRateLimit(IoRateLimiter* limiter);
+  ~ScopedIoRateLimit();
+
+  ScopedIoRateLimit(const ScopedIoRateLimit&) = delete;
+  ScopedIoRateLimit& operator=(const ScopedIoRateLimit&) = delete;
+
+ private:
+  IoRateLimiter* const previous_limiter_;
+};
+
+// Acquires `num_bytes` from the limiter of the current thread, if any, before
+// writing them to a file.
+void ThrottleFileWrite(int64_t num_bytes);
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_IO_RATE_LIMITER_H_
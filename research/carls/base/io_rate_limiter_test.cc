@@ -0,0 +1,64 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/io_rate_limiter.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "absl/time/clock.h"
+#include "research/carls/base/file_helper.h"
+
+namespace carls {
+namespace {
+
+using ::testing::TempDir;
+
+TEST(IoRateLimiterTest, BurstDoesNotWait) {
+  IoRateLimiter limiter(/*bytes_per_second=*/1000, /*burst_bytes=*/1000);
+  limiter.Acquire(600);
+  limiter.Acquire(400);
+  EXPECT_EQ(1000, limiter.TotalBytes());
+  EXPECT_EQ(absl::ZeroDuration(), limiter.TotalWaitTime());
+}
+
+TEST(IoRateLimiterTest, WaitsForDebt) {
+  IoRateLimiter limiter(/*bytes_per_second=*/1000, /*burst_bytes=*/0);
+  const absl::Time start = absl::Now();
+  // A write larger than the bucket is allowed, but waits for its tokens.
+  limiter.Acquire(100);
+  limiter.Acquire(100);
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(180));
+  EXPECT_GE(limiter.TotalWaitTime(), absl::Milliseconds(180));
+}
+
+TEST(IoRateLimiterTest, ScopedIoRateLimit) {
+  IoRateLimiter limiter(/*bytes_per_second=*/1e9, /*burst_bytes=*/1 << 20);
+  const std::string filepath = JoinPath(TempDir(), "rate_limited_data");
+  {
+    ScopedIoRateLimit scoped_limit(&limiter);
+    ASSERT_TRUE(
+        WriteFileString(filepath, "0123456789", /*can_overwrite=*/true).ok());
+  }
+  EXPECT_EQ(10, limiter.TotalBytes());
+
+  // Writes outside the scope are not limited.
+  ASSERT_TRUE(
+      WriteFileString(filepath, "0123456789", /*can_overwrite=*/true).ok());
+  EXPECT_EQ(10, limiter.TotalBytes());
+}
+
+}  // namespace
+}  // namespace carls
@@ -0,0 +1,204 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_PREFETCHING_HASH_INDEX_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_PREFETCHING_HASH_INDEX_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "absl/hash/hash.h"
+#include "absl/strings/string_view.h"
+#include "research/carls/base/huge_page_allocator.h"
+
+namespace carls {
+
+// Hints the CPU to bring the cache line of `ptr` into the cache.
+inline void PrefetchForRead(const void* ptr) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(ptr, /*rw=*/0, /*locality=*/3);
+#endif
+}
+
+// An open addressing hash index from string keys to the values owned by
+// another container, e.g., a protobuf Map whose nodes are pointer stable.
+//
+// Looking up a batch of keys in a table much larger than the last level cache
+// stalls on a cache miss for the slot and then for the value of every key.
+// BatchFind() hides that latency by group prefetching: it hashes a group of
+// keys and prefetches their slots, then prefetches the values they point to,
+// then the data referred to by the values, and only then resolves the keys.
+// The misses of the keys in a group are hence served in parallel.
+//
+// Keys cannot be erased, Clear() the index and insert the keys again instead.
+//
+// This class is not thread-safe.
+template <typename Value>
+class PrefetchingHashIndex {
+ public:
+  // Number of keys whose cache misses are in flight together in BatchFind().
+  static constexpr int kGroupSize = 16;
+
+  PrefetchingHashIndex() = default;
+
+  // Maps `key` to `value`, or replaces the value of an existing key. The
+  // content of `key` must stay valid while it is in the index.
+  void Insert(absl::string_view key, Value* value) {
+    if (2 * (size_ + 1) > slots_.size()) {
+      Rehash(std::max<size_t>(kGroupSize, 2 * slots_.size()));
+    }
+    const uint64_t hash = Hash(key);
+    Slot* slot = &slots_[hash & mask()];
+    while (slot->value != nullptr) {
+      if (slot->hash == hash && slot->key == key) {
+        slot->value = value;
+        return;
+      }
+      slot = Next(slot);
+    }
+    *slot = {hash, key, value};
+    ++size_;
+  }
+
+  // Returns the value of `key`, or nullptr if it is not found.
+  Value* Find(absl::string_view key) const { return Find(key, Hash(key)); }
+
+  // Calls `fn(i, value)` for every keys[i] in order, where `value` is the
+  // result of Find(keys[i]). Before resolving a group of keys, it calls
+  // `prefetch(value)` for the values whose slots match the hash of a key, so
+  // that the caller can prefetch the data referred to by the value, e.g., the
+  // embedding row of a proto.
+  template <typename PrefetchFn, typename Fn>
+  void BatchFind(const std::vector<absl::string_view>& keys,
+                 PrefetchFn prefetch, Fn fn) const {
+    uint64_t hashes[kGroupSize];
+    const Slot* candidates[kGroupSize];
+    for (size_t begin = 0; begin < keys.size(); begin += kGroupSize) {
+      const int group_size =
+          static_cast<int>(std::min<size_t>(kGroupSize, keys.size() - begin));
+      // Stage 1: hashes the keys and prefetches their first slots.
+      for (int i = 0; i < group_size; ++i) {
+        hashes[i] = Hash(keys[begin + i]);
+        if (size_ > 0) {
+          PrefetchForRead(&slots_[hashes[i] & mask()]);
+        }
+      }
+      // Stage 2: finds the slots matching the hashes and prefetches their
+      // values and keys.
+      for (int i = 0; i < group_size; ++i) {
+        candidates[i] = FindSlotByHash(hashes[i]);
+        if (candidates[i] != nullptr) {
+          PrefetchForRead(candidates[i]->value);
+          PrefetchForRead(candidates[i]->key.data());
+        }
+      }
+      // Stage 3: prefetches the data referred to by the values.
+      for (int i = 0; i < group_size; ++i) {
+        if (candidates[i] != nullptr) {
+          prefetch(*candidates[i]->value);
+        }
+      }
+      // Stage 4: resolves the keys, their data are in the cache by now.
+      for (int i = 0; i < group_size; ++i) {
+        fn(begin + i, Find(keys[begin + i], hashes[i]));
+      }
+    }
+  }
+
+  void Clear() {
+    slots_.clear();
+    slots_.shrink_to_fit();
+    size_ = 0;
+  }
+
+  size_t size() const { return size_; }
+
+ private:
+  // An empty slot has a null value.
+  struct Slot {
+    uint64_t hash = 0;
+    absl::string_view key;
+    Value* value = nullptr;
+  };
+
+  static uint64_t Hash(absl::string_view key) {
+    return absl::Hash<absl::string_view>()(key);
+  }
+
+  size_t mask() const { return slots_.size() - 1; }
+
+  const Slot* Next(const Slot* slot) const {
+    return slot + 1 == slots_.data() + slots_.size() ? slots_.data()
+                                                     : slot + 1;
+  }
+  Slot* Next(Slot* slot) {
+    return slot + 1 == slots_.data() + slots_.size() ? slots_.data()
+                                                     : slot + 1;
+  }
+
+  // Returns the first slot of given hash, regardless of its key.
+  const Slot* FindSlotByHash(uint64_t hash) const {
+    if (size_ == 0) {
+      return nullptr;
+    }
+    for (const Slot* slot = &slots_[hash & mask()]; slot->value != nullptr;
+         slot = Next(slot)) {
+      if (slot->hash == hash) {
+        return slot;
+      }
+    }
+    return nullptr;
+  }
+
+  Value* Find(absl::string_view key, uint64_t hash) const {
+    if (size_ == 0) {
+      return nullptr;
+    }
+    for (const Slot* slot = &slots_[hash & mask()]; slot->value != nullptr;
+         slot = Next(slot)) {
+      if (slot->hash == hash && slot->key == key) {
+        return slot->value;
+      }
+    }
+    return nullptr;
+  }
+
+  // Moves the entries into `capacity` slots, a power of two.
+  void Rehash(size_t capacity) {
+    HugePageVector<Slot> old_slots(capacity);
+    old_slots.swap(slots_);
+    for (const Slot& old_slot : old_slots) {
+      if (old_slot.value == nullptr) {
+        continue;
+      }
+      Slot* slot = &slots_[old_slot.hash & mask()];
+      while (slot->value != nullptr) {
+        slot = Next(slot);
+      }
+      *slot = old_slot;
+    }
+  }
+
+  // The slots are linearly probed and at most half full. They are backed by
+  // huge pages since they are randomly accessed.
+  HugePageVector<Slot> slots_;
+  size_t size_ = 0;
+};
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_PREFETCHING_HASH_INDEX_H_
@@ -0,0 +1,116 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/prefetching_hash_index.h"
+
+#include <deque>
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+
+namespace carls {
+namespace {
+
+using ::testing::ElementsAre;
+
+TEST(PrefetchingHashIndexTest, InsertAndFind) {
+  PrefetchingHashIndex<int> index;
+  EXPECT_EQ(nullptr, index.Find("a"));
+
+  int a = 1, b = 2, c = 3;
+  index.Insert("a", &a);
+  index.Insert("b", &b);
+  EXPECT_EQ(2, index.size());
+  EXPECT_EQ(&a, index.Find("a"));
+  EXPECT_EQ(&b, index.Find("b"));
+  EXPECT_EQ(nullptr, index.Find("c"));
+
+  // Replaces the value of an existing key.
+  index.Insert("a", &c);
+  EXPECT_EQ(2, index.size());
+  EXPECT_EQ(&c, index.Find("a"));
+
+  index.Clear();
+  EXPECT_EQ(0, index.size());
+  EXPECT_EQ(nullptr, index.Find("a"));
+}
+
+TEST(PrefetchingHashIndexTest, Grows) {
+  // The keys and values must be pointer stable.
+  std::deque<std::string> keys;
+  std::deque<int> values;
+  PrefetchingHashIndex<int> index;
+  for (int i = 0; i < 10000; ++i) {
+    keys.push_back(absl::StrCat("key", i));
+    values.push_back(i);
+    index.Insert(keys.back(), &values.back());
+  }
+  EXPECT_EQ(10000, index.size());
+  for (int i = 0; i < 10000; ++i) {
+    const int* value = index.Find(keys[i]);
+    ASSERT_TRUE(value != nullptr);
+    EXPECT_EQ(i, *value);
+  }
+  EXPECT_EQ(nullptr, index.Find("key10000"));
+}
+
+TEST(PrefetchingHashIndexTest, BatchFind) {
+  std::deque<std::string> keys;
+  std::deque<int> values;
+  PrefetchingHashIndex<int> index;
+  for (int i = 0; i < 100; ++i) {
+    keys.push_back(absl::StrCat("key", i));
+    values.push_back(i);
+    index.Insert(keys.back(), &values.back());
+  }
+
+  // More than kGroupSize keys, with duplicates and missing keys.
+  std::vector<absl::string_view> batch;
+  for (int i = 0; i < 50; ++i) {
+    batch.push_back(keys[(i * 7) % 100]);
+    if (i % 10 == 0) {
+      batch.push_back("missing");
+    }
+  }
+  std::vector<int> results;
+  int num_prefetched = 0;
+  index.BatchFind(
+      batch, [&num_prefetched](const int& value) { ++num_prefetched; },
+      [&](size_t i, const int* value) {
+        EXPECT_EQ(results.size(), i);
+        EXPECT_EQ(index.Find(batch[i]), value);
+        results.push_back(value == nullptr ? -1 : *value);
+      });
+  ASSERT_EQ(batch.size(), results.size());
+  EXPECT_EQ(50, num_prefetched);
+  EXPECT_EQ(0, results[0]);
+  EXPECT_EQ(-1, results[1]);
+  EXPECT_EQ(7, results[2]);
+
+  // An empty index finds nothing.
+  PrefetchingHashIndex<int> empty_index;
+  results.clear();
+  empty_index.BatchFind(
+      {"a", "b"}, [](const int& value) {},
+      [&results](size_t i, const int* value) {
+        results.push_back(value == nullptr ? -1 : *value);
+      });
+  EXPECT_THAT(results, ElementsAre(-1, -1));
+}
+
+}  // namespace
+}  // namespace carls
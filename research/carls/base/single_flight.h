@@ -0,0 +1,117 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_SINGLE_FLIGHT_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_SINGLE_FLIGHT_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+
+namespace carls {
+
+// Coalesces concurrent calls for the same key, so that an expensive operation
+// (e.g., reading a key from disk or initializing a new key) runs once while
+// the other callers wait for it and share its result. A later call for the key
+// starts a new operation, nothing is cached once all callers have returned.
+//
+// Example:
+//   SingleFlight<bool> flights;
+//   bool found = false;
+//   auto status = flights.Do(key, [&](bool* result) {
+//     return ReadFromDisk(key, result);
+//   }, &found);
+//
+// This class is thread-safe.
+template <typename T>
+class SingleFlight {
+ public:
+  SingleFlight() = default;
+
+  // Runs `fn` for `key` unless a call for the same key is in flight, in which
+  // case it waits for that call instead. Outputs the result of the call into
+  // `result` and returns its status. `shared` is set to true if the result
+  // comes from the call of another thread, when it is not null.
+  absl::Status Do(absl::string_view key,
+                  const std::function<absl::Status(T*)>& fn, T* result,
+                  bool* shared = nullptr) ABSL_LOCKS_EXCLUDED(mu_) {
+    std::shared_ptr<Call> call;
+    bool leader = false;
+    {
+      absl::MutexLock l(&mu_);
+      auto& in_flight = calls_[key];
+      if (in_flight == nullptr) {
+        in_flight = std::make_shared<Call>();
+        leader = true;
+      } else {
+        ++num_shared_;
+      }
+      call = in_flight;
+      ++num_calls_;
+    }
+    if (leader) {
+      call->status = fn(&call->result);
+      {
+        absl::MutexLock l(&mu_);
+        calls_.erase(key);
+      }
+      call->done.Notify();
+    } else {
+      call->done.WaitForNotification();
+    }
+    if (result != nullptr) {
+      *result = call->result;
+    }
+    if (shared != nullptr) {
+      *shared = !leader;
+    }
+    return call->status;
+  }
+
+  // Returns the total number of calls to Do(), and the number of those that
+  // waited for the call of another thread instead of running their own.
+  int64_t num_calls() const ABSL_LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock l(&mu_);
+    return num_calls_;
+  }
+  int64_t num_shared() const ABSL_LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock l(&mu_);
+    return num_shared_;
+  }
+
+ private:
+  // A call in flight, shared by its leader and the waiting threads.
+  struct Call {
+    absl::Notification done;
+    absl::Status status;
+    T result{};
+  };
+
+  mutable absl::Mutex mu_;
+  absl::flat_hash_map<std::string, std::shared_ptr<Call>> calls_
+      ABSL_GUARDED_BY(mu_);
+  int64_t num_calls_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t num_shared_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_BASE_SINGLE_FLIGHT_H_
@@ -0,0 +1,124 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/base/single_flight.h"
+
+#include <atomic>
+
+#include "gtest/gtest.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "research/carls/base/thread_bundle.h"
+
+namespace carls {
+namespace {
+
+TEST(SingleFlightTest, SequentialCallsRunSeparately) {
+  SingleFlight<int> flights;
+  int num_runs = 0;
+  auto fn = [&num_runs](int* result) {
+    *result = ++num_runs;
+    return absl::OkStatus();
+  };
+  int result = 0;
+  bool shared = true;
+  EXPECT_TRUE(flights.Do("a", fn, &result, &shared).ok());
+  EXPECT_EQ(1, result);
+  EXPECT_FALSE(shared);
+  EXPECT_TRUE(flights.Do("a", fn, &result, &shared).ok());
+  EXPECT_EQ(2, result);
+  EXPECT_FALSE(shared);
+  EXPECT_EQ(2, flights.num_calls());
+  EXPECT_EQ(0, flights.num_shared());
+}
+
+TEST(SingleFlightTest, ConcurrentCallsShareResult) {
+  const int num_threads = 8;
+  SingleFlight<int> flights;
+  std::atomic<int> num_runs(0);
+  std::atomic<int> num_shared(0);
+  absl::Notification release;
+  {
+    ThreadBundle bundle("SingleFlight", num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+      bundle.Add([&]() {
+        int result = 0;
+        bool shared = false;
+        const auto status = flights.Do(
+            "a",
+            [&](int* result) {
+              ++num_runs;
+              // Blocks until all the other threads are waiting for this call.
+              release.WaitForNotification();
+              *result = 42;
+              return absl::InvalidArgumentError("error");
+            },
+            &result, &shared);
+        EXPECT_EQ(absl::StatusCode::kInvalidArgument, status.code());
+        EXPECT_EQ(42, result);
+        if (shared) {
+          ++num_shared;
+        }
+      });
+    }
+    while (flights.num_calls() < num_threads) {
+      absl::SleepFor(absl::Milliseconds(1));
+    }
+    release.Notify();
+    bundle.JoinAll();
+  }
+  EXPECT_EQ(1, num_runs);
+  EXPECT_EQ(num_threads - 1, num_shared);
+  EXPECT_EQ(num_threads - 1, flights.num_shared());
+}
+
+TEST(SingleFlightTest, DifferentKeysRunConcurrently) {
+  SingleFlight<int> flights;
+  absl::Notification a_started;
+  absl::Notification b_done;
+  ThreadBundle bundle("SingleFlight", 2);
+  bundle.Add([&]() {
+    int result = 0;
+    EXPECT_TRUE(flights
+                    .Do("a",
+                        [&](int* result) {
+                          a_started.Notify();
+                          // Only returns if the call for "b" is not blocked.
+                          b_done.WaitForNotification();
+                          *result = 1;
+                          return absl::OkStatus();
+                        },
+                        &result)
+                    .ok());
+  });
+  a_started.WaitForNotification();
+  int result = 0;
+  EXPECT_TRUE(flights
+                  .Do("b",
+                      [](int* result) {
+                        *result = 2;
+                        return absl::OkStatus();
+                      },
+                      &result)
+                  .ok());
+  EXPECT_EQ(2, result);
+  b_done.Notify();
+  bundle.JoinAll();
+  EXPECT_EQ(0, flights.num_shared());
+}
+
+}  // namespace
+}  // namespace carls
@@ -13,15 +13,20 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <limits>
 #include <string>
 #include <vector>
 
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
 #include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
 #include "research/carls/base/embedding_helper.h"
 #include "research/carls/base/top_n.h"
 #include "research/carls/candidate_sampling/candidate_sampler.h"
 #include "research/carls/candidate_sampling/candidate_sampler_config.pb.h"  // proto to pb
 #include "research/carls/embedding.pb.h"  // proto to pb
+#include "research/carls/input_context.pb.h"  // proto to pb
 
 namespace carls {
 namespace candidate_sampling {
@@ -48,6 +53,75 @@ struct CandidateInfoComparator {
   }
 };
 
+// Returns the token of a metadata feature value in the posting lists, or an
+// empty string if the value is not set. The weights and debug_info of the
+// value are ignored.
+std::string PostingToken(absl::string_view feature_name,
+                         const FeatureValue& value) {
+  // The feature name cannot contain '\0', which separates it from the value.
+  const absl::string_view separator("\0", 1);
+  switch (value.feature_case()) {
+    case FeatureValue::kBytesFeature:
+      return absl::StrCat(feature_name, separator, "b",
+                          value.bytes_feature().value());
+    case FeatureValue::kFloatFeature:
+      return absl::StrCat(feature_name, separator, "f",
+                          value.float_feature().value());
+    case FeatureValue::kInt64Feature:
+      return absl::StrCat(feature_name, separator, "i",
+                          value.int64_feature().value());
+    case FeatureValue::kUint64Feature:
+      return absl::StrCat(feature_name, separator, "u",
+                          value.uint64_feature().value());
+    default:
+      return "";
+  }
+}
+
+// Returns the posting tokens of all the feature values in `meta_data`.
+std::vector<std::string> PostingTokens(const InputContext& meta_data) {
+  std::vector<std::string> tokens;
+  for (const auto& feature : meta_data.feature()) {
+    for (const auto& value : feature.second.feature_value()) {
+      std::string token = PostingToken(feature.first, value);
+      if (!token.empty()) {
+        tokens.push_back(std::move(token));
+      }
+    }
+  }
+  return tokens;
+}
+
+// Returns true if `meta_data` satisfies all the predicates.
+bool MatchesPredicates(
+    const InputContext& meta_data,
+    const google::protobuf::RepeatedPtrField<MetadataPredicate>& predicates) {
+  for (const auto& predicate : predicates) {
+    const auto iter = meta_data.feature().find(predicate.feature_name());
+    if (iter == meta_data.feature().end()) {
+      return false;
+    }
+    bool matched = false;
+    for (const auto& expected : predicate.value()) {
+      const std::string expected_token =
+          PostingToken(predicate.feature_name(), expected);
+      for (const auto& value : iter->second.feature_value()) {
+        if (PostingToken(predicate.feature_name(), value) == expected_token) {
+          matched = true;
+          break;
+        }
+      }
+      if (matched) {
+        break;
+      }
+    }
+    if (!matched) {
+      return false;
+    }
+  }
+  return true;
+}
+
 BruteForceTopkSamplerConfig GetTopkConfig(
     const CandidateSamplerConfig& config) {
   return GetExtensionProtoOrDie<CandidateSamplerConfig,
@@ -57,13 +131,25 @@ BruteForceTopkSamplerConfig GetTopkConfig(
 }  // namespace
 
 // A brute-force implementation of the top-k sampler. Each time the Sample()
-// method is called, it traverses all the embeddings in a knowledge bank and
-// compares their similarities with given input activation.
+// method is called, it traverses all the embeddings in a knowledge bank, or
+// the ones passing the CandidateFilter of the sample context, and compares
+// their similarities with given input activation.
+//
+// With index_metadata in the config, the sampler is incremental and keeps the
+// posting lists of the metadata feature values, so that the metadata
+// predicates of a filter are resolved before any embedding is looked up.
 class BruteForceTopkSampler : public CandidateSampler {
  public:
   BruteForceTopkSampler(const CandidateSamplerConfig& config)
       : CandidateSampler(config), topk_config_(GetTopkConfig(config)) {}
 
+  // Implementation of the incremental interface, used with index_metadata.
+  absl::Status InsertOrUpdate(absl::string_view key,
+                              const EmbeddingVectorProto& embedding) override;
+  absl::Status Remove(absl::string_view key) override;
+  bool IsIncremental() const override { return topk_config_.index_metadata(); }
+  int NumOfCandidates() override;
+
  private:
   absl::Status SampleInternal(
       const KnowledgeBank& knowledge_bank, const SampleContext& sample_context,
@@ -71,7 +157,30 @@ class BruteForceTopkSampler : public CandidateSampler {
       std::vector<std::pair<absl::string_view, SampledResult>>* results)
       const override;
 
+  // Returns the indexed keys satisfying all the predicates.
+  std::vector<std::string> FindIndexedCandidates(
+      const google::protobuf::RepeatedPtrField<MetadataPredicate>& predicates)
+      const;
+
+  // Removes `key` from the posting lists. Requires index_mu_.
+  void RemoveFromPostingLists(const std::string& key,
+                              const std::vector<std::string>& tokens)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(index_mu_);
+
   const BruteForceTopkSamplerConfig topk_config_;
+
+  // The version and posting tokens of an indexed key.
+  struct IndexedKey {
+    int64_t version = 0;
+    std::vector<std::string> tokens;
+  };
+
+  mutable absl::Mutex index_mu_;
+  absl::flat_hash_map<std::string, IndexedKey> indexed_keys_
+      ABSL_GUARDED_BY(index_mu_);
+  // Maps from the token of a metadata feature value to the keys having it.
+  absl::flat_hash_map<std::string, absl::flat_hash_set<std::string>>
+      posting_lists_ ABSL_GUARDED_BY(index_mu_);
 };
 
 REGISTER_SAMPLER_FACTORY(BruteForceTopkSamplerConfig,
@@ -103,9 +212,38 @@ absl::Status BruteForceTopkSampler::SampleInternal(
                      sample_context.activation().value_size(), "."));
   }
 
-  std::vector<absl::string_view> all_keys = knowledge_bank.Keys();
+  // Pushes the filter down to the traversal, starting from the smallest set
+  // of candidates: the allowed keys, the indexed keys matching the metadata
+  // predicates, or all the keys.
+  const auto& filter = sample_context.filter();
+  absl::flat_hash_set<absl::string_view> denied_keys(
+      filter.denied_key().begin(), filter.denied_key().end());
+  if (filter.deny_positive_keys()) {
+    denied_keys.insert(sample_context.positive_key().begin(),
+                       sample_context.positive_key().end());
+  }
+  std::vector<absl::string_view> candidate_keys;
+  // Owns the keys from the index, which can be removed meanwhile.
+  std::vector<std::string> indexed_keys;
+  if (!filter.allowed_key().empty()) {
+    absl::flat_hash_set<absl::string_view> allowed_keys;
+    for (const auto& key : filter.allowed_key()) {
+      if (allowed_keys.insert(key).second) {
+        candidate_keys.push_back(key);
+      }
+    }
+  } else if (IsIncremental() && !filter.metadata_predicate().empty()) {
+    indexed_keys = FindIndexedCandidates(filter.metadata_predicate());
+    candidate_keys.assign(indexed_keys.begin(), indexed_keys.end());
+  } else {
+    candidate_keys = knowledge_bank.Keys();
+  }
+
   TopN<CandidateInfo, CandidateInfoComparator> topn(num_samples);
-  for (auto key : all_keys) {
+  for (auto key : candidate_keys) {
+    if (denied_keys.contains(key)) {
+      continue;
+    }
     EmbeddingVectorProto embed;
     if (!knowledge_bank.Lookup(key, &embed).ok()) {
       continue;
@@ -115,6 +253,11 @@ absl::Status BruteForceTopkSampler::SampleInternal(
           "Inconsistent embedding size (", embed.value_size(), " v.s. ",
           sample_context.activation().value_size(), ") for key: ", key));
     }
+    // The predicates are checked on the embedding itself as well, since the
+    // index is updated asynchronously.
+    if (!MatchesPredicates(embed.meta_data(), filter.metadata_predicate())) {
+      continue;
+    }
     float similarity = 0;
     switch (topk_config_.similarity_type()) {
       case DOT_PRODUCT:
@@ -139,7 +282,9 @@ absl::Status BruteForceTopkSampler::SampleInternal(
     }
   }
 
-  // Processes results.
+  // Processes results. The keys from the index do not outlive this call, so
+  // the returned keys refer to the results instead, which are reserved up
+  // front so that they are never moved.
   results->clear();
   results->reserve(num_samples);
   std::unique_ptr<std::vector<CandidateInfo>> topn_results(topn.Extract());
@@ -149,10 +294,127 @@ absl::Status BruteForceTopkSampler::SampleInternal(
     result->set_key(std::string(candidate_info.key));
     result->set_similarity(candidate_info.similarity);
     *(result->mutable_embedding()) = std::move(candidate_info.embed);
-    results->push_back({candidate_info.key, std::move(sampled_result)});
+    results->push_back({absl::string_view(), std::move(sampled_result)});
+    results->back().first =
+        results->back().second.topk_sampling_result().key();
   }
   return absl::OkStatus();
 }
 
+std::vector<std::string> BruteForceTopkSampler::FindIndexedCandidates(
+    const google::protobuf::RepeatedPtrField<MetadataPredicate>& predicates)
+    const {
+  using PostingLists = std::vector<const absl::flat_hash_set<std::string>*>;
+  absl::ReaderMutexLock l(&index_mu_);
+  // The posting lists of the values of each predicate, whose union is the
+  // keys satisfying the predicate.
+  std::vector<PostingLists> postings(predicates.size());
+  int smallest = 0;
+  size_t smallest_size = std::numeric_limits<size_t>::max();
+  for (int i = 0; i < predicates.size(); ++i) {
+    size_t size = 0;
+    for (const auto& value : predicates[i].value()) {
+      const auto iter = posting_lists_.find(
+          PostingToken(predicates[i].feature_name(), value));
+      if (iter != posting_lists_.end()) {
+        postings[i].push_back(&iter->second);
+        size += iter->second.size();
+      }
+    }
+    if (size < smallest_size) {
+      smallest = i;
+      smallest_size = size;
+    }
+  }
+
+  // Traverses the keys of the most selective predicate and checks the others.
+  auto contains = [](const PostingLists& lists, const std::string& key,
+                     size_t end) {
+    for (size_t i = 0; i < end; ++i) {
+      if (lists[i]->contains(key)) {
+        return true;
+      }
+    }
+    return false;
+  };
+  std::vector<std::string> candidates;
+  const auto& smallest_lists = postings[smallest];
+  for (size_t i = 0; i < smallest_lists.size(); ++i) {
+    for (const auto& key : *smallest_lists[i]) {
+      // A key having several values of the predicate is only added once.
+      if (contains(smallest_lists, key, i)) {
+        continue;
+      }
+      bool matched = true;
+      for (int j = 0; j < predicates.size() && matched; ++j) {
+        matched =
+            j == smallest || contains(postings[j], key, postings[j].size());
+      }
+      if (matched) {
+        candidates.push_back(key);
+      }
+    }
+  }
+  return candidates;
+}
+
+absl::Status BruteForceTopkSampler::InsertOrUpdate(
+    absl::string_view key, const EmbeddingVectorProto& embedding) {
+  if (!IsIncremental()) {
+    return absl::FailedPreconditionError("index_metadata is not enabled.");
+  }
+  std::vector<std::string> tokens = PostingTokens(embedding.meta_data());
+  const std::string key_str(key);
+  absl::MutexLock l(&index_mu_);
+  auto insert_result = indexed_keys_.try_emplace(key_str);
+  auto& indexed_key = insert_result.first->second;
+  // The same key may be inserted twice out of order, see
+  // ConnectSamplerToKnowledgeBank().
+  if (!insert_result.second && embedding.version() < indexed_key.version) {
+    return absl::OkStatus();
+  }
+  RemoveFromPostingLists(key_str, indexed_key.tokens);
+  for (const auto& token : tokens) {
+    posting_lists_[token].insert(key_str);
+  }
+  indexed_key.version = embedding.version();
+  indexed_key.tokens = std::move(tokens);
+  return absl::OkStatus();
+}
+
+absl::Status BruteForceTopkSampler::Remove(absl::string_view key) {
+  if (!IsIncremental()) {
+    return absl::FailedPreconditionError("index_metadata is not enabled.");
+  }
+  const std::string key_str(key);
+  absl::MutexLock l(&index_mu_);
+  const auto iter = indexed_keys_.find(key_str);
+  if (iter == indexed_keys_.end()) {
+    return absl::OkStatus();
+  }
+  RemoveFromPostingLists(key_str, iter->second.tokens);
+  indexed_keys_.erase(iter);
+  return absl::OkStatus();
+}
+
+int BruteForceTopkSampler::NumOfCandidates() {
+  absl::MutexLock l(&index_mu_);
+  return indexed_keys_.size();
+}
+
+void BruteForceTopkSampler::RemoveFromPostingLists(
+    const std::string& key, const std::vector<std::string>& tokens) {
+  for (const auto& token : tokens) {
+    const auto iter = posting_lists_.find(token);
+    if (iter == posting_lists_.end()) {
+      continue;
+    }
+    iter->second.erase(key);
+    if (iter->second.empty()) {
+      posting_lists_.erase(iter);
+    }
+  }
+}
+
 }  // namespace candidate_sampling
 }  // namespace carls
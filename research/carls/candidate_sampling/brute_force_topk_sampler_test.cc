@@ -15,6 +15,8 @@ limitations under the License.
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
 #include "absl/strings/string_view.h"
 #include "research/carls/candidate_sampling/candidate_sampler.h"
 #include "research/carls/embedding.pb.h"  // proto to pb
@@ -102,10 +104,12 @@ class BruteForceTopkSamplerTest : public ::testing::Test {
  protected:
   BruteForceTopkSamplerTest() = default;
 
-  std::unique_ptr<CandidateSampler> CreateSampler(SimilarityType type) {
+  std::unique_ptr<CandidateSampler> CreateSampler(SimilarityType type,
+                                                  bool index_metadata = false) {
     CandidateSamplerConfig sampler_config;
     BruteForceTopkSamplerConfig bf_sampler_config;
     bf_sampler_config.set_similarity_type(type);
+    bf_sampler_config.set_index_metadata(index_metadata);
     sampler_config.mutable_extension()->PackFrom(bf_sampler_config);
     return SamplerFactory::Make(sampler_config);
   }
@@ -115,6 +119,46 @@ class BruteForceTopkSamplerTest : public ::testing::Test {
     config.mutable_initializer()->mutable_zero_initializer();
     return KnowledgeBankFactory::Make(config, embedding_dimension);
   }
+
+  // Adds key1 to key4 with embeddings [1, 1], [2, 2], [3, 3], [4, 4] and the
+  // metadata "color" of red, blue, red, blue.
+  void AddColoredKeys(KnowledgeBank* knowledge_bank,
+                      CandidateSampler* sampler = nullptr) {
+    for (int i = 1; i <= 4; ++i) {
+      auto embed = ParseTextProtoOrDie<EmbeddingVectorProto>(absl::StrFormat(
+          R"pb(
+            value: %d
+            value: %d
+            meta_data {
+              feature {
+                key: "color"
+                value { feature_value { bytes_feature { value: "%s" } } }
+              }
+            }
+          )pb",
+          i, i, i % 2 == 1 ? "red" : "blue"));
+      const std::string key = absl::StrCat("key", i);
+      ASSERT_OK(knowledge_bank->Update(key, embed));
+      if (sampler != nullptr) {
+        ASSERT_OK(sampler->InsertOrUpdate(key, embed));
+      }
+    }
+  }
+
+  // Returns the sampled keys in the order of their similarities.
+  std::vector<std::string> SampleKeys(const CandidateSampler& sampler,
+                                      const KnowledgeBank& knowledge_bank,
+                                      const SampleContext& context) {
+    std::vector<std::pair<absl::string_view, SampledResult>> results;
+    EXPECT_OK(
+        sampler.Sample(knowledge_bank, context, /*num_samples=*/2, &results));
+    std::vector<std::string> keys;
+    for (const auto& result : results) {
+      EXPECT_EQ(result.first, result.second.topk_sampling_result().key());
+      keys.emplace_back(result.first);
+    }
+    return keys;
+  }
 };
 
 TEST_F(BruteForceTopkSamplerTest, Create) {
@@ -208,5 +252,126 @@ TEST_F(BruteForceTopkSamplerTest, DotProtudctSimilarity) {
               )pb"));
 }
 
+TEST_F(BruteForceTopkSamplerTest, Filter_AllowedAndDeniedKeys) {
+  auto sampler = CreateSampler(DOT_PRODUCT);
+  auto knowledge_bank = CreateKnowledgeBank(2);
+  AddColoredKeys(knowledge_bank.get());
+
+  SampleContext context;
+  context.mutable_activation()->add_value(1);
+  context.mutable_activation()->add_value(1);
+  EXPECT_THAT(SampleKeys(*sampler, *knowledge_bank, context),
+              testing::ElementsAre("key4", "key3"));
+
+  // Only the allowed keys are sampled, while unknown keys are ignored.
+  auto* filter = context.mutable_filter();
+  filter->add_allowed_key("key1");
+  filter->add_allowed_key("key2");
+  filter->add_allowed_key("key2");
+  filter->add_allowed_key("unknown");
+  EXPECT_THAT(SampleKeys(*sampler, *knowledge_bank, context),
+              testing::ElementsAre("key2", "key1"));
+
+  // Denied keys are never sampled.
+  filter->Clear();
+  filter->add_denied_key("key4");
+  EXPECT_THAT(SampleKeys(*sampler, *knowledge_bank, context),
+              testing::ElementsAre("key3", "key2"));
+
+  // Neither are the positive keys.
+  context.add_positive_key("key3");
+  EXPECT_THAT(SampleKeys(*sampler, *knowledge_bank, context),
+              testing::ElementsAre("key3", "key2"));
+  filter->set_deny_positive_keys(true);
+  EXPECT_THAT(SampleKeys(*sampler, *knowledge_bank, context),
+              testing::ElementsAre("key2", "key1"));
+}
+
+TEST_F(BruteForceTopkSamplerTest, Filter_MetadataPredicates) {
+  auto sampler = CreateSampler(DOT_PRODUCT);
+  auto knowledge_bank = CreateKnowledgeBank(2);
+  AddColoredKeys(knowledge_bank.get());
+
+  SampleContext context = ParseTextProtoOrDie<SampleContext>(R"pb(
+    activation { value: 1 value: 1 }
+    filter {
+      metadata_predicate {
+        feature_name: "color"
+        value { bytes_feature { value: "red" } }
+      }
+    }
+  )pb");
+  EXPECT_THAT(SampleKeys(*sampler, *knowledge_bank, context),
+              testing::ElementsAre("key3", "key1"));
+
+  // Combined with the allowed keys.
+  context.mutable_filter()->add_allowed_key("key1");
+  context.mutable_filter()->add_allowed_key("key2");
+  EXPECT_THAT(SampleKeys(*sampler, *knowledge_bank, context),
+              testing::ElementsAre("key1"));
+
+  // No candidate has an unknown feature.
+  context.mutable_filter()->clear_allowed_key();
+  context.mutable_filter()->mutable_metadata_predicate(0)->set_feature_name(
+      "size");
+  EXPECT_TRUE(SampleKeys(*sampler, *knowledge_bank, context).empty());
+}
+
+TEST_F(BruteForceTopkSamplerTest, Filter_IndexedMetadata) {
+  auto sampler = CreateSampler(DOT_PRODUCT, /*index_metadata=*/true);
+  ASSERT_TRUE(sampler->IsIncremental());
+  auto knowledge_bank = CreateKnowledgeBank(2);
+  AddColoredKeys(knowledge_bank.get(), sampler.get());
+  EXPECT_EQ(4, sampler->NumOfCandidates());
+
+  SampleContext context = ParseTextProtoOrDie<SampleContext>(R"pb(
+    activation { value: 1 value: 1 }
+    filter {
+      metadata_predicate {
+        feature_name: "color"
+        value { bytes_feature { value: "blue" } }
+        value { bytes_feature { value: "green" } }
+      }
+    }
+  )pb");
+  EXPECT_THAT(SampleKeys(*sampler, *knowledge_bank, context),
+              testing::ElementsAre("key4", "key2"));
+  context.mutable_filter()->add_denied_key("key4");
+  EXPECT_THAT(SampleKeys(*sampler, *knowledge_bank, context),
+              testing::ElementsAre("key2"));
+
+  // Updates the index.
+  auto embed = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    value: 5
+    value: 5
+    version: 1
+    meta_data {
+      feature {
+        key: "color"
+        value { feature_value { bytes_feature { value: "green" } } }
+      }
+    }
+  )pb");
+  ASSERT_OK(knowledge_bank->Update("key5", embed));
+  ASSERT_OK(sampler->InsertOrUpdate("key5", embed));
+  ASSERT_OK(sampler->Remove("key2"));
+  EXPECT_EQ(4, sampler->NumOfCandidates());
+  EXPECT_THAT(SampleKeys(*sampler, *knowledge_bank, context),
+              testing::ElementsAre("key5"));
+
+  // An older version does not overwrite the index.
+  embed.set_version(0);
+  embed.clear_meta_data();
+  ASSERT_OK(sampler->InsertOrUpdate("key5", embed));
+  EXPECT_THAT(SampleKeys(*sampler, *knowledge_bank, context),
+              testing::ElementsAre("key5"));
+
+  // Index is not updated when index_metadata is false.
+  auto scan_sampler = CreateSampler(DOT_PRODUCT);
+  EXPECT_FALSE(scan_sampler->IsIncremental());
+  EXPECT_ERROR_EQ(scan_sampler->InsertOrUpdate("key5", embed),
+                  "index_metadata is not enabled.");
+}
+
 }  // namespace candidate_sampling
 }  // namespace carls
@@ -44,9 +44,57 @@ absl::Status CandidateSampler::InsertOrUpdate(
   LOG(FATAL) << "Method is not implemented, possibly because it is not needed.";
 }
 
+absl::Status CandidateSampler::Remove(absl::string_view key) {
+  LOG(FATAL) << "Method is not implemented, possibly because it is not needed.";
+}
+
 int CandidateSampler::NumOfCandidates() {
   LOG(FATAL) << "Method is not implemented, possibly because it is not needed.";
 }
 
+CandidateSamplerObserver::CandidateSamplerObserver(CandidateSampler* sampler)
+    : sampler_(sampler) {
+  CHECK(sampler_ != nullptr);
+}
+
+void CandidateSamplerObserver::OnChanges(
+    const std::vector<KnowledgeBankChange>& changes) {
+  for (const auto& change : changes) {
+    absl::Status status;
+    if (change.type == KnowledgeBankChange::kEvict) {
+      status = sampler_->Remove(change.key);
+    } else {
+      status = sampler_->InsertOrUpdate(change.key, change.value);
+    }
+    if (!status.ok()) {
+      ++num_errors_;
+      LOG(ERROR) << "Applying the change of key " << change.key
+                 << " to the sampler failed: " << status;
+    }
+  }
+}
+
+std::shared_ptr<CandidateSamplerObserver> ConnectSamplerToKnowledgeBank(
+    CandidateSampler* sampler, KnowledgeBank* knowledge_bank) {
+  CHECK(sampler != nullptr);
+  CHECK(knowledge_bank != nullptr);
+  auto observer = std::make_shared<CandidateSamplerObserver>(sampler);
+  // Registers the observer first so that no change is missed while the
+  // existing keys are added.
+  knowledge_bank->AddObserver(observer);
+  EmbeddingVectorProto embedding;
+  for (const auto& key : knowledge_bank->Keys()) {
+    if (!knowledge_bank->Lookup(key, &embedding).ok()) {
+      continue;
+    }
+    auto status = sampler->InsertOrUpdate(key, embedding);
+    if (!status.ok()) {
+      LOG(ERROR) << "Adding key " << key << " to the sampler failed: "
+                 << status;
+    }
+  }
+  return observer;
+}
+
 }  // namespace candidate_sampling
 }  // namespace carls
@@ -16,12 +16,15 @@ limitations under the License.
 #ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_CANDIDATE_SAMPLING_CANDIDATE_SAMPLER_H_
 #define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_CANDIDATE_SAMPLING_CANDIDATE_SAMPLER_H_
 
+#include <atomic>
+#include <memory>
 #include <vector>
 
 #include "absl/status/status.h"
 #include "absl/strings/string_view.h"
 #include "research/carls/base/proto_factory.h"
 #include "research/carls/candidate_sampling/candidate_sampler_config.pb.h"  // proto to pb
+#include "research/carls/knowledge_bank/change_notifier.h"
 #include "research/carls/knowledge_bank/knowledge_bank.h"
 
 namespace carls {
@@ -54,6 +57,14 @@ class CandidateSampler {
   virtual absl::Status InsertOrUpdate(absl::string_view key,
                                       const EmbeddingVectorProto& embedding);
 
+  // Removes a candidate from sampling.
+  virtual absl::Status Remove(absl::string_view key);
+
+  // Returns true if the sampler maintains its own index of the candidates
+  // through InsertOrUpdate() and Remove(), in which case it should be kept up
+  // to date with the knowledge bank, e.g., by a CandidateSamplerObserver.
+  virtual bool IsIncremental() const { return false; }
+
   // Returns the number of candidates currently available for sampling.
   virtual int NumOfCandidates();
 
@@ -74,6 +85,33 @@ class CandidateSampler {
 REGISTER_CARLS_BASE_CLASS_0(CandidateSamplerConfig, CandidateSampler,
                             SamplerFactory);
 
+// Forwards the changes of a knowledge bank to the index of an incremental
+// CandidateSampler, so it does not need to rescan the knowledge bank.
+// The sampler must outlive the observer's registration with the knowledge bank.
+class CandidateSamplerObserver : public KnowledgeBankObserver {
+ public:
+  explicit CandidateSamplerObserver(CandidateSampler* sampler);
+
+  // Implementation of the KnowledgeBankObserver interface.
+  void OnChanges(const std::vector<KnowledgeBankChange>& changes) override;
+
+  // Returns the number of changes the sampler failed to apply.
+  int64_t num_errors() const { return num_errors_; }
+
+ private:
+  CandidateSampler* sampler_;
+  std::atomic<int64_t> num_errors_{0};
+};
+
+// Registers a CandidateSamplerObserver of `sampler` with `knowledge_bank` and
+// then adds the existing keys of the knowledge bank to the sampler. A key
+// changed meanwhile may be passed to InsertOrUpdate() twice out of order, so
+// the sampler should keep the embedding with the larger version().
+// Returns the observer so that it can be removed from the knowledge bank
+// before the sampler is destroyed.
+std::shared_ptr<CandidateSamplerObserver> ConnectSamplerToKnowledgeBank(
+    CandidateSampler* sampler, KnowledgeBank* knowledge_bank);
+
 }  // namespace candidate_sampling
 }  // namespace carls
 
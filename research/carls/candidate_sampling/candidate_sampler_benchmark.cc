@@ -0,0 +1,211 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Benchmarks the candidate samplers on an InProtoKnowledgeBank of N keys at
+// dimension D, e.g.,
+//   bazel run -c opt //research/carls/candidate_sampling:candidate_sampler_benchmark
+//
+// Every benchmark reports
+// - items_per_second: the samples returned per second,
+// - allocs_per_sample: the heap allocations per returned sample,
+// - p50_us and p99_us: the latency of sampling a batch of contexts,
+// and runs with one or more threads sharing the sampler and the knowledge
+// bank. A new sampler is benchmarked by adding its config with
+// REGISTER_SAMPLER_BENCHMARK() below.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "research/carls/base/proto_helper.h"
+#include "research/carls/candidate_sampling/candidate_sampler.h"
+#include "research/carls/candidate_sampling/candidate_sampler_config.pb.h"  // proto to pb
+#include "research/carls/knowledge_bank/knowledge_bank.h"
+
+// Counts the heap allocations of the calling thread.
+namespace {
+thread_local int64_t num_allocations = 0;
+}  // namespace
+
+void* operator new(size_t size) {
+  ++num_allocations;
+  void* ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+namespace carls {
+namespace candidate_sampling {
+namespace {
+
+// Returns a knowledge bank of `num_keys` keys with random embeddings of given
+// dimension, shared by all the benchmarks.
+const KnowledgeBank& GetKnowledgeBank(int num_keys, int dimension) {
+  static absl::Mutex mu(absl::kConstInit);
+  static auto* banks =
+      new std::map<std::pair<int, int>, std::unique_ptr<KnowledgeBank>>();
+  absl::MutexLock l(&mu);
+  auto& bank = (*banks)[{num_keys, dimension}];
+  if (bank == nullptr) {
+    KnowledgeBankConfig config;
+    config.mutable_initializer()->mutable_zero_initializer();
+    config.mutable_extension()->PackFrom(InProtoKnowledgeBankConfig());
+    bank = KnowledgeBankFactory::Make(config, dimension);
+    std::mt19937 rng(num_keys);
+    std::normal_distribution<float> distribution;
+    EmbeddingVectorProto embedding;
+    for (int i = 0; i < num_keys; ++i) {
+      embedding.clear_value();
+      for (int j = 0; j < dimension; ++j) {
+        embedding.add_value(distribution(rng));
+      }
+      CHECK(bank->Update(absl::StrCat("key", i), embedding).ok());
+    }
+  }
+  return *bank;
+}
+
+// Returns the sampler of given config, shared by all the threads.
+const CandidateSampler& GetSampler(const CandidateSamplerConfig& config) {
+  static absl::Mutex mu(absl::kConstInit);
+  static auto* samplers =
+      new std::map<std::string, std::unique_ptr<CandidateSampler>>();
+  absl::MutexLock l(&mu);
+  auto& sampler = (*samplers)[config.SerializeAsString()];
+  if (sampler == nullptr) {
+    sampler = SamplerFactory::Make(config);
+    CHECK(sampler != nullptr) << "Invalid config: " << config.DebugString();
+  }
+  return *sampler;
+}
+
+template <typename Config>
+CandidateSamplerConfig MakeConfig(const std::string& text) {
+  CandidateSamplerConfig config;
+  config.mutable_extension()->PackFrom(ParseTextProtoOrDie<Config>(text));
+  return config;
+}
+
+// Args are {num_keys, dimension, batch_size, num_samples}.
+void SampleArgs(benchmark::internal::Benchmark* b) {
+  for (int num_keys : {1 << 14, 1 << 17}) {
+    for (int batch_size : {1, 32}) {
+      for (int num_samples : {8, 128}) {
+        b->Args({num_keys, /*dimension=*/64, batch_size, num_samples});
+      }
+    }
+  }
+}
+
+void BM_Sample(benchmark::State& state, const CandidateSamplerConfig& config) {
+  const int num_keys = state.range(0);
+  const int dimension = state.range(1);
+  const int batch_size = state.range(2);
+  const int num_samples = state.range(3);
+  const auto& knowledge_bank = GetKnowledgeBank(num_keys, dimension);
+  const auto& sampler = GetSampler(config);
+
+  // Every context has a positive key for the negative samplers and an
+  // activation for the top-k samplers.
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<int> key_distribution(0, num_keys - 1);
+  std::normal_distribution<float> value_distribution;
+  std::vector<SampleContext> contexts(batch_size);
+  for (auto& context : contexts) {
+    context.add_positive_key(absl::StrCat("key", key_distribution(rng)));
+    for (int i = 0; i < dimension; ++i) {
+      context.mutable_activation()->add_value(value_distribution(rng));
+    }
+  }
+
+  std::vector<std::pair<absl::string_view, SampledResult>> results;
+  std::vector<double> latencies_us;
+  const int64_t allocations_begin = num_allocations;
+  for (auto _ : state) {
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto& context : contexts) {
+      const auto status =
+          sampler.Sample(knowledge_bank, context, num_samples, &results);
+      if (!status.ok()) {
+        state.SkipWithError(std::string(status.message()).c_str());
+        break;
+      }
+      benchmark::DoNotOptimize(results.data());
+    }
+    latencies_us.push_back(std::chrono::duration<double, std::micro>(
+                               std::chrono::steady_clock::now() - start)
+                               .count());
+  }
+  const int64_t num_allocated = num_allocations - allocations_begin;
+
+  const int64_t total_samples = state.iterations() * batch_size * num_samples;
+  state.SetItemsProcessed(total_samples);
+  if (total_samples > 0) {
+    state.counters["allocs_per_sample"] = benchmark::Counter(
+        static_cast<double>(num_allocated) / total_samples,
+        benchmark::Counter::kAvgThreads);
+  }
+  if (!latencies_us.empty()) {
+    std::sort(latencies_us.begin(), latencies_us.end());
+    state.counters["p50_us"] = benchmark::Counter(
+        latencies_us[latencies_us.size() / 2], benchmark::Counter::kAvgThreads);
+    state.counters["p99_us"] =
+        benchmark::Counter(latencies_us[latencies_us.size() * 99 / 100],
+                           benchmark::Counter::kAvgThreads);
+  }
+}
+
+#define REGISTER_SAMPLER_BENCHMARK(name, config)   \
+  BENCHMARK_CAPTURE(BM_Sample, name, config)       \
+      ->Apply(SampleArgs)                          \
+      ->Threads(1)                                 \
+      ->Threads(4)                                 \
+      ->UseRealTime()
+
+REGISTER_SAMPLER_BENCHMARK(
+    negative_uniform, MakeConfig<NegativeSamplerConfig>("sampler: UNIFORM"));
+REGISTER_SAMPLER_BENCHMARK(
+    negative_log_uniform,
+    MakeConfig<NegativeSamplerConfig>("sampler: LOG_UNIFORM"));
+REGISTER_SAMPLER_BENCHMARK(
+    negative_unique,
+    MakeConfig<NegativeSamplerConfig>("sampler: UNIFORM unique: true"));
+REGISTER_SAMPLER_BENCHMARK(
+    topk_dot_product,
+    MakeConfig<BruteForceTopkSamplerConfig>("similarity_type: DOT_PRODUCT"));
+REGISTER_SAMPLER_BENCHMARK(
+    topk_cosine,
+    MakeConfig<BruteForceTopkSamplerConfig>("similarity_type: COSINE"));
+
+}  // namespace
+}  // namespace candidate_sampling
+}  // namespace carls
@@ -44,12 +44,15 @@ def negative_sampler(unique: bool,
 
 
 def brute_force_topk_sampler(
-    similarity_type) -> cs_config_pb2.BruteForceTopkSamplerConfig:
+    similarity_type,
+    index_metadata: bool = False) -> cs_config_pb2.BruteForceTopkSamplerConfig:
   """Returns a BruteForceTopkSamplerConfig based on given similarity type.
 
   Args:
     similarity_type: A string or an int indicating the type of similarity
       defined in carls.candidate_sampling.SimilarityType.
+    index_metadata: If True, the metadata of the embeddings is indexed for the
+      metadata predicates of a CandidateFilter.
 
   Returns:
     An instance of BruteForceTopkSamplerConfig if input is valid.
@@ -66,7 +69,23 @@ def brute_force_topk_sampler(
     raise ValueError('Invalid input: %r' % similarity_type)
 
   return cs_config_pb2.BruteForceTopkSamplerConfig(
-      similarity_type=similarity_type)
+      similarity_type=similarity_type, index_metadata=index_metadata)
+
+
+def hierarchical_softmax_sampler(
+    node_key_prefix: typing.Text = ''
+) -> cs_config_pb2.HierarchicalSoftmaxSamplerConfig:
+  """Returns a HierarchicalSoftmaxSamplerConfig.
+
+  Args:
+    node_key_prefix: The prefix of the keys of the internal nodes of the tree in
+      the knowledge bank. If empty, the default prefix is used.
+
+  Returns:
+    An instance of HierarchicalSoftmaxSamplerConfig.
+  """
+  return cs_config_pb2.HierarchicalSoftmaxSamplerConfig(
+      node_key_prefix=node_key_prefix)
 
 
 def build_candidate_sampler_config(
@@ -74,8 +93,8 @@ def build_candidate_sampler_config(
   """Builds a CandidateSamplerConfig from given sampler.
 
   Args:
-    sampler: an instance of NegativeSamplerConfig or
-      BruteForceTopkSamplerConfig.
+    sampler: an instance of NegativeSamplerConfig,
+      BruteForceTopkSamplerConfig or HierarchicalSoftmaxSamplerConfig.
 
   Returns:
     A valid CandidateSamplerConfig.
@@ -84,10 +103,11 @@ def build_candidate_sampler_config(
     ValueError if `sampler` is not valid.
   """
   if not (isinstance(sampler, cs_config_pb2.NegativeSamplerConfig) or
-          isinstance(sampler, cs_config_pb2.BruteForceTopkSamplerConfig)):
+          isinstance(sampler, cs_config_pb2.BruteForceTopkSamplerConfig) or
+          isinstance(sampler, cs_config_pb2.HierarchicalSoftmaxSamplerConfig)):
     raise ValueError(
-        'sampler must be one of NegativeSamplerConfig or BruteForceTopkSamplerConfig'
-    )
+        'sampler must be one of NegativeSamplerConfig, '
+        'BruteForceTopkSamplerConfig or HierarchicalSoftmaxSamplerConfig')
 
   sampler_config = cs_config_pb2.CandidateSamplerConfig()
   sampler_config.extension.Pack(sampler)
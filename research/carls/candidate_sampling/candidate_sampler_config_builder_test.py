@@ -77,6 +77,13 @@ class CandidateSamplerConfigBuilderTest(tf.test.TestCase):
         """
       similarity_type: DOT_PRODUCT
     """, cs_config_builder.brute_force_topk_sampler(cs_config_pb2.DOT_PRODUCT))
+    self.assertProtoEquals(
+        """
+      similarity_type: DOT_PRODUCT
+      index_metadata: true
+    """,
+        cs_config_builder.brute_force_topk_sampler(
+            'DOT_PRODUCT', index_metadata=True))
 
   def test_brute_force_topk_sampler_failed(self):
     with self.assertRaises(ValueError):
@@ -88,6 +95,14 @@ class CandidateSamplerConfigBuilderTest(tf.test.TestCase):
     with self.assertRaises(ValueError):
       cs_config_builder.brute_force_topk_sampler(999)
 
+  def test_hierarchical_softmax_sampler(self):
+    self.assertProtoEquals('',
+                           cs_config_builder.hierarchical_softmax_sampler())
+    self.assertProtoEquals(
+        """
+      node_key_prefix: "node/"
+    """, cs_config_builder.hierarchical_softmax_sampler('node/'))
+
   def test_build_candidate_sampler_config_success(self):
     self.assertProtoEquals(
         """
@@ -112,6 +127,17 @@ class CandidateSamplerConfigBuilderTest(tf.test.TestCase):
         cs_config_builder.build_candidate_sampler_config(
             cs_config_builder.negative_sampler(True, 'UNIFORM')))
 
+    self.assertProtoEquals(
+        """
+        extension {
+          [type.googleapis.com/carls.candidate_sampling.HierarchicalSoftmaxSamplerConfig] {
+            node_key_prefix: "node/"
+          }
+        }
+    """,
+        cs_config_builder.build_candidate_sampler_config(
+            cs_config_builder.hierarchical_softmax_sampler('node/')))
+
   def test_build_candidate_sampler_config_failed(self):
     with self.assertRaises(ValueError):
       cs_config_builder.build_candidate_sampler_config(100)
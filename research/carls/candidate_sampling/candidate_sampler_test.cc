@@ -15,10 +15,15 @@ limitations under the License.
 
 #include "research/carls/candidate_sampling/candidate_sampler.h"
 
+#include <map>
+#include <string>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/status/status.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "research/carls/knowledge_bank/initializer.pb.h"  // proto to pb
 
 namespace carls {
 namespace candidate_sampling {
@@ -52,6 +57,121 @@ REGISTER_SAMPLER_FACTORY(CandidateSamplerConfig,
                                new FakeSampler(config));
                          });
 
+// A sampler that keeps its own index of the candidates.
+class IndexedSampler : public CandidateSampler {
+ public:
+  IndexedSampler() : CandidateSampler(CandidateSamplerConfig()) {}
+
+  absl::Status SampleInternal(
+      const KnowledgeBank& knowledge_bank, const SampleContext& sample_context,
+      int num_samples,
+      std::vector<std::pair<absl::string_view, SampledResult>>* results)
+      const override {
+    return absl::OkStatus();
+  }
+
+  bool IsIncremental() const override { return true; }
+
+  int NumOfCandidates() override {
+    absl::MutexLock l(&mu_);
+    return index_.size();
+  }
+
+  absl::Status InsertOrUpdate(absl::string_view key,
+                              const EmbeddingVectorProto& embedding) override {
+    absl::MutexLock l(&mu_);
+    auto& entry = index_[std::string(key)];
+    if (embedding.version() >= entry.version()) {
+      entry = embedding;
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status Remove(absl::string_view key) override {
+    absl::MutexLock l(&mu_);
+    if (index_.erase(std::string(key)) == 0) {
+      return absl::NotFoundError("Key not found.");
+    }
+    return absl::OkStatus();
+  }
+
+  int64_t Version(const std::string& key) {
+    absl::MutexLock l(&mu_);
+    auto iter = index_.find(key);
+    return iter == index_.end() ? -1 : iter->second.version();
+  }
+
+ private:
+  absl::Mutex mu_;
+  std::map<std::string, EmbeddingVectorProto> index_ ABSL_GUARDED_BY(mu_);
+};
+
+// A knowledge bank that only supports Update() and Evict().
+class FakeKnowledgeBank : public KnowledgeBank {
+ public:
+  explicit FakeKnowledgeBank(const KnowledgeBankConfig& config)
+      : KnowledgeBank(config, /*embedding_dimension=*/1) {}
+
+  absl::Status Lookup(const absl::string_view key,
+                      EmbeddingVectorProto* result) const override {
+    auto iter = data_.find(std::string(key));
+    if (iter == data_.end()) {
+      return absl::NotFoundError("Key not found.");
+    }
+    *result = iter->second;
+    return absl::OkStatus();
+  }
+
+  absl::Status LookupWithUpdate(const absl::string_view key,
+                                EmbeddingVectorProto* result) override {
+    return Lookup(key, result);
+  }
+
+  absl::Status Update(const absl::string_view key,
+                      const EmbeddingVectorProto& value) override {
+    auto& entry = data_[std::string(key)];
+    const bool inserted = entry.version() == 0;
+    const int64_t version = entry.version() + 1;
+    entry = value;
+    entry.set_version(version);
+    NotifyChange(
+        inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+        key, entry);
+    return absl::OkStatus();
+  }
+
+  void Evict(const std::string& key) {
+    data_.erase(key);
+    NotifyChange(KnowledgeBankChange::kEvict, key, EmbeddingVectorProto());
+  }
+
+  absl::Status ExportInternal(const std::string& dir,
+                              std::string* exported_path) override {
+    return absl::OkStatus();
+  }
+
+  absl::Status ImportInternal(const std::string& saved_path) override {
+    return absl::OkStatus();
+  }
+
+  size_t Size() const override { return data_.size(); }
+
+  std::vector<absl::string_view> Keys() const override {
+    std::vector<absl::string_view> keys;
+    for (const auto& key_value : data_) {
+      keys.push_back(key_value.first);
+    }
+    return keys;
+  }
+
+  bool Contains(absl::string_view key) const override {
+    return data_.find(std::string(key)) != data_.end();
+  }
+
+ private:
+  std::map<std::string, EmbeddingVectorProto> data_;
+};
+
 }  // namespace
 
 class CandidateSamplerTest : public ::testing::Test {
@@ -69,5 +189,41 @@ TEST_F(CandidateSamplerTest, Create) {
   ASSERT_NE(sampler, nullptr);
 }
 
+TEST_F(CandidateSamplerTest, ConnectSamplerToKnowledgeBank) {
+  KnowledgeBankConfig config;
+  config.mutable_initializer()->mutable_zero_initializer();
+  FakeKnowledgeBank knowledge_bank(config);
+  IndexedSampler sampler;
+  EmbeddingVectorProto value;
+  value.add_value(1.0f);
+  ASSERT_TRUE(knowledge_bank.Update("key1", value).ok());
+  ASSERT_TRUE(knowledge_bank.Update("key2", value).ok());
+
+  // Existing keys are added when connected.
+  auto observer = ConnectSamplerToKnowledgeBank(&sampler, &knowledge_bank);
+  EXPECT_EQ(2, sampler.NumOfCandidates());
+
+  // Later changes are forwarded.
+  ASSERT_TRUE(knowledge_bank.Update("key2", value).ok());
+  ASSERT_TRUE(knowledge_bank.Update("key3", value).ok());
+  knowledge_bank.Evict("key1");
+  knowledge_bank.FlushChanges();
+  EXPECT_EQ(2, sampler.NumOfCandidates());
+  EXPECT_EQ(-1, sampler.Version("key1"));
+  EXPECT_EQ(2, sampler.Version("key2"));
+  EXPECT_EQ(1, sampler.Version("key3"));
+  EXPECT_EQ(0, observer->num_errors());
+
+  // Evicting an unknown key is counted as an error.
+  knowledge_bank.Evict("key1");
+  knowledge_bank.FlushChanges();
+  EXPECT_EQ(1, observer->num_errors());
+
+  knowledge_bank.RemoveObserver(observer.get());
+  ASSERT_TRUE(knowledge_bank.Update("key4", value).ok());
+  knowledge_bank.FlushChanges();
+  EXPECT_EQ(2, sampler.NumOfCandidates());
+}
+
 }  // namespace candidate_sampling
 }  // namespace carls
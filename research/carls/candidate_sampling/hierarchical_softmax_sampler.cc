@@ -0,0 +1,365 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "research/carls/base/embedding_helper.h"
+#include "research/carls/candidate_sampling/candidate_sampler.h"
+#include "research/carls/candidate_sampling/candidate_sampler_config.pb.h"  // proto to pb
+#include "research/carls/embedding.pb.h"  // proto to pb
+
+namespace carls {
+namespace candidate_sampling {
+namespace {
+
+constexpr char kDefaultNodeKeyPrefix[] = "__hs_node__/";
+
+HierarchicalSoftmaxSamplerConfig GetHierarchicalSoftmaxConfig(
+    const CandidateSamplerConfig& config) {
+  return GetExtensionProtoOrDie<CandidateSamplerConfig,
+                                HierarchicalSoftmaxSamplerConfig>(config);
+}
+
+// Returns log(sigmoid(x)) without overflow.
+float LogSigmoid(float x) {
+  return x >= 0 ? -std::log1p(std::exp(-x)) : x - std::log1p(std::exp(x));
+}
+
+// Returns the weight of a leaf in the tree, where keys without a weight count
+// as one.
+double LeafWeight(const EmbeddingVectorProto& embedding) {
+  return embedding.weight() > 0 ? embedding.weight() : 1.0;
+}
+
+}  // namespace
+
+// An implementation of the hierarchical softmax, see
+// HierarchicalSoftmaxSamplerConfig for details. The tree is stored as a vector
+// of nodes linked by their indices, where the freed nodes are reused. The
+// internal nodes are never renamed, so their keys in the knowledge bank keep
+// the embeddings trained for them.
+class HierarchicalSoftmaxSampler : public CandidateSampler {
+ public:
+  explicit HierarchicalSoftmaxSampler(const CandidateSamplerConfig& config)
+      : CandidateSampler(config),
+        node_key_prefix_(
+            GetHierarchicalSoftmaxConfig(config).node_key_prefix().empty()
+                ? kDefaultNodeKeyPrefix
+                : GetHierarchicalSoftmaxConfig(config).node_key_prefix()) {}
+
+  // Implementation of the incremental interface. The keys of the internal
+  // nodes, which are in the same knowledge bank, are ignored.
+  absl::Status InsertOrUpdate(absl::string_view key,
+                              const EmbeddingVectorProto& embedding) override;
+  absl::Status Remove(absl::string_view key) override;
+  bool IsIncremental() const override { return true; }
+  int NumOfCandidates() override;
+
+ private:
+  // A node of the tree. A leaf has a key and no children.
+  struct Node {
+    int parent = -1;
+    int children[2] = {-1, -1};
+    // The total weight of the leaves under the node.
+    double weight = 0;
+    // The key of a leaf, or the key of an internal node in the knowledge bank.
+    std::string key;
+    // The version of the embedding of a leaf.
+    int64_t version = 0;
+
+    bool is_leaf() const { return children[0] < 0; }
+  };
+
+  absl::Status SampleInternal(
+      const KnowledgeBank& knowledge_bank, const SampleContext& sample_context,
+      int num_samples,
+      std::vector<std::pair<absl::string_view, SampledResult>>* results)
+      const override;
+
+  // Returns the nodes along the paths of the positive keys for training.
+  absl::Status SamplePaths(
+      const KnowledgeBank& knowledge_bank, const SampleContext& sample_context,
+      int num_samples,
+      std::vector<std::pair<absl::string_view, SampledResult>>* results) const
+      ABSL_SHARED_LOCKS_REQUIRED(mu_);
+
+  // Returns the `num_samples` leaves with the largest probabilities by a best
+  // first search from the root. The log probabilities only decrease along a
+  // path, so the leaves are found in the order of their probabilities.
+  absl::Status SampleTopk(
+      const KnowledgeBank& knowledge_bank, const SampleContext& sample_context,
+      int num_samples,
+      std::vector<std::pair<absl::string_view, SampledResult>>* results) const
+      ABSL_SHARED_LOCKS_REQUIRED(mu_);
+
+  // Returns the index of a new node, reusing a freed one if any.
+  int NewNode() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Adds `delta` to the weights of `node` and its ancestors.
+  void AddWeight(int node, double delta) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Replaces the child `old_child` of `parent`, or the root if `parent` is
+  // -1, by `new_child`.
+  void ReplaceChild(int parent, int old_child, int new_child)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const std::string node_key_prefix_;
+
+  mutable absl::Mutex mu_;
+  std::vector<Node> nodes_ ABSL_GUARDED_BY(mu_);
+  std::vector<int> free_nodes_ ABSL_GUARDED_BY(mu_);
+  int root_ ABSL_GUARDED_BY(mu_) = -1;
+  // Maps from the key of a leaf to its node.
+  absl::flat_hash_map<std::string, int> leaves_ ABSL_GUARDED_BY(mu_);
+  // The id of the next internal node, never reused so that a new node does not
+  // inherit the embedding of a removed one.
+  int64_t next_node_id_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+REGISTER_SAMPLER_FACTORY(HierarchicalSoftmaxSamplerConfig,
+                         [](const CandidateSamplerConfig& config)
+                             -> std::unique_ptr<CandidateSampler> {
+                           return std::unique_ptr<CandidateSampler>(
+                               new HierarchicalSoftmaxSampler(config));
+                         });
+
+absl::Status HierarchicalSoftmaxSampler::SampleInternal(
+    const KnowledgeBank& knowledge_bank, const SampleContext& sample_context,
+    int num_samples,
+    std::vector<std::pair<absl::string_view, SampledResult>>* results) const {
+  if (!sample_context.has_activation()) {
+    return absl::InvalidArgumentError("No activation from sample_context.");
+  }
+  if (knowledge_bank.embedding_dimension() !=
+      sample_context.activation().value_size()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid embedding dimension from activation, expect ",
+                     knowledge_bank.embedding_dimension(), ", got ",
+                     sample_context.activation().value_size(), "."));
+  }
+  results->clear();
+  // The returned keys refer to the results, since the nodes can be changed
+  // once the lock is released.
+  results->reserve(num_samples);
+  absl::ReaderMutexLock l(&mu_);
+  if (!sample_context.positive_key().empty()) {
+    return SamplePaths(knowledge_bank, sample_context, num_samples, results);
+  }
+  return SampleTopk(knowledge_bank, sample_context, num_samples, results);
+}
+
+absl::Status HierarchicalSoftmaxSampler::SamplePaths(
+    const KnowledgeBank& knowledge_bank, const SampleContext& sample_context,
+    int num_samples,
+    std::vector<std::pair<absl::string_view, SampledResult>>* results) const {
+  std::vector<std::pair<int, int>> path;
+  for (const auto& positive_key : sample_context.positive_key()) {
+    const auto iter = leaves_.find(positive_key);
+    if (iter == leaves_.end()) {
+      continue;
+    }
+    // Collects the (node, turn) pairs from the leaf up to the root.
+    path.clear();
+    for (int child = iter->second; nodes_[child].parent >= 0;
+         child = nodes_[child].parent) {
+      const int parent = nodes_[child].parent;
+      path.emplace_back(parent, nodes_[parent].children[1] == child ? 1 : 0);
+    }
+    if (results->size() + path.size() > num_samples) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("The paths of the positive keys have more nodes than "
+                       "num_samples: ",
+                       num_samples));
+    }
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+      const Node& node = nodes_[it->first];
+      SampledResult sampled_result;
+      auto* result = sampled_result.mutable_hierarchical_softmax_result();
+      result->set_key(node.key);
+      // A node that is not trained yet has no embedding.
+      if (!knowledge_bank.Lookup(node.key, result->mutable_embedding()).ok()) {
+        result->clear_embedding();
+      }
+      result->set_label(it->second);
+      result->set_positive_key(positive_key);
+      results->push_back({absl::string_view(), std::move(sampled_result)});
+      results->back().first =
+          results->back().second.hierarchical_softmax_result().key();
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status HierarchicalSoftmaxSampler::SampleTopk(
+    const KnowledgeBank& knowledge_bank, const SampleContext& sample_context,
+    int num_samples,
+    std::vector<std::pair<absl::string_view, SampledResult>>* results) const {
+  if (root_ < 0) {
+    return absl::OkStatus();
+  }
+  // Pairs of (log probability, node), the most probable first.
+  std::priority_queue<std::pair<float, int>> frontier;
+  frontier.push({0.0f, root_});
+  EmbeddingVectorProto embedding;
+  while (!frontier.empty() && results->size() < num_samples) {
+    const auto top = frontier.top();
+    frontier.pop();
+    const Node& node = nodes_[top.second];
+    if (node.is_leaf()) {
+      SampledResult sampled_result;
+      auto* result = sampled_result.mutable_topk_sampling_result();
+      result->set_key(node.key);
+      result->set_similarity(top.first);
+      results->push_back({absl::string_view(), std::move(sampled_result)});
+      results->back().first =
+          results->back().second.topk_sampling_result().key();
+      continue;
+    }
+    // An untrained node splits the probability evenly.
+    float logit = 0;
+    if (knowledge_bank.Lookup(node.key, &embedding).ok() &&
+        !ComputeDotProduct(sample_context.activation(), embedding, &logit)) {
+      return absl::InternalError(
+          absl::StrCat("Inconsistent embedding size (", embedding.value_size(),
+                       " v.s. ", sample_context.activation().value_size(),
+                       ") for key: ", node.key));
+    }
+    frontier.push({top.first + LogSigmoid(-logit), node.children[0]});
+    frontier.push({top.first + LogSigmoid(logit), node.children[1]});
+  }
+  return absl::OkStatus();
+}
+
+absl::Status HierarchicalSoftmaxSampler::InsertOrUpdate(
+    absl::string_view key, const EmbeddingVectorProto& embedding) {
+  if (absl::StartsWith(key, node_key_prefix_)) {
+    return absl::OkStatus();
+  }
+  const double weight = LeafWeight(embedding);
+  absl::MutexLock l(&mu_);
+  const auto iter = leaves_.find(key);
+  if (iter != leaves_.end()) {
+    // The same key may be inserted twice out of order, see
+    // ConnectSamplerToKnowledgeBank().
+    Node& leaf = nodes_[iter->second];
+    if (embedding.version() < leaf.version) {
+      return absl::OkStatus();
+    }
+    leaf.version = embedding.version();
+    AddWeight(iter->second, weight - leaf.weight);
+    return absl::OkStatus();
+  }
+
+  const int leaf = NewNode();
+  nodes_[leaf].key = std::string(key);
+  nodes_[leaf].version = embedding.version();
+  nodes_[leaf].weight = weight;
+  leaves_[nodes_[leaf].key] = leaf;
+  if (root_ < 0) {
+    root_ = leaf;
+    return absl::OkStatus();
+  }
+  // Descends into the lighter subtrees, then splits the leaf reached.
+  int sibling = root_;
+  while (!nodes_[sibling].is_leaf()) {
+    const Node& node = nodes_[sibling];
+    sibling = nodes_[node.children[0]].weight <= nodes_[node.children[1]].weight
+                  ? node.children[0]
+                  : node.children[1];
+  }
+  const int parent = NewNode();
+  nodes_[parent].key = absl::StrCat(node_key_prefix_, next_node_id_++);
+  nodes_[parent].parent = nodes_[sibling].parent;
+  ReplaceChild(nodes_[parent].parent, sibling, parent);
+  nodes_[parent].children[0] = sibling;
+  nodes_[parent].children[1] = leaf;
+  nodes_[sibling].parent = parent;
+  nodes_[leaf].parent = parent;
+  nodes_[parent].weight = nodes_[sibling].weight;
+  AddWeight(parent, weight);
+  return absl::OkStatus();
+}
+
+absl::Status HierarchicalSoftmaxSampler::Remove(absl::string_view key) {
+  absl::MutexLock l(&mu_);
+  const auto iter = leaves_.find(key);
+  if (iter == leaves_.end()) {
+    return absl::OkStatus();
+  }
+  const int leaf = iter->second;
+  leaves_.erase(iter);
+  const int parent = nodes_[leaf].parent;
+  if (parent < 0) {
+    root_ = -1;
+  } else {
+    // The sibling takes the place of the parent.
+    AddWeight(parent, -nodes_[leaf].weight);
+    const int sibling = nodes_[parent].children[0] == leaf
+                            ? nodes_[parent].children[1]
+                            : nodes_[parent].children[0];
+    nodes_[sibling].parent = nodes_[parent].parent;
+    ReplaceChild(nodes_[parent].parent, parent, sibling);
+    nodes_[parent] = Node();
+    free_nodes_.push_back(parent);
+  }
+  nodes_[leaf] = Node();
+  free_nodes_.push_back(leaf);
+  return absl::OkStatus();
+}
+
+int HierarchicalSoftmaxSampler::NumOfCandidates() {
+  absl::ReaderMutexLock l(&mu_);
+  return leaves_.size();
+}
+
+int HierarchicalSoftmaxSampler::NewNode() {
+  if (!free_nodes_.empty()) {
+    const int node = free_nodes_.back();
+    free_nodes_.pop_back();
+    return node;
+  }
+  nodes_.emplace_back();
+  return nodes_.size() - 1;
+}
+
+void HierarchicalSoftmaxSampler::AddWeight(int node, const double delta) {
+  for (; node >= 0; node = nodes_[node].parent) {
+    nodes_[node].weight += delta;
+  }
+}
+
+void HierarchicalSoftmaxSampler::ReplaceChild(const int parent,
+                                              const int old_child,
+                                              const int new_child) {
+  if (parent < 0) {
+    root_ = new_child;
+    return;
+  }
+  auto& children = nodes_[parent].children;
+  children[children[0] == old_child ? 0 : 1] = new_child;
+}
+
+}  // namespace candidate_sampling
+}  // namespace carls
@@ -0,0 +1,293 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include <cmath>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/string_view.h"
+#include "research/carls/candidate_sampling/candidate_sampler.h"
+#include "research/carls/embedding.pb.h"  // proto to pb
+#include "research/carls/knowledge_bank/initializer.pb.h"  // proto to pb
+#include "research/carls/knowledge_bank/initializer_helper.h"
+#include "research/carls/testing/test_helper.h"
+
+namespace carls {
+namespace candidate_sampling {
+namespace {
+
+class FakeEmbedding : public KnowledgeBank {
+ public:
+  explicit FakeEmbedding(const KnowledgeBankConfig& config, int dimension)
+      : KnowledgeBank(config, dimension) {}
+
+  absl::Status Lookup(const absl::string_view key,
+                      EmbeddingVectorProto* result) const override {
+    CHECK(result != nullptr);
+    std::string str_key(key);
+    if (!data_table_.embedding_table().contains(str_key)) {
+      return absl::InvalidArgumentError("Data not found");
+    }
+    *result = data_table_.embedding_table().find(str_key)->second;
+    return absl::OkStatus();
+  }
+
+  absl::Status LookupWithUpdate(const absl::string_view key,
+                                EmbeddingVectorProto* result) override {
+    CHECK(result != nullptr);
+    std::string str_key(key);
+    if (!data_table_.embedding_table().contains(str_key)) {
+      (*data_table_.mutable_embedding_table())[str_key] =
+          InitializeEmbedding(embedding_dimension(), config().initializer());
+      keys_.push_back(data_table_.embedding_table().find(str_key)->first);
+    }
+    *result = data_table_.embedding_table().find(str_key)->second;
+    return absl::OkStatus();
+  }
+
+  absl::Status Update(const absl::string_view key,
+                      const EmbeddingVectorProto& value) override {
+    std::string str_key(key);
+    if (!data_table_.embedding_table().contains(str_key)) {
+      (*data_table_.mutable_embedding_table())[str_key] = value;
+      keys_.push_back(data_table_.embedding_table().find(str_key)->first);
+    } else {
+      data_table_.mutable_embedding_table()->at(str_key) = value;
+    }
+    return absl::OkStatus();
+  }
+
+  absl::Status ExportInternal(const std::string& dir,
+                              std::string* exported_path) override {
+    *exported_path = "fake_checkpoint";
+    return absl::OkStatus();
+  }
+
+  absl::Status ImportInternal(const std::string& saved_path) override {
+    return absl::OkStatus();
+  }
+
+  size_t Size() const override { return data_table_.embedding_table_size(); }
+
+  std::vector<absl::string_view> Keys() const { return keys_; }
+
+  bool Contains(absl::string_view key) const {
+    return data_table_.embedding_table().contains(std::string(key));
+  }
+
+ private:
+  InProtoKnowledgeBankConfig::EmbeddingData data_table_;
+  std::vector<absl::string_view> keys_;
+};
+
+REGISTER_KNOWLEDGE_BANK_FACTORY(KnowledgeBankConfig,
+                                [](const KnowledgeBankConfig& config,
+                                   int dimension)
+                                    -> std::unique_ptr<KnowledgeBank> {
+                                  return std::unique_ptr<KnowledgeBank>(
+                                      new FakeEmbedding(config, dimension));
+                                });
+
+float LogSigmoid(float x) { return -std::log1p(std::exp(-x)); }
+
+}  // namespace
+
+class HierarchicalSoftmaxSamplerTest : public ::testing::Test {
+ protected:
+  HierarchicalSoftmaxSamplerTest() {
+    CandidateSamplerConfig sampler_config;
+    sampler_config.mutable_extension()->PackFrom(
+        HierarchicalSoftmaxSamplerConfig());
+    sampler_ = SamplerFactory::Make(sampler_config);
+    KnowledgeBankConfig config;
+    config.mutable_initializer()->mutable_zero_initializer();
+    knowledge_bank_ = KnowledgeBankFactory::Make(config, 2);
+  }
+
+  // Inserts key1, key2 and key3 with the default weights, which results in
+  // the tree ((key1, key3), key2) whose internal nodes are
+  // "__hs_node__/0" for the root and "__hs_node__/1" for its left child.
+  void InsertKeys() {
+    for (const char* key : {"key1", "key2", "key3"}) {
+      ASSERT_OK(sampler_->InsertOrUpdate(key, EmbeddingVectorProto()));
+    }
+  }
+
+  // Returns the sampled results with the given positive keys.
+  std::vector<SampledResult> SamplePaths(
+      const std::vector<std::string>& positive_keys, int num_samples = 10) {
+    SampleContext context;
+    context.mutable_activation()->add_value(1);
+    context.mutable_activation()->add_value(0);
+    for (const auto& key : positive_keys) {
+      context.add_positive_key(key);
+    }
+    std::vector<std::pair<absl::string_view, SampledResult>> results;
+    EXPECT_OK(
+        sampler_->Sample(*knowledge_bank_, context, num_samples, &results));
+    std::vector<SampledResult> sampled_results;
+    for (const auto& result : results) {
+      EXPECT_EQ(result.first, result.second.hierarchical_softmax_result().key());
+      sampled_results.push_back(result.second);
+    }
+    return sampled_results;
+  }
+
+  std::unique_ptr<CandidateSampler> sampler_;
+  std::unique_ptr<KnowledgeBank> knowledge_bank_;
+};
+
+TEST_F(HierarchicalSoftmaxSamplerTest, Create) {
+  ASSERT_NE(nullptr, sampler_);
+  EXPECT_TRUE(sampler_->IsIncremental());
+  EXPECT_EQ(0, sampler_->NumOfCandidates());
+}
+
+TEST_F(HierarchicalSoftmaxSamplerTest, InvalidInput) {
+  SampleContext context;
+  std::vector<std::pair<absl::string_view, SampledResult>> results;
+  EXPECT_ERROR_EQ(
+      sampler_->Sample(*knowledge_bank_, context, /*num_samples=*/1, &results),
+      "No activation from sample_context.");
+  context.mutable_activation()->add_value(1.0);
+  EXPECT_ERROR_EQ(
+      sampler_->Sample(*knowledge_bank_, context, /*num_samples=*/1, &results),
+      "Invalid embedding dimension from activation, expect 2, got 1.");
+
+  // The paths must fit into num_samples.
+  InsertKeys();
+  context.mutable_activation()->add_value(1.0);
+  context.add_positive_key("key1");
+  EXPECT_ERROR_EQ(
+      sampler_->Sample(*knowledge_bank_, context, /*num_samples=*/1, &results),
+      "The paths of the positive keys have more nodes than num_samples: 1");
+}
+
+TEST_F(HierarchicalSoftmaxSamplerTest, SamplePaths) {
+  InsertKeys();
+  EXPECT_EQ(3, sampler_->NumOfCandidates());
+  // The keys of the internal nodes are not candidates.
+  ASSERT_OK(sampler_->InsertOrUpdate("__hs_node__/0", EmbeddingVectorProto()));
+  EXPECT_EQ(3, sampler_->NumOfCandidates());
+
+  ASSERT_OK(knowledge_bank_->Update(
+      "__hs_node__/0", ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 1 value: 2
+      )pb")));
+  auto results = SamplePaths({"key3", "unknown", "key2"});
+  ASSERT_EQ(3, results.size());
+  EXPECT_THAT(results[0], EqualsProto<SampledResult>(R"pb(
+                hierarchical_softmax_result {
+                  key: "__hs_node__/0"
+                  embedding { value: 1 value: 2 }
+                  positive_key: "key3"
+                }
+              )pb"));
+  EXPECT_THAT(results[1], EqualsProto<SampledResult>(R"pb(
+                hierarchical_softmax_result {
+                  key: "__hs_node__/1"
+                  label: 1
+                  positive_key: "key3"
+                }
+              )pb"));
+  EXPECT_THAT(results[2], EqualsProto<SampledResult>(R"pb(
+                hierarchical_softmax_result {
+                  key: "__hs_node__/0"
+                  embedding { value: 1 value: 2 }
+                  label: 1
+                  positive_key: "key2"
+                }
+              )pb"));
+
+  // The sibling takes the place of a removed key.
+  ASSERT_OK(sampler_->Remove("key2"));
+  EXPECT_EQ(2, sampler_->NumOfCandidates());
+  results = SamplePaths({"key3"});
+  ASSERT_EQ(1, results.size());
+  EXPECT_EQ("__hs_node__/1", results[0].hierarchical_softmax_result().key());
+  EXPECT_EQ(1, results[0].hierarchical_softmax_result().label());
+  ASSERT_OK(sampler_->Remove("key1"));
+  ASSERT_OK(sampler_->Remove("key3"));
+  EXPECT_EQ(0, sampler_->NumOfCandidates());
+  EXPECT_TRUE(SamplePaths({"key3"}).empty());
+}
+
+TEST_F(HierarchicalSoftmaxSamplerTest, WeightBalanced) {
+  // A heavy key stays close to the root.
+  auto embed = ParseTextProtoOrDie<EmbeddingVectorProto>("weight: 10");
+  ASSERT_OK(sampler_->InsertOrUpdate("heavy", embed));
+  for (const char* key : {"key1", "key2", "key3", "key4"}) {
+    ASSERT_OK(sampler_->InsertOrUpdate(key, EmbeddingVectorProto()));
+  }
+  EXPECT_EQ(1, SamplePaths({"heavy"}).size());
+  EXPECT_EQ(3, SamplePaths({"key1"}).size());
+
+  // An older version does not change the weight.
+  embed.set_version(1);
+  embed.set_weight(1);
+  ASSERT_OK(sampler_->InsertOrUpdate("heavy", embed));
+  embed.set_version(0);
+  embed.set_weight(100);
+  ASSERT_OK(sampler_->InsertOrUpdate("heavy", embed));
+  // So that a new key goes under "heavy".
+  ASSERT_OK(sampler_->InsertOrUpdate("key5", EmbeddingVectorProto()));
+  EXPECT_EQ(2, SamplePaths({"heavy"}).size());
+  EXPECT_EQ(2, SamplePaths({"key5"}).size());
+}
+
+TEST_F(HierarchicalSoftmaxSamplerTest, SampleTopk) {
+  SampleContext context;
+  context.mutable_activation()->add_value(1);
+  context.mutable_activation()->add_value(0);
+  std::vector<std::pair<absl::string_view, SampledResult>> results;
+  ASSERT_OK(
+      sampler_->Sample(*knowledge_bank_, context, /*num_samples=*/2, &results));
+  EXPECT_TRUE(results.empty());
+
+  InsertKeys();
+  // The root turns to the right with logit 2, while "__hs_node__/1" is not in
+  // the knowledge bank and splits its probability evenly.
+  ASSERT_OK(knowledge_bank_->Update(
+      "__hs_node__/0", ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 2 value: 5
+      )pb")));
+  ASSERT_OK(
+      sampler_->Sample(*knowledge_bank_, context, /*num_samples=*/2, &results));
+  ASSERT_EQ(2, results.size());
+  EXPECT_EQ("key2", results[0].first);
+  EXPECT_EQ("key2", results[0].second.topk_sampling_result().key());
+  EXPECT_FLOAT_EQ(LogSigmoid(2),
+                  results[0].second.topk_sampling_result().similarity());
+  EXPECT_THAT(results[1].first, testing::AnyOf("key1", "key3"));
+  EXPECT_FLOAT_EQ(LogSigmoid(-2) + std::log(0.5f),
+                  results[1].second.topk_sampling_result().similarity());
+
+  // The left child prefers key3.
+  ASSERT_OK(knowledge_bank_->Update(
+      "__hs_node__/1", ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 1 value: 0
+      )pb")));
+  ASSERT_OK(
+      sampler_->Sample(*knowledge_bank_, context, /*num_samples=*/5, &results));
+  ASSERT_EQ(3, results.size());
+  EXPECT_EQ("key2", results[0].first);
+  EXPECT_EQ("key3", results[1].first);
+  EXPECT_FLOAT_EQ(LogSigmoid(-2) + LogSigmoid(1),
+                  results[1].second.topk_sampling_result().similarity());
+  EXPECT_EQ("key1", results[2].first);
+}
+
+}  // namespace candidate_sampling
+}  // namespace carls
@@ -141,6 +141,67 @@ def sampled_sigmoid_loss(positive_keys: tf.Tensor,
   return reduced_sum / num_samples
 
 
+def hierarchical_softmax_loss(positive_keys: tf.Tensor,
+                              inputs: tf.Tensor,
+                              max_depth: int,
+                              de_config: de_config_pb2.DynamicEmbeddingConfig,
+                              var_name: typing.Text,
+                              service_address: typing.Text = "",
+                              timeout_ms: int = -1):
+  """Computes the hierarchical softmax loss from given input activations.
+
+  The candidate sampler of `de_config` must be a hierarchical_softmax_sampler,
+  whose tree has the positive keys as leaves. The loss is the negative log
+  probability of the paths of the positive keys, i.e., the sigmoid cross
+  entropy of the O(log N) nodes along them. For inference, top_k() with the
+  same config returns the keys with the largest log probabilities.
+
+  Args:
+    positive_keys: A string `Tensor` of shape `[batch_size, None]` representing
+      input positive keys.
+    inputs: A float `Tensor` of shape `[batch_size, dim]`, representing the
+      forward activations of the input network.
+    max_depth: An int bounding the total number of nodes on the paths of the
+      positive keys of an entry.
+    de_config: A DynamicEmbeddingConfig for configuring the dynamic embedding.
+    var_name: A unique name for the operation.
+    service_address: The address of a dynamic embedding service. If empty, the
+      value passed from --kbs_address flag will be used instead.
+    timeout_ms: Timeout millseconds for the connection. If negative, never
+      timout.
+
+  Returns:
+    A float `Tensor` representing the hierarchical softmax loss averaged over
+    the entries with any positive keys.
+
+  Raises:
+    ValueError: If var_name is not specified or max_depth is invalid.
+  """
+  if not var_name:
+    raise ValueError("Must specify a valid name, got %s" % var_name)
+  if max_depth < 1:
+    raise ValueError("Invalid max_depth: %d" % max_depth)
+
+  context.add_to_collection(var_name, de_config)
+  resource = gen_carls_ops.dynamic_embedding_manager_resource(
+      de_config.SerializeToString(), var_name, service_address, timeout_ms)
+
+  # Create a dummy variable so that the gradients can be passed in.
+  grad_placeholder = tf.Variable(0.0)
+
+  _, labels, mask, weights = gen_carls_ops.hierarchical_softmax_lookup(
+      positive_keys, inputs, max_depth, grad_placeholder, resource)
+
+  # [d1, d2, dn-1, embed_dim] -> [d1, d2, dn-1, 1, embed_dim]
+  tiled_inputs = tf.expand_dims(inputs, axis=-2)
+  # [d1, d2, dn-1, max_depth, embed_dim] -> [d1, d2, dn-1, max_depth]
+  logits = tf.reduce_sum(weights * tiled_inputs, -1)
+  losses = tf.nn.sigmoid_cross_entropy_with_logits(
+      labels=labels, logits=logits) * mask
+  num_entries = tf.reduce_sum(tf.reduce_max(mask, -1))
+  return tf.reduce_sum(losses) / tf.maximum(num_entries, 1)
+
+
 def compute_sampled_logits(positive_keys,
                            inputs,
                            num_samples: int,
@@ -248,3 +309,35 @@ def _sampled_logits_lookup_grad(op, keys_grad, labels_grad,
   inputs_grad = tf.zeros_like(op.inputs[1])
   return (pos_keys_grad, inputs_grad, num_samples_grad, dummy_variable_grad,
           resource_grad)
+
+
+@tf.RegisterGradient("HierarchicalSoftmaxLookup")
+def _hierarchical_softmax_lookup_grad(op, keys_grad, labels_grad, mask_grad,
+                                      weights_grad):
+  """Computes the gradients for HierarchicalSoftmaxLookup.
+
+  Same as SampledLogitsLookup, the gradients w.r.t. the weights output update
+  the embeddings of the nodes, while none of the inputs is back-propagated.
+
+  Args:
+    op: The HierarchicalSoftmaxLookup op.
+    keys_grad: The tensor representing the gradient w.r.t. the keys output.
+    labels_grad: The tensor representing the gradient w.r.t. the labels output.
+    mask_grad: The tensor representing the gradient w.r.t. the mask output.
+    weights_grad: The tensor representing the gradient w.r.t. the weights
+      output.
+
+  Returns:
+    The gradients w.r.t. the input.
+  """
+  del keys_grad, labels_grad, mask_grad  # Unused.
+
+  pos_keys_grad, max_depth_grad, dummy_variable_grad, resource_grad = (
+      gen_carls_ops.sampled_logits_lookup_grad(
+          keys=op.outputs[0],
+          weight_gradients=weights_grad,
+          handle=op.inputs[4]))
+  # Gradient for the input activation.
+  inputs_grad = tf.zeros_like(op.inputs[1])
+  return (pos_keys_grad, inputs_grad, max_depth_grad, dummy_variable_grad,
+          resource_grad)
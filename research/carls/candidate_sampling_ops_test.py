@@ -183,6 +183,46 @@ class CandidateSamplingOpsTest(tf.test.TestCase):
     # [12, 15, 18] * [[4, 4, 4], [6, 6, 6]] = [[48, 60, 72], [72, 90, 108]]
     self.assertAllClose(grads, [[48, 60, 72], [72, 90, 108]])
 
+  def test_hierarchical_softmax_loss(self):
+    cs_config = cs_config_builder.build_candidate_sampler_config(
+        cs_config_builder.hierarchical_softmax_sampler())
+    de_config = test_util.default_de_config(2, cs_config=cs_config)
+
+    # Both new keys are added into a tree with one internal node, whose path
+    # turns to the left for one key and to the right for the other.
+    inputs = tf.Variable([[1.0, 2.0], [1.0, 2.0]])
+    with tf.GradientTape() as tape:
+      loss = cs_ops.hierarchical_softmax_loss([['key1'], ['key2']],
+                                              inputs,
+                                              2,
+                                              de_config,
+                                              'emb',
+                                              service_address=self._kbs_address)
+    node_embedding = de_ops.dynamic_embedding_lookup(
+        ['__hs_node__/0'], de_config, 'emb', service_address=self._kbs_address)
+    logit = tf.reduce_sum(node_embedding * inputs[0])
+    expected_loss = (
+        tf.nn.sigmoid_cross_entropy_with_logits(labels=0.0, logits=logit) +
+        tf.nn.sigmoid_cross_entropy_with_logits(labels=1.0, logits=logit)) / 2
+    self.assertAllClose(expected_loss, loss)
+
+    # The gradients update the embedding of the node.
+    tape.gradient(loss, inputs)
+    updated_embedding = de_ops.dynamic_embedding_lookup(
+        ['__hs_node__/0'], de_config, 'emb', service_address=self._kbs_address)
+    self.assertNotAllClose(node_embedding, updated_embedding)
+
+  def test_hierarchical_softmax_loss_invalid_input(self):
+    cs_config = cs_config_builder.build_candidate_sampler_config(
+        cs_config_builder.hierarchical_softmax_sampler())
+    de_config = test_util.default_de_config(2, cs_config=cs_config)
+    with self.assertRaises(ValueError):
+      cs_ops.hierarchical_softmax_loss([['key1']], [[1.0, 2.0]], 0, de_config,
+                                       'emb')
+    with self.assertRaises(ValueError):
+      cs_ops.hierarchical_softmax_loss([['key1']], [[1.0, 2.0]], 2, de_config,
+                                       '')
+
 
 if __name__ == '__main__':
   tf.test.main()
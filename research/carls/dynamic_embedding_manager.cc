@@ -47,6 +47,88 @@ T DieIfNull(const char* file, int line, const char* exprtext, T&& t) {
   return std::forward<T>(t);
 }
 
+// Checks that the keys are strings or int64s.
+absl::Status CheckKeyType(const Tensor& keys) {
+  if (keys.dtype() != tensorflow::DT_STRING &&
+      keys.dtype() != tensorflow::DT_INT64) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Keys must be strings or int64s, got ",
+                     tensorflow::DataTypeString(keys.dtype())));
+  }
+  return absl::OkStatus();
+}
+
+// Copies the embeddings of `keys` of type KeyType from the lookup result
+// `embedding_table` into the rows of `output`.
+template <typename KeyType, typename TableKeyType>
+absl::Status CopyEmbeddings(
+    const Tensor& keys,
+    const google::protobuf::Map<TableKeyType, EmbeddingVectorProto>&
+        embedding_table,
+    Tensor* output) {
+  const auto key_values = keys.flat<KeyType>();
+  // Shape (num_keys, dim_size) for both 1D and 2D keys.
+  auto output_values = output->flat_inner_dims<float>();
+  for (int i = 0; i < keys.NumElements(); ++i) {
+    const auto& key = key_values(i);
+    if (IsPaddingKey(key)) {
+      for (int d = 0; d < output_values.dimension(1); ++d) {
+        output_values(i, d) = 0;
+      }
+      continue;
+    }
+    const auto lookup_iter = embedding_table.find(TableKeyType(key));
+    if (lookup_iter == embedding_table.end()) {
+      return absl::InternalError(absl::StrCat(
+          TableKeyType(key), " is not in the Lookup result, unexpected."));
+    }
+    const auto& embedding = lookup_iter->second;
+    for (int d = 0; d < embedding.value_size(); ++d) {
+      output_values(i, d) = embedding.value(d);
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Copies the embeddings of `keys` from `response` into the rows of `output`.
+absl::Status CopyLookupResult(const Tensor& keys,
+                              const LookupResponse& response, Tensor* output) {
+  if (keys.dtype() == tensorflow::DT_INT64) {
+    return CopyEmbeddings<int64_t, int64_t>(
+        keys, response.int_embedding_table(), output);
+  }
+  return CopyEmbeddings<tstring, std::string>(keys, response.embedding_table(),
+                                              output);
+}
+
+// Adds the rows of `values` to `rows` by their keys of type KeyType, except
+// for padding keys. The rows of a key showing up multiple times are summed if
+// `sum_duplicates` is true, otherwise the last one is kept.
+template <typename KeyType, typename TableKeyType>
+void AddRows(const Tensor& keys, const Tensor& values,
+             const bool sum_duplicates,
+             google::protobuf::Map<TableKeyType, EmbeddingVectorProto>* rows) {
+  const auto key_values = keys.flat<KeyType>();
+  const auto row_values = values.flat_inner_dims<float>();
+  const int emb_dim = row_values.dimension(1);
+  for (int b = 0; b < keys.NumElements(); ++b) {
+    if (IsPaddingKey(key_values(b))) {
+      continue;
+    }
+    auto* emb = &(*rows)[TableKeyType(key_values(b))];
+    if (!sum_duplicates || emb->value_size() != emb_dim) {
+      emb->clear_value();
+      for (int i = 0; i < emb_dim; ++i) {
+        emb->add_value(row_values(b, i));
+      }
+      continue;
+    }
+    for (int i = 0; i < emb_dim; ++i) {
+      emb->set_value(i, emb->value(i) + row_values(b, i));
+    }
+  }
+}
+
 }  // namespace
 
 // Static.
@@ -61,6 +143,12 @@ std::unique_ptr<DynamicEmbeddingManager> DynamicEmbeddingManager::Create(
     LOG(ERROR) << "kbs_address is empty.";
     return nullptr;
   }
+  if (config.has_gradient_compression_config() &&
+      GradientCompressor::Create(config.gradient_compression_config()) ==
+          nullptr) {
+    LOG(ERROR) << "Invalid gradient_compression_config.";
+    return nullptr;
+  }
 
   // Starts a channel to DES and creates a stub.
   std::shared_ptr<grpc::ChannelCredentials> credentials =
@@ -106,85 +194,43 @@ DynamicEmbeddingManager::DynamicEmbeddingManager(
     const DynamicEmbeddingConfig& config, const std::string& session_handle)
     : stub_(std::move(INTERNAL_DIE_IF_NULL(stub))),
       config_(config),
-      session_handle_(session_handle) {}
+      session_handle_(session_handle) {
+  if (config_.has_gradient_compression_config()) {
+    gradient_compressor_ =
+        GradientCompressor::Create(config_.gradient_compression_config());
+  }
+}
 
 absl::Status DynamicEmbeddingManager::Lookup(const Tensor& keys, bool update,
                                              Tensor* output) {
   CHECK(output != nullptr);
-  if (!(keys.dims() == 1 || keys.dims() == 2)) {
-    return absl::InvalidArgumentError(absl::StrCat(
-        "Input dimension must be either 1 or 2, got ", keys.dims()));
-  }
-  if (keys.NumElements() == 0) {
-    return absl::InvalidArgumentError("No input.");
+  const auto input_status = CheckInputForLookup(keys);
+  if (!input_status.ok()) {
+    return input_status;
   }
   LookupResponse lookup_response;
   const auto lookup_status = LookupInternal(keys, update, &lookup_response);
   if (!lookup_status.ok()) {
     return lookup_status;
   }
+  return CopyLookupResult(keys, lookup_response, output);
+}
 
-  // Process results.
-  // This is usually used in the case when the input is a batch of keys.
-  if (keys.dims() == 1) {
-    const auto key_values = keys.flat<tstring>();
-    auto output_values = output->matrix<float>();  // (key_size, dim_size)
-    for (int i = 0; i < keys.NumElements(); ++i) {
-      const auto& key = key_values(i);
-      if (key.empty()) {
-        for (int d = 0; d < config_.embedding_dimension(); ++d) {
-          output_values(i, d) = 0;
-        }
-        continue;
-      }
-
-      const auto& embedding_table = lookup_response.embedding_table();
-      const auto lookup_iter = embedding_table.find(key);
-      if (lookup_iter == embedding_table.end()) {
-        return absl::InternalError(absl::StrCat(
-            std::string(key), " is not in the Lookup result, unexpected."));
-      }
-      const auto& embedding = lookup_iter->second;
-      for (int d = 0; d < embedding.value_size(); ++d) {
-        output_values(i, d) = embedding.value(d);
-      }
-    }
-    return absl::OkStatus();
+absl::Status DynamicEmbeddingManager::CheckInputForLookup(const Tensor& keys) {
+  if (!(keys.dims() == 1 || keys.dims() == 2)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Input dimension must be either 1 or 2, got ", keys.dims()));
   }
-
-  // keys.dims() == 2
-  // This is usually used in the case when the input is a batch of sequences.
-  const auto key_values = keys.matrix<tstring>();
-  // (batch_size, max_sequence_size, dim_size)
-  auto output_values = output->tensor<float, 3>();
-  for (int b = 0; b < keys.dim_size(0); ++b) {
-    for (int i = 0; i < keys.dim_size(1); ++i) {
-      const auto& key = key_values(b, i);
-      if (key.empty()) {
-        for (int d = 0; d < config_.embedding_dimension(); ++d) {
-          output_values(b, i, d) = 0;
-        }
-        continue;
-      }
-
-      const auto& embedding_table = lookup_response.embedding_table();
-      const auto lookup_iter = embedding_table.find(key);
-      if (lookup_iter == embedding_table.end()) {
-        return absl::InternalError(absl::StrCat(
-            std::string(key), " is not in the Lookup result, unexpected."));
-      }
-      const auto& embedding = lookup_iter->second;
-      for (int d = 0; d < embedding.value_size(); ++d) {
-        output_values(b, i, d) = embedding.value(d);
-      }
-    }
+  if (keys.NumElements() == 0) {
+    return absl::InvalidArgumentError("No input.");
   }
-  return absl::OkStatus();
+  return CheckKeyType(keys);
 }
 
 absl::Status DynamicEmbeddingManager::CheckInputForUpdate(
     const Tensor& keys, const Tensor& values) {
   RET_CHECK_TRUE(keys.NumElements() > 0) << "Input key is empty.";
+  RET_CHECK_OK(CheckKeyType(keys));
   const int num_keys = keys.NumElements();
   const int emb_dim = values.dim_size(values.dims() - 1);
   const int num_values = values.NumElements() / emb_dim;
@@ -205,25 +251,16 @@ absl::Status DynamicEmbeddingManager::CheckInputForUpdate(
 absl::Status DynamicEmbeddingManager::UpdateValues(const Tensor& keys,
                                                    const Tensor& values) {
   RET_CHECK_OK(CheckInputForUpdate(keys, values));
-  const auto key_values = keys.flat<tstring>();
-  const int num_keys = keys.NumElements();
-  const int emb_dim = values.dim_size(values.dims() - 1);
 
   UpdateRequest update_request;
   update_request.set_session_handle(session_handle_);
-  // shape (key_size, dim_size)
-  const auto emb_values = values.flat_inner_dims<float>();
-  for (int b = 0; b < num_keys; ++b) {
-    const std::string key_value = key_values(b);
-    if (key_value.empty()) {
-      continue;
-    }
-    auto* emb = &(*update_request.mutable_values())[key_value];
-    emb->clear_value();
-    // If a key shows up in a batch multiple times, do not add up.
-    for (int i = 0; i < emb_dim; ++i) {
-      emb->add_value(emb_values(b, i));
-    }
+  // If a key shows up in a batch multiple times, do not add up.
+  if (keys.dtype() == tensorflow::DT_INT64) {
+    AddRows<int64_t, int64_t>(keys, values, /*sum_duplicates=*/false,
+                              update_request.mutable_int_values());
+  } else {
+    AddRows<tstring, std::string>(keys, values, /*sum_duplicates=*/false,
+                                  update_request.mutable_values());
   }
 
   UpdateResponse update_response;
@@ -235,19 +272,33 @@ absl::Status DynamicEmbeddingManager::UpdateValues(const Tensor& keys,
       stub_->Update(&context, update_request, &update_response));
 }
 
+void DynamicEmbeddingManager::BuildLookupRequest(const Tensor& keys,
+                                                 bool update,
+                                                 LookupRequest* request) {
+  request->set_update(update);
+  if (keys.dtype() == tensorflow::DT_INT64) {
+    const auto key_values = keys.flat<int64_t>();
+    for (int i = 0; i < keys.NumElements(); ++i) {
+      if (!IsPaddingKey(key_values(i))) {
+        request->add_int_key(key_values(i));
+      }
+    }
+  } else {
+    const auto key_values = keys.flat<tstring>();
+    for (int i = 0; i < keys.NumElements(); ++i) {
+      if (!IsPaddingKey(key_values(i))) {
+        request->add_key(std::string(key_values(i)));
+      }
+    }
+  }
+}
+
 absl::Status DynamicEmbeddingManager::LookupInternal(
     const tensorflow::Tensor& keys, bool update, LookupResponse* response) {
   CHECK(response != nullptr);
-  const auto key_values = keys.flat<tstring>();
-
   LookupRequest request;
-  request.set_update(update);
   request.set_session_handle(session_handle_);
-  for (int i = 0; i < keys.NumElements(); ++i) {
-    if (!key_values(i).empty()) {
-      request.add_key(std::string(key_values(i)));
-    }
-  }
+  BuildLookupRequest(keys, update, &request);
 
   grpc::ClientContext context;
   context.set_deadline(std::chrono::system_clock::now() +
@@ -256,32 +307,36 @@ absl::Status DynamicEmbeddingManager::LookupInternal(
   return ToAbslStatus(stub_->Lookup(&context, request, response));
 }
 
+bool DynamicEmbeddingManager::BuildGradientRequest(const Tensor& keys,
+                                                   const Tensor& grads,
+                                                   UpdateRequest* request) {
+  // If a key shows up in a batch multiple times, add their gradients up.
+  if (keys.dtype() == tensorflow::DT_INT64) {
+    AddRows<int64_t, int64_t>(keys, grads, /*sum_duplicates=*/true,
+                              request->mutable_int_gradients());
+    if (gradient_compressor_ != nullptr) {
+      gradient_compressor_->Compress(request->mutable_int_gradients());
+    }
+  } else {
+    AddRows<tstring, std::string>(keys, grads, /*sum_duplicates=*/true,
+                                  request->mutable_gradients());
+    if (gradient_compressor_ != nullptr) {
+      gradient_compressor_->Compress(request->mutable_gradients());
+    }
+  }
+  return gradient_compressor_ == nullptr || !request->gradients().empty() ||
+         !request->int_gradients().empty();
+}
+
 absl::Status DynamicEmbeddingManager::UpdateGradients(const Tensor& keys,
                                                       const Tensor& grads) {
   RET_CHECK_OK(CheckInputForUpdate(keys, grads));
-  const auto key_values = keys.flat<tstring>();
-  const int num_keys = keys.NumElements();
-  const int emb_dim = grads.dim_size(grads.dims() - 1);
 
   // Prepare update request.
   UpdateRequest update_request;
   update_request.set_session_handle(session_handle_);
-
-  auto grad_values = grads.flat_inner_dims<float>();  // (num_keys, dim_size)
-  for (int b = 0; b < num_keys; ++b) {
-    const std::string& key_value = key_values(b);
-    if (key_value.empty()) {
-      continue;
-    }
-    auto* emb = &(*update_request.mutable_gradients())[key_value];
-    // Initializes the embedding values if they are not set.
-    while (emb->value_size() < emb_dim) {
-      emb->add_value(0.0);
-    }
-    // If a key shows up in a batch multiple times, add their gradients up.
-    for (int i = 0; i < emb_dim; ++i) {
-      emb->set_value(i, emb->value(i) + grad_values(b, i));
-    }
+  if (!BuildGradientRequest(keys, grads, &update_request)) {
+    return absl::OkStatus();
   }
 
   grpc::ClientContext context;
@@ -293,6 +348,36 @@ absl::Status DynamicEmbeddingManager::UpdateGradients(const Tensor& keys,
       stub_->Update(&context, update_request, &update_response));
 }
 
+absl::Status DynamicEmbeddingManager::UpdateGradientsAndLookup(
+    const Tensor& grad_keys, const Tensor& grads, const Tensor& lookup_keys,
+    bool update, Tensor* output) {
+  CHECK(output != nullptr);
+  RET_CHECK_OK(CheckInputForUpdate(grad_keys, grads));
+  const auto input_status = CheckInputForLookup(lookup_keys);
+  if (!input_status.ok()) {
+    return input_status;
+  }
+
+  UpdateAndLookupRequest request;
+  request.set_session_handle(session_handle_);
+  // The update is left empty if all the gradients are kept by the compressor.
+  if (!BuildGradientRequest(grad_keys, grads, request.mutable_update())) {
+    request.clear_update();
+  }
+  BuildLookupRequest(lookup_keys, update, request.mutable_lookup());
+
+  grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() +
+                       absl::ToChronoSeconds(absl::Seconds(
+                           absl::GetFlag(FLAGS_kbs_rpc_deadline_sec))));
+  UpdateAndLookupResponse response;
+  const auto status = stub_->UpdateAndLookup(&context, request, &response);
+  if (!status.ok()) {
+    return ToAbslStatus(status);
+  }
+  return CopyLookupResult(lookup_keys, response.lookup(), output);
+}
+
 absl::Status DynamicEmbeddingManager::LookupGaussianCluster(
     const tensorflow::Tensor& inputs, const int mode, Tensor* mean,
     Tensor* variance, Tensor* output_distance, Tensor* output_cluster_id) {
@@ -433,6 +518,89 @@ absl::Status DynamicEmbeddingManager::NegativeSampling(
   return absl::OkStatus();
 }
 
+absl::Status DynamicEmbeddingManager::HierarchicalSoftmax(
+    const Tensor& positive_keys, const Tensor& input_activations,
+    const int max_depth, const bool update, Tensor* output_keys,
+    Tensor* output_labels, Tensor* output_masks, Tensor* output_embeddings) {
+  RET_CHECK_TRUE(config_.embedding_dimension() > 0)
+      << "Invalid embedding dimension:" << config_.embedding_dimension();
+  RET_CHECK_TRUE(max_depth > 0);
+
+  // Shape of input: [d1, d2, ..., inner_dim].
+  const int dims = input_activations.dims();
+  const int inner_dim = input_activations.dim_size(dims - 1);
+  RET_CHECK_TRUE(inner_dim == config_.embedding_dimension())
+      << inner_dim << " v.s. " << config_.embedding_dimension();
+  const int batch_size =
+      input_activations.NumElements() / config_.embedding_dimension();
+
+  // Processes the positive keys and activations.
+  SampleRequest sample_request;
+  sample_request.set_session_handle(session_handle_);
+  sample_request.set_num_samples(max_depth);
+  sample_request.set_update(update);
+  const auto pos_key_values = positive_keys.flat_inner_dims<tstring>();
+  RET_CHECK_TRUE(pos_key_values.dimension(0) == batch_size)
+      << pos_key_values.dimension(0) << " v.s. " << batch_size;
+  auto activation_value = input_activations.flat_inner_dims<float>();
+  for (int b = 0; b < batch_size; ++b) {
+    auto* sample_context = sample_request.add_sample_context();
+    for (int i = 0; i < pos_key_values.dimension(1); ++i) {
+      if (!pos_key_values(b, i).empty()) {
+        sample_context->add_positive_key(std::string(pos_key_values(b, i)));
+      }
+    }
+    for (int i = 0; i < config_.embedding_dimension(); ++i) {
+      sample_context->mutable_activation()->add_value(activation_value(b, i));
+    }
+  }
+
+  // Calls the Sample RPC.
+  grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() +
+                       absl::ToChronoSeconds(absl::Seconds(
+                           absl::GetFlag(FLAGS_kbs_rpc_deadline_sec))));
+  SampleResponse sample_response;
+  RET_CHECK_OK(stub_->Sample(&context, sample_request, &sample_response));
+  RET_CHECK_TRUE(sample_response.samples_size() == batch_size);
+
+  // Process the nodes, padded up to max_depth.
+  auto output_keys_values = output_keys->flat_inner_dims<tstring>();
+  auto label_values = output_labels->flat_inner_dims<float>();
+  auto mask_values = output_masks->flat_inner_dims<float>();
+  auto embedding_values = output_embeddings->flat_inner_dims<float, 3>();
+  for (int b = 0; b < batch_size; ++b) {
+    auto& samples = *sample_response.mutable_samples(b);
+    RET_CHECK_TRUE(samples.sampled_result_size() <= max_depth);
+    for (int i = 0; i < max_depth; ++i) {
+      if (i >= samples.sampled_result_size()) {
+        output_keys_values(b, i) = "";
+        label_values(b, i) = 0;
+        mask_values(b, i) = 0;
+        for (int d = 0; d < config_.embedding_dimension(); ++d) {
+          embedding_values(b, i, d) = 0.0f;
+        }
+        continue;
+      }
+      RET_CHECK_TRUE(
+          samples.sampled_result(i).has_hierarchical_softmax_result());
+      auto& result = *samples.mutable_sampled_result(i)
+                          ->mutable_hierarchical_softmax_result();
+      // A node is not in the knowledge bank before it is first trained.
+      const auto& embedding = result.embedding();
+      const bool has_embedding =
+          embedding.value_size() == config_.embedding_dimension();
+      label_values(b, i) = result.label();
+      mask_values(b, i) = 1;
+      output_keys_values(b, i) = std::move(*result.mutable_key());
+      for (int d = 0; d < config_.embedding_dimension(); ++d) {
+        embedding_values(b, i, d) = has_embedding ? embedding.value(d) : 0.0f;
+      }
+    }
+  }
+  return absl::OkStatus();
+}
+
 absl::Status DynamicEmbeddingManager::TopK(
     const tensorflow::Tensor& input_activations, const int k,
     tensorflow::Tensor* output_keys, tensorflow::Tensor* output_logits) {
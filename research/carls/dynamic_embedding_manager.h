@@ -20,11 +20,17 @@ limitations under the License.
 
 #include "absl/status/status.h"
 #include "research/carls/dynamic_embedding_config.pb.h"  // proto to pb
+#include "research/carls/gradient_descent/gradient_compressor.h"
 #include "research/carls/knowledge_bank_grpc_service.h"
 #include "tensorflow/core/framework/tensor.h"
 
 namespace carls {
 
+// Returns true if a key of the input tensors is padding, i.e., an empty string
+// key or a negative int64 key, which is mapped to an all zero embedding.
+inline bool IsPaddingKey(const tensorflow::tstring& key) { return key.empty(); }
+inline bool IsPaddingKey(const int64_t key) { return key < 0; }
+
 // Responsible for communicating with a KnowledgeBankService stub within
 // Tensorflow C++ Operation code. Each instance of DynamicEmbeddingManager only
 // works for one session.
@@ -43,7 +49,9 @@ class DynamicEmbeddingManager {
 
   // Prepares KnowledgeBankService::LookupRequest from given input and
   // calls DES server.
-  // If a given key is empty, the output tensor is filled with zero values.
+  // The keys are either strings or int64s, the latter are sent without being
+  // converted to strings. If a given key is padding (see IsPaddingKey()), the
+  // output tensor is filled with zero values.
   absl::Status Lookup(const tensorflow::Tensor& keys, bool update,
                       tensorflow::Tensor* output);
 
@@ -55,9 +63,22 @@ class DynamicEmbeddingManager {
                             const tensorflow::Tensor& values);
 
   // Update the gradients of the embeddings for given keys.
+  // If the config has a gradient_compression_config, only the rows of the
+  // largest gradients are sent and the others are kept for the next calls.
   absl::Status UpdateGradients(const tensorflow::Tensor& keys,
                                const tensorflow::Tensor& grads);
 
+  // Combines UpdateGradients() and Lookup() into a single
+  // KnowledgeBankService::UpdateAndLookup call, so that a training step
+  // applying the gradients of the last batch and looking up the embeddings of
+  // the next one needs a single round trip. The lookup sees the updated
+  // embeddings of `grad_keys`.
+  absl::Status UpdateGradientsAndLookup(const tensorflow::Tensor& grad_keys,
+                                        const tensorflow::Tensor& grads,
+                                        const tensorflow::Tensor& lookup_keys,
+                                        bool update,
+                                        tensorflow::Tensor* output);
+
   // Looks up the mean and variance for each input tensor.
   // mode must be consistent with MemoryLookupRequest::LookupMode.
   absl::Status LookupGaussianCluster(const tensorflow::Tensor& inputs, int mode,
@@ -69,6 +90,12 @@ class DynamicEmbeddingManager {
   // Returns DynamicEmbeddingConfig.
   const DynamicEmbeddingConfig& config() { return config_; }
 
+  // Returns the GradientCompressor used by UpdateGradients(), e.g., for its
+  // bytes sent, or nullptr if the gradients are not compressed.
+  const GradientCompressor* gradient_compressor() const {
+    return gradient_compressor_.get();
+  }
+
   // Samples negative keys from given positive keys.
   //
   // If update = true, new embeddings are dynamically allocated for new
@@ -97,6 +124,29 @@ class DynamicEmbeddingManager {
                                 tensorflow::Tensor* output_masks,
                                 tensorflow::Tensor* output_embeddings);
 
+  // Returns the internal nodes on the paths of `positive_keys` in the tree of
+  // a hierarchical softmax, see
+  // carls.candidate_sampling.HierarchicalSoftmaxSamplerConfig for details.
+  //
+  // `max_depth` bounds the total number of nodes on the paths of the positive
+  // keys of an entry, and the outputs are padded up to it with empty keys. The
+  // `output_labels` is 1 if a path turns to the right child of the
+  // corresponding node and 0 otherwise, and `output_masks` is 1 for the nodes
+  // and 0 for the padding, both allocated as [batch_size, max_depth].
+  //
+  // If update = true, new embeddings are dynamically allocated for the new
+  // positive keys as well as the nodes on their paths.
+  //
+  // `output_embeddings` returns the embeddings of the nodes. It should be
+  // allocated as [batch_size, max_depth, embed_dim].
+  absl::Status HierarchicalSoftmax(const tensorflow::Tensor& positive_keys,
+                                   const tensorflow::Tensor& input_activations,
+                                   int max_depth, bool update,
+                                   tensorflow::Tensor* output_keys,
+                                   tensorflow::Tensor* output_labels,
+                                   tensorflow::Tensor* output_masks,
+                                   tensorflow::Tensor* output_embeddings);
+
   // Return top k closest embeddings to each of the input activations.
   // Note that for a logit layer with activation x, one need to append an extra
   // 1 to the input activations to obtain wx + b, where [w, b] is the embedding
@@ -117,6 +167,20 @@ class DynamicEmbeddingManager {
   absl::Status CheckInputForUpdate(const tensorflow::Tensor& keys,
                                    const tensorflow::Tensor& values);
 
+  // Check validity of input for both Lookup() and UpdateGradientsAndLookup().
+  absl::Status CheckInputForLookup(const tensorflow::Tensor& keys);
+
+  // Adds the non-padding keys to `request`.
+  void BuildLookupRequest(const tensorflow::Tensor& keys, bool update,
+                          LookupRequest* request);
+
+  // Adds the gradients of the keys to `request`, compressed if the config has
+  // a gradient_compression_config. Returns false if the compressor kept all
+  // of them for the next calls, i.e., there is nothing to send.
+  bool BuildGradientRequest(const tensorflow::Tensor& keys,
+                            const tensorflow::Tensor& grads,
+                            UpdateRequest* request);
+
   // Internal implementation of the Lookup() method.
   absl::Status LookupInternal(const tensorflow::Tensor& keys, bool update,
                               LookupResponse* response);
@@ -124,6 +188,7 @@ class DynamicEmbeddingManager {
   std::unique_ptr</*grpc_gen::*/KnowledgeBankService::Stub> stub_;
   const DynamicEmbeddingConfig config_;
   const std::string session_handle_;
+  std::unique_ptr<GradientCompressor> gradient_compressor_;
 };
 
 }  // namespace carls
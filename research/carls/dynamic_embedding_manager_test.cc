@@ -321,6 +321,153 @@ TEST_F(DynamicEmbeddingManagerTest, UpdateGradients_2DInput) {
   EXPECT_FLOAT_EQ(0, embed_values(1, 1, 1));
 }
 
+TEST_F(DynamicEmbeddingManagerTest, Int64Keys) {
+  KnowledgeBankServiceOptions options;
+  KbsServerHelper helper(options);
+  const std::string address = absl::StrCat("localhost:", helper.port());
+  DynamicEmbeddingConfig config = BuildConfig(/*dimension=*/2);
+  auto de_manager = DynamicEmbeddingManager::Create(config, "emb", address);
+  ASSERT_TRUE(de_manager != nullptr);
+
+  Tensor keys(tensorflow::DT_INT64, TensorShape({3}));
+  auto keys_value = keys.vec<int64_t>();
+  keys_value(0) = 7;
+  keys_value(1) = -1;  // Padding.
+  keys_value(2) = 7;
+  Tensor values(tensorflow::DT_FLOAT, TensorShape({3, 2}));
+  values.matrix<float>().setConstant(1);
+  ASSERT_TRUE(de_manager->UpdateValues(keys, values).ok());
+
+  // The gradients of the duplicated key are added up.
+  ASSERT_TRUE(de_manager->UpdateGradients(keys, values).ok());
+  Tensor embed(tensorflow::DT_FLOAT, TensorShape({3, 2}));
+  ASSERT_TRUE(de_manager->Lookup(keys, /*update=*/false, &embed).ok());
+  auto embed_values = embed.matrix<float>();
+  EXPECT_FLOAT_EQ(0.8, embed_values(0, 0));
+  EXPECT_FLOAT_EQ(0, embed_values(1, 0));
+  EXPECT_FLOAT_EQ(0.8, embed_values(2, 1));
+
+  // The same embedding is found with the decimal string key.
+  Tensor string_keys(tensorflow::DT_STRING, TensorShape({1}));
+  string_keys.vec<tstring>()(0) = "7";
+  Tensor string_embed(tensorflow::DT_FLOAT, TensorShape({1, 2}));
+  ASSERT_TRUE(
+      de_manager->Lookup(string_keys, /*update=*/false, &string_embed).ok());
+  EXPECT_FLOAT_EQ(0.8, string_embed.matrix<float>()(0, 0));
+
+  // Other key types are rejected.
+  Tensor int32_keys(tensorflow::DT_INT32, TensorShape({1}));
+  EXPECT_FALSE(de_manager->Lookup(int32_keys, /*update=*/true, &embed).ok());
+}
+
+TEST_F(DynamicEmbeddingManagerTest, UpdateGradients_Compressed) {
+  KnowledgeBankServiceOptions options;
+  KbsServerHelper helper(options);
+  const std::string address = absl::StrCat("localhost:", helper.port());
+  DynamicEmbeddingConfig config = BuildConfig(/*dimension=*/2);
+  config.mutable_gradient_compression_config()->set_density(0.5);
+  auto de_manager = DynamicEmbeddingManager::Create(config, "emb", address);
+  ASSERT_TRUE(de_manager != nullptr);
+  ASSERT_TRUE(de_manager->gradient_compressor() != nullptr);
+
+  Tensor keys(tensorflow::DT_STRING, TensorShape({2}));
+  auto keys_value = keys.vec<tstring>();
+  keys_value(0) = "first";
+  keys_value(1) = "second";
+  Tensor embed = Tensor(tensorflow::DT_FLOAT, TensorShape({2, 2}));
+  ASSERT_TRUE(de_manager->Lookup(keys, /*update=*/true, &embed).ok());
+
+  // Only the gradient of the largest norm is sent.
+  Tensor grads(tensorflow::DT_FLOAT, TensorShape({2, 2}));
+  auto grads_values = grads.matrix<float>();
+  grads_values(0, 0) = 1;
+  grads_values(0, 1) = 0;
+  grads_values(1, 0) = 3;
+  grads_values(1, 1) = 4;
+  ASSERT_TRUE(de_manager->UpdateGradients(keys, grads).ok());
+  ASSERT_TRUE(de_manager->Lookup(keys, /*update=*/false, &embed).ok());
+  auto embed_values = embed.matrix<float>();
+  EXPECT_FLOAT_EQ(0, embed_values(0, 0));
+  EXPECT_FLOAT_EQ(0, embed_values(0, 1));
+  EXPECT_FLOAT_EQ(-0.3, embed_values(1, 0));
+  EXPECT_FLOAT_EQ(-0.4, embed_values(1, 1));
+
+  // The residual is sent with the next gradients.
+  grads_values.setZero();
+  ASSERT_TRUE(de_manager->UpdateGradients(keys, grads).ok());
+  ASSERT_TRUE(de_manager->Lookup(keys, /*update=*/false, &embed).ok());
+  embed_values = embed.matrix<float>();
+  EXPECT_FLOAT_EQ(-0.1, embed_values(0, 0));
+  EXPECT_FLOAT_EQ(0, embed_values(0, 1));
+  EXPECT_EQ(4, de_manager->gradient_compressor()->NumRowsTotal());
+  EXPECT_EQ(2, de_manager->gradient_compressor()->NumRowsSent());
+  EXPECT_LT(de_manager->gradient_compressor()->NumBytesSent(),
+            de_manager->gradient_compressor()->NumBytesTotal());
+
+  // Invalid compression config.
+  config.mutable_gradient_compression_config()->set_density(2);
+  EXPECT_TRUE(DynamicEmbeddingManager::Create(config, "emb", address) ==
+              nullptr);
+}
+
+TEST_F(DynamicEmbeddingManagerTest, UpdateGradientsAndLookup) {
+  KnowledgeBankServiceOptions options;
+  KbsServerHelper helper(options);
+  const std::string address = absl::StrCat("localhost:", helper.port());
+  DynamicEmbeddingConfig config = BuildConfig(/*dimension=*/2);
+  auto de_manager = DynamicEmbeddingManager::Create(config, "emb", address);
+  ASSERT_TRUE(de_manager != nullptr);
+
+  Tensor grad_keys(tensorflow::DT_STRING, TensorShape({2}));
+  auto grad_keys_value = grad_keys.vec<tstring>();
+  grad_keys_value(0) = "first";
+  grad_keys_value(1) = "second";
+  Tensor embed = Tensor(tensorflow::DT_FLOAT, TensorShape({2, 2}));
+  ASSERT_TRUE(de_manager->Lookup(grad_keys, /*update=*/true, &embed).ok());
+
+  // Applies the gradients of the first batch and looks up the next batch,
+  // which shares a key with the first one.
+  Tensor grads(tensorflow::DT_FLOAT, TensorShape({2, 2}));
+  auto grads_values = grads.matrix<float>();
+  grads_values(0, 0) = 1;
+  grads_values(0, 1) = 2;
+  grads_values(1, 0) = 3;
+  grads_values(1, 1) = 4;
+  Tensor lookup_keys(tensorflow::DT_STRING, TensorShape({3}));
+  auto lookup_keys_value = lookup_keys.vec<tstring>();
+  lookup_keys_value(0) = "second";
+  lookup_keys_value(1) = "third";
+  lookup_keys_value(2) = "";
+  Tensor output = Tensor(tensorflow::DT_FLOAT, TensorShape({3, 2}));
+  ASSERT_TRUE(de_manager
+                  ->UpdateGradientsAndLookup(grad_keys, grads, lookup_keys,
+                                             /*update=*/true, &output)
+                  .ok());
+  auto output_values = output.matrix<float>();
+  EXPECT_FLOAT_EQ(-0.3, output_values(0, 0));
+  EXPECT_FLOAT_EQ(-0.4, output_values(0, 1));
+  for (int i = 1; i < 3; ++i) {
+    for (int j = 0; j < 2; ++j) {
+      EXPECT_FLOAT_EQ(0, output_values(i, j));
+    }
+  }
+
+  // The first key is updated as well.
+  ASSERT_TRUE(de_manager->Lookup(grad_keys, /*update=*/false, &embed).ok());
+  auto embed_values = embed.matrix<float>();
+  EXPECT_FLOAT_EQ(-0.1, embed_values(0, 0));
+  EXPECT_FLOAT_EQ(-0.2, embed_values(0, 1));
+
+  // Invalid lookup keys.
+  Tensor empty_keys(tensorflow::DT_STRING, TensorShape({0}));
+  EXPECT_EQ("No input.", de_manager
+                             ->UpdateGradientsAndLookup(grad_keys, grads,
+                                                        empty_keys,
+                                                        /*update=*/true,
+                                                        &output)
+                             .message());
+}
+
 TEST_F(DynamicEmbeddingManagerTest, NegativeSampling) {
   KnowledgeBankServiceOptions options;
   KbsServerHelper helper(options);
@@ -25,8 +25,13 @@ class DynamicEmbeddingLookup(tf.keras.layers.Layer):
   """A Keras Layer for Dynamic Embedding Lookup.
 
   This is useful when the gradient descent update is required for embedding
-  lookup. The input of this layer is a `Tensor` of string keys and it outputs
-  the embedding output as a float `Tensor`.
+  lookup. The input of this layer is a `Tensor` of string or int64 keys and it
+  outputs the embedding output as a float `Tensor`. If the input is a
+  `tf.RaggedTensor` or a `tf.SparseTensor`, the output is a `tf.RaggedTensor`
+  holding only the embeddings of the real keys (see
+  `dynamic_embedding_lookup_ragged()`). An int64 key is sent to the knowledge
+  bank service as an integer but is stored under its decimal string, so 42 and
+  "42" share an embedding. The candidate sampling ops take string keys only.
 
   """
 
@@ -70,6 +75,9 @@ class DynamicEmbeddingLookup(tf.keras.layers.Layer):
         initializer=tf.keras.initializers.zeros)
 
   def call(self, keys):
+    if isinstance(keys, (tf.RaggedTensor, tf.SparseTensor)):
+      return _ragged_lookup(keys, self.grad_placeholder, self.resource,
+                            self.embedding_dimension)
     return gen_carls_ops.dynamic_embedding_lookup(keys, self.grad_placeholder,
                                                   self.resource,
                                                   self.embedding_dimension)
@@ -84,9 +92,9 @@ def dynamic_embedding_lookup(keys: tf.Tensor,
   """Returns the embeddings of from given keys.
 
   Args:
-    keys: A string `Tensor` of shape [batch_size] or [batch_size,
-      max_sequence_length] where an empty string would be mapped to an all zero
-      embedding.
+    keys: A string or int64 `Tensor` of shape [batch_size] or [batch_size,
+      max_sequence_length] where an empty string or a negative integer would be
+      mapped to an all zero embedding.
     config: A DynamicEmbeddingConfig proto that configures the embedding.
     var_name: A unique name for the given embedding.
     service_address: The address of a knowledge bank service. If empty, the
@@ -122,6 +130,66 @@ def dynamic_embedding_lookup(keys: tf.Tensor,
                                                 config.embedding_dimension)
 
 
+def dynamic_embedding_lookup_ragged(
+    keys: typing.Union[tf.RaggedTensor, tf.SparseTensor],
+    config: de_config_pb2.DynamicEmbeddingConfig,
+    var_name: typing.Text,
+    service_address: typing.Text = "",
+    skip_gradient_update: bool = False,
+    timeout_ms: int = -1) -> tf.RaggedTensor:
+  """Returns the embeddings of a ragged or sparse batch of keys.
+
+  Unlike `dynamic_embedding_lookup()` on a padded 2D input, no embedding is
+  computed or copied for padding, so the cost is proportional to the number of
+  real keys.
+
+  Args:
+    keys: A string or int64 `tf.RaggedTensor` of shape [batch_size,
+      (num_keys)], or a `tf.SparseTensor` of the same dtype and of shape
+      [batch_size, max_sequence_length] whose indices are in row-major order.
+    config: A DynamicEmbeddingConfig proto that configures the embedding.
+    var_name: A unique name for the given embedding.
+    service_address: The address of a knowledge bank service. If empty, the
+      value passed from --kbs_address flag will be used instead.
+    skip_gradient_update: A boolean indicating if gradient update is needed.
+    timeout_ms: Timeout millseconds for the connection. If negative, never
+      timout.
+
+  Returns:
+    A `tf.RaggedTensor` of shape [batch_size, (num_keys),
+    config.embedding_dimension] with the same row partition as `keys` (or as
+    `tf.RaggedTensor.from_sparse(keys)` for a `tf.SparseTensor` input).
+  Raises:
+    ValueError: If name is not specified.
+    TypeError: If keys is neither a `tf.RaggedTensor` nor a `tf.SparseTensor`.
+  """
+  if not var_name:
+    raise ValueError("Must specify a valid var_name.")
+  if not isinstance(keys, (tf.RaggedTensor, tf.SparseTensor)):
+    raise TypeError("keys must be a tf.RaggedTensor or a tf.SparseTensor.")
+
+  if skip_gradient_update:
+    grad_placeholder = tf.constant(0.0)
+  else:
+    grad_placeholder = tf.Variable(0.0)
+
+  context.add_to_collection(var_name, config)
+  resource = gen_carls_ops.dynamic_embedding_manager_resource(
+      config.SerializeToString(), var_name, service_address, timeout_ms)
+  return _ragged_lookup(keys, grad_placeholder, resource,
+                        config.embedding_dimension)
+
+
+def _ragged_lookup(keys, grad_placeholder, resource, embedding_dimension):
+  """Calls DynamicEmbeddingRaggedLookup and rebuilds the ragged output."""
+  if isinstance(keys, tf.SparseTensor):
+    keys = tf.RaggedTensor.from_sparse(keys)
+  values = gen_carls_ops.dynamic_embedding_ragged_lookup(
+      keys.flat_values, keys.nested_row_splits[-1], grad_placeholder, resource,
+      embedding_dimension)
+  return keys.with_flat_values(values)
+
+
 def dynamic_embedding_update(keys: tf.Tensor,
                              values: tf.Tensor,
                              config: de_config_pb2.DynamicEmbeddingConfig,
@@ -131,7 +199,7 @@ def dynamic_embedding_update(keys: tf.Tensor,
   """Updates the embeddings of given keys with given values.
 
   Args:
-    keys: A string `Tensor` of shape [batch] or [batch_size,
+    keys: A string or int64 `Tensor` of shape [batch] or [batch_size,
       max_sequence_length].
     values: A `Tensor` of shape [batch_size, embedding_dimension] or
       [batch_size, max_sequence_length, embedding_dimension].
@@ -180,3 +248,28 @@ def _dynamic_embedding_lookup_grad(op, grad):
       grad,
       op.inputs[2]  # resource
   )
+
+
+@tf.RegisterGradient("DynamicEmbeddingRaggedLookup")
+def _dynamic_embedding_ragged_lookup_grad(op, grad):
+  """The gradient for DynamicEmbeddingRaggedLookup.
+
+  Args:
+    op: The gen_carls_ops.dynamic_embedding_ragged_lookup() op.
+    grad: The tensor of shape [total_keys, embedding_dimension] representing the
+      gradient w.r.t. the output of the op.
+
+  Returns:
+    The gradients w.r.t. the input of the
+    gen_carls_ops.dynamic_embedding_ragged_lookup() op.
+  """
+  if isinstance(grad, tf.IndexedSlices):
+    grad = tf.convert_to_tensor(grad)
+  dummy_grad, resource_grad = (
+      gen_carls_ops.dynamic_embedding_ragged_lookup_grad(
+          op.inputs[0],  # keys
+          grad,
+          op.inputs[3]  # resource
+      ))
+  # No gradients for the keys and the row_splits.
+  return None, None, dummy_grad, resource_grad
@@ -170,6 +170,63 @@ class DynamicEmbeddingOpsTest(tf.test.TestCase, parameterized.TestCase):
     self.assertAllClose(embedding.numpy(),
                         [[[3, 5], [5, 9]], [[9, 17], [0, 0]]])
 
+  @parameterized.parameters({True, False})
+  def testLookup_RaggedInput(self, skip_gradient):
+    init = self._config.knowledge_bank_config.initializer
+    init.default_embedding.value.append(1)
+    init.default_embedding.value.append(2)
+    keys = tf.ragged.constant([['first', 'second', 'third'], [], ['']])
+    embedding = de_ops.dynamic_embedding_lookup_ragged(
+        keys,
+        self._config,
+        'emb',
+        service_address=self._kbs_address,
+        skip_gradient_update=skip_gradient)
+    self.assertIsInstance(embedding, tf.RaggedTensor)
+    self.assertAllEqual(embedding.row_splits.numpy(), [0, 3, 3, 4])
+    self.assertAllClose(embedding.flat_values.numpy(),
+                        [[1, 2], [1, 2], [1, 2], [0, 0]])
+
+    # All rows are empty.
+    embedding = de_ops.dynamic_embedding_lookup_ragged(
+        tf.ragged.constant([[], []], dtype=tf.string),
+        self._config,
+        'emb',
+        service_address=self._kbs_address,
+        skip_gradient_update=skip_gradient)
+    self.assertEqual((0, 2), embedding.flat_values.shape)
+
+  def testLookup_SparseInput(self):
+    init = self._config.knowledge_bank_config.initializer
+    init.default_embedding.value.append(1)
+    init.default_embedding.value.append(2)
+    keys = tf.SparseTensor(
+        indices=[[0, 0], [0, 1], [2, 0]],
+        values=['first', 'second', 'third'],
+        dense_shape=[3, 5])
+    embedding = de_ops.dynamic_embedding_lookup_ragged(
+        keys, self._config, 'emb', service_address=self._kbs_address)
+    self.assertAllEqual(embedding.row_splits.numpy(), [0, 2, 2, 3])
+    self.assertAllClose(embedding.flat_values.numpy(),
+                        [[1, 2], [1, 2], [1, 2]])
+
+  def testLookup_RaggedInputGradient(self):
+    init = self._config.knowledge_bank_config.initializer
+    init.default_embedding.value.append(1)
+    init.default_embedding.value.append(2)
+    keys = tf.ragged.constant([['first', 'second'], ['third']])
+    with tf.GradientTape() as tape:
+      embedding = de_ops.dynamic_embedding_lookup_ragged(
+          keys, self._config, 'emb', service_address=self._kbs_address)
+      loss = tf.reduce_sum(embedding.flat_values)
+    # Triggers the gradient op, which pushes the gradients to the KBS.
+    tape.gradient(loss, tape.watched_variables())
+    new_embedding = de_ops.dynamic_embedding_lookup_ragged(
+        keys, self._config, 'emb', service_address=self._kbs_address)
+    distance = np.sum(
+        (new_embedding.flat_values.numpy() - embedding.flat_values.numpy())**2)
+    self.assertGreater(distance, 0)
+
   def testWrongAddress(self):
     init = self._config.knowledge_bank_config.initializer
     init.default_embedding.value.append(1)
@@ -267,6 +324,10 @@ class DynamicEmbeddingOpsTest(tf.test.TestCase, parameterized.TestCase):
     # 2D case.
     embed = de_layer(np.array([['key1', 'key2'], ['key3', '']]))
     self.assertEqual((2, 2, 2), embed.shape)
+    # Ragged case.
+    embed = de_layer(tf.ragged.constant([['key1', 'key2'], ['key3']]))
+    self.assertIsInstance(embed, tf.RaggedTensor)
+    self.assertEqual((3, 2), embed.flat_values.shape)
 
   def testDynamicEmbeddingKerasInterface_KerasModel(self):
     """A simple Logistic Regression Keras model."""
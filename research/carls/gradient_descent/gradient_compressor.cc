@@ -0,0 +1,191 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/gradient_descent/gradient_compressor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+#include "absl/memory/memory.h"
+
+namespace carls {
+namespace {
+
+// Defaults keeping the convergence close to uncompressed training.
+constexpr float kDefaultDensity = 0.25;
+constexpr int kDefaultMinRows = 1;
+
+float SquaredNorm(const EmbeddingVectorProto& gradient) {
+  float sum = 0;
+  for (const float value : gradient.value()) {
+    sum += value * value;
+  }
+  return sum;
+}
+
+// Returns the approximate number of bytes of a row in an UpdateRequest.
+int64_t RowBytes(const std::string& key, const EmbeddingVectorProto& gradient) {
+  return key.size() + gradient.ByteSizeLong();
+}
+
+int64_t RowBytes(const int64_t key, const EmbeddingVectorProto& gradient) {
+  return sizeof(key) + gradient.ByteSizeLong();
+}
+
+// Adds `residual` to `gradient`.
+void AddResidual(const EmbeddingVectorProto& residual,
+                 EmbeddingVectorProto* gradient) {
+  if (gradient->value_size() == 0) {
+    *gradient->mutable_value() = residual.value();
+    return;
+  }
+  const int size = std::min(gradient->value_size(), residual.value_size());
+  for (int i = 0; i < size; ++i) {
+    gradient->set_value(i, gradient->value(i) + residual.value(i));
+  }
+}
+
+}  // namespace
+
+std::unique_ptr<GradientCompressor> GradientCompressor::Create(
+    const GradientCompressionConfig& config) {
+  if (config.density() < 0 || config.density() > 1) {
+    LOG(ERROR) << "density must be in (0, 1]: " << config.density();
+    return nullptr;
+  }
+  if (config.min_rows() < 0) {
+    LOG(ERROR) << "Invalid min_rows: " << config.min_rows();
+    return nullptr;
+  }
+  if (config.warmup_steps() < 0) {
+    LOG(ERROR) << "Invalid warmup_steps: " << config.warmup_steps();
+    return nullptr;
+  }
+  if (config.max_residual_rows() < 0) {
+    LOG(ERROR) << "Invalid max_residual_rows: " << config.max_residual_rows();
+    return nullptr;
+  }
+  return absl::make_unique<GradientCompressor>(config);
+}
+
+GradientCompressor::GradientCompressor(const GradientCompressionConfig& config)
+    : density_(config.density() > 0 ? config.density() : kDefaultDensity),
+      min_rows_(config.min_rows() > 0 ? config.min_rows() : kDefaultMinRows),
+      warmup_steps_(config.warmup_steps()),
+      max_residual_rows_(config.max_residual_rows()) {}
+
+void GradientCompressor::Compress(
+    google::protobuf::Map<std::string, EmbeddingVectorProto>* gradients) {
+  CHECK(gradients != nullptr);
+  absl::MutexLock l(&mu_);
+  CompressRows(gradients, &residuals_);
+}
+
+void GradientCompressor::Compress(
+    google::protobuf::Map<int64_t, EmbeddingVectorProto>* gradients) {
+  CHECK(gradients != nullptr);
+  absl::MutexLock l(&mu_);
+  CompressRows(gradients, &int_residuals_);
+}
+
+template <typename Key>
+void GradientCompressor::CompressRows(
+    google::protobuf::Map<Key, EmbeddingVectorProto>* gradients,
+    absl::flat_hash_map<Key, EmbeddingVectorProto>* residuals) {
+  int64_t num_bytes = 0;
+  for (const auto& pair : *gradients) {
+    num_bytes += RowBytes(pair.first, pair.second);
+  }
+  num_rows_total_ += gradients->size();
+  num_bytes_total_ += num_bytes;
+  ++num_steps_;
+  if (num_steps_ <= warmup_steps_) {
+    num_rows_sent_ += gradients->size();
+    num_bytes_sent_ += num_bytes;
+    return;
+  }
+
+  // Error feedback: the rows not sent before compete with the new ones.
+  for (const auto& pair : *residuals) {
+    AddResidual(pair.second, &(*gradients)[pair.first]);
+  }
+  residuals->clear();
+
+  const int num_rows = gradients->size();
+  const int num_to_send = std::min(
+      num_rows,
+      std::max(min_rows_, static_cast<int>(std::ceil(density_ * num_rows))));
+  if (num_to_send < num_rows) {
+    std::vector<std::pair<float, Key>> norms;
+    norms.reserve(num_rows);
+    for (const auto& pair : *gradients) {
+      norms.emplace_back(SquaredNorm(pair.second), pair.first);
+    }
+    // Moves the rows of the largest norms to the front.
+    std::nth_element(norms.begin(), norms.begin() + num_to_send, norms.end(),
+                     [](const auto& a, const auto& b) {
+                       return a.first > b.first;
+                     });
+    for (int i = num_to_send; i < num_rows; ++i) {
+      auto iter = gradients->find(norms[i].second);
+      (*residuals)[norms[i].second] = std::move(iter->second);
+      gradients->erase(iter);
+    }
+
+    // Drops the residuals of the smallest norms beyond the limit.
+    if (max_residual_rows_ > 0 && residuals->size() > max_residual_rows_) {
+      std::sort(norms.begin() + num_to_send, norms.end(),
+                [](const auto& a, const auto& b) { return a.first > b.first; });
+      for (int i = num_to_send + max_residual_rows_; i < num_rows; ++i) {
+        residuals->erase(norms[i].second);
+      }
+    }
+  }
+
+  num_rows_sent_ += gradients->size();
+  for (const auto& pair : *gradients) {
+    num_bytes_sent_ += RowBytes(pair.first, pair.second);
+  }
+}
+
+int64_t GradientCompressor::NumRowsTotal() const {
+  absl::MutexLock l(&mu_);
+  return num_rows_total_;
+}
+
+int64_t GradientCompressor::NumRowsSent() const {
+  absl::MutexLock l(&mu_);
+  return num_rows_sent_;
+}
+
+int64_t GradientCompressor::NumBytesTotal() const {
+  absl::MutexLock l(&mu_);
+  return num_bytes_total_;
+}
+
+int64_t GradientCompressor::NumBytesSent() const {
+  absl::MutexLock l(&mu_);
+  return num_bytes_sent_;
+}
+
+int GradientCompressor::NumResidualRows() const {
+  absl::MutexLock l(&mu_);
+  return residuals_.size() + int_residuals_.size();
+}
+
+}  // namespace carls
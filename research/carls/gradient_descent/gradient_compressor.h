@@ -0,0 +1,93 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_GRADIENT_DESCENT_GRADIENT_COMPRESSOR_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_GRADIENT_DESCENT_GRADIENT_COMPRESSOR_H_
+
+#include <memory>
+#include <string>
+
+#include "google/protobuf/map.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "research/carls/embedding.pb.h"  // proto to pb
+#include "research/carls/gradient_descent/gradient_descent_config.pb.h"  // proto to pb
+
+namespace carls {
+
+// Top-k row sparsification of the gradients with error feedback, used by the
+// clients to reduce the bytes sent to the knowledge bank service. In each
+// batch, the residual of the previous batches is added to the gradients, only
+// the rows of the largest L2 norms are kept and the others become the new
+// residual.
+//
+// This class is thread-safe.
+class GradientCompressor {
+ public:
+  // Returns nullptr if the config is invalid.
+  static std::unique_ptr<GradientCompressor> Create(
+      const GradientCompressionConfig& config);
+
+  explicit GradientCompressor(const GradientCompressionConfig& config);
+
+  // Compresses the gradients of a batch in place, which maps from keys to
+  // their gradients.
+  void Compress(
+      google::protobuf::Map<std::string, EmbeddingVectorProto>* gradients);
+
+  // Same as above for integer keys.
+  void Compress(
+      google::protobuf::Map<int64_t, EmbeddingVectorProto>* gradients);
+
+  // Returns the number of rows and bytes of the gradients given to Compress(),
+  // and the number of rows and bytes actually sent after compression.
+  int64_t NumRowsTotal() const;
+  int64_t NumRowsSent() const;
+  int64_t NumBytesTotal() const;
+  int64_t NumBytesSent() const;
+
+  // Returns the number of rows currently held in the residual.
+  int NumResidualRows() const;
+
+ private:
+  // Implementation of Compress() for both key types, with the residuals of
+  // the same key type.
+  template <typename Key>
+  void CompressRows(
+      google::protobuf::Map<Key, EmbeddingVectorProto>* gradients,
+      absl::flat_hash_map<Key, EmbeddingVectorProto>* residuals)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const float density_;
+  const int min_rows_;
+  const int warmup_steps_;
+  const int max_residual_rows_;
+
+  mutable absl::Mutex mu_;
+  int64_t num_steps_ ABSL_GUARDED_BY(mu_) = 0;
+  // Maps from keys to the gradients not sent yet.
+  absl::flat_hash_map<std::string, EmbeddingVectorProto> residuals_
+      ABSL_GUARDED_BY(mu_);
+  absl::flat_hash_map<int64_t, EmbeddingVectorProto> int_residuals_
+      ABSL_GUARDED_BY(mu_);
+  int64_t num_rows_total_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t num_rows_sent_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t num_bytes_total_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t num_bytes_sent_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_GRADIENT_DESCENT_GRADIENT_COMPRESSOR_H_
@@ -0,0 +1,177 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/gradient_descent/gradient_compressor.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "research/carls/base/proto_helper.h"
+#include "research/carls/testing/test_helper.h"
+
+namespace carls {
+namespace {
+
+using GradientMap = google::protobuf::Map<std::string, EmbeddingVectorProto>;
+
+GradientMap MakeGradients(
+    const std::vector<std::pair<std::string, std::vector<float>>>& rows) {
+  GradientMap gradients;
+  for (const auto& row : rows) {
+    auto& gradient = gradients[row.first];
+    for (const float value : row.second) {
+      gradient.add_value(value);
+    }
+  }
+  return gradients;
+}
+
+TEST(GradientCompressorTest, Create) {
+  EXPECT_NE(nullptr, GradientCompressor::Create(GradientCompressionConfig()));
+  EXPECT_EQ(nullptr, GradientCompressor::Create(
+                         ParseTextProtoOrDie<GradientCompressionConfig>(
+                             "density: 1.5")));
+  EXPECT_EQ(nullptr, GradientCompressor::Create(
+                         ParseTextProtoOrDie<GradientCompressionConfig>(
+                             "min_rows: -1")));
+  EXPECT_EQ(nullptr, GradientCompressor::Create(
+                         ParseTextProtoOrDie<GradientCompressionConfig>(
+                             "warmup_steps: -1")));
+  EXPECT_EQ(nullptr, GradientCompressor::Create(
+                         ParseTextProtoOrDie<GradientCompressionConfig>(
+                             "max_residual_rows: -1")));
+}
+
+TEST(GradientCompressorTest, KeepsLargestRows) {
+  auto compressor = GradientCompressor::Create(
+      ParseTextProtoOrDie<GradientCompressionConfig>("density: 0.5"));
+  ASSERT_NE(nullptr, compressor);
+  auto gradients = MakeGradients({{"a", {0.1, 0}},
+                                  {"b", {3, 4}},
+                                  {"c", {0, -2}},
+                                  {"d", {0.1, 0.1}}});
+  int64_t num_bytes = 0;
+  for (const auto& pair : gradients) {
+    num_bytes += pair.first.size() + pair.second.ByteSizeLong();
+  }
+  compressor->Compress(&gradients);
+  ASSERT_EQ(2, gradients.size());
+  EXPECT_THAT(gradients.at("b"),
+              EqualsProto<EmbeddingVectorProto>("value: 3 value: 4"));
+  EXPECT_THAT(gradients.at("c"),
+              EqualsProto<EmbeddingVectorProto>("value: 0 value: -2"));
+  EXPECT_EQ(2, compressor->NumResidualRows());
+  EXPECT_EQ(4, compressor->NumRowsTotal());
+  EXPECT_EQ(2, compressor->NumRowsSent());
+  EXPECT_EQ(num_bytes, compressor->NumBytesTotal());
+  EXPECT_EQ(num_bytes / 2, compressor->NumBytesSent());
+}
+
+TEST(GradientCompressorTest, ErrorFeedback) {
+  auto compressor = GradientCompressor::Create(
+      ParseTextProtoOrDie<GradientCompressionConfig>("density: 0.5"));
+  ASSERT_NE(nullptr, compressor);
+  auto gradients = MakeGradients({{"a", {1}}, {"b", {2}}});
+  compressor->Compress(&gradients);
+  ASSERT_EQ(1, gradients.size());
+  EXPECT_TRUE(gradients.contains("b"));
+
+  // The residual of "a" is added to its new gradient and now is the largest.
+  gradients = MakeGradients({{"a", {1.5}}, {"b", {2}}});
+  compressor->Compress(&gradients);
+  ASSERT_EQ(1, gradients.size());
+  EXPECT_THAT(gradients.at("a"),
+              EqualsProto<EmbeddingVectorProto>("value: 2.5"));
+
+  // A residual of a key absent from the batch is also sent eventually.
+  gradients = MakeGradients({{"c", {0.5}}});
+  compressor->Compress(&gradients);
+  ASSERT_EQ(1, gradients.size());
+  EXPECT_THAT(gradients.at("b"), EqualsProto<EmbeddingVectorProto>("value: 2"));
+  EXPECT_EQ(1, compressor->NumResidualRows());
+}
+
+TEST(GradientCompressorTest, IntKeys) {
+  auto compressor = GradientCompressor::Create(
+      ParseTextProtoOrDie<GradientCompressionConfig>("density: 0.5"));
+  ASSERT_NE(nullptr, compressor);
+  google::protobuf::Map<int64_t, EmbeddingVectorProto> gradients;
+  gradients[1].add_value(1);
+  gradients[2].add_value(2);
+  compressor->Compress(&gradients);
+  ASSERT_EQ(1, gradients.size());
+  EXPECT_TRUE(gradients.contains(2));
+  EXPECT_EQ(1, compressor->NumResidualRows());
+
+  // The residuals of integer keys are kept apart from the string keys.
+  auto string_gradients = MakeGradients({{"1", {0.5}}});
+  compressor->Compress(&string_gradients);
+  EXPECT_TRUE(string_gradients.contains("1"));
+  gradients.clear();
+  gradients[3].add_value(0.5);
+  compressor->Compress(&gradients);
+  ASSERT_EQ(1, gradients.size());
+  EXPECT_THAT(gradients.at(1), EqualsProto<EmbeddingVectorProto>("value: 1"));
+}
+
+TEST(GradientCompressorTest, WarmupAndMinRows) {
+  auto compressor = GradientCompressor::Create(
+      ParseTextProtoOrDie<GradientCompressionConfig>(R"pb(
+        density: 0.1 min_rows: 2 warmup_steps: 1
+      )pb"));
+  ASSERT_NE(nullptr, compressor);
+  auto gradients = MakeGradients({{"a", {1}}, {"b", {2}}, {"c", {3}}});
+  compressor->Compress(&gradients);
+  EXPECT_EQ(3, gradients.size());
+  EXPECT_EQ(0, compressor->NumResidualRows());
+
+  gradients = MakeGradients({{"a", {1}}, {"b", {2}}, {"c", {3}}});
+  compressor->Compress(&gradients);
+  EXPECT_EQ(2, gradients.size());
+  EXPECT_FALSE(gradients.contains("a"));
+  EXPECT_EQ(6, compressor->NumRowsTotal());
+  EXPECT_EQ(5, compressor->NumRowsSent());
+}
+
+TEST(GradientCompressorTest, MaxResidualRows) {
+  auto compressor = GradientCompressor::Create(
+      ParseTextProtoOrDie<GradientCompressionConfig>(R"pb(
+        density: 0.25 max_residual_rows: 2
+      )pb"));
+  ASSERT_NE(nullptr, compressor);
+  auto gradients =
+      MakeGradients({{"a", {1}}, {"b", {2}}, {"c", {3}}, {"d", {4}}});
+  compressor->Compress(&gradients);
+  ASSERT_EQ(1, gradients.size());
+  EXPECT_TRUE(gradients.contains("d"));
+  EXPECT_EQ(2, compressor->NumResidualRows());
+
+  // "a" was dropped from the residual.
+  gradients = MakeGradients({{"e", {0.1}}});
+  compressor->Compress(&gradients);
+  ASSERT_EQ(1, gradients.size());
+  EXPECT_TRUE(gradients.contains("c"));
+  gradients = MakeGradients({{"e", {0.1}}});
+  compressor->Compress(&gradients);
+  ASSERT_EQ(1, gradients.size());
+  EXPECT_TRUE(gradients.contains("b"));
+  gradients = MakeGradients({{"f", {0.1}}});
+  compressor->Compress(&gradients);
+  ASSERT_EQ(1, gradients.size());
+  EXPECT_THAT(gradients.at("e"),
+              EqualsProto<EmbeddingVectorProto>("value: 0.2"));
+}
+
+}  // namespace
+}  // namespace carls
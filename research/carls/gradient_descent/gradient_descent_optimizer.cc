@@ -15,6 +15,8 @@ limitations under the License.
 
 #include "research/carls/gradient_descent/gradient_descent_optimizer.h"
 
+#include <cmath>
+
 #include "research/carls/embedding.pb.h"  // proto to pb
 
 namespace carls {
@@ -60,6 +62,14 @@ std::unique_ptr<GradientDescentOptimizer> GradientDescentOptimizer::Create(
       return nullptr;
     }
   }
+
+  // Checks the weight decay, which must keep the embeddings' signs.
+  if (config.weight_decay() < 0 ||
+      config.learning_rate() * config.weight_decay() >= 1) {
+    LOG(ERROR) << "Invalid weight_decay: " << config.weight_decay()
+               << ", learning_rate * weight_decay must be in [0, 1).";
+    return nullptr;
+  }
   return absl::make_unique<GradientDescentOptimizer>(embedding_dimension,
                                                      config);
 }
@@ -68,7 +78,9 @@ GradientDescentOptimizer::GradientDescentOptimizer(
     const int embedding_dimension, const GradientDescentConfig& config)
     : embedding_dimension_(embedding_dimension),
       learning_rate_(config.learning_rate()),
-      config_(config) {}
+      config_(config),
+      decay_factor_(1.0f - config.learning_rate() * config.weight_decay()),
+      kernels_(GetEmbeddingKernels(embedding_dimension)) {}
 
 std::vector<EmbeddingVectorProto> GradientDescentOptimizer::Apply(
     const std::vector<EmbeddingVectorProto>& variables,
@@ -84,7 +96,6 @@ std::vector<EmbeddingVectorProto> GradientDescentOptimizer::Apply(
                               variables.size(), ", ", gradients.size(), ")");
     return {};
   }
-  std::vector<EmbeddingVectorProto> results(variables.size());
   for (size_t i = 0; i < variables.size(); ++i) {
     if (variables[i].value_size() != embedding_dimension_ ||
         gradients[i]->value_size() != embedding_dimension_) {
@@ -94,13 +105,35 @@ std::vector<EmbeddingVectorProto> GradientDescentOptimizer::Apply(
                        gradients[i]->value_size(), " for input ", i);
       return {};
     }
+  }
+
+  // The step is only advanced here, never from the decay_step of the
+  // variables, which may come from another process.
+  const int64_t step = has_weight_decay() ? ++*step_ : 0;
+
+  std::vector<EmbeddingVectorProto> results(variables.size());
+  EmbeddingVectorProto decayed_var;
+  for (size_t i = 0; i < variables.size(); ++i) {
+    const EmbeddingVectorProto* var = &variables[i];
+    if (step > 0) {
+      // w <- w * (1 - learning_rate * weight_decay) at every step, including
+      // the current one for a row receiving its first gradient. A decay_step
+      // ahead of the current step is not from this optimizer, the row is only
+      // decayed for the current step.
+      decayed_var = variables[i];
+      if (decayed_var.decay_step() == 0 || decayed_var.decay_step() >= step) {
+        decayed_var.set_decay_step(step - 1);
+      }
+      DecayToStep(step, &decayed_var);
+      var = &decayed_var;
+    }
 
     switch (config_.optimizer_case()) {
       case GradientDescentConfig::kSgd:
-        results[i] = ApplyGradientDescent(variables[i], *gradients[i]);
+        results[i] = ApplyGradientDescent(*var, *gradients[i]);
         break;
       case GradientDescentConfig::kAdagrad:
-        results[i] = ApplyAdagrad(variables[i], *gradients[i]);
+        results[i] = ApplyAdagrad(*var, *gradients[i]);
         break;
       default:
         LOG(FATAL) << "Unsupported optimizer: " << config_.optimizer_case();
@@ -108,24 +141,56 @@ std::vector<EmbeddingVectorProto> GradientDescentOptimizer::Apply(
 
     results[i].set_tag(variables[i].tag());
     results[i].set_weight(variables[i].weight());
+    results[i].set_decay_step(var->decay_step());
+    // The metadata is used by the candidate filters of the samplers.
+    if (variables[i].has_meta_data()) {
+      *results[i].mutable_meta_data() = variables[i].meta_data();
+    }
   }
   return results;
 }
 
+void GradientDescentOptimizer::ApplyWeightDecay(
+    EmbeddingVectorProto* var) const {
+  CHECK(var != nullptr);
+  if (!has_weight_decay() || var->decay_step() == 0) {
+    return;
+  }
+  DecayToStep(*step_, var);
+}
+
+void GradientDescentOptimizer::FlushWeightDecay(
+    EmbeddingVectorProto* var) const {
+  ApplyWeightDecay(var);
+  var->clear_decay_step();
+}
+
+void GradientDescentOptimizer::DecayToStep(const int64_t step,
+                                           EmbeddingVectorProto* var) const {
+  if (var->decay_step() >= step) {
+    return;
+  }
+  const float factor = std::pow(decay_factor_, step - var->decay_step());
+  for (float& value : *var->mutable_value()) {
+    value *= factor;
+  }
+  var->set_decay_step(step);
+}
+
 EmbeddingVectorProto GradientDescentOptimizer::ApplyGradientDescent(
     const EmbeddingVectorProto& var, const EmbeddingVectorProto& grad) {
   EmbeddingVectorProto result;
-  result.mutable_value()->Reserve(var.value_size());
-  for (int i = 0; i < var.value_size(); ++i) {
-    result.add_value(var.value(i) - grad.value(i) * learning_rate_);
-  }
+  result.mutable_value()->Resize(embedding_dimension_, 0.0f);
+  kernels_.sgd_update(var.value().data(), grad.value().data(), learning_rate_,
+                      embedding_dimension_,
+                      result.mutable_value()->mutable_data());
   return result;
 }
 
 EmbeddingVectorProto GradientDescentOptimizer::ApplyAdagrad(
     const EmbeddingVectorProto& var, const EmbeddingVectorProto& grad) {
   EmbeddingVectorProto result;
-  result.mutable_value()->Reserve(embedding_dimension_);
+  result.mutable_value()->Resize(embedding_dimension_, 0.0f);
   const auto& key = var.tag();
   absl::MutexLock l(&params_mu_);
   if (!params_[kAccum].contains(key)) {
@@ -134,11 +199,10 @@ EmbeddingVectorProto GradientDescentOptimizer::ApplyAdagrad(
   }
 
   auto* accum = params_[kAccum][key].mutable_value();
-  for (int i = 0; i < embedding_dimension_; ++i) {
-    *accum->Mutable(i) += grad.value(i) * grad.value(i);
-    result.add_value(var.value(i) -
-                     grad.value(i) * learning_rate_ / std::sqrt(accum->Get(i)));
-  }
+  kernels_.adagrad_update(var.value().data(), grad.value().data(),
+                          learning_rate_, embedding_dimension_,
+                          accum->mutable_data(),
+                          result.mutable_value()->mutable_data());
   return result;
 }
 
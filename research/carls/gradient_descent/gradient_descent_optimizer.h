@@ -16,9 +16,14 @@ limitations under the License.
 #ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_GRADIENT_DESCENT_GRADIENT_DESCENT_OPTIMIZER_H_
 #define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_GRADIENT_DESCENT_GRADIENT_DESCENT_OPTIMIZER_H_
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
 #include <glog/logging.h>
 #include "absl/container/node_hash_map.h"
 #include "absl/synchronization/mutex.h"
+#include "research/carls/base/embedding_kernels.h"
 #include "research/carls/embedding.pb.h"  // proto to pb
 #include "research/carls/gradient_descent/gradient_descent_config.pb.h"  // proto to pb
 
@@ -46,7 +51,38 @@ class GradientDescentOptimizer {
       const std::vector<const EmbeddingVectorProto*>& gradients,
       std::string* error_msg);
 
+  // Applies the weight decay of the steps since var->decay_step() to `var`,
+  // which is read from the knowledge bank outside of Apply(), and advances its
+  // decay_step to the current step. It is a no-op without weight_decay in the
+  // config or for a row that has never received a gradient.
+  void ApplyWeightDecay(EmbeddingVectorProto* var) const;
+
+  // Applies the weight decay pending on `var` and clears its decay_step, for a
+  // row leaving this optimizer, e.g., exported or sent to another KBS, since
+  // its decay_step refers to the steps of this optimizer only. The row is
+  // decayed again from its next gradient on.
+  void FlushWeightDecay(EmbeddingVectorProto* var) const;
+
+  // Returns true if the config has a weight_decay.
+  bool has_weight_decay() const { return decay_factor_ != 1.0f; }
+
+  // Returns the number of steps, i.e., calls to Apply(), with weight decay.
+  int64_t step() const { return *step_; }
+
+  // Replaces the step with `step`, shared with the optimizers of the other
+  // sessions updating the same rows, since the decay_step of a row refers to
+  // the step of the optimizer that last updated it. Must be called before
+  // Apply().
+  void ShareStep(std::shared_ptr<std::atomic<int64_t>> step) {
+    CHECK(step != nullptr);
+    step_ = std::move(step);
+  }
+
  private:
+  // Multiplies the value of `var` by the decay of the steps from its
+  // decay_step to `step`, and sets its decay_step to `step`.
+  void DecayToStep(int64_t step, EmbeddingVectorProto* var) const;
+
   // Implementation of the basic SGD algorithm.
   EmbeddingVectorProto ApplyGradientDescent(const EmbeddingVectorProto& var,
                                             const EmbeddingVectorProto& grad);
@@ -59,6 +95,17 @@ class GradientDescentOptimizer {
   const float learning_rate_;
   const GradientDescentConfig config_;
 
+  // Factor multiplying the embeddings at each step, 1 without weight decay.
+  const float decay_factor_;
+
+  // Current step of the weight decay, see ShareStep().
+  std::shared_ptr<std::atomic<int64_t>> step_ =
+      std::make_shared<std::atomic<int64_t>>(0);
+
+  // Vector kernels specialized for embedding_dimension_, selected once at
+  // construction time.
+  const EmbeddingKernels& kernels_;
+
   // Mutex for params_.
   absl::Mutex params_mu_;
 
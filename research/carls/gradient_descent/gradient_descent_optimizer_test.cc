@@ -122,4 +122,61 @@ TEST_F(GradientDescentOptimizerTest, Adagrad) {
   EXPECT_NE(update_result[0].value(1), 1.9046538);
 }
 
+TEST_F(GradientDescentOptimizerTest, WeightDecay) {
+  GradientDescentConfig config = ParseTextProtoOrDie<GradientDescentConfig>(R"(
+    learning_rate: 0.1
+    sgd {}
+    weight_decay: 10
+  )");
+  EXPECT_TRUE(GradientDescentOptimizer::Create(2, config) == nullptr);
+  config.set_weight_decay(-1);
+  EXPECT_TRUE(GradientDescentOptimizer::Create(2, config) == nullptr);
+
+  // Multiplies the embeddings by 0.9 at each step.
+  config.set_weight_decay(1);
+  auto gd_result = GradientDescentOptimizer::Create(2, config);
+  ASSERT_TRUE(gd_result != nullptr);
+  ASSERT_TRUE(gd_result->has_weight_decay());
+  std::string error_msg;
+  auto update_result1 = gd_result->Apply({var1_}, {&grad1_}, &error_msg);
+  ASSERT_EQ(1, update_result1.size());
+  ASSERT_EQ(2, update_result1[0].value_size());
+  EXPECT_FLOAT_EQ(0.8, update_result1[0].value(0));
+  EXPECT_FLOAT_EQ(1.7, update_result1[0].value(1));
+  EXPECT_EQ(1, update_result1[0].decay_step());
+  auto update_result2 = gd_result->Apply({var2_}, {&grad2_}, &error_msg);
+  ASSERT_EQ(1, update_result2.size());
+  ASSERT_EQ(2, update_result2[0].value_size());
+  EXPECT_FLOAT_EQ(89, update_result2[0].value(0));
+  EXPECT_FLOAT_EQ(179, update_result2[0].value(1));
+  EXPECT_EQ(2, update_result2[0].decay_step());
+  EXPECT_EQ(2, gd_result->step());
+
+  // The first row missed the decay of the second step.
+  gd_result->ApplyWeightDecay(&update_result1[0]);
+  ASSERT_EQ(2, update_result1[0].value_size());
+  EXPECT_FLOAT_EQ(0.72, update_result1[0].value(0));
+  EXPECT_FLOAT_EQ(1.53, update_result1[0].value(1));
+  EXPECT_EQ(2, update_result1[0].decay_step());
+  // Rows without gradients do not decay.
+  EmbeddingVectorProto var = var1_;
+  gd_result->ApplyWeightDecay(&var);
+  EXPECT_THAT(var, EqualsProto(var1_));
+
+  // Flushing the decay brings the row up to date and clears its decay_step.
+  gd_result->FlushWeightDecay(&update_result2[0]);
+  EXPECT_FLOAT_EQ(89, update_result2[0].value(0));
+  EXPECT_EQ(0, update_result2[0].decay_step());
+
+  // The decay_step of a row from another optimizer does not move the step.
+  var.set_decay_step(100);
+  auto update_result3 = gd_result->Apply({var}, {&grad1_}, &error_msg);
+  ASSERT_EQ(1, update_result3.size());
+  EXPECT_EQ(3, gd_result->step());
+  ASSERT_EQ(2, update_result3[0].value_size());
+  EXPECT_FLOAT_EQ(0.8, update_result3[0].value(0));
+  EXPECT_FLOAT_EQ(1.7, update_result3[0].value(1));
+  EXPECT_EQ(3, update_result3[0].decay_step());
+}
+
 }  // namespace carls
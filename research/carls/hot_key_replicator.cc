@@ -0,0 +1,179 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/hot_key_replicator.h"
+
+#include <algorithm>
+
+namespace carls {
+namespace {
+
+constexpr double kDefaultMinReadFraction = 0.01;
+constexpr int kDefaultMaxHotKeys = 100;
+constexpr int kDefaultSketchCapacityFactor = 10;
+constexpr double kDefaultDecay = 0.5;
+
+int SketchCapacity(const HotKeyConfig& config) {
+  if (config.sketch_capacity() > 0) {
+    return config.sketch_capacity();
+  }
+  const int max_hot_keys =
+      config.max_hot_keys() > 0 ? config.max_hot_keys() : kDefaultMaxHotKeys;
+  return kDefaultSketchCapacityFactor * max_hot_keys;
+}
+
+// Adds `gradient` to the sum of the gradients of a key.
+void AddGradient(const EmbeddingVectorProto& gradient,
+                 EmbeddingVectorProto* sum) {
+  if (sum->value_size() == 0) {
+    *sum = gradient;
+    return;
+  }
+  const int size = std::min(sum->value_size(), gradient.value_size());
+  for (int i = 0; i < size; ++i) {
+    sum->set_value(i, sum->value(i) + gradient.value(i));
+  }
+}
+
+}  // namespace
+
+HotKeyReplicator::HotKeyReplicator(const HotKeyConfig& config)
+    : min_read_fraction_(config.min_read_fraction() > 0
+                             ? config.min_read_fraction()
+                             : kDefaultMinReadFraction),
+      max_hot_keys_(config.max_hot_keys() > 0 ? config.max_hot_keys()
+                                              : kDefaultMaxHotKeys),
+      decay_(config.decay() > 0 ? std::min(config.decay(), 1.0)
+                                : kDefaultDecay),
+      read_counts_(SketchCapacity(config)) {}
+
+void HotKeyReplicator::RecordOwnedReads(
+    const std::vector<absl::string_view>& keys) {
+  absl::MutexLock l(&mu_);
+  for (const auto& key : keys) {
+    read_counts_.Add(key);
+  }
+  num_owned_reads_ += keys.size();
+}
+
+void HotKeyReplicator::AddReadCounts(
+    const google::protobuf::Map<std::string, int64_t>& read_counts) {
+  absl::MutexLock l(&mu_);
+  for (const auto& pair : read_counts) {
+    read_counts_.Add(pair.first, pair.second);
+  }
+}
+
+std::vector<std::string> HotKeyReplicator::UpdateHotKeys() {
+  absl::MutexLock l(&mu_);
+  hot_keys_.clear();
+  for (auto& pair : read_counts_.TopKeys(min_read_fraction_, max_hot_keys_)) {
+    hot_keys_.push_back(std::move(pair.first));
+  }
+  read_counts_.Decay(decay_);
+  return hot_keys_;
+}
+
+std::vector<std::string> HotKeyReplicator::HotKeys() const {
+  absl::MutexLock l(&mu_);
+  return hot_keys_;
+}
+
+void HotKeyReplicator::SetReplicatedRows(
+    const std::string& owner_address,
+    const google::protobuf::Map<std::string, EmbeddingVectorProto>& rows) {
+  absl::MutexLock l(&mu_);
+  for (auto iter = replicas_.begin(); iter != replicas_.end();) {
+    if (iter->second.owner_address == owner_address) {
+      replicas_.erase(iter++);
+    } else {
+      ++iter;
+    }
+  }
+  for (const auto& pair : rows) {
+    auto& replica = replicas_[pair.first];
+    replica.owner_address = owner_address;
+    replica.value = pair.second;
+  }
+}
+
+bool HotKeyReplicator::IsReplicated(absl::string_view key) const {
+  absl::MutexLock l(&mu_);
+  return replicas_.contains(key);
+}
+
+bool HotKeyReplicator::LookupReplica(absl::string_view key,
+                                     EmbeddingVectorProto* value) {
+  absl::MutexLock l(&mu_);
+  auto iter = replicas_.find(key);
+  if (iter == replicas_.end()) {
+    return false;
+  }
+  *value = iter->second.value;
+  auto& read_counts =
+      *pending_pushes_[iter->second.owner_address].mutable_read_counts();
+  ++read_counts[iter->first];
+  ++num_replica_reads_;
+  return true;
+}
+
+bool HotKeyReplicator::AddReplicaGradient(
+    absl::string_view key, const EmbeddingVectorProto& gradient) {
+  absl::MutexLock l(&mu_);
+  auto iter = replicas_.find(key);
+  if (iter == replicas_.end()) {
+    return false;
+  }
+  AddGradient(gradient, &(*pending_pushes_[iter->second.owner_address]
+                                .mutable_gradients())[iter->first]);
+  return true;
+}
+
+std::vector<std::pair<std::string, PushHotKeyStatsRequest>>
+HotKeyReplicator::TakePendingPushes() {
+  absl::MutexLock l(&mu_);
+  std::vector<std::pair<std::string, PushHotKeyStatsRequest>> pushes;
+  pushes.reserve(pending_pushes_.size());
+  for (auto& pair : pending_pushes_) {
+    pushes.emplace_back(pair.first, std::move(pair.second));
+  }
+  pending_pushes_.clear();
+  return pushes;
+}
+
+void HotKeyReplicator::RequeuePush(const std::string& owner_address,
+                                   const PushHotKeyStatsRequest& push) {
+  absl::MutexLock l(&mu_);
+  auto& pending = pending_pushes_[owner_address];
+  for (const auto& pair : push.gradients()) {
+    AddGradient(pair.second, &(*pending.mutable_gradients())[pair.first]);
+  }
+  auto& read_counts = *pending.mutable_read_counts();
+  for (const auto& pair : push.read_counts()) {
+    read_counts[pair.first] += pair.second;
+  }
+}
+
+int64_t HotKeyReplicator::NumOwnedReads() const {
+  absl::MutexLock l(&mu_);
+  return num_owned_reads_;
+}
+
+int64_t HotKeyReplicator::NumReplicaReads() const {
+  absl::MutexLock l(&mu_);
+  return num_replica_reads_;
+}
+
+}  // namespace carls
@@ -0,0 +1,114 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_HOT_KEY_REPLICATOR_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_HOT_KEY_REPLICATOR_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/map.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "research/carls/base/heavy_hitters.h"
+#include "research/carls/embedding.pb.h"  // proto to pb
+#include "research/carls/knowledge_bank_service.pb.h"  // proto to pb
+
+namespace carls {
+
+// Keeps the state of the hot key replication of a sharded session on a KBS,
+// see HotKeyConfig. As the owner of some keys, it finds the most read ones.
+// As a replica, it serves the rows replicated by the other KBS and collects
+// the reads and gradients of these rows for their owners.
+//
+// This class is thread-safe.
+class HotKeyReplicator {
+ public:
+  explicit HotKeyReplicator(const HotKeyConfig& config);
+
+  // Records the reads of keys owned by this KBS.
+  void RecordOwnedReads(const std::vector<absl::string_view>& keys);
+
+  // Adds the read counts of keys owned by this KBS reported by other KBS.
+  void AddReadCounts(
+      const google::protobuf::Map<std::string, int64_t>& read_counts);
+
+  // Recomputes the hot keys from the read counts, then decays the counts.
+  // Returns the new hot keys.
+  std::vector<std::string> UpdateHotKeys();
+
+  // Returns the hot keys found by the last UpdateHotKeys().
+  std::vector<std::string> HotKeys() const;
+
+  // Replaces the rows replicated from `owner_address`.
+  void SetReplicatedRows(
+      const std::string& owner_address,
+      const google::protobuf::Map<std::string, EmbeddingVectorProto>& rows);
+
+  bool IsReplicated(absl::string_view key) const;
+
+  // Outputs the replicated row of `key` and counts the read. Returns false if
+  // the key is not replicated here.
+  bool LookupReplica(absl::string_view key, EmbeddingVectorProto* value);
+
+  // Sums the gradient of a replicated key until the next push to its owner.
+  // Returns false if the key is not replicated here.
+  bool AddReplicaGradient(absl::string_view key,
+                          const EmbeddingVectorProto& gradient);
+
+  // Returns the gradients and read counts collected since the last call,
+  // grouped by the address of their owner. The session_handle of the requests
+  // is not set.
+  std::vector<std::pair<std::string, PushHotKeyStatsRequest>>
+  TakePendingPushes();
+
+  // Adds back a push taken by TakePendingPushes() that failed, so that its
+  // gradients and read counts are sent with the next push to the same owner.
+  void RequeuePush(const std::string& owner_address,
+                   const PushHotKeyStatsRequest& push);
+
+  // Returns the number of reads served from the knowledge bank and from the
+  // replicated rows, for measuring the load skew between KBS.
+  int64_t NumOwnedReads() const;
+  int64_t NumReplicaReads() const;
+
+ private:
+  // A row replicated from another KBS.
+  struct Replica {
+    std::string owner_address;
+    EmbeddingVectorProto value;
+  };
+
+  const double min_read_fraction_;
+  const int max_hot_keys_;
+  const double decay_;
+
+  mutable absl::Mutex mu_;
+  HeavyHitters read_counts_ ABSL_GUARDED_BY(mu_);
+  std::vector<std::string> hot_keys_ ABSL_GUARDED_BY(mu_);
+  // Maps from the replicated keys to their rows.
+  absl::flat_hash_map<std::string, Replica> replicas_ ABSL_GUARDED_BY(mu_);
+  // Maps from owner addresses to their pending gradients and read counts.
+  absl::flat_hash_map<std::string, PushHotKeyStatsRequest> pending_pushes_
+      ABSL_GUARDED_BY(mu_);
+  int64_t num_owned_reads_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t num_replica_reads_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_HOT_KEY_REPLICATOR_H_
@@ -0,0 +1,145 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/hot_key_replicator.h"
+
+#include <algorithm>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "research/carls/base/proto_helper.h"
+#include "research/carls/testing/test_helper.h"
+
+namespace carls {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+TEST(HotKeyReplicatorTest, FindsHotKeys) {
+  HotKeyReplicator replicator(ParseTextProtoOrDie<HotKeyConfig>(R"pb(
+    min_read_fraction: 0.2 max_hot_keys: 2 decay: 0.5
+  )pb"));
+  EXPECT_THAT(replicator.UpdateHotKeys(), IsEmpty());
+
+  replicator.RecordOwnedReads({"a", "a", "a", "b", "c", "a", "b", "d"});
+  EXPECT_EQ(8, replicator.NumOwnedReads());
+  EXPECT_THAT(replicator.UpdateHotKeys(), ElementsAre("a", "b"));
+  EXPECT_THAT(replicator.HotKeys(), ElementsAre("a", "b"));
+
+  // Reads reported by the replicas count as well, the old counts are decayed.
+  google::protobuf::Map<std::string, int64_t> read_counts;
+  read_counts["c"] = 10;
+  replicator.AddReadCounts(read_counts);
+  EXPECT_THAT(replicator.UpdateHotKeys(), ElementsAre("c"));
+}
+
+TEST(HotKeyReplicatorTest, ServesReplicas) {
+  HotKeyReplicator replicator((HotKeyConfig()));
+  google::protobuf::Map<std::string, EmbeddingVectorProto> rows;
+  rows["a"] = ParseTextProtoOrDie<EmbeddingVectorProto>("value: 1 value: 2");
+  rows["b"] = ParseTextProtoOrDie<EmbeddingVectorProto>("value: 3 value: 4");
+  replicator.SetReplicatedRows("kbs1", rows);
+  rows.clear();
+  rows["c"] = ParseTextProtoOrDie<EmbeddingVectorProto>("value: 5 value: 6");
+  replicator.SetReplicatedRows("kbs2", rows);
+
+  EXPECT_TRUE(replicator.IsReplicated("a"));
+  EXPECT_FALSE(replicator.IsReplicated("d"));
+  EmbeddingVectorProto value;
+  ASSERT_TRUE(replicator.LookupReplica("a", &value));
+  EXPECT_THAT(value, EqualsProto<EmbeddingVectorProto>("value: 1 value: 2"));
+  ASSERT_TRUE(replicator.LookupReplica("a", &value));
+  ASSERT_TRUE(replicator.LookupReplica("c", &value));
+  EXPECT_FALSE(replicator.LookupReplica("d", &value));
+  EXPECT_EQ(3, replicator.NumReplicaReads());
+
+  // New rows from an owner replace its previous ones.
+  rows.clear();
+  rows["b"] = ParseTextProtoOrDie<EmbeddingVectorProto>("value: 7 value: 8");
+  replicator.SetReplicatedRows("kbs1", rows);
+  EXPECT_FALSE(replicator.IsReplicated("a"));
+  ASSERT_TRUE(replicator.LookupReplica("b", &value));
+  EXPECT_THAT(value, EqualsProto<EmbeddingVectorProto>("value: 7 value: 8"));
+  EXPECT_TRUE(replicator.IsReplicated("c"));
+}
+
+TEST(HotKeyReplicatorTest, CollectsPushesByOwner) {
+  HotKeyReplicator replicator((HotKeyConfig()));
+  google::protobuf::Map<std::string, EmbeddingVectorProto> rows;
+  rows["a"] = ParseTextProtoOrDie<EmbeddingVectorProto>("value: 1 value: 2");
+  replicator.SetReplicatedRows("kbs1", rows);
+  rows.clear();
+  rows["b"] = ParseTextProtoOrDie<EmbeddingVectorProto>("value: 3 value: 4");
+  replicator.SetReplicatedRows("kbs2", rows);
+
+  EXPECT_TRUE(replicator.AddReplicaGradient(
+      "a", ParseTextProtoOrDie<EmbeddingVectorProto>("value: 1 value: 1")));
+  EXPECT_TRUE(replicator.AddReplicaGradient(
+      "a", ParseTextProtoOrDie<EmbeddingVectorProto>("value: 2 value: 3")));
+  EXPECT_FALSE(replicator.AddReplicaGradient(
+      "c", ParseTextProtoOrDie<EmbeddingVectorProto>("value: 1 value: 1")));
+  EmbeddingVectorProto value;
+  ASSERT_TRUE(replicator.LookupReplica("b", &value));
+
+  auto pushes = replicator.TakePendingPushes();
+  ASSERT_EQ(2, pushes.size());
+  std::sort(pushes.begin(), pushes.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+  EXPECT_EQ("kbs1", pushes[0].first);
+  EXPECT_THAT(pushes[0].second, EqualsProto<PushHotKeyStatsRequest>(R"pb(
+                gradients {
+                  key: "a"
+                  value { value: 3 value: 4 }
+                }
+              )pb"));
+  EXPECT_EQ("kbs2", pushes[1].first);
+  EXPECT_THAT(pushes[1].second, EqualsProto<PushHotKeyStatsRequest>(R"pb(
+                read_counts { key: "b" value: 1 }
+              )pb"));
+  EXPECT_THAT(replicator.TakePendingPushes(), IsEmpty());
+}
+
+TEST(HotKeyReplicatorTest, RequeuesFailedPushes) {
+  HotKeyReplicator replicator((HotKeyConfig()));
+  google::protobuf::Map<std::string, EmbeddingVectorProto> rows;
+  rows["a"] = ParseTextProtoOrDie<EmbeddingVectorProto>("value: 1 value: 2");
+  replicator.SetReplicatedRows("kbs1", rows);
+  EXPECT_TRUE(replicator.AddReplicaGradient(
+      "a", ParseTextProtoOrDie<EmbeddingVectorProto>("value: 1 value: 1")));
+  EmbeddingVectorProto value;
+  ASSERT_TRUE(replicator.LookupReplica("a", &value));
+  auto pushes = replicator.TakePendingPushes();
+  ASSERT_EQ(1, pushes.size());
+
+  // The failed push is merged with the stats collected meanwhile.
+  EXPECT_TRUE(replicator.AddReplicaGradient(
+      "a", ParseTextProtoOrDie<EmbeddingVectorProto>("value: 2 value: 3")));
+  ASSERT_TRUE(replicator.LookupReplica("a", &value));
+  replicator.RequeuePush(pushes[0].first, pushes[0].second);
+  pushes = replicator.TakePendingPushes();
+  ASSERT_EQ(1, pushes.size());
+  EXPECT_EQ("kbs1", pushes[0].first);
+  EXPECT_THAT(pushes[0].second, EqualsProto<PushHotKeyStatsRequest>(R"pb(
+                gradients {
+                  key: "a"
+                  value { value: 3 value: 4 }
+                }
+                read_counts { key: "a" value: 2 }
+              )pb"));
+}
+
+}  // namespace
+}  // namespace carls
@@ -67,20 +67,74 @@ Status SetInputShape(InferenceContext* c) {
   return tensorflow::OkStatus();
 }
 
+// The output of the ragged lookup has shape [total_keys, embedding_dimension].
+Status SetRaggedOutputShape(InferenceContext* c) {
+  int embedding_dimension;
+  TF_RETURN_IF_ERROR(c->GetAttr("embedding_dimension", &embedding_dimension));
+  ShapeHandle keys_shape;
+  TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &keys_shape));
+  ShapeHandle row_splits_shape;
+  TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &row_splits_shape));
+  c->set_output(0, c->Matrix(c->Dim(keys_shape, 0),
+                             DimensionOrConstant(embedding_dimension)));
+  return tensorflow::OkStatus();
+}
+
+// Checks that row_splits is a valid partition of `num_keys` keys, i.e., it
+// starts with 0, is non-decreasing and ends with num_keys.
+template <typename SplitsType>
+Status CheckRowSplits(const Tensor& row_splits, const int64_t num_keys) {
+  if (row_splits.dims() != 1 || row_splits.NumElements() == 0) {
+    return InvalidArgument("row_splits must be a non-empty 1D Tensor.");
+  }
+  const auto splits = row_splits.vec<SplitsType>();
+  if (splits(0) != 0) {
+    return InvalidArgument("row_splits must start with 0.");
+  }
+  for (int i = 1; i < splits.size(); ++i) {
+    if (splits(i) < splits(i - 1)) {
+      return InvalidArgument("row_splits must be non-decreasing.");
+    }
+  }
+  const int64_t last_split = splits(splits.size() - 1);
+  if (last_split != num_keys) {
+    return InvalidArgument(
+        absl::StrCat("row_splits must end with the number of keys ", num_keys,
+                     ", got ", last_split));
+  }
+  return tensorflow::OkStatus();
+}
+
+// Sets the rows of `output` to zero for the padding keys, see IsPaddingKey().
+template <typename KeyType>
+void ZeroPaddingRows(const Tensor& keys, Tensor* output) {
+  auto output_value = output->flat_inner_dims<float>();
+  const auto keys_value = keys.flat<KeyType>();
+  for (int i = 0; i < keys.NumElements(); ++i) {
+    if (IsPaddingKey(keys_value(i))) {
+      for (int j = 0; j < output_value.dimension(1); ++j) {
+        output_value(i, j) = 0.0;
+      }
+    }
+  }
+}
+
 }  // namespace
 
 REGISTER_OP("DynamicEmbeddingLookup")
-    .Input("keys: string")
+    .Input("keys: Tkeys")
     .Input("grad_placeholder: float")
     .Input("handle: resource")
     .Output("values: float")
     .Attr("embedding_dimension: int")
+    .Attr("Tkeys: {string, int64} = DT_STRING")
     .SetShapeFn([](InferenceContext* c) { return SetInputShape(c); })
     .Doc(R"doc(
 An operation that returns the embedding of a given set of keys.
 
-keys: A string Tensor of shape [batch_size] or [batch_size, max_sequence_length]
-      where an empty string would be mapped to an all zero embedding.
+keys: A string or int64 Tensor of shape [batch_size] or
+      [batch_size, max_sequence_length] where an empty string or a negative
+      integer would be mapped to an all zero embedding.
 grad_placeholder: A dummy Tensor so that the gradients can be passed in.
 handle: A handle to DynamicEmbeddingManagerResource.
 values: A Tensor of shape [batch_size, embedding_dimension] if the
@@ -90,17 +144,18 @@ values: A Tensor of shape [batch_size, embedding_dimension] if the
 )doc");
 
 REGISTER_OP("DynamicEmbeddingUpdate")
-    .Input("keys: string")
+    .Input("keys: Tkeys")
     .Input("values: float")
     .Input("handle: resource")
     .Output("results: float")
     .Attr("embedding_dimension: int")
+    .Attr("Tkeys: {string, int64} = DT_STRING")
     .SetShapeFn([](InferenceContext* c) { return SetInputShape(c); })
     .Doc(R"doc(
 An operation that updates the embeddings of a given set of keys in the dynamic
 embedding service.
 
-keys: A string `Tensor` of shape [batch] or [batch_size,
+keys: A string or int64 `Tensor` of shape [batch] or [batch_size,
       max_sequence_length].
 values: A `Tensor` of shape [batch_size, embedding_dimension] or
         [batch_size, max_sequence_length, embedding_dimension].
@@ -111,18 +166,19 @@ results: A `Tensor` of the same shape as `values` representing the updated
 )doc");
 
 REGISTER_OP("DynamicEmbeddingLookupGrad")
-    .Input("keys: string")
+    .Input("keys: Tkeys")
     .Input("gradients: float")
     .Input("handle: resource")
     .Output("keys_gradients: float")
     .Output("dummy_variable_gradients: float")
     .Output("resource_gradients: float")
+    .Attr("Tkeys: {string, int64} = DT_STRING")
     .Doc(R"doc(
 An operation that updates the gradients of the given `keys` by calling the
 knowledge bank service and returns the fake gradients for the
 DynamicEmbeddingLookup op.
 
-keys: A string `Tensor` of shape [batch] or [batch_size,
+keys: A string or int64 `Tensor` of shape [batch] or [batch_size,
       max_sequence_length].
 gradients: A `Tensor` of shape [batch_size, embedding_dimension] or
         [batch_size, max_sequence_length, embedding_dimension].
@@ -135,6 +191,52 @@ resource_gradients: A float `Tensor` representing the fake gradient of the
                     resource input.
 )doc");
 
+REGISTER_OP("DynamicEmbeddingRaggedLookup")
+    .Input("keys: Tkeys")
+    .Input("row_splits: Tsplits")
+    .Input("grad_placeholder: float")
+    .Input("handle: resource")
+    .Output("values: float")
+    .Attr("embedding_dimension: int")
+    .Attr("Tsplits: {int32, int64} = DT_INT64")
+    .Attr("Tkeys: {string, int64} = DT_STRING")
+    .SetShapeFn([](InferenceContext* c) { return SetRaggedOutputShape(c); })
+    .Doc(R"doc(
+An operation that returns the embeddings of a ragged batch of keys. Unlike
+DynamicEmbeddingLookup on a padded 2D input, the output only holds the
+embeddings of the real keys, so its size does not depend on the longest row.
+
+keys: A string or int64 Tensor of shape [total_keys], i.e., the flat values
+      of a RaggedTensor (or the values of a SparseTensor). An empty string or
+      a negative integer would be mapped to an all zero embedding.
+row_splits: The row partition of `keys`, only used for validation. The caller
+            reassembles the ragged output from it.
+grad_placeholder: A dummy Tensor so that the gradients can be passed in.
+handle: A handle to DynamicEmbeddingManagerResource.
+values: A Tensor of shape [total_keys, embedding_dimension].
+)doc");
+
+REGISTER_OP("DynamicEmbeddingRaggedLookupGrad")
+    .Input("keys: Tkeys")
+    .Input("gradients: float")
+    .Input("handle: resource")
+    .Output("dummy_variable_gradients: float")
+    .Output("resource_gradients: float")
+    .Attr("Tkeys: {string, int64} = DT_STRING")
+    .Doc(R"doc(
+The gradient operation of DynamicEmbeddingRaggedLookup. It sends the gradients
+of the given `keys` to the knowledge bank service and returns the fake gradients
+for the non-key inputs of DynamicEmbeddingRaggedLookup.
+
+keys: A string or int64 `Tensor` of shape [total_keys].
+gradients: A `Tensor` of shape [total_keys, embedding_dimension].
+handle: A handle to DynamicEmbeddingManagerResource.
+dummy_variable_gradients: A float `Tensor` representing the fake gradient of the
+                          dummy variable input.
+resource_gradients: A float `Tensor` representing the fake gradient of the
+                    resource input.
+)doc");
+
 class DynamicEmbeddingLookupOp : public OpKernel {
  public:
   explicit DynamicEmbeddingLookupOp(OpKernelConstruction* context)
@@ -233,14 +335,10 @@ class DynamicEmbeddingUpdateOp : public OpKernel {
     OP_REQUIRES_OK(context, context->allocate_output(0, values_batch.shape(),
                                                      &output_tensor));
     *output_tensor = values_batch;
-    auto output_value = output_tensor->flat_inner_dims<float>();
-    auto keys_value = keys_batch.flat<tensorflow::tstring>();
-    for (int i = 0; i < keys_batch.NumElements(); ++i) {
-      if (keys_value(i).empty()) {
-        for (int j = 0; j < embedding_dimension; ++j) {
-          output_value(i, j) = 0.0;
-        }
-      }
+    if (keys_batch.dtype() == tensorflow::DT_INT64) {
+      ZeroPaddingRows<tensorflow::int64>(keys_batch, output_tensor);
+    } else {
+      ZeroPaddingRows<tensorflow::tstring>(keys_batch, output_tensor);
     }
   }
 };
@@ -291,4 +389,97 @@ REGISTER_KERNEL_BUILDER(
     Name("DynamicEmbeddingLookupGrad").Device(tensorflow::DEVICE_CPU),
     DynamicEmbeddingLookupGradOp);
 
+class DynamicEmbeddingRaggedLookupOp : public OpKernel {
+ public:
+  explicit DynamicEmbeddingRaggedLookupOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    DynamicEmbeddingManagerResource* resource;
+    OP_REQUIRES_OK(context, LookupResource(context, HandleFromInput(context, 3),
+                                           &resource));
+    OP_REQUIRES(context, resource->manager() != nullptr,
+                FailedPrecondition("Creating DynamicEmbeddingManager failed."));
+
+    const Tensor& keys = context->input(0);
+    OP_REQUIRES(context, keys.dims() == 1,
+                InvalidArgument("keys must be a 1D Tensor."));
+    const Tensor& row_splits = context->input(1);
+    if (row_splits.dtype() == tensorflow::DT_INT32) {
+      OP_REQUIRES_OK(context,
+                     CheckRowSplits<tensorflow::int32>(row_splits,
+                                                       keys.NumElements()));
+    } else {
+      OP_REQUIRES_OK(context,
+                     CheckRowSplits<tensorflow::int64>(row_splits,
+                                                       keys.NumElements()));
+    }
+
+    const int embedding_dimension =
+        resource->manager()->config().embedding_dimension();
+    Tensor* output_tensor = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       0, TensorShape({keys.dim_size(0), embedding_dimension}),
+                       &output_tensor));
+    // All the rows are empty.
+    if (keys.NumElements() == 0) {
+      return;
+    }
+
+    auto status =
+        resource->manager()->Lookup(keys, /*update=*/true, output_tensor);
+    OP_REQUIRES(context, status.ok(),
+                FailedPrecondition(std::string(status.message())));
+  }
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("DynamicEmbeddingRaggedLookup").Device(tensorflow::DEVICE_CPU),
+    DynamicEmbeddingRaggedLookupOp);
+
+class DynamicEmbeddingRaggedLookupGradOp : public OpKernel {
+ public:
+  explicit DynamicEmbeddingRaggedLookupGradOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    DynamicEmbeddingManagerResource* resource;
+    OP_REQUIRES_OK(context, LookupResource(context, HandleFromInput(context, 2),
+                                           &resource));
+    OP_REQUIRES(context, resource->manager() != nullptr,
+                FailedPrecondition("Creating DynamicEmbeddingManager failed."));
+
+    const Tensor& keys = context->input(0);
+    const Tensor& grad_input = context->input(1);
+    OP_REQUIRES(context, keys.dims() == 1,
+                InvalidArgument("keys must be a 1D Tensor."));
+    OP_REQUIRES(
+        context,
+        grad_input.dims() == 2 && grad_input.dim_size(0) == keys.dim_size(0),
+        InvalidArgument("gradients must be of shape [total_keys, dim]."));
+
+    if (keys.NumElements() > 0) {
+      auto status = resource->manager()->UpdateGradients(keys, grad_input);
+      OP_REQUIRES(context, status.ok(),
+                  FailedPrecondition(std::string(status.message())));
+    }
+
+    // Gradient for the dummy input, required by the TF framework.
+    Tensor* output_tensor = nullptr;
+    OP_REQUIRES_OK(
+        context, context->allocate_output(0, TensorShape({1}), &output_tensor));
+    output_tensor->scalar<float>()() = 0;
+
+    // Gradient for the resource, required by the TF framework.
+    OP_REQUIRES_OK(
+        context, context->allocate_output(1, TensorShape({1}), &output_tensor));
+    output_tensor->scalar<float>()() = 0;
+  }
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("DynamicEmbeddingRaggedLookupGrad").Device(tensorflow::DEVICE_CPU),
+    DynamicEmbeddingRaggedLookupGradOp);
+
 }  // namespace carls
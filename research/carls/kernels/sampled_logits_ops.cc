@@ -98,6 +98,46 @@ dummy_variable_gradients: gradient for the grad_placeholder.
 resource_grad: gradient for the resource input.
 )doc");
 
+REGISTER_OP("HierarchicalSoftmaxLookup")
+    .Input("positive_keys: string")
+    .Input("inputs: float")
+    .Input("max_depth: int32")
+    .Input("grad_placeholder: float")
+    .Input("handle: resource")
+    .Output("keys: string")
+    .Output("labels: float")
+    .Output("mask: float")
+    .Output("embedding: float")
+    .Doc(R"doc(
+An operation that returns the internal nodes on the paths of the positive keys
+in the tree of a hierarchical softmax.
+
+This is used in the logit layer of a neural network with many output keys, so
+that each entry only needs the logits of the O(log N) nodes on its paths. It
+can handle unseen labels and dynamically allocates new embeddings for them and
+their nodes during training. The gradients of the node embeddings are passed
+to SampledLogitsLookupGrad.
+
+positive_keys: A string Tensor of shape [d1, ..., dN, max_length]
+               where the last dimension holds positive keys with various
+               lengths.
+inputs: A float Tensor of shape [d1, ..., dN, embed_dim], where
+        where `embed_dim` must be the same as set in DynamicEmbeddingConfig.
+max_depth: An int bounding the total number of nodes on the paths of the
+           positive keys of an entry.
+grad_placeholder: A dummy Tensor so that the gradients can be passed in.
+handle: A handle to DynamicEmbeddingManagerResource.
+keys: A string Tensor of shape [d1, ..., dN, max_depth] holding the keys of the
+      nodes, padded with empty keys.
+labels: A float Tensor of shape [d1, ..., dN, max_depth] indicating if a path
+        turns to the right (1.0) or left (0.0) child of a node.
+mask: A float Tensor of shape [d1, ..., dN, max_depth] indicating if a node is
+      valid (1.0) or padding (0.0).
+embedding: A float Tensor of shape [d1, ..., dN, max_depth, embed_dim]
+           returning the embedding/weights of each node.
+           This is used in the gradient op for gradient update.
+)doc");
+
 class SampledLogitsLookupOp : public OpKernel {
  public:
   explicit SampledLogitsLookupOp(OpKernelConstruction* context)
@@ -159,6 +199,60 @@ REGISTER_KERNEL_BUILDER(
     Name("SampledLogitsLookup").Device(tensorflow::DEVICE_CPU),
     SampledLogitsLookupOp);
 
+class HierarchicalSoftmaxLookupOp : public OpKernel {
+ public:
+  explicit HierarchicalSoftmaxLookupOp(OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(OpKernelContext* context) override {
+    DynamicEmbeddingManagerResource* resource = nullptr;
+    OP_REQUIRES_OK(context, LookupResource(context, HandleFromInput(context, 4),
+                                           &resource));
+    OP_REQUIRES(context, resource->manager() != nullptr,
+                FailedPrecondition("Creating DynamicEmbeddingManager failed."));
+    const Tensor& positive_keys = context->input(0);
+    const Tensor& input = context->input(1);
+    const int max_depth = context->input(2).scalar<int>()();
+
+    std::vector<int64> dims;
+    dims.reserve(input.dims());
+    for (int d = 0; d < input.dims() - 1; ++d) {
+      dims.push_back(input.dim_size(d));
+    }
+    dims.push_back(max_depth);
+
+    Tensor* keys_output = nullptr;
+    OP_REQUIRES_OK(
+        context, context->allocate_output(0, TensorShape(dims), &keys_output));
+
+    Tensor* label_output = nullptr;
+    OP_REQUIRES_OK(
+        context, context->allocate_output(1, TensorShape(dims), &label_output));
+
+    Tensor* mask_output = nullptr;
+    OP_REQUIRES_OK(
+        context, context->allocate_output(2, TensorShape(dims), &mask_output));
+
+    dims.push_back(resource->manager()->config().embedding_dimension());
+    Tensor* output_embed = nullptr;
+    OP_REQUIRES_OK(
+        context, context->allocate_output(3, TensorShape(dims), &output_embed));
+
+    auto status = resource->manager()->HierarchicalSoftmax(
+        positive_keys, input, max_depth, /*update=*/true, keys_output,
+        label_output, mask_output, output_embed);
+    OP_REQUIRES(
+        context, status.ok(),
+        Internal(absl::StrCat(
+            "DynamicEmbeddingManager::HierarchicalSoftmax failed with error: ",
+            status.message())));
+  }
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("HierarchicalSoftmaxLookup").Device(tensorflow::DEVICE_CPU),
+    HierarchicalSoftmaxLookupOp);
+
 class SampledLogitsLookupGradOp : public OpKernel {
  public:
   explicit SampledLogitsLookupGradOp(OpKernelConstruction* context)
@@ -0,0 +1,137 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/knowledge_bank/change_notifier.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace carls {
+namespace {
+
+constexpr char kDeliveryThreadName[] = "KnowledgeBankChangeNotifier";
+
+}  // namespace
+
+ChangeNotifier::ChangeNotifier(const int max_queue_size,
+                               const int max_batch_size)
+    : max_queue_size_(max_queue_size),
+      max_batch_size_(max_batch_size),
+      delivery_thread_(kDeliveryThreadName, /*num_threads=*/1) {
+  CHECK_GT(max_queue_size_, 0);
+  CHECK_GT(max_batch_size_, 0);
+  delivery_thread_.Add([this]() { Run(); });
+}
+
+ChangeNotifier::~ChangeNotifier() {
+  {
+    absl::MutexLock l(&mu_);
+    stopped_ = true;
+    cv_.SignalAll();
+  }
+  delivery_thread_.JoinAll();
+}
+
+void ChangeNotifier::AddObserver(
+    std::shared_ptr<KnowledgeBankObserver> observer) {
+  CHECK(observer != nullptr);
+  absl::MutexLock l(&mu_);
+  observers_.push_back(std::move(observer));
+}
+
+void ChangeNotifier::RemoveObserver(const KnowledgeBankObserver* observer) {
+  {
+    absl::MutexLock l(&mu_);
+    observers_.erase(std::remove_if(observers_.begin(), observers_.end(),
+                                    [observer](const auto& o) {
+                                      return o.get() == observer;
+                                    }),
+                     observers_.end());
+  }
+  // Waits for the delivery that may still hold the observer.
+  absl::MutexLock l(&delivery_mu_);
+}
+
+bool ChangeNotifier::HasObservers() const {
+  absl::MutexLock l(&mu_);
+  return !observers_.empty();
+}
+
+void ChangeNotifier::Notify(KnowledgeBankChange change) {
+  absl::MutexLock l(&mu_);
+  while (queue_.size() >= max_queue_size_ && !stopped_) {
+    cv_.Wait(&mu_);
+  }
+  queue_.push_back(std::move(change));
+  ++num_enqueued_;
+  cv_.SignalAll();
+}
+
+void ChangeNotifier::Flush() {
+  absl::MutexLock l(&mu_);
+  const int64_t target = num_enqueued_;
+  while (num_delivered_ < target) {
+    cv_.Wait(&mu_);
+  }
+}
+
+int64_t ChangeNotifier::NumDelivered() const {
+  absl::MutexLock l(&mu_);
+  return num_delivered_;
+}
+
+void ChangeNotifier::Run() {
+  std::vector<KnowledgeBankChange> batch;
+  while (true) {
+    batch.clear();
+    {
+      absl::MutexLock l(&mu_);
+      while (queue_.empty() && !stopped_) {
+        cv_.Wait(&mu_);
+      }
+      // Pending changes are still delivered after stopped_ is set.
+      if (queue_.empty()) {
+        return;
+      }
+      const int batch_size = std::min<int>(queue_.size(), max_batch_size_);
+      batch.reserve(batch_size);
+      for (int i = 0; i < batch_size; ++i) {
+        batch.push_back(std::move(queue_.front()));
+        queue_.pop_front();
+      }
+      // Wakes up the writers waiting for room.
+      cv_.SignalAll();
+    }
+
+    {
+      absl::MutexLock delivery_lock(&delivery_mu_);
+      std::vector<std::shared_ptr<KnowledgeBankObserver>> observers;
+      {
+        absl::MutexLock l(&mu_);
+        observers = observers_;
+      }
+      for (const auto& observer : observers) {
+        observer->OnChanges(batch);
+      }
+    }
+
+    absl::MutexLock l(&mu_);
+    num_delivered_ += batch.size();
+    cv_.SignalAll();
+  }
+}
+
+}  // namespace carls
@@ -0,0 +1,120 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_KNOWLEDGE_BANK_CHANGE_NOTIFIER_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_KNOWLEDGE_BANK_CHANGE_NOTIFIER_H_
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "research/carls/base/thread_bundle.h"
+#include "research/carls/embedding.pb.h"  // proto to pb
+
+namespace carls {
+
+// A change of a single key in a KnowledgeBank.
+struct KnowledgeBankChange {
+  enum Type {
+    // A new key is added to the knowledge bank.
+    kInsert = 0,
+    // The embedding of an existing key is replaced.
+    kUpdate = 1,
+    // The key is removed from the knowledge bank.
+    kEvict = 2,
+  };
+
+  Type type;
+  std::string key;
+  // The new embedding of the key, including its version. Empty for kEvict.
+  EmbeddingVectorProto value;
+};
+
+// Interface for listening to the changes of a KnowledgeBank, e.g., for keeping
+// the index of a candidate sampler up to date incrementally.
+class KnowledgeBankObserver {
+ public:
+  virtual ~KnowledgeBankObserver() = default;
+
+  // Called from the delivery thread of the ChangeNotifier with a batch of
+  // changes in the order they were reported. Changes of the same key reported
+  // by concurrent writers may be out of order, in which case the observer can
+  // order them by value.version().
+  // It must not add or remove observers of the same notifier.
+  virtual void OnChanges(const std::vector<KnowledgeBankChange>& changes) = 0;
+};
+
+// Delivers the changes of a KnowledgeBank to its observers asynchronously.
+// Changes are buffered in a bounded queue and a single delivery thread hands
+// them out in batches of up to `max_batch_size`. When the queue is full,
+// Notify() blocks until there is room, so a slow observer slows the writers
+// down instead of missing changes. All methods are thread-safe.
+class ChangeNotifier {
+ public:
+  ChangeNotifier(int max_queue_size, int max_batch_size);
+
+  // Delivers all the pending changes and stops the delivery thread.
+  ~ChangeNotifier();
+
+  ChangeNotifier(const ChangeNotifier&) = delete;
+  ChangeNotifier& operator=(const ChangeNotifier&) = delete;
+
+  // Adds an observer. It only receives the changes reported afterwards.
+  void AddObserver(std::shared_ptr<KnowledgeBankObserver> observer);
+
+  // Removes an observer. After it returns, the observer is no longer called.
+  void RemoveObserver(const KnowledgeBankObserver* observer);
+
+  // Returns true if there is at least one observer.
+  bool HasObservers() const;
+
+  // Enqueues a change for delivery, blocking while the queue is full.
+  void Notify(KnowledgeBankChange change);
+
+  // Blocks until all the changes reported before the call are delivered.
+  void Flush();
+
+  // Returns the number of changes delivered so far.
+  int64_t NumDelivered() const;
+
+ private:
+  // Main loop of the delivery thread.
+  void Run();
+
+  const int max_queue_size_;
+  const int max_batch_size_;
+
+  mutable absl::Mutex mu_;
+  absl::CondVar cv_;
+  std::deque<KnowledgeBankChange> queue_ ABSL_GUARDED_BY(mu_);
+  std::vector<std::shared_ptr<KnowledgeBankObserver>> observers_
+      ABSL_GUARDED_BY(mu_);
+  int64_t num_enqueued_ ABSL_GUARDED_BY(mu_) = 0;
+  int64_t num_delivered_ ABSL_GUARDED_BY(mu_) = 0;
+  bool stopped_ ABSL_GUARDED_BY(mu_) = false;
+
+  // Held while calling the observers so that RemoveObserver() can wait for an
+  // ongoing delivery. Acquired before mu_.
+  absl::Mutex delivery_mu_;
+
+  // Runs the delivery thread.
+  ThreadBundle delivery_thread_;
+};
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_KNOWLEDGE_BANK_CHANGE_NOTIFIER_H_
@@ -0,0 +1,185 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/knowledge_bank/change_notifier.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "research/carls/base/thread_bundle.h"
+
+namespace carls {
+namespace {
+
+// Records all the changes and the batch sizes.
+class RecordingObserver : public KnowledgeBankObserver {
+ public:
+  void OnChanges(const std::vector<KnowledgeBankChange>& changes) override {
+    if (block_ != nullptr) {
+      block_->WaitForNotification();
+    }
+    absl::MutexLock l(&mu_);
+    batch_sizes_.push_back(changes.size());
+    for (const auto& change : changes) {
+      keys_.push_back(change.key);
+      types_.push_back(change.type);
+    }
+  }
+
+  // Blocks the delivery until `block` is notified.
+  void set_block(absl::Notification* block) { block_ = block; }
+
+  std::vector<std::string> keys() {
+    absl::MutexLock l(&mu_);
+    return keys_;
+  }
+
+  std::vector<KnowledgeBankChange::Type> types() {
+    absl::MutexLock l(&mu_);
+    return types_;
+  }
+
+  std::vector<int> batch_sizes() {
+    absl::MutexLock l(&mu_);
+    return batch_sizes_;
+  }
+
+ private:
+  absl::Notification* block_ = nullptr;
+  absl::Mutex mu_;
+  std::vector<std::string> keys_ ABSL_GUARDED_BY(mu_);
+  std::vector<KnowledgeBankChange::Type> types_ ABSL_GUARDED_BY(mu_);
+  std::vector<int> batch_sizes_ ABSL_GUARDED_BY(mu_);
+};
+
+KnowledgeBankChange MakeChange(KnowledgeBankChange::Type type,
+                               const std::string& key) {
+  KnowledgeBankChange change;
+  change.type = type;
+  change.key = key;
+  return change;
+}
+
+TEST(ChangeNotifierTest, DeliversInOrder) {
+  ChangeNotifier notifier(/*max_queue_size=*/100, /*max_batch_size=*/10);
+  EXPECT_FALSE(notifier.HasObservers());
+  auto observer = std::make_shared<RecordingObserver>();
+  notifier.AddObserver(observer);
+  EXPECT_TRUE(notifier.HasObservers());
+
+  notifier.Notify(MakeChange(KnowledgeBankChange::kInsert, "a"));
+  notifier.Notify(MakeChange(KnowledgeBankChange::kUpdate, "a"));
+  notifier.Notify(MakeChange(KnowledgeBankChange::kEvict, "a"));
+  notifier.Flush();
+  EXPECT_EQ(3, notifier.NumDelivered());
+  EXPECT_THAT(observer->keys(), ::testing::ElementsAre("a", "a", "a"));
+  EXPECT_THAT(observer->types(),
+              ::testing::ElementsAre(KnowledgeBankChange::kInsert,
+                                     KnowledgeBankChange::kUpdate,
+                                     KnowledgeBankChange::kEvict));
+}
+
+TEST(ChangeNotifierTest, BatchesPendingChanges) {
+  ChangeNotifier notifier(/*max_queue_size=*/100, /*max_batch_size=*/4);
+  absl::Notification block;
+  auto observer = std::make_shared<RecordingObserver>();
+  observer->set_block(&block);
+  notifier.AddObserver(observer);
+
+  // The first change is taken by the delivery thread, which then blocks. The
+  // rest are delivered in batches of at most 4.
+  for (int i = 0; i < 9; ++i) {
+    notifier.Notify(MakeChange(KnowledgeBankChange::kInsert, absl::StrCat(i)));
+  }
+  block.Notify();
+  notifier.Flush();
+  EXPECT_EQ(9, observer->keys().size());
+  int total = 0;
+  for (int batch_size : observer->batch_sizes()) {
+    EXPECT_LE(batch_size, 4);
+    total += batch_size;
+  }
+  EXPECT_EQ(9, total);
+  EXPECT_LT(observer->batch_sizes().size(), 9);
+}
+
+TEST(ChangeNotifierTest, BoundedQueueBlocksWriters) {
+  ChangeNotifier notifier(/*max_queue_size=*/2, /*max_batch_size=*/1);
+  absl::Notification block;
+  auto observer = std::make_shared<RecordingObserver>();
+  observer->set_block(&block);
+  notifier.AddObserver(observer);
+
+  absl::Notification writer_done;
+  ThreadBundle writer;
+  writer.Add([&notifier, &writer_done]() {
+    for (int i = 0; i < 10; ++i) {
+      notifier.Notify(
+          MakeChange(KnowledgeBankChange::kInsert, absl::StrCat(i)));
+    }
+    writer_done.Notify();
+  });
+  // At most 1 change in delivery plus 2 in the queue while blocked.
+  EXPECT_FALSE(writer_done.WaitForNotificationWithTimeout(absl::Seconds(1)));
+  EXPECT_EQ(0, notifier.NumDelivered());
+
+  block.Notify();
+  writer.JoinAll();
+  notifier.Flush();
+  EXPECT_EQ(10, notifier.NumDelivered());
+  std::vector<std::string> expected_keys;
+  for (int i = 0; i < 10; ++i) {
+    expected_keys.push_back(absl::StrCat(i));
+  }
+  EXPECT_EQ(expected_keys, observer->keys());
+}
+
+TEST(ChangeNotifierTest, RemoveObserver) {
+  ChangeNotifier notifier(/*max_queue_size=*/100, /*max_batch_size=*/10);
+  auto observer1 = std::make_shared<RecordingObserver>();
+  auto observer2 = std::make_shared<RecordingObserver>();
+  notifier.AddObserver(observer1);
+  notifier.AddObserver(observer2);
+
+  notifier.Notify(MakeChange(KnowledgeBankChange::kInsert, "a"));
+  notifier.Flush();
+  notifier.RemoveObserver(observer1.get());
+  notifier.Notify(MakeChange(KnowledgeBankChange::kInsert, "b"));
+  notifier.Flush();
+  EXPECT_THAT(observer1->keys(), ::testing::ElementsAre("a"));
+  EXPECT_THAT(observer2->keys(), ::testing::ElementsAre("a", "b"));
+
+  notifier.RemoveObserver(observer2.get());
+  EXPECT_FALSE(notifier.HasObservers());
+}
+
+TEST(ChangeNotifierTest, DestructorDeliversPendingChanges) {
+  auto observer = std::make_shared<RecordingObserver>();
+  {
+    ChangeNotifier notifier(/*max_queue_size=*/100, /*max_batch_size=*/10);
+    notifier.AddObserver(observer);
+    for (int i = 0; i < 50; ++i) {
+      notifier.Notify(
+          MakeChange(KnowledgeBankChange::kUpdate, absl::StrCat(i)));
+    }
+  }
+  EXPECT_EQ(50, observer->keys().size());
+}
+
+}  // namespace
+}  // namespace carls
@@ -0,0 +1,250 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/knowledge_bank/copy_on_write_knowledge_bank.h"
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+
+namespace carls {
+
+std::unique_ptr<CopyOnWriteKnowledgeBank> CopyOnWriteKnowledgeBank::Create(
+    std::shared_ptr<KnowledgeBank> base, const KnowledgeBankConfig& config,
+    const int embedding_dimension) {
+  if (base == nullptr) {
+    LOG(ERROR) << "Base knowledge bank is null.";
+    return nullptr;
+  }
+  if (base->embedding_dimension() != embedding_dimension) {
+    LOG(ERROR) << "Inconsistent embedding dimension with the base, expect "
+               << base->embedding_dimension() << ", got "
+               << embedding_dimension;
+    return nullptr;
+  }
+  auto fork = KnowledgeBankFactory::Make(config, embedding_dimension);
+  if (fork == nullptr) {
+    LOG(ERROR) << "Creating the knowledge bank of the fork failed.";
+    return nullptr;
+  }
+  return std::unique_ptr<CopyOnWriteKnowledgeBank>(new CopyOnWriteKnowledgeBank(
+      std::move(base), std::move(fork), config, embedding_dimension));
+}
+
+CopyOnWriteKnowledgeBank::CopyOnWriteKnowledgeBank(
+    std::shared_ptr<KnowledgeBank> base, std::unique_ptr<KnowledgeBank> fork,
+    const KnowledgeBankConfig& config, const int embedding_dimension)
+    : KnowledgeBank(config, embedding_dimension),
+      base_(std::move(base)),
+      fork_(std::move(fork)) {}
+
+absl::Status CopyOnWriteKnowledgeBank::Lookup(
+    const absl::string_view key, EmbeddingVectorProto* result) const {
+  CHECK(result != nullptr);
+  if (fork_->Lookup(key, result).ok()) {
+    return absl::OkStatus();
+  }
+  return base_->Lookup(key, result);
+}
+
+absl::Status CopyOnWriteKnowledgeBank::LookupWithUpdate(
+    const absl::string_view key, EmbeddingVectorProto* result) {
+  CHECK(result != nullptr);
+  if (!fork_->Contains(key)) {
+    if (base_->Lookup(key, result).ok()) {
+      return absl::OkStatus();
+    }
+    auto status = fork_->LookupWithUpdate(key, result);
+    if (status.ok()) {
+      NotifyChange(KnowledgeBankChange::kInsert, key, *result);
+    }
+    return status;
+  }
+  auto status = fork_->LookupWithUpdate(key, result);
+  if (status.ok()) {
+    NotifyChange(KnowledgeBankChange::kUpdate, key, *result);
+  }
+  return status;
+}
+
+void CopyOnWriteKnowledgeBank::BatchLookup(
+    const std::vector<absl::string_view>& keys,
+    std::vector<absl::variant<EmbeddingVectorProto, std::string>>*
+        value_or_errors) const {
+  CHECK(value_or_errors != nullptr);
+  if (keys.empty()) {
+    return;
+  }
+  fork_->BatchLookup(keys, value_or_errors);
+  std::vector<absl::string_view> shared_keys;
+  std::vector<size_t> shared_indices;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (!absl::holds_alternative<EmbeddingVectorProto>((*value_or_errors)[i])) {
+      shared_keys.push_back(keys[i]);
+      shared_indices.push_back(i);
+    }
+  }
+  if (shared_keys.empty()) {
+    return;
+  }
+  std::vector<absl::variant<EmbeddingVectorProto, std::string>> shared_values;
+  base_->BatchLookup(shared_keys, &shared_values);
+  for (size_t i = 0; i < shared_keys.size(); ++i) {
+    (*value_or_errors)[shared_indices[i]] = std::move(shared_values[i]);
+  }
+}
+
+absl::Status CopyOnWriteKnowledgeBank::Update(
+    const absl::string_view key, const EmbeddingVectorProto& value) {
+  const bool inserted = !Contains(key);
+  auto status = CopyRowIfNecessary(key);
+  if (!status.ok()) {
+    return status;
+  }
+  status = fork_->Update(key, value);
+  if (status.ok()) {
+    NotifyForkChange(
+        inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+        key);
+  }
+  return status;
+}
+
+absl::Status CopyOnWriteKnowledgeBank::UpdateIfVersionMatches(
+    const absl::string_view key, int64_t expected_version,
+    const EmbeddingVectorProto& value, EmbeddingVectorProto* current) {
+  CHECK(current != nullptr);
+  const bool inserted = !Contains(key);
+  auto status = CopyRowIfNecessary(key);
+  if (!status.ok()) {
+    return status;
+  }
+  status = fork_->UpdateIfVersionMatches(key, expected_version, value, current);
+  if (status.ok()) {
+    NotifyChange(
+        inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+        key, *current);
+  }
+  return status;
+}
+
+absl::Status CopyOnWriteKnowledgeBank::Restore(
+    const absl::string_view key, const EmbeddingVectorProto& value) {
+  const bool inserted = !Contains(key);
+  auto status = fork_->Restore(key, value);
+  if (status.ok()) {
+    NotifyChange(
+        inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+        key, value);
+  }
+  return status;
+}
+
+size_t CopyOnWriteKnowledgeBank::Size() const {
+  size_t size = base_->Size();
+  for (const auto& key : fork_->Keys()) {
+    if (!base_->Contains(key)) {
+      ++size;
+    }
+  }
+  return size;
+}
+
+std::vector<absl::string_view> CopyOnWriteKnowledgeBank::Keys() const {
+  std::vector<absl::string_view> keys = fork_->Keys();
+  for (const auto& key : base_->Keys()) {
+    if (!fork_->Contains(key)) {
+      keys.push_back(key);
+    }
+  }
+  return keys;
+}
+
+bool CopyOnWriteKnowledgeBank::Contains(absl::string_view key) const {
+  return fork_->Contains(key) || base_->Contains(key);
+}
+
+absl::Status CopyOnWriteKnowledgeBank::ExportInternal(
+    const std::string& dir, std::string* exported_path) {
+  // Writes the rows of the fork overlaid on the rows of the base through the
+  // fork's checkpoint format, without copying the base rows into the fork.
+  const std::vector<absl::string_view> fork_keys = fork_->Keys();
+  const std::vector<absl::string_view> base_keys = base_->Keys();
+  size_t fork_index = 0;
+  size_t base_index = 0;
+  return fork_->ExportRows(
+      dir,
+      [this, &fork_keys, &base_keys, &fork_index, &base_index](
+          std::string* key, EmbeddingVectorProto* value) {
+        while (fork_index < fork_keys.size()) {
+          *key = std::string(fork_keys[fork_index++]);
+          if (fork_->Lookup(*key, value).ok()) {
+            TransformExportedRow(value);
+            return true;
+          }
+        }
+        while (base_index < base_keys.size()) {
+          *key = std::string(base_keys[base_index++]);
+          if (!fork_->Contains(*key) && base_->Lookup(*key, value).ok()) {
+            TransformExportedRow(value);
+            return true;
+          }
+        }
+        return false;
+      },
+      exported_path);
+}
+
+absl::Status CopyOnWriteKnowledgeBank::ImportInternal(
+    const std::string& saved_path) {
+  return absl::UnimplementedError(
+      "Import is not supported by a copy-on-write fork, import into a new "
+      "knowledge bank instead.");
+}
+
+absl::Status CopyOnWriteKnowledgeBank::CopyRowIfNecessary(
+    absl::string_view key) {
+  if (fork_->Contains(key)) {
+    return absl::OkStatus();
+  }
+  absl::MutexLock l(&copy_mu_);
+  if (fork_->Contains(key)) {
+    return absl::OkStatus();
+  }
+  EmbeddingVectorProto value;
+  if (!base_->Lookup(key, &value).ok()) {
+    return absl::OkStatus();
+  }
+  auto status = fork_->Restore(key, value);
+  if (!status.ok()) {
+    return absl::Status(
+        status.code(),
+        absl::StrCat("Copying the row of ", key,
+                     " from the base failed: ", status.message()));
+  }
+  return absl::OkStatus();
+}
+
+void CopyOnWriteKnowledgeBank::NotifyForkChange(KnowledgeBankChange::Type type,
+                                                absl::string_view key) {
+  if (!HasObservers()) {
+    return;
+  }
+  EmbeddingVectorProto value;
+  if (fork_->Lookup(key, &value).ok()) {
+    NotifyChange(type, key, value);
+  }
+}
+
+}  // namespace carls
@@ -0,0 +1,123 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_KNOWLEDGE_BANK_COPY_ON_WRITE_KNOWLEDGE_BANK_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_KNOWLEDGE_BANK_COPY_ON_WRITE_KNOWLEDGE_BANK_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "research/carls/embedding.pb.h"  // proto to pb
+#include "research/carls/knowledge_bank/knowledge_bank.h"
+#include "research/carls/knowledge_bank/knowledge_bank_config.pb.h"  // proto to pb
+
+namespace carls {
+
+// A fork of a base KnowledgeBank that shares its rows until they are written.
+// Reads of a row the fork has not written go through to the base, so they see
+// the later updates of the base as well. The first write of a row copies it
+// from the base into the fork's own knowledge bank, so its version continues
+// from the base, and the base is never written. Keys added by the fork are
+// created from the fork's own config.
+//
+// Export() writes a standalone checkpoint of all the rows seen by the fork in
+// the format of the fork's own knowledge bank, which must support
+// ExportRows(). The rows still shared with the base are written from the base
+// and stay shared. Import() is not supported since the base rows missing from
+// a checkpoint would still be visible.
+class CopyOnWriteKnowledgeBank : public KnowledgeBank {
+ public:
+  // Returns nullptr if `base` is null, the embedding dimensions differ, or the
+  // knowledge bank of the fork cannot be created from `config`.
+  static std::unique_ptr<CopyOnWriteKnowledgeBank> Create(
+      std::shared_ptr<KnowledgeBank> base, const KnowledgeBankConfig& config,
+      int embedding_dimension);
+
+  // Implementation of the Lookup interface.
+  absl::Status Lookup(const absl::string_view key,
+                      EmbeddingVectorProto* result) const override;
+
+  // Looks up the rows of the base without updating them, while the rows of
+  // the fork and the new keys are looked up with update by the fork.
+  absl::Status LookupWithUpdate(const absl::string_view key,
+                                EmbeddingVectorProto* result) override;
+
+  // Looks up all the keys in the fork, then the missing ones in the base.
+  void BatchLookup(const std::vector<absl::string_view>& keys,
+                   std::vector<absl::variant<EmbeddingVectorProto, std::string>>*
+                       value_or_errors) const override;
+
+  // Implementation of the Update interface.
+  absl::Status Update(const absl::string_view key,
+                      const EmbeddingVectorProto& value) override;
+
+  // Implementation of the UpdateIfVersionMatches interface.
+  absl::Status UpdateIfVersionMatches(const absl::string_view key,
+                                      int64_t expected_version,
+                                      const EmbeddingVectorProto& value,
+                                      EmbeddingVectorProto* current) override;
+
+  // Implementation of the Restore interface.
+  absl::Status Restore(const absl::string_view key,
+                       const EmbeddingVectorProto& value) override;
+
+  // Returns the number of keys in the base or the fork.
+  size_t Size() const override;
+
+  // Returns the keys in the base or the fork.
+  std::vector<absl::string_view> Keys() const override;
+
+  // Implementation of the Contains interface.
+  bool Contains(absl::string_view key) const override;
+
+  // Returns the number of rows owned by the fork, i.e., written or added by
+  // it, as opposed to the rows shared with the base.
+  size_t NumOwnedRows() const { return fork_->Size(); }
+
+ private:
+  CopyOnWriteKnowledgeBank(std::shared_ptr<KnowledgeBank> base,
+                           std::unique_ptr<KnowledgeBank> fork,
+                           const KnowledgeBankConfig& config,
+                           int embedding_dimension);
+
+  // Implementation of the ExportInternal interface.
+  absl::Status ExportInternal(const std::string& dir,
+                              std::string* exported_path) override;
+
+  // Implementation of the ImportInternal interface.
+  absl::Status ImportInternal(const std::string& saved_path) override;
+
+  // Copies the row of `key` from the base into the fork before it is first
+  // written, unless the fork already has it or the base does not.
+  absl::Status CopyRowIfNecessary(absl::string_view key);
+
+  // Reports the current value of `key` in the fork to the observers.
+  void NotifyForkChange(KnowledgeBankChange::Type type, absl::string_view key);
+
+  const std::shared_ptr<KnowledgeBank> base_;
+  const std::unique_ptr<KnowledgeBank> fork_;
+
+  // Serializes copying the rows from the base, so that concurrent first
+  // writes of the same key do not copy it twice.
+  absl::Mutex copy_mu_;
+};
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_KNOWLEDGE_BANK_COPY_ON_WRITE_KNOWLEDGE_BANK_H_
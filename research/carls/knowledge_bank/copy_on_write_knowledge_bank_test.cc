@@ -0,0 +1,193 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/knowledge_bank/copy_on_write_knowledge_bank.h"
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "research/carls/knowledge_bank/initializer.pb.h"  // proto to pb
+#include "research/carls/knowledge_bank/knowledge_bank.h"
+#include "research/carls/testing/test_helper.h"
+
+namespace carls {
+
+using ::testing::TempDir;
+using ::testing::UnorderedElementsAre;
+
+class CopyOnWriteKnowledgeBankTest : public ::testing::Test {
+ protected:
+  CopyOnWriteKnowledgeBankTest() {
+    base_ = CreateInProtoBank(/*init_value=*/0);
+    EXPECT_OK(base_->Update("key1",
+                            ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+                              value: 1 value: 1
+                            )pb")));
+    EXPECT_OK(base_->Update("key2",
+                            ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+                              value: 2 value: 2
+                            )pb")));
+  }
+
+  // Returns the config of an InProtoKnowledgeBank of dimension 2, whose new
+  // embeddings are [init_value, init_value].
+  KnowledgeBankConfig InProtoConfig(float init_value) {
+    KnowledgeBankConfig config;
+    auto* default_embedding =
+        config.mutable_initializer()->mutable_default_embedding();
+    default_embedding->add_value(init_value);
+    default_embedding->add_value(init_value);
+    InProtoKnowledgeBankConfig in_proto_config;
+    config.mutable_extension()->PackFrom(in_proto_config);
+    return config;
+  }
+
+  std::shared_ptr<KnowledgeBank> CreateInProtoBank(float init_value) {
+    return KnowledgeBankFactory::Make(InProtoConfig(init_value),
+                                      /*embedding_dimension=*/2);
+  }
+
+  std::shared_ptr<KnowledgeBank> base_;
+};
+
+TEST_F(CopyOnWriteKnowledgeBankTest, Create) {
+  EXPECT_EQ(nullptr,
+            CopyOnWriteKnowledgeBank::Create(nullptr, InProtoConfig(0), 2));
+  EXPECT_EQ(nullptr,
+            CopyOnWriteKnowledgeBank::Create(base_, InProtoConfig(0), 3));
+  EXPECT_EQ(nullptr, CopyOnWriteKnowledgeBank::Create(
+                         base_, KnowledgeBankConfig(), 2));
+  EXPECT_NE(nullptr,
+            CopyOnWriteKnowledgeBank::Create(base_, InProtoConfig(0), 2));
+}
+
+TEST_F(CopyOnWriteKnowledgeBankTest, SharesRowsUntilWritten) {
+  auto fork = CopyOnWriteKnowledgeBank::Create(base_, InProtoConfig(5), 2);
+  ASSERT_NE(nullptr, fork);
+  EXPECT_EQ(2, fork->Size());
+  EXPECT_EQ(0, fork->NumOwnedRows());
+
+  // Reads go through to the base.
+  EmbeddingVectorProto embed;
+  ASSERT_OK(fork->Lookup("key1", &embed));
+  EXPECT_THAT(embed, EqualsProto<EmbeddingVectorProto>(R"pb(
+                value: 1 value: 1 version: 1
+              )pb"));
+  ASSERT_OK(fork->LookupWithUpdate("key2", &embed));
+  EXPECT_EQ(0, fork->NumOwnedRows());
+
+  // The first write copies the row, so its version continues from the base.
+  ASSERT_OK(fork->Update("key1", ParseTextProtoOrDie<EmbeddingVectorProto>(
+                                     R"pb(
+                                       value: 10 value: 10
+                                     )pb")));
+  EXPECT_EQ(1, fork->NumOwnedRows());
+  ASSERT_OK(fork->Lookup("key1", &embed));
+  EXPECT_THAT(embed, EqualsProto<EmbeddingVectorProto>(R"pb(
+                value: 10 value: 10 version: 2
+              )pb"));
+  ASSERT_OK(base_->Lookup("key1", &embed));
+  EXPECT_THAT(embed, EqualsProto<EmbeddingVectorProto>(R"pb(
+                value: 1 value: 1 version: 1
+              )pb"));
+
+  // New keys are created by the fork from its own initializer.
+  ASSERT_OK(fork->LookupWithUpdate("key3", &embed));
+  EXPECT_THAT(embed, EqualsProto<EmbeddingVectorProto>(R"pb(
+                tag: "key3" value: 5 value: 5 weight: 1
+              )pb"));
+  EXPECT_FALSE(base_->Contains("key3"));
+  EXPECT_TRUE(fork->Contains("key3"));
+  EXPECT_EQ(3, fork->Size());
+  EXPECT_EQ(2, fork->NumOwnedRows());
+  EXPECT_THAT(fork->Keys(), UnorderedElementsAre("key1", "key2", "key3"));
+
+  // Unwritten rows see the later updates of the base.
+  ASSERT_OK(base_->Update("key2", ParseTextProtoOrDie<EmbeddingVectorProto>(
+                                      R"pb(
+                                        value: 20 value: 20
+                                      )pb")));
+  std::vector<absl::variant<EmbeddingVectorProto, std::string>> value_or_errors;
+  fork->BatchLookup({"key1", "key2", "key3", "key4"}, &value_or_errors);
+  ASSERT_EQ(4, value_or_errors.size());
+  EXPECT_EQ(10, absl::get<EmbeddingVectorProto>(value_or_errors[0]).value(0));
+  EXPECT_EQ(20, absl::get<EmbeddingVectorProto>(value_or_errors[1]).value(0));
+  EXPECT_EQ(5, absl::get<EmbeddingVectorProto>(value_or_errors[2]).value(0));
+  EXPECT_TRUE(absl::holds_alternative<std::string>(value_or_errors[3]));
+}
+
+TEST_F(CopyOnWriteKnowledgeBankTest, UpdateIfVersionMatches) {
+  auto fork = CopyOnWriteKnowledgeBank::Create(base_, InProtoConfig(0), 2);
+  ASSERT_NE(nullptr, fork);
+  EmbeddingVectorProto current;
+  const auto value = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    value: 3 value: 3
+  )pb");
+  EXPECT_EQ(absl::StatusCode::kAborted,
+            fork->UpdateIfVersionMatches("key1", /*expected_version=*/0, value,
+                                         &current)
+                .code());
+  EXPECT_EQ(1, current.version());
+  ASSERT_OK(fork->UpdateIfVersionMatches("key1", /*expected_version=*/1, value,
+                                         &current));
+  EXPECT_EQ(2, current.version());
+  ASSERT_OK(base_->Lookup("key1", &current));
+  EXPECT_EQ(1, current.version());
+}
+
+TEST_F(CopyOnWriteKnowledgeBankTest, ExportStandaloneCheckpoint) {
+  auto fork = CopyOnWriteKnowledgeBank::Create(base_, InProtoConfig(0), 2);
+  ASSERT_NE(nullptr, fork);
+  ASSERT_OK(fork->Update("key1", ParseTextProtoOrDie<EmbeddingVectorProto>(
+                                     R"pb(
+                                       value: 10 value: 10
+                                     )pb")));
+  std::string checkpoint;
+  ASSERT_OK(fork->Export(TempDir(), "cow_fork", &checkpoint));
+  // The rows shared with the base are not copied into the fork.
+  EXPECT_EQ(1, fork->NumOwnedRows());
+
+  // The checkpoint contains all the rows and can be imported without the base.
+  auto restored = CreateInProtoBank(/*init_value=*/0);
+  ASSERT_OK(restored->Import(checkpoint));
+  EXPECT_THAT(restored->Keys(), UnorderedElementsAre("key1", "key2"));
+  EmbeddingVectorProto embed;
+  ASSERT_OK(restored->Lookup("key1", &embed));
+  EXPECT_EQ(10, embed.value(0));
+  ASSERT_OK(restored->Lookup("key2", &embed));
+  EXPECT_EQ(2, embed.value(0));
+
+  // Import is not supported by the fork.
+  EXPECT_EQ(absl::StatusCode::kUnimplemented,
+            fork->Import(checkpoint).code());
+
+  // A transform is applied to the exported rows, not to the rows of the fork
+  // or the base.
+  ASSERT_OK(fork->Export(TempDir(), "cow_fork", &checkpoint,
+                         [](EmbeddingVectorProto* value) {
+                           value->set_value(0, value->value(0) + 1);
+                         }));
+  EXPECT_EQ(1, fork->NumOwnedRows());
+  ASSERT_OK(restored->Import(checkpoint));
+  ASSERT_OK(restored->Lookup("key1", &embed));
+  EXPECT_EQ(11, embed.value(0));
+  ASSERT_OK(restored->Lookup("key2", &embed));
+  EXPECT_EQ(3, embed.value(0));
+  ASSERT_OK(fork->Lookup("key2", &embed));
+  EXPECT_EQ(2, embed.value(0));
+}
+
+}  // namespace carls
@@ -13,11 +13,20 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_set.h"
 #include "absl/status/status.h"
 #include "absl/strings/string_view.h"
+#include "absl/strings/match.h"
 #include "absl/synchronization/mutex.h"
+#include "research/carls/base/compressed_block_file.h"
 #include "research/carls/base/file_helper.h"
+#include "research/carls/base/prefetching_hash_index.h"
 #include "research/carls/base/proto_helper.h"
+#include "research/carls/base/status_helper.h"
 #include "research/carls/knowledge_bank/initializer_helper.h"
 #include "research/carls/knowledge_bank/knowledge_bank.h"
 
@@ -25,6 +34,18 @@ namespace carls {
 namespace {
 
 constexpr char kDataOutput[] = "in_proto_embedding_data.pbbin";
+constexpr char kBlockDataOutput[] = "in_proto_embedding_data.blk";
+// Number of rows copied at a time by ExportInternal().
+constexpr size_t kExportBatchSize = 1024;
+
+// Prefetches the cache lines of the embedding row of `embedding`.
+void PrefetchEmbedding(const EmbeddingVectorProto& embedding) {
+  const char* begin = reinterpret_cast<const char*>(embedding.value().data());
+  const char* end = begin + embedding.value_size() * sizeof(float);
+  for (const char* line = begin; line < end; line += 64) {
+    PrefetchForRead(line);
+  }
+}
 
 }  // namespace
 
@@ -33,7 +54,15 @@ constexpr char kDataOutput[] = "in_proto_embedding_data.pbbin";
 class InProtoKnowledgeBank : public KnowledgeBank {
  public:
   InProtoKnowledgeBank(const KnowledgeBankConfig& config, int dimension)
-      : KnowledgeBank(config, dimension) {}
+      : KnowledgeBank(config, dimension),
+        has_checkpoint_file_options_(
+            GetExtensionProtoOrDie<KnowledgeBankConfig,
+                                   InProtoKnowledgeBankConfig>(config)
+                .has_checkpoint_file_options()),
+        checkpoint_file_options_(
+            GetExtensionProtoOrDie<KnowledgeBankConfig,
+                                   InProtoKnowledgeBankConfig>(config)
+                .checkpoint_file_options()) {}
 
  private:
   // Implementation of the Lookup interface.
@@ -44,17 +73,50 @@ class InProtoKnowledgeBank : public KnowledgeBank {
   absl::Status LookupWithUpdate(const absl::string_view key,
                                 EmbeddingVectorProto* result) override;
 
+  // Looks up the keys in groups with prefetching, see PrefetchingHashIndex.
+  void BatchLookup(const std::vector<absl::string_view>& keys,
+                   std::vector<absl::variant<EmbeddingVectorProto, std::string>>*
+                       value_or_errors) const override;
+
+  // Looks up the existing keys as BatchLookup() does, then inserts the new
+  // keys one by one.
+  void BatchLookupWithUpdate(
+      const std::vector<absl::string_view>& keys,
+      std::vector<absl::variant<EmbeddingVectorProto, std::string>>*
+          value_or_errors) override;
+
   // Updates the embedding of a single key.
   absl::Status Update(const absl::string_view key,
                       const EmbeddingVectorProto& value) override;
 
+  // Atomic implementation of the UpdateIfVersionMatches interface.
+  absl::Status UpdateIfVersionMatches(const absl::string_view key,
+                                      int64_t expected_version,
+                                      const EmbeddingVectorProto& value,
+                                      EmbeddingVectorProto* current) override;
+
+  // Implementation of the Restore interface.
+  absl::Status Restore(const absl::string_view key,
+                       const EmbeddingVectorProto& value) override;
+
+  // Implementation of the Remove interface.
+  absl::Status Remove(const std::vector<absl::string_view>& keys) override;
+
   // Implementation of the ExportInternal interface.
   absl::Status ExportInternal(const std::string& dir,
                               std::string* exported_path) override;
 
   // Implementation of the ImportInternal interface.
+  // All the rows are loaded before it returns. There is no warm start as in
+  // LeveldbKnowledgeBankConfig, since a row missing from memory cannot be read
+  // from the checkpoint on demand, and LookupWithUpdate() would replace it
+  // with a new embedding before it is loaded.
   absl::Status ImportInternal(const std::string& saved_path) override;
 
+  // Implementation of the ExportRows interface.
+  absl::Status ExportRows(const std::string& dir, const RowReader& next_row,
+                          std::string* exported_path) override;
+
   // Returns the size of the current embedding data.
   size_t Size() const override;
 
@@ -68,10 +130,43 @@ class InProtoKnowledgeBank : public KnowledgeBank {
         std::string(key));
   }
 
+  // Writes the rows from `next_row` as a compressed block file, one entry of
+  // the embedding table per record.
+  absl::Status ExportBlockFile(const std::string& filepath,
+                               const RowReader& next_row);
+
+  // Copies the rows of keys_[begin, end) into `rows` and returns the index
+  // after the last copied key, which is smaller than `end` if the keys have
+  // been replaced by Import().
+  size_t CopyRows(size_t begin, size_t end,
+                  std::vector<std::pair<std::string, EmbeddingVectorProto>>*
+                      rows) const ABSL_LOCKS_EXCLUDED(mu_);
+
+  // Reads the embedding data from a compressed block file in parallel.
+  absl::Status ImportBlockFile(const std::string& filepath);
+
+  // Records a key newly inserted into the embedding table, `key` and `value`
+  // are the entry in the table.
+  void AddKey(const std::string& key, EmbeddingVectorProto* value)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    keys_.push_back(key);
+    index_.Insert(key, value);
+  }
+
+  const bool has_checkpoint_file_options_;
+  const CompressedBlockFileOptions checkpoint_file_options_;
+
+  // Serializes Remove() with ExportInternal(), which reads keys_ by position.
+  absl::Mutex remove_mu_ ABSL_ACQUIRED_BEFORE(mu_);
+
   mutable absl::Mutex mu_;
   InProtoKnowledgeBankConfig in_proto_config_ ABSL_GUARDED_BY(mu_);
 
   std::vector<absl::string_view> keys_ ABSL_GUARDED_BY(mu_);
+
+  // Indexes the entries of the embedding table for batched lookups, the
+  // entries of a protobuf Map are pointer stable.
+  PrefetchingHashIndex<EmbeddingVectorProto> index_ ABSL_GUARDED_BY(mu_);
 };
 
 REGISTER_KNOWLEDGE_BANK_FACTORY(
@@ -107,50 +202,377 @@ absl::Status InProtoKnowledgeBank::Lookup(const absl::string_view key,
 
 absl::Status InProtoKnowledgeBank::LookupWithUpdate(
     const absl::string_view key, EmbeddingVectorProto* result) {
-  absl::WriterMutexLock l(&mu_);
-  auto* embedding_table =
-      in_proto_config_.mutable_embedding_data()->mutable_embedding_table();
-  std::string key_str(key);
-  if (!embedding_table->contains(key_str)) {
-    // Insert a new embedding.
-    EmbeddingVectorProto embed =
-        InitializeEmbedding(embedding_dimension(), config().initializer());
-    embed.set_tag(key_str);
-    (*embedding_table)[key_str] = std::move(embed);
-    keys_.push_back(embedding_table->find(key_str)->first);
-  }
-  auto& value = (*embedding_table)[key_str];
-  // Incement frequency by one for each lookup with update.
-  value.set_weight(value.weight() + 1);
-  *result = value;
+  bool inserted = false;
+  {
+    absl::WriterMutexLock l(&mu_);
+    auto* embedding_table =
+        in_proto_config_.mutable_embedding_data()->mutable_embedding_table();
+    std::string key_str(key);
+    if (!embedding_table->contains(key_str)) {
+      // Insert a new embedding.
+      EmbeddingVectorProto embed =
+          InitializeEmbedding(embedding_dimension(), config().initializer());
+      embed.set_tag(key_str);
+      auto iter =
+          embedding_table->insert({key_str, std::move(embed)}).first;
+      AddKey(iter->first, &iter->second);
+      inserted = true;
+    }
+    auto& value = (*embedding_table)[key_str];
+    // Incement frequency by one for each lookup with update.
+    value.set_weight(value.weight() + 1);
+    *result = value;
+  }
+  NotifyChange(
+      inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+      key, *result);
   return absl::OkStatus();
 }
 
+void InProtoKnowledgeBank::BatchLookup(
+    const std::vector<absl::string_view>& keys,
+    std::vector<absl::variant<EmbeddingVectorProto, std::string>>*
+        value_or_errors) const {
+  CHECK(value_or_errors != nullptr);
+  if (keys.empty()) {
+    return;
+  }
+  value_or_errors->clear();
+  value_or_errors->reserve(keys.size());
+  absl::ReaderMutexLock l(&mu_);
+  index_.BatchFind(keys, PrefetchEmbedding,
+                   [&keys, value_or_errors](size_t i,
+                                            const EmbeddingVectorProto* value) {
+                     if (value == nullptr) {
+                       value_or_errors->push_back(
+                           absl::StrCat("Key is not found: ", keys[i]));
+                     } else {
+                       value_or_errors->push_back(*value);
+                     }
+                   });
+}
+
+void InProtoKnowledgeBank::BatchLookupWithUpdate(
+    const std::vector<absl::string_view>& keys,
+    std::vector<absl::variant<EmbeddingVectorProto, std::string>>*
+        value_or_errors) {
+  CHECK(value_or_errors != nullptr);
+  if (keys.empty()) {
+    return;
+  }
+  value_or_errors->clear();
+  value_or_errors->reserve(keys.size());
+  std::vector<size_t> new_keys;
+  {
+    absl::WriterMutexLock l(&mu_);
+    index_.BatchFind(
+        keys, PrefetchEmbedding,
+        [value_or_errors, &new_keys](size_t i, EmbeddingVectorProto* value) {
+          if (value == nullptr) {
+            new_keys.push_back(i);
+            value_or_errors->push_back(EmbeddingVectorProto());
+            return;
+          }
+          // Incement frequency by one for each lookup with update.
+          value->set_weight(value->weight() + 1);
+          value_or_errors->push_back(*value);
+        });
+  }
+  if (HasObservers()) {
+    // Reports the weight increments of the existing keys, new_keys is sorted.
+    auto new_key = new_keys.begin();
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (new_key != new_keys.end() && *new_key == i) {
+        ++new_key;
+        continue;
+      }
+      NotifyChange(KnowledgeBankChange::kUpdate, keys[i],
+                   absl::get<EmbeddingVectorProto>((*value_or_errors)[i]));
+    }
+  }
+  // A new key may appear more than once, LookupWithUpdate() inserts it only
+  // the first time.
+  for (size_t i : new_keys) {
+    EmbeddingVectorProto result;
+    const auto status = LookupWithUpdate(keys[i], &result);
+    if (!status.ok()) {
+      (*value_or_errors)[i] = std::string(status.message());
+    } else {
+      (*value_or_errors)[i] = std::move(result);
+    }
+  }
+}
+
 absl::Status InProtoKnowledgeBank::Update(const absl::string_view key,
                                           const EmbeddingVectorProto& value) {
-  absl::WriterMutexLock l(&mu_);
-  auto* embedding_table =
-      in_proto_config_.mutable_embedding_data()->mutable_embedding_table();
-  std::string key_str(key);
-  if (!embedding_table->contains(key_str)) {
-    (*embedding_table)[key_str] = value;
-    keys_.push_back(embedding_table->find(key_str)->first);
-  } else {
+  const bool observed = HasObservers();
+  EmbeddingVectorProto updated;
+  bool inserted = false;
+  {
+    absl::WriterMutexLock l(&mu_);
+    auto* embedding_table =
+        in_proto_config_.mutable_embedding_data()->mutable_embedding_table();
+    std::string key_str(key);
+    inserted = !embedding_table->contains(key_str);
+    auto& embedding = (*embedding_table)[key_str];
+    const int64_t version = embedding.version();
+    embedding = value;
+    embedding.set_version(version + 1);
+    if (inserted) {
+      auto iter = embedding_table->find(key_str);
+      AddKey(iter->first, &iter->second);
+    }
+    if (observed) {
+      updated = embedding;
+    }
+  }
+  if (observed) {
+    NotifyChange(
+        inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+        key, updated);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status InProtoKnowledgeBank::UpdateIfVersionMatches(
+    const absl::string_view key, int64_t expected_version,
+    const EmbeddingVectorProto& value, EmbeddingVectorProto* current) {
+  CHECK(current != nullptr);
+  bool inserted = false;
+  {
+    absl::WriterMutexLock l(&mu_);
+    auto* embedding_table =
+        in_proto_config_.mutable_embedding_data()->mutable_embedding_table();
+    std::string key_str(key);
+    auto iter = embedding_table->find(key_str);
+    const int64_t version =
+        iter == embedding_table->end() ? 0 : iter->second.version();
+    if (version != expected_version) {
+      if (iter == embedding_table->end()) {
+        current->Clear();
+      } else {
+        *current = iter->second;
+      }
+      return absl::AbortedError(
+          absl::StrCat("Version mismatch for key ", key, ": expected ",
+                       expected_version, ", found ", version));
+    }
+    if (iter == embedding_table->end()) {
+      iter = embedding_table->insert({key_str, EmbeddingVectorProto()}).first;
+      AddKey(iter->first, &iter->second);
+      inserted = true;
+    }
+    iter->second = value;
+    iter->second.set_version(version + 1);
+    *current = iter->second;
+  }
+  NotifyChange(
+      inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+      key, *current);
+  return absl::OkStatus();
+}
+
+absl::Status InProtoKnowledgeBank::Restore(const absl::string_view key,
+                                           const EmbeddingVectorProto& value) {
+  bool inserted = false;
+  {
+    absl::WriterMutexLock l(&mu_);
+    auto* embedding_table =
+        in_proto_config_.mutable_embedding_data()->mutable_embedding_table();
+    std::string key_str(key);
+    inserted = !embedding_table->contains(key_str);
     (*embedding_table)[key_str] = value;
+    if (inserted) {
+      auto iter = embedding_table->find(key_str);
+      AddKey(iter->first, &iter->second);
+    }
+  }
+  NotifyChange(
+      inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+      key, value);
+  return absl::OkStatus();
+}
+
+absl::Status InProtoKnowledgeBank::Remove(
+    const std::vector<absl::string_view>& keys) {
+  absl::MutexLock remove_lock(&remove_mu_);
+  std::vector<std::string> removed_keys;
+  {
+    absl::WriterMutexLock l(&mu_);
+    auto* embedding_table =
+        in_proto_config_.mutable_embedding_data()->mutable_embedding_table();
+    absl::flat_hash_set<std::string> removed;
+    for (const auto& key : keys) {
+      std::string key_str(key);
+      if (embedding_table->contains(key_str)) {
+        removed.insert(std::move(key_str));
+      }
+    }
+    if (removed.empty()) {
+      return absl::OkStatus();
+    }
+    keys_.erase(std::remove_if(keys_.begin(), keys_.end(),
+                               [&removed](absl::string_view key) {
+                                 return removed.contains(key);
+                               }),
+                keys_.end());
+    for (const auto& key : removed) {
+      embedding_table->erase(key);
+    }
+    // The index cannot erase keys, it is rebuilt from the remaining ones.
+    index_.Clear();
+    for (const auto& key : keys_) {
+      auto iter = embedding_table->find(std::string(key));
+      index_.Insert(iter->first, &iter->second);
+    }
+    removed_keys.assign(removed.begin(), removed.end());
+  }
+  for (const auto& key : removed_keys) {
+    NotifyChange(KnowledgeBankChange::kEvict, key, EmbeddingVectorProto());
   }
   return absl::OkStatus();
 }
 
 absl::Status InProtoKnowledgeBank::ExportInternal(const std::string& dir,
                                                   std::string* exported_path) {
-  *exported_path = JoinPath(dir, kDataOutput);
+  // The rows are copied in batches in the insertion order of the keys, and
+  // written without holding the lock, so that the updates are not blocked by
+  // the writes of the checkpoint, which may be rate limited. The keys inserted
+  // after the export starts are not exported.
+  absl::MutexLock remove_lock(&remove_mu_);
+  size_t num_keys = 0;
+  {
+    absl::ReaderMutexLock l(&mu_);
+    num_keys = keys_.size();
+  }
+  std::vector<std::pair<std::string, EmbeddingVectorProto>> batch;
+  size_t begin = 0;
+  size_t batch_index = 0;
+  return ExportRows(
+      dir,
+      [this, num_keys, &batch, &begin, &batch_index](
+          std::string* key, EmbeddingVectorProto* value) {
+        if (batch_index == batch.size()) {
+          batch_index = 0;
+          begin = CopyRows(begin, std::min(num_keys, begin + kExportBatchSize),
+                           &batch);
+          if (batch.empty()) {
+            return false;
+          }
+        }
+        *key = std::move(batch[batch_index].first);
+        *value = std::move(batch[batch_index].second);
+        ++batch_index;
+        TransformExportedRow(value);
+        return true;
+      },
+      exported_path);
+}
+
+size_t InProtoKnowledgeBank::CopyRows(
+    size_t begin, size_t end,
+    std::vector<std::pair<std::string, EmbeddingVectorProto>>* rows) const {
+  rows->clear();
   absl::ReaderMutexLock l(&mu_);
-  return WriteBinaryProto(*exported_path, in_proto_config_,
-                          /*can_overwrite=*/true);
+  // Import() may have replaced the keys since the export started.
+  end = std::min(end, keys_.size());
+  const auto& embedding_table =
+      in_proto_config_.embedding_data().embedding_table();
+  for (; begin < end; ++begin) {
+    const auto iter = embedding_table.find(std::string(keys_[begin]));
+    rows->emplace_back(iter->first, iter->second);
+  }
+  return end;
+}
+
+absl::Status InProtoKnowledgeBank::ExportRows(const std::string& dir,
+                                              const RowReader& next_row,
+                                              std::string* exported_path) {
+  if (has_checkpoint_file_options_) {
+    *exported_path = JoinPath(dir, kBlockDataOutput);
+    return ExportBlockFile(*exported_path, next_row);
+  }
+  // A single binary proto needs all the rows in memory.
+  InProtoKnowledgeBankConfig rows;
+  auto* embedding_table =
+      rows.mutable_embedding_data()->mutable_embedding_table();
+  std::string key;
+  EmbeddingVectorProto value;
+  while (next_row(&key, &value)) {
+    (*embedding_table)[key] = std::move(value);
+  }
+  *exported_path = JoinPath(dir, kDataOutput);
+  return WriteBinaryProto(*exported_path, rows, /*can_overwrite=*/true);
+}
+
+absl::Status InProtoKnowledgeBank::ExportBlockFile(const std::string& filepath,
+                                                   const RowReader& next_row) {
+  std::unique_ptr<CompressedBlockFileWriter> writer;
+  RET_CHECK_OK(CompressedBlockFileWriter::Open(
+      filepath, checkpoint_file_options_, &writer));
+  InProtoKnowledgeBankConfig::EmbeddingData entry;
+  std::string record;
+  std::string key;
+  EmbeddingVectorProto value;
+  while (next_row(&key, &value)) {
+    entry.clear_embedding_table();
+    (*entry.mutable_embedding_table())[key] = std::move(value);
+    RET_CHECK_TRUE(entry.SerializeToString(&record))
+        << "Serializing embedding failed for key: " << key;
+    RET_CHECK_OK(writer->Append(record));
+  }
+  return writer->Close();
+}
+
+absl::Status InProtoKnowledgeBank::ImportBlockFile(
+    const std::string& filepath) {
+  std::unique_ptr<CompressedBlockFileReader> reader;
+  RET_CHECK_OK(CompressedBlockFileReader::Open(filepath, &reader));
+  // Parses the blocks in parallel, then merges them in order.
+  std::vector<InProtoKnowledgeBankConfig::EmbeddingData> blocks(
+      reader->num_blocks());
+  std::vector<std::vector<std::string>> block_keys(reader->num_blocks());
+  RET_CHECK_OK(reader->ForEachBlock(
+      checkpoint_file_options_.parallelism(),
+      [&blocks, &block_keys](int block_index,
+                             const std::vector<absl::string_view>& records)
+          -> absl::Status {
+        InProtoKnowledgeBankConfig::EmbeddingData entry;
+        for (const auto& record : records) {
+          entry.Clear();
+          RET_CHECK_TRUE(entry.ParseFromArray(record.data(), record.size()))
+              << "Corrupted record in block " << block_index;
+          for (auto& pair : *entry.mutable_embedding_table()) {
+            block_keys[block_index].push_back(pair.first);
+            (*blocks[block_index].mutable_embedding_table())[pair.first] =
+                std::move(pair.second);
+          }
+        }
+        return absl::OkStatus();
+      }));
+
+  absl::WriterMutexLock l(&mu_);
+  auto* embedding_table =
+      in_proto_config_.mutable_embedding_data()->mutable_embedding_table();
+  embedding_table->clear();
+  keys_.clear();
+  index_.Clear();
+  for (int i = 0; i < blocks.size(); ++i) {
+    auto* block_table = blocks[i].mutable_embedding_table();
+    for (const auto& key : block_keys[i]) {
+      auto iter = embedding_table->insert({key, EmbeddingVectorProto()}).first;
+      iter->second = std::move(block_table->at(key));
+      AddKey(iter->first, &iter->second);
+    }
+  }
+  return absl::OkStatus();
 }
 
 absl::Status InProtoKnowledgeBank::ImportInternal(
     const std::string& saved_path) {
+  if (absl::EndsWith(saved_path, ".blk")) {
+    return ImportBlockFile(saved_path);
+  }
   absl::WriterMutexLock l(&mu_);
   auto status = ReadBinaryProto(saved_path, &in_proto_config_);
   if (!status.ok()) {
@@ -158,8 +580,10 @@ absl::Status InProtoKnowledgeBank::ImportInternal(
   }
   // Collect all the keys.
   keys_.clear();
-  for (const auto& pair : in_proto_config_.embedding_data().embedding_table()) {
-    keys_.push_back(pair.first);
+  index_.Clear();
+  for (auto& pair :
+       *in_proto_config_.mutable_embedding_data()->mutable_embedding_table()) {
+    AddKey(pair.first, &pair.second);
   }
   return absl::OkStatus();
 }
@@ -0,0 +1,94 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Compares the batched probing of InProtoKnowledgeBank::BatchLookup() against
+// looking up the keys one by one, for tables fitting in the last level cache
+// or much larger than it, e.g.,
+//   bazel run -c opt //research/carls/knowledge_bank:in_proto_knowledge_bank_benchmark
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "absl/strings/str_cat.h"
+#include "research/carls/knowledge_bank/knowledge_bank.h"
+
+namespace carls {
+namespace {
+
+constexpr int kEmbeddingDimension = 64;
+constexpr int kBatchSize = 1024;
+constexpr int kNumBatches = 64;
+
+std::unique_ptr<KnowledgeBank> CreateStore(int num_keys) {
+  KnowledgeBankConfig config;
+  config.mutable_initializer()->mutable_zero_initializer();
+  config.mutable_extension()->PackFrom(InProtoKnowledgeBankConfig());
+  auto store = KnowledgeBankFactory::Make(config, kEmbeddingDimension);
+  EmbeddingVectorProto value;
+  for (int i = 0; i < kEmbeddingDimension; ++i) {
+    value.add_value(i);
+  }
+  for (int i = 0; i < num_keys; ++i) {
+    CHECK(store->Update(absl::StrCat("key", i), value).ok());
+  }
+  return store;
+}
+
+// Args are {number of keys in the table, batched}.
+void TableArgs(benchmark::internal::Benchmark* b) {
+  // About 2MB and 1GB of embedding data.
+  for (int num_keys : {1 << 12, 1 << 21}) {
+    b->Args({num_keys, 0});
+    b->Args({num_keys, 1});
+  }
+}
+
+void BM_BatchLookup(benchmark::State& state) {
+  const int num_keys = state.range(0);
+  const bool batched = state.range(1);
+  auto store = CreateStore(num_keys);
+
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<int> distribution(0, num_keys - 1);
+  std::vector<std::string> str_keys(kBatchSize * kNumBatches);
+  for (auto& key : str_keys) {
+    key = absl::StrCat("key", distribution(rng));
+  }
+  std::vector<std::vector<absl::string_view>> batches(kNumBatches);
+  for (int i = 0; i < str_keys.size(); ++i) {
+    batches[i / kBatchSize].push_back(str_keys[i]);
+  }
+
+  std::vector<absl::variant<EmbeddingVectorProto, std::string>> results;
+  int batch_index = 0;
+  for (auto _ : state) {
+    const auto& keys = batches[batch_index];
+    batch_index = (batch_index + 1) % kNumBatches;
+    if (batched) {
+      store->BatchLookup(keys, &results);
+    } else {
+      // The default implementation, which calls Lookup() for every key.
+      store->KnowledgeBank::BatchLookup(keys, &results);
+    }
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * kBatchSize);
+}
+BENCHMARK(BM_BatchLookup)->Apply(TableArgs);
+
+}  // namespace
+}  // namespace carls
@@ -13,11 +13,20 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
+#include <memory>
 #include <string>
+#include <thread>  // NOLINT
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
 #include "research/carls/base/file_helper.h"
+#include "research/carls/base/io_rate_limiter.h"
 #include "research/carls/base/proto_helper.h"
 #include "research/carls/knowledge_bank/initializer.pb.h"  // proto to pb
 #include "research/carls/knowledge_bank/knowledge_bank.h"
@@ -27,6 +36,38 @@ namespace carls {
 
 using ::testing::TempDir;
 
+namespace {
+
+// Records the (type, key, version) and the values of the changes.
+class RecordingObserver : public KnowledgeBankObserver {
+ public:
+  void OnChanges(const std::vector<KnowledgeBankChange>& changes) override {
+    absl::MutexLock l(&mu_);
+    for (const auto& change : changes) {
+      changes_.push_back(absl::StrCat(change.type, ":", change.key, ":",
+                                      change.value.version()));
+      values_.push_back(change.value);
+    }
+  }
+
+  std::vector<std::string> changes() {
+    absl::MutexLock l(&mu_);
+    return changes_;
+  }
+
+  std::vector<EmbeddingVectorProto> values() {
+    absl::MutexLock l(&mu_);
+    return values_;
+  }
+
+ private:
+  absl::Mutex mu_;
+  std::vector<std::string> changes_ ABSL_GUARDED_BY(mu_);
+  std::vector<EmbeddingVectorProto> values_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace
+
 class InProtoKnowledgeBankTest : public ::testing::Test {
  protected:
   InProtoKnowledgeBankTest() {}
@@ -38,6 +79,20 @@ class InProtoKnowledgeBankTest : public ::testing::Test {
     config.mutable_extension()->PackFrom(in_proto_config);
     return KnowledgeBankFactory::Make(config, embedding_dimension);
   }
+
+  std::unique_ptr<KnowledgeBank> CreateStoreWithBlockCheckpoint(
+      int embedding_dimension, CompressedBlockFileOptions::Compression
+                                   compression) {
+    KnowledgeBankConfig config;
+    config.mutable_initializer()->mutable_zero_initializer();
+    InProtoKnowledgeBankConfig in_proto_config;
+    auto* options = in_proto_config.mutable_checkpoint_file_options();
+    options->set_compression(compression);
+    options->set_block_size(64);
+    options->set_parallelism(4);
+    config.mutable_extension()->PackFrom(in_proto_config);
+    return KnowledgeBankFactory::Make(config, embedding_dimension);
+  }
 };
 
 TEST_F(InProtoKnowledgeBankTest, LookupAndUpdate) {
@@ -50,7 +105,7 @@ TEST_F(InProtoKnowledgeBankTest, LookupAndUpdate) {
   EmbeddingVectorProto result;
   EXPECT_OK(store->Lookup("key1", &result));
   EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(R"pb(
-                value: 1 value: 2
+                value: 1 value: 2 version: 1
               )pb"));
 
   EXPECT_NOT_OK(store->Lookup("key2", &result));
@@ -109,6 +164,106 @@ TEST_F(InProtoKnowledgeBankTest, BatchLookupAndUpdate) {
   EXPECT_FALSE(store->Contains("key199"));
 }
 
+TEST_F(InProtoKnowledgeBankTest, BatchUpdateIfVersionMatches) {
+  auto store = CreateDefaultStore(2);
+  EmbeddingVectorProto value;
+  value.add_value(1);
+  value.add_value(2);
+  ASSERT_OK(store->Update("key1", value));
+  // A new key created by LookupWithUpdate() has version 0.
+  EmbeddingVectorProto result;
+  ASSERT_OK(store->LookupWithUpdate("key2", &result));
+  EXPECT_EQ(0, result.version());
+
+  value.set_value(0, 3);
+  std::vector<EmbeddingVectorProto> current_values;
+  auto statuses = store->BatchUpdateIfVersionMatches(
+      {"key1", "key2", "key3", "key4"}, {value, value, value, value},
+      {1, 0, 0, 1}, &current_values);
+  ASSERT_EQ(4, statuses.size());
+  ASSERT_EQ(4, current_values.size());
+  EXPECT_OK(statuses[0]);
+  EXPECT_THAT(current_values[0], EqualsProto<EmbeddingVectorProto>(R"pb(
+                value: 3 value: 2 version: 2
+              )pb"));
+  EXPECT_OK(statuses[1]);
+  EXPECT_EQ(1, current_values[1].version());
+  // A missing key has version 0.
+  EXPECT_OK(statuses[2]);
+  EXPECT_EQ(1, current_values[2].version());
+  EXPECT_EQ(absl::StatusCode::kAborted, statuses[3].code());
+  EXPECT_THAT(current_values[3], EqualsProto<EmbeddingVectorProto>(""));
+  EXPECT_FALSE(store->Contains("key4"));
+
+  // A stale version returns the current value without updating it.
+  value.set_value(0, 4);
+  statuses = store->BatchUpdateIfVersionMatches({"key1"}, {value}, {1},
+                                                &current_values);
+  EXPECT_EQ(absl::StatusCode::kAborted, statuses[0].code());
+  EXPECT_THAT(current_values[0], EqualsProto<EmbeddingVectorProto>(R"pb(
+                value: 3 value: 2 version: 2
+              )pb"));
+  ASSERT_OK(store->Lookup("key1", &result));
+  EXPECT_EQ(2, result.version());
+  EXPECT_FLOAT_EQ(3, result.value(0));
+  EXPECT_EQ(3, store->Size());
+}
+
+TEST_F(InProtoKnowledgeBankTest, UpdateRacesUpdateIfVersionMatches) {
+  auto store = CreateDefaultStore(2);
+  auto observer = std::make_shared<RecordingObserver>();
+  store->AddObserver(observer);
+  EmbeddingVectorProto value;
+  value.set_tag("plain");
+  value.add_value(0);
+  value.add_value(0);
+  ASSERT_OK(store->Update("key", value));
+
+  // value(1) is set by the plain updates, and carried over by the conditional
+  // updates, which increment value(0).
+  constexpr int kNumUpdates = 1000;
+  std::thread writer([&store]() {
+    EmbeddingVectorProto value;
+    value.set_tag("plain");
+    value.add_value(0);
+    value.add_value(0);
+    for (int i = 1; i <= kNumUpdates; ++i) {
+      value.set_value(1, i);
+      ASSERT_OK(store->Update("key", value));
+    }
+  });
+  for (int i = 0; i < kNumUpdates; ++i) {
+    EmbeddingVectorProto current;
+    ASSERT_OK(store->Lookup("key", &current));
+    EmbeddingVectorProto next = current;
+    next.set_tag("conditional");
+    next.set_value(0, current.value(0) + 1);
+    const auto status = store->UpdateIfVersionMatches(
+        "key", current.version(), next, &current);
+    ASSERT_TRUE(status.ok() || absl::IsAborted(status)) << status;
+  }
+  writer.join();
+  store->FlushChanges();
+  store->RemoveObserver(observer.get());
+
+  // Each write has its own version, and no conditional update overwrites a
+  // plain update made after its lookup.
+  auto values = observer->values();
+  std::sort(values.begin(), values.end(),
+            [](const EmbeddingVectorProto& a, const EmbeddingVectorProto& b) {
+              return a.version() < b.version();
+            });
+  ASSERT_GT(values.size(), kNumUpdates);
+  for (size_t i = 1; i < values.size(); ++i) {
+    ASSERT_EQ(values[i - 1].version() + 1, values[i].version());
+    if (values[i].tag() == "conditional") {
+      EXPECT_EQ(values[i - 1].value(1), values[i].value(1))
+          << "version " << values[i].version();
+    }
+  }
+  EXPECT_EQ(kNumUpdates, values.back().value(1));
+}
+
 TEST_F(InProtoKnowledgeBankTest, LookupWithUpdate) {
   auto store = CreateDefaultStore(2);
   EmbeddingVectorProto result;
@@ -169,6 +324,61 @@ TEST_F(InProtoKnowledgeBankTest, BatchLookupWithUpdate) {
   }
 }
 
+TEST_F(InProtoKnowledgeBankTest, BatchLookup_DuplicateAndMissingKeys) {
+  auto store = CreateDefaultStore(2);
+  EmbeddingVectorProto value;
+  for (int i = 0; i < 40; ++i) {
+    value.set_tag(absl::StrCat("key", i));
+    ASSERT_OK(store->Update(value.tag(), value));
+  }
+
+  // More keys than a group of the batched probing.
+  std::vector<absl::string_view> keys = {"key3", "new", "key3", "key39",
+                                         "new",  "key0"};
+  std::vector<std::string> str_keys;
+  for (int i = 0; i < 20; ++i) {
+    str_keys.push_back(absl::StrCat("key", i * 2));
+  }
+  keys.insert(keys.end(), str_keys.begin(), str_keys.end());
+  std::vector<absl::variant<EmbeddingVectorProto, std::string>> results;
+  store->BatchLookup(keys, &results);
+  ASSERT_EQ(keys.size(), results.size());
+  for (int i = 0; i < keys.size(); ++i) {
+    if (keys[i] == "new") {
+      ASSERT_TRUE(absl::holds_alternative<std::string>(results[i]));
+      EXPECT_EQ("Key is not found: new", absl::get<std::string>(results[i]));
+    } else {
+      ASSERT_TRUE(absl::holds_alternative<EmbeddingVectorProto>(results[i]));
+      EXPECT_EQ(keys[i], absl::get<EmbeddingVectorProto>(results[i]).tag());
+    }
+  }
+
+  // A new key is inserted once and its weight is counted for every lookup.
+  store->BatchLookupWithUpdate(keys, &results);
+  ASSERT_EQ(keys.size(), results.size());
+  EXPECT_EQ(41, store->Size());
+  EXPECT_FLOAT_EQ(1, absl::get<EmbeddingVectorProto>(results[0]).weight());
+  EXPECT_FLOAT_EQ(1, absl::get<EmbeddingVectorProto>(results[1]).weight());
+  EXPECT_FLOAT_EQ(2, absl::get<EmbeddingVectorProto>(results[2]).weight());
+  EXPECT_FLOAT_EQ(2, absl::get<EmbeddingVectorProto>(results[4]).weight());
+  EXPECT_EQ("new", absl::get<EmbeddingVectorProto>(results[4]).tag());
+  EXPECT_FLOAT_EQ(1, absl::get<EmbeddingVectorProto>(results[5]).weight());
+  EXPECT_FLOAT_EQ(2, absl::get<EmbeddingVectorProto>(results[6]).weight());
+  ASSERT_OK(store->Lookup("key3", &value));
+  EXPECT_FLOAT_EQ(2, value.weight());
+
+  // The keys are indexed again after an import.
+  std::string exported_path;
+  ASSERT_OK(store->Export(TempDir(), "", &exported_path));
+  auto new_store = CreateDefaultStore(2);
+  ASSERT_OK(new_store->Import(exported_path));
+  new_store->BatchLookup({"new", "key39", "missing"}, &results);
+  ASSERT_EQ(3, results.size());
+  EXPECT_EQ("new", absl::get<EmbeddingVectorProto>(results[0]).tag());
+  EXPECT_EQ("key39", absl::get<EmbeddingVectorProto>(results[1]).tag());
+  EXPECT_TRUE(absl::holds_alternative<std::string>(results[2]));
+}
+
 TEST_F(InProtoKnowledgeBankTest, Export) {
   auto store = CreateDefaultStore(2);
 
@@ -184,6 +394,33 @@ TEST_F(InProtoKnowledgeBankTest, Export) {
             meta_data.checkpoint_saved_path());
 }
 
+TEST_F(InProtoKnowledgeBankTest, ExportWithTransform) {
+  const auto double_value = [](EmbeddingVectorProto* value) {
+    for (float& v : *value->mutable_value()) {
+      v *= 2;
+    }
+  };
+  std::vector<std::unique_ptr<KnowledgeBank>> stores;
+  stores.push_back(CreateDefaultStore(2));
+  stores.push_back(
+      CreateStoreWithBlockCheckpoint(2, CompressedBlockFileOptions::SNAPPY));
+  for (auto& store : stores) {
+    ASSERT_OK(store->Update("key1", ParseTextProtoOrDie<EmbeddingVectorProto>(
+                                        "value: 1 value: 2")));
+    std::string exported_path;
+    ASSERT_OK(store->Export(TempDir(), "", &exported_path, double_value));
+
+    // Only the exported rows are transformed.
+    EmbeddingVectorProto result;
+    ASSERT_OK(store->Lookup("key1", &result));
+    EXPECT_FLOAT_EQ(1, result.value(0));
+    ASSERT_OK(store->Import(exported_path));
+    ASSERT_OK(store->Lookup("key1", &result));
+    EXPECT_FLOAT_EQ(2, result.value(0));
+    EXPECT_FLOAT_EQ(4, result.value(1));
+  }
+}
+
 TEST_F(InProtoKnowledgeBankTest, Import) {
   auto store = CreateDefaultStore(2);
 
@@ -221,4 +458,174 @@ TEST_F(InProtoKnowledgeBankTest, Import) {
   ASSERT_EQ(3, store->Keys().size());
 }
 
+TEST_F(InProtoKnowledgeBankTest, ExportAndImportBlockFile) {
+  auto store =
+      CreateStoreWithBlockCheckpoint(2, CompressedBlockFileOptions::SNAPPY);
+  const int num_keys = 100;
+  for (int i = 0; i < num_keys; ++i) {
+    EmbeddingVectorProto value;
+    value.add_value(i);
+    value.add_value(-i);
+    ASSERT_OK(store->Update(absl::StrCat("key", i), value));
+  }
+
+  std::string exported_path;
+  ASSERT_OK(store->Export(TempDir(), "", &exported_path));
+  KnowledgeBankCheckpointMetaData meta_data;
+  ASSERT_OK(ReadTextProto(exported_path, &meta_data));
+  EXPECT_EQ(JoinPath(TempDir(), "in_proto_embedding_data.blk"),
+            meta_data.checkpoint_saved_path());
+
+  // Imports into a new store with a different compression, the compression of
+  // the checkpoint is read from the file.
+  auto new_store =
+      CreateStoreWithBlockCheckpoint(2, CompressedBlockFileOptions::ZLIB);
+  EmbeddingVectorProto result;
+  EXPECT_OK(new_store->LookupWithUpdate("new_key", &result));
+  ASSERT_OK(new_store->Import(exported_path));
+  EXPECT_FALSE(new_store->Contains("new_key"));
+  ASSERT_EQ(num_keys, new_store->Size());
+  const auto keys = new_store->Keys();
+  for (int i = 0; i < num_keys; ++i) {
+    EXPECT_EQ(absl::StrCat("key", i), keys[i]);
+    ASSERT_OK(new_store->Lookup(keys[i], &result));
+    EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(absl::StrCat(
+                            "value: ", i, " value: ", -i, " version: 1")));
+  }
+}
+
+TEST_F(InProtoKnowledgeBankTest, UpdateDuringThrottledExport) {
+  auto store =
+      CreateStoreWithBlockCheckpoint(2, CompressedBlockFileOptions::SNAPPY);
+  const int num_keys = 1000;
+  for (int i = 0; i < num_keys; ++i) {
+    EmbeddingVectorProto value;
+    value.add_value(i);
+    value.add_value(-i);
+    ASSERT_OK(store->Update(absl::StrCat("key", i), value));
+  }
+  // Measures the size of a checkpoint, then exports at a rate that takes about
+  // two seconds.
+  std::string exported_path;
+  IoRateLimiter unlimited(/*bytes_per_second=*/1e12, /*burst_bytes=*/0);
+  {
+    ScopedIoRateLimit scoped_limit(&unlimited);
+    ASSERT_OK(store->Export(TempDir(), "throttled", &exported_path));
+  }
+  IoRateLimiter limiter(/*bytes_per_second=*/unlimited.TotalBytes() / 2.0,
+                        /*burst_bytes=*/0);
+  absl::Notification export_done;
+  std::thread exporter([&]() {
+    ScopedIoRateLimit scoped_limit(&limiter);
+    std::string path;
+    EXPECT_OK(store->Export(TempDir(), "throttled", &path));
+    export_done.Notify();
+  });
+  while (limiter.TotalBytes() == 0) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+
+  // The updates are not blocked by the export.
+  EmbeddingVectorProto result;
+  ASSERT_OK(store->LookupWithUpdate("key0", &result));
+  ASSERT_OK(store->Update("key1", result));
+  ASSERT_OK(store->LookupWithUpdate("new_key", &result));
+  EXPECT_FALSE(export_done.HasBeenNotified());
+  exporter.join();
+  EXPECT_GT(limiter.TotalWaitTime(), absl::Seconds(1));
+}
+
+TEST_F(InProtoKnowledgeBankTest, Restore) {
+  auto store = CreateDefaultStore(2);
+  EmbeddingVectorProto result;
+  ASSERT_OK(store->LookupWithUpdate("key1", &result));
+
+  // The versions are kept for both existing and new keys.
+  ASSERT_OK(store->Restore("key1", ParseTextProtoOrDie<EmbeddingVectorProto>(
+                                       "value: 1 value: 2 version: 7")));
+  ASSERT_OK(store->Restore("key2", ParseTextProtoOrDie<EmbeddingVectorProto>(
+                                       "value: 3 value: 4 version: 3")));
+  ASSERT_OK(store->Lookup("key1", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(
+                          "value: 1 value: 2 version: 7"));
+  ASSERT_OK(store->Lookup("key2", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(
+                          "value: 3 value: 4 version: 3"));
+  EXPECT_EQ(2, store->Size());
+
+  // Conditional updates continue from the restored version.
+  EXPECT_FALSE(store->UpdateIfVersionMatches("key2", 1, result, &result).ok());
+  ASSERT_OK(store->UpdateIfVersionMatches("key2", 3, result, &result));
+  EXPECT_EQ(4, result.version());
+}
+
+TEST_F(InProtoKnowledgeBankTest, ObserverReceivesChanges) {
+  auto store = CreateDefaultStore(2);
+  EmbeddingVectorProto value;
+  value.add_value(1.0f);
+  value.add_value(2.0f);
+  // Not reported since there is no observer yet.
+  ASSERT_OK(store->Update("key0", value));
+
+  auto observer = std::make_shared<RecordingObserver>();
+  store->AddObserver(observer);
+  EmbeddingVectorProto result;
+  ASSERT_OK(store->LookupWithUpdate("key1", &result));
+  // Only the first lookup of a key inserts it, the next ones update its
+  // weight.
+  ASSERT_OK(store->LookupWithUpdate("key1", &result));
+  ASSERT_OK(store->Update("key1", value));
+  ASSERT_OK(store->Update("key2", value));
+  ASSERT_OK(store->UpdateIfVersionMatches("key2", 1, value, &result));
+  EXPECT_FALSE(store->UpdateIfVersionMatches("key2", 1, value, &result).ok());
+  store->FlushChanges();
+  EXPECT_THAT(observer->changes(),
+              ::testing::ElementsAre("0:key1:0", "1:key1:0", "1:key1:1",
+                                     "0:key2:1", "1:key2:2"));
+
+  store->RemoveObserver(observer.get());
+  ASSERT_OK(store->Update("key3", value));
+  store->FlushChanges();
+  EXPECT_EQ(5, observer->changes().size());
+}
+
+TEST_F(InProtoKnowledgeBankTest, Remove) {
+  auto store = CreateDefaultStore(2);
+  EmbeddingVectorProto value;
+  value.add_value(1.0f);
+  value.add_value(2.0f);
+  ASSERT_OK(store->Update("key1", value));
+  ASSERT_OK(store->Update("key2", value));
+  ASSERT_OK(store->Update("key3", value));
+
+  auto observer = std::make_shared<RecordingObserver>();
+  store->AddObserver(observer);
+  // Missing keys are ignored.
+  ASSERT_OK(store->Remove({"key1", "key3", "key4"}));
+  store->FlushChanges();
+  EXPECT_THAT(observer->changes(),
+              ::testing::UnorderedElementsAre("2:key1:0", "2:key3:0"));
+  store->RemoveObserver(observer.get());
+
+  EXPECT_EQ(1, store->Size());
+  EXPECT_THAT(store->Keys(), ::testing::ElementsAre("key2"));
+  EXPECT_FALSE(store->Contains("key1"));
+  std::vector<absl::variant<EmbeddingVectorProto, std::string>>
+      value_or_errors;
+  store->BatchLookup({"key1", "key2", "key3"}, &value_or_errors);
+  ASSERT_EQ(3, value_or_errors.size());
+  EXPECT_TRUE(absl::holds_alternative<std::string>(value_or_errors[0]));
+  EXPECT_THAT(absl::get<EmbeddingVectorProto>(value_or_errors[1]),
+              EqualsProto<EmbeddingVectorProto>(
+                  "value: 1 value: 2 version: 1"));
+  EXPECT_TRUE(absl::holds_alternative<std::string>(value_or_errors[2]));
+
+  // A removed key is inserted again with a new embedding.
+  EmbeddingVectorProto result;
+  ASSERT_OK(store->LookupWithUpdate("key1", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(
+                          "tag: 'key1' value: 0 value: 0 weight: 1"));
+  EXPECT_EQ(2, store->Size());
+}
+
 }  // namespace carls
@@ -15,7 +15,9 @@ limitations under the License.
 
 #include "research/carls/knowledge_bank/knowledge_bank.h"
 
+#include "absl/memory/memory.h"
 #include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
 #include "research/carls/base/file_helper.h"
 #include "research/carls/base/proto_helper.h"
 #include "research/carls/knowledge_bank/initializer_helper.h"
@@ -24,6 +26,8 @@ namespace carls {
 namespace {
 
 constexpr char kSavedMetadataFilename[] = "embedding_store_meta_data.pbtxt";
+constexpr int kDefaultMaxChangeQueueSize = 10000;
+constexpr int kDefaultMaxChangeBatchSize = 256;
 
 }  // namespace
 
@@ -80,6 +84,27 @@ void KnowledgeBank::BatchLookupWithUpdate(
   }
 }
 
+void KnowledgeBank::LookupAsync(absl::string_view key,
+                                LookupCallback done) const {
+  EmbeddingVectorProto result;
+  absl::Status status = Lookup(key, &result);
+  done(std::move(status), std::move(result));
+}
+
+void KnowledgeBank::BatchLookupAsync(const std::vector<absl::string_view>& keys,
+                                     BatchLookupCallback done) const {
+  std::vector<absl::variant<EmbeddingVectorProto, std::string>> value_or_errors;
+  BatchLookup(keys, &value_or_errors);
+  done(std::move(value_or_errors));
+}
+
+void KnowledgeBank::BatchLookupWithUpdateAsync(
+    const std::vector<absl::string_view>& keys, BatchLookupCallback done) {
+  std::vector<absl::variant<EmbeddingVectorProto, std::string>> value_or_errors;
+  BatchLookupWithUpdate(keys, &value_or_errors);
+  done(std::move(value_or_errors));
+}
+
 std::vector<absl::Status> KnowledgeBank::BatchUpdate(
     const std::vector<absl::string_view>& keys,
     const std::vector<EmbeddingVectorProto>& values) {
@@ -95,9 +120,108 @@ std::vector<absl::Status> KnowledgeBank::BatchUpdate(
   return statuses;
 }
 
+absl::Status KnowledgeBank::UpdateIfVersionMatches(
+    const absl::string_view key, int64_t expected_version,
+    const EmbeddingVectorProto& value, EmbeddingVectorProto* current) {
+  return absl::UnimplementedError(
+      "UpdateIfVersionMatches() is not supported by this knowledge bank.");
+}
+
+std::vector<absl::Status> KnowledgeBank::BatchUpdateIfVersionMatches(
+    const std::vector<absl::string_view>& keys,
+    const std::vector<EmbeddingVectorProto>& values,
+    const std::vector<int64_t>& expected_versions,
+    std::vector<EmbeddingVectorProto>* current_values) {
+  CHECK(keys.size() == values.size());
+  CHECK(keys.size() == expected_versions.size());
+  CHECK(current_values != nullptr);
+  std::vector<absl::Status> statuses;
+  current_values->clear();
+  if (keys.empty()) {
+    return statuses;
+  }
+  statuses.reserve(keys.size());
+  current_values->resize(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    statuses.emplace_back(UpdateIfVersionMatches(
+        keys[i], expected_versions[i], values[i], &(*current_values)[i]));
+  }
+  return statuses;
+}
+
+absl::Status KnowledgeBank::Restore(const absl::string_view key,
+                                    const EmbeddingVectorProto& value) {
+  return absl::UnimplementedError(
+      "Restore() is not supported by this knowledge bank.");
+}
+
+absl::Status KnowledgeBank::Remove(const std::vector<absl::string_view>& keys) {
+  return absl::UnimplementedError(
+      "Remove() is not supported by this knowledge bank.");
+}
+
+void KnowledgeBank::AddObserver(
+    std::shared_ptr<KnowledgeBankObserver> observer) {
+  absl::MutexLock l(&notifier_mu_);
+  if (notifier_ == nullptr) {
+    const auto& options = config_.change_notification_options();
+    notifier_ = absl::make_unique<ChangeNotifier>(
+        options.max_queue_size() > 0 ? options.max_queue_size()
+                                     : kDefaultMaxChangeQueueSize,
+        options.max_batch_size() > 0 ? options.max_batch_size()
+                                     : kDefaultMaxChangeBatchSize);
+  }
+  notifier_->AddObserver(std::move(observer));
+  has_observers_ = true;
+}
+
+void KnowledgeBank::RemoveObserver(const KnowledgeBankObserver* observer) {
+  absl::MutexLock l(&notifier_mu_);
+  if (notifier_ == nullptr) {
+    return;
+  }
+  notifier_->RemoveObserver(observer);
+  has_observers_ = notifier_->HasObservers();
+}
+
+void KnowledgeBank::FlushChanges() {
+  ChangeNotifier* notifier = nullptr;
+  {
+    absl::MutexLock l(&notifier_mu_);
+    notifier = notifier_.get();
+  }
+  if (notifier != nullptr) {
+    notifier->Flush();
+  }
+}
+
+void KnowledgeBank::NotifyChange(KnowledgeBankChange::Type type,
+                                 absl::string_view key,
+                                 const EmbeddingVectorProto& value) {
+  if (!has_observers_) {
+    return;
+  }
+  KnowledgeBankChange change;
+  change.type = type;
+  change.key = std::string(key);
+  if (type != KnowledgeBankChange::kEvict) {
+    change.value = value;
+  }
+  // The notifier is never destroyed before the knowledge bank.
+  ChangeNotifier* notifier = nullptr;
+  {
+    absl::MutexLock l(&notifier_mu_);
+    notifier = notifier_.get();
+  }
+  if (notifier != nullptr) {
+    notifier->Notify(std::move(change));
+  }
+}
+
 absl::Status KnowledgeBank::Export(const std::string& export_directory,
                                    const std::string& subdir,
-                                   std::string* checkpoint) {
+                                   std::string* checkpoint,
+                                   const RowTransform& transform) {
   CHECK(checkpoint != nullptr);
   if (!IsDirectory(export_directory).ok()) {
     return absl::InvalidArgumentError(
@@ -113,7 +237,13 @@ absl::Status KnowledgeBank::Export(const std::string& export_directory,
     }
   }
   std::string exported_path;
-  auto status = ExportInternal(dirname, &exported_path);
+  absl::Status status;
+  {
+    absl::MutexLock l(&export_mu_);
+    export_transform_ = transform;
+    status = ExportInternal(dirname, &exported_path);
+    export_transform_ = nullptr;
+  }
   if (!status.ok()) {
     return status;
   }
@@ -130,6 +260,13 @@ absl::Status KnowledgeBank::Export(const std::string& export_directory,
   return absl::OkStatus();
 }
 
+absl::Status KnowledgeBank::ExportRows(const std::string& dir,
+                                       const RowReader& next_row,
+                                       std::string* exported_path) {
+  return absl::UnimplementedError(
+      "ExportRows is not supported by this knowledge bank.");
+}
+
 absl::Status KnowledgeBank::Import(const std::string& saved_path) {
   KnowledgeBankCheckpointMetaData meta_data;
   auto status = ReadTextProto(saved_path, &meta_data);
@@ -16,11 +16,17 @@ limitations under the License.
 #ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_KNOWLEDGE_BANK_KNOWLEDGE_BANK_H_
 #define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_KNOWLEDGE_BANK_KNOWLEDGE_BANK_H_
 
+#include <atomic>
+#include <functional>
+#include <memory>
+
 #include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "research/carls/base/proto_factory.h"
 #include "research/carls/embedding.pb.h"  // proto to pb
+#include "research/carls/knowledge_bank/change_notifier.h"
 #include "research/carls/knowledge_bank/knowledge_bank_config.pb.h"  // proto to pb
 
 namespace carls {
@@ -46,9 +52,24 @@ class KnowledgeBank {
 
   // Updates the embedding of a single key.
   // The function may move the value into the storage.
+  // Implementations are expected to ignore value.version() and store the
+  // previous version of the key plus one instead.
   virtual absl::Status Update(const absl::string_view key,
                               const EmbeddingVectorProto& value) = 0;
 
+  // Updates the embedding of a single key only if its current version equals
+  // `expected_version`, where a key not in the knowledge bank has version 0.
+  // Upon success, the stored value with its new version is returned in
+  // `current`. Otherwise it returns an ABORTED error with the current value of
+  // the key in `current` so that the caller can retry.
+  // Implementations must compare and store the version atomically with
+  // respect to the other updates of the key, including Update().
+  // The default implementation returns an UNIMPLEMENTED error.
+  virtual absl::Status UpdateIfVersionMatches(const absl::string_view key,
+                                              int64_t expected_version,
+                                              const EmbeddingVectorProto& value,
+                                              EmbeddingVectorProto* current);
+
   // Batch lookup for the given keys.
   // Returns a vector of variant [EmbeddingVectorProto, error message] with the
   // same length as the input keys.
@@ -65,6 +86,36 @@ class KnowledgeBank {
       std::vector<absl::variant<EmbeddingVectorProto, std::string>>*
           value_or_errors);
 
+  // Callback for an asynchronous lookup of a single key. It is called exactly
+  // once, with the status of the lookup and the embedding if it succeeded.
+  using LookupCallback =
+      std::function<void(absl::Status status, EmbeddingVectorProto result)>;
+
+  // Callback for an asynchronous batch lookup. It is called exactly once, with
+  // a vector of variant [EmbeddingVectorProto, error message] of the same
+  // length as the input keys.
+  using BatchLookupCallback = std::function<void(
+      std::vector<absl::variant<EmbeddingVectorProto, std::string>>
+          value_or_errors)>;
+
+  // Asynchronous version of Lookup(). `done` may be called from the calling
+  // thread before LookupAsync() returns, or later from an I/O thread.
+  // The default implementation calls Lookup() and then `done` inline, which
+  // serves as an adapter for subclasses that are purely in memory.
+  virtual void LookupAsync(absl::string_view key, LookupCallback done) const;
+
+  // Asynchronous version of BatchLookup(). Subclasses backed by disk can
+  // override it to fetch the keys concurrently.
+  // The default implementation calls BatchLookup() and then `done` inline.
+  virtual void BatchLookupAsync(const std::vector<absl::string_view>& keys,
+                                BatchLookupCallback done) const;
+
+  // Asynchronous version of BatchLookupWithUpdate().
+  // The default implementation calls BatchLookupWithUpdate() and then `done`
+  // inline.
+  virtual void BatchLookupWithUpdateAsync(
+      const std::vector<absl::string_view>& keys, BatchLookupCallback done);
+
   // Batch update.
   // Since the update is done one by one, it is not guaranteed that
   // atomic commit/cancellation if only part of the updates are successful.
@@ -72,16 +123,60 @@ class KnowledgeBank {
       const std::vector<absl::string_view>& keys,
       const std::vector<EmbeddingVectorProto>& values);
 
+  // Batch conditional update, see UpdateIfVersionMatches() for details.
+  // Returns a status for each key, and `current_values` has the same length
+  // as the input keys. Keys with an ABORTED status are not updated.
+  virtual std::vector<absl::Status> BatchUpdateIfVersionMatches(
+      const std::vector<absl::string_view>& keys,
+      const std::vector<EmbeddingVectorProto>& values,
+      const std::vector<int64_t>& expected_versions,
+      std::vector<EmbeddingVectorProto>* current_values);
+
+  // Stores `value` as the embedding of `key` without changing its version,
+  // e.g., when the key is migrated from another knowledge bank, so that the
+  // conditional updates based on the original versions stay valid.
+  // The default implementation returns an UNIMPLEMENTED error.
+  virtual absl::Status Restore(const absl::string_view key,
+                               const EmbeddingVectorProto& value);
+
+  // Removes the given keys and their embeddings, e.g., after they are migrated
+  // to another knowledge bank. Keys not in the knowledge bank are ignored, the
+  // removed ones are reported to the observers as evicted. Like Import(), it
+  // invalidates the keys returned by Keys() before.
+  // The default implementation returns an UNIMPLEMENTED error.
+  virtual absl::Status Remove(const std::vector<absl::string_view>& keys);
+
+  // Transforms the copy of a row written by Export(), e.g., to apply the
+  // weight decay pending since the row was last updated.
+  using RowTransform = std::function<void(EmbeddingVectorProto* value)>;
+
   // Exports current data to a timestamped output directory with given subdir,
   // e.g., %export_directory%/%subdir%
   // The checkpoint contains the full file path of the saved binary proto of the
-  // KnowledgeBankConfig upon success.
+  // KnowledgeBankConfig upon success. If `transform` is set, it is applied to
+  // the exported rows only, the rows of the knowledge bank are unchanged.
   absl::Status Export(const std::string& export_directory,
-                      const std::string& subdir, std::string* checkpoint);
+                      const std::string& subdir, std::string* checkpoint,
+                      const RowTransform& transform = nullptr);
 
   // Restores the stage of the embedding from the given saved path.
   absl::Status Import(const std::string& saved_path);
 
+  // Reads the next row to export into `key` and `value`, returns false after
+  // the last row.
+  using RowReader =
+      std::function<bool(std::string* key, EmbeddingVectorProto* value)>;
+
+  // Writes the rows read from `next_row`, instead of the rows of this
+  // knowledge bank, to `dir` in the format of this knowledge bank's
+  // checkpoints, and returns the path as ExportInternal() does. It is used to
+  // export a view composed of several knowledge banks without copying their
+  // rows into one of them, and does not change this knowledge bank.
+  // The default implementation returns an UNIMPLEMENTED error.
+  virtual absl::Status ExportRows(const std::string& dir,
+                                  const RowReader& next_row,
+                                  std::string* exported_path);
+
   // Returns embedding dimension.
   int embedding_dimension() const { return embedding_dimension_; }
 
@@ -99,20 +194,69 @@ class KnowledgeBank {
   // embedding.
   virtual bool Contains(absl::string_view key) const = 0;
 
+  // Registers an observer that receives the insert, update and evict events of
+  // the knowledge bank in batches, asynchronously through a bounded queue
+  // configured by KnowledgeBankConfig.change_notification_options.
+  // Incrementing the weight of an existing key in LookupWithUpdate() is
+  // reported as an update, reloading the whole bank in Import() is not
+  // reported.
+  void AddObserver(std::shared_ptr<KnowledgeBankObserver> observer);
+
+  // Unregisters an observer. It is not called after this returns.
+  void RemoveObserver(const KnowledgeBankObserver* observer);
+
+  // Blocks until all the changes so far are delivered to the observers.
+  void FlushChanges();
+
  protected:
   KnowledgeBank(const KnowledgeBankConfig& config,
                 const int embedding_dimension);
 
   // Internal implementation of the Export() method.
   // The caller is expected to export the files to %output_dir%/%subdir%.
+  // Implementations call TransformExportedRow() on each row they write.
   virtual absl::Status ExportInternal(const std::string& dir,
                                       std::string* exported_path) = 0;
 
+  // Returns true if the ongoing Export() transforms the exported rows, so that
+  // implementations can write the rows without copying them otherwise. Only
+  // called from ExportInternal().
+  bool HasExportTransform() const { return export_transform_ != nullptr; }
+
+  // Applies the transform of the ongoing Export(), if any, to the copy of a
+  // row to be written. Only called from ExportInternal().
+  void TransformExportedRow(EmbeddingVectorProto* value) const {
+    if (export_transform_ != nullptr) {
+      export_transform_(value);
+    }
+  }
+
   // Internal implementation of the Import() method.
   virtual absl::Status ImportInternal(const std::string& saved_path) = 0;
 
+  // Returns true if any observer is registered. Subclasses can use it to skip
+  // preparing the changes nobody listens to.
+  bool HasObservers() const { return has_observers_; }
+
+  // Reports a change of `key` to the observers. Subclasses are expected to
+  // call it after the change is applied, without holding their own locks
+  // since it blocks when the notification queue is full.
+  void NotifyChange(KnowledgeBankChange::Type type, absl::string_view key,
+                    const EmbeddingVectorProto& value);
+
   KnowledgeBankConfig config_;
   const int embedding_dimension_;
+
+ private:
+  // Serializes the exports, export_transform_ is the transform of the ongoing
+  // one.
+  absl::Mutex export_mu_;
+  RowTransform export_transform_;
+
+  // Created on the first AddObserver().
+  absl::Mutex notifier_mu_;
+  std::unique_ptr<ChangeNotifier> notifier_ ABSL_GUARDED_BY(notifier_mu_);
+  std::atomic<bool> has_observers_{false};
 };
 
 REGISTER_CARLS_BASE_CLASS_1(KnowledgeBankConfig, KnowledgeBank,
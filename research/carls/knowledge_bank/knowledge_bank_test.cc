@@ -18,6 +18,7 @@ limitations under the License.
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/status/status.h"
+#include "absl/synchronization/notification.h"
 #include "research/carls/base/file_helper.h"
 #include "research/carls/knowledge_bank/initializer.pb.h"  // proto to pb
 #include "research/carls/knowledge_bank/initializer_helper.h"
@@ -70,6 +71,23 @@ class FakeEmbedding : public KnowledgeBank {
     return absl::OkStatus();
   }
 
+  absl::Status UpdateIfVersionMatches(const absl::string_view key,
+                                      int64_t expected_version,
+                                      const EmbeddingVectorProto& value,
+                                      EmbeddingVectorProto* current) override {
+    CHECK(current != nullptr);
+    current->Clear();
+    if (Contains(key)) {
+      *current = data_table_.embedding_table().find(std::string(key))->second;
+    }
+    if (current->version() != expected_version) {
+      return absl::AbortedError("Version mismatch");
+    }
+    *current = value;
+    current->set_version(expected_version + 1);
+    return Update(key, *current);
+  }
+
   absl::Status ExportInternal(const std::string& dir,
                               std::string* exported_path) override {
     *exported_path = "fake_checkpoint";
@@ -192,6 +210,96 @@ TEST_F(KnowledgeBankTest, BatchLookupWithUpdate) {
   EXPECT_EQ("key3", store->Keys()[2]);
 }
 
+TEST_F(KnowledgeBankTest, BatchUpdateIfVersionMatches) {
+  auto store = CreateDefaultStore(2);
+  EmbeddingInitializer initializer;
+  initializer.mutable_zero_initializer();
+  EmbeddingVectorProto value = InitializeEmbedding(2, initializer);
+
+  std::vector<EmbeddingVectorProto> current_values;
+  auto statuses = store->BatchUpdateIfVersionMatches(
+      {"key1", "key2"}, {value, value}, {0, 1}, &current_values);
+  ASSERT_EQ(2, statuses.size());
+  ASSERT_EQ(2, current_values.size());
+  EXPECT_OK(statuses[0]);
+  EXPECT_EQ(1, current_values[0].version());
+  EXPECT_EQ(absl::StatusCode::kAborted, statuses[1].code());
+  EXPECT_FALSE(store->Contains("key2"));
+
+  // Retries with the current version.
+  statuses = store->BatchUpdateIfVersionMatches(
+      {"key1", "key1"}, {value, value}, {1, 1}, &current_values);
+  EXPECT_OK(statuses[0]);
+  EXPECT_EQ(2, current_values[0].version());
+  EXPECT_EQ(absl::StatusCode::kAborted, statuses[1].code());
+  EXPECT_EQ(2, current_values[1].version());
+}
+
+TEST_F(KnowledgeBankTest, LookupAsync) {
+  auto store = CreateDefaultStore(2);
+  EmbeddingVectorProto value;
+  value.add_value(1);
+  value.add_value(2);
+  ASSERT_OK(store->Update("key1", value));
+
+  absl::Notification found;
+  store->LookupAsync("key1", [&found](absl::Status status,
+                                      EmbeddingVectorProto result) {
+    EXPECT_OK(status);
+    EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(R"pb(
+                  value: 1 value: 2
+                )pb"));
+    found.Notify();
+  });
+  found.WaitForNotification();
+
+  absl::Notification not_found;
+  store->LookupAsync("key2", [&not_found](absl::Status status,
+                                          EmbeddingVectorProto result) {
+    EXPECT_ERROR_EQ(status, "Data not found");
+    not_found.Notify();
+  });
+  not_found.WaitForNotification();
+}
+
+TEST_F(KnowledgeBankTest, BatchLookupAsync) {
+  auto store = CreateDefaultStore(2);
+  EmbeddingInitializer initializer;
+  initializer.mutable_zero_initializer();
+  EmbeddingVectorProto value = InitializeEmbedding(2, initializer);
+  ASSERT_OK(store->Update("key1", value));
+
+  absl::Notification done;
+  store->BatchLookupAsync(
+      {"key1", "key2"},
+      [&done](std::vector<absl::variant<EmbeddingVectorProto, std::string>>
+                  value_or_errors) {
+        ASSERT_EQ(2, value_or_errors.size());
+        EXPECT_TRUE(
+            absl::holds_alternative<EmbeddingVectorProto>(value_or_errors[0]));
+        ASSERT_TRUE(absl::holds_alternative<std::string>(value_or_errors[1]));
+        EXPECT_EQ("Data not found", absl::get<std::string>(value_or_errors[1]));
+        done.Notify();
+      });
+  done.WaitForNotification();
+
+  // BatchLookupWithUpdateAsync() creates the missing key.
+  absl::Notification updated;
+  store->BatchLookupWithUpdateAsync(
+      {"key1", "key2"},
+      [&updated](std::vector<absl::variant<EmbeddingVectorProto, std::string>>
+                     value_or_errors) {
+        ASSERT_EQ(2, value_or_errors.size());
+        EXPECT_TRUE(
+            absl::holds_alternative<EmbeddingVectorProto>(value_or_errors[0]));
+        EXPECT_TRUE(
+            absl::holds_alternative<EmbeddingVectorProto>(value_or_errors[1]));
+        updated.Notify();
+      });
+  updated.WaitForNotification();
+  EXPECT_EQ(2, store->Size());
+}
+
 TEST_F(KnowledgeBankTest, Export) {
   auto store = CreateDefaultStore(2);
 
@@ -13,16 +13,27 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+
 #include "absl/base/thread_annotations.h"
 #include "absl/container/flat_hash_set.h"
+#include "absl/container/node_hash_set.h"
+#include "absl/hash/hash.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
 #include "absl/synchronization/mutex.h"
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 #include "research/carls/base/async_node_hash_map.h"
 #include "research/carls/base/file_helper.h"
 #include "research/carls/base/proto_helper.h"
+#include "research/carls/base/single_flight.h"
 #include "research/carls/base/status_helper.h"
+#include "research/carls/base/thread_bundle.h"
 #include "research/carls/embedding.pb.h"  // proto to pb
 #include "research/carls/knowledge_bank/initializer_helper.h"
 #include "research/carls/knowledge_bank/knowledge_bank.h"
@@ -31,6 +42,12 @@ namespace carls {
 namespace {
 
 constexpr char kMetaDataOutputBaseName[] = "leveldb_embedding_metadata.txt";
+constexpr char kIoThreadPoolName[] = "LeveldbKnowledgeBankIo";
+constexpr char kWarmStartThreadPoolName[] = "LeveldbKnowledgeBankWarmStart";
+// Saved in the DB directory when warm_start is true.
+constexpr char kAccessProfileBaseName[] = "carls_access_profile.txt";
+// Expected version of the unconditional updates.
+constexpr int64_t kAnyVersion = -1;
 
 }  // namespace
 
@@ -47,11 +64,17 @@ class LeveldbKnowledgeBank : public KnowledgeBank {
                         leveldb_config_.max_in_memory_write_buffer_size(),
                         [](const std::deque<EmbeddingVectorProto>& data)
                             -> EmbeddingVectorProto { return data.back(); }) {
+    if (leveldb_config_.num_io_threads() > 0) {
+      io_bundle_ = absl::make_unique<ThreadBundle>(
+          kIoThreadPoolName, leveldb_config_.num_io_threads());
+    }
     auto absl_status = LoadDataFromLevelDb(leveldb_config_.leveldb_address(),
                                            /*create_if_missing=*/true);
     CHECK(absl_status.ok()) << absl_status.message();
   }
 
+  ~LeveldbKnowledgeBank() override { StopWarmStart(); }
+
  private:
   // Implementation of the Lookup interface.
   absl::Status Lookup(const absl::string_view key,
@@ -68,6 +91,43 @@ class LeveldbKnowledgeBank : public KnowledgeBank {
                       const EmbeddingVectorProto& value)
       ABSL_LOCKS_EXCLUDED(load_db_mu_, keys_mu_) override;
 
+  // Implementation of the UpdateIfVersionMatches interface.
+  // The version is compared and the value stored under the lock of the key,
+  // which Update() also takes, so no concurrent update of the key is lost.
+  absl::Status UpdateIfVersionMatches(const absl::string_view key,
+                                      int64_t expected_version,
+                                      const EmbeddingVectorProto& value,
+                                      EmbeddingVectorProto* current)
+      ABSL_LOCKS_EXCLUDED(load_db_mu_, keys_mu_) override;
+
+  // Implementation of the Restore interface.
+  absl::Status Restore(const absl::string_view key,
+                       const EmbeddingVectorProto& value)
+      ABSL_LOCKS_EXCLUDED(load_db_mu_, keys_mu_) override;
+
+  // Implementation of the Remove interface.
+  // The keys are deleted from the DB and from memory.
+  absl::Status Remove(const std::vector<absl::string_view>& keys)
+      ABSL_LOCKS_EXCLUDED(load_db_mu_, keys_mu_) override;
+
+  // Implementation of the LookupAsync interface.
+  // Embeddings in memory are returned inline, others are read from the DB in
+  // the I/O thread pool.
+  void LookupAsync(absl::string_view key, LookupCallback done) const
+      ABSL_LOCKS_EXCLUDED(load_db_mu_) override;
+
+  // Implementation of the BatchLookupAsync interface.
+  // Embeddings in memory are returned inline, others are read from the DB
+  // concurrently in the I/O thread pool.
+  void BatchLookupAsync(const std::vector<absl::string_view>& keys,
+                        BatchLookupCallback done) const
+      ABSL_LOCKS_EXCLUDED(load_db_mu_) override;
+
+  // Implementation of the BatchLookupWithUpdateAsync interface.
+  void BatchLookupWithUpdateAsync(const std::vector<absl::string_view>& keys,
+                                  BatchLookupCallback done)
+      ABSL_LOCKS_EXCLUDED(load_db_mu_, keys_mu_) override;
+
   // Implementation of the ExportInternal interface.
   // Exports the embeddings of updated keys and save these keys into a txt file.
   absl::Status ExportInternal(const std::string& dir,
@@ -83,6 +143,11 @@ class LeveldbKnowledgeBank : public KnowledgeBank {
 
   // Returns the size of the current embedding data.
   size_t Size() const ABSL_LOCKS_EXCLUDED(load_db_mu_) override {
+    if (LoadsOnDemand()) {
+      // Not all the embeddings are in memory.
+      absl::ReaderMutexLock l(&keys_mu_);
+      return keys_.size();
+    }
     absl::ReaderMutexLock rl(&load_db_mu_);
     return embedding_data_.size();
   }
@@ -98,7 +163,14 @@ class LeveldbKnowledgeBank : public KnowledgeBank {
   bool Contains(absl::string_view key) const
       ABSL_LOCKS_EXCLUDED(load_db_mu_) override {
     absl::ReaderMutexLock rl(&load_db_mu_);
-    return embedding_data_.find(std::string(key)) != embedding_data_.end();
+    if (embedding_data_.find(std::string(key)) != embedding_data_.end()) {
+      return true;
+    }
+    if (!LoadsOnDemand()) {
+      return false;
+    }
+    absl::ReaderMutexLock l(&keys_mu_);
+    return keys_set_.contains(key);
   }
 
   void ClearInternalData() ABSL_EXCLUSIVE_LOCKS_REQUIRED(load_db_mu_)
@@ -110,13 +182,96 @@ class LeveldbKnowledgeBank : public KnowledgeBank {
     keys_.clear();
     updated_keys_.clear();
     keys_set_.clear();
+    disk_keys_.clear();
   }
 
-  // Loads all the data into memory.
+  // Implementation of LookupWithUpdate(). `inserted` is set to true if a new
+  // embedding is created for the key.
+  absl::Status LookupWithUpdateInternal(absl::string_view key,
+                                        EmbeddingVectorProto* result,
+                                        bool* inserted)
+      ABSL_LOCKS_EXCLUDED(load_db_mu_, keys_mu_);
+
+  // Implementation of Update(), UpdateIfVersionMatches() and Restore(). The
+  // version of `value` is kept if `keep_version` is true, otherwise the
+  // previous version plus one is stored. Unless `expected_version` is
+  // kAnyVersion, it returns an ABORTED error with the current value in
+  // `updated` if the previous version differs from it. `inserted` is set to
+  // true if the key is new, and the stored value is returned in `updated` if it
+  // is not null.
+  absl::Status UpdateInternal(absl::string_view key,
+                              const EmbeddingVectorProto& value,
+                              bool keep_version, int64_t expected_version,
+                              bool* inserted, EmbeddingVectorProto* updated)
+      ABSL_LOCKS_EXCLUDED(load_db_mu_, keys_mu_);
+
+  // Returns the lock serializing the writes of the given key.
+  absl::Mutex& KeyMutex(absl::string_view key) const {
+    return key_mu_[absl::Hash<absl::string_view>()(key) % kNumKeyLocks];
+  }
+
+  // Returns true if embeddings missing from memory may be in the DB.
+  bool LoadsOnDemand() const {
+    return leveldb_config_.lazy_load() || leveldb_config_.warm_start();
+  }
+
+  // Returns true if the embedding of the given key is in memory.
+  bool IsResident(absl::string_view key) const
+      ABSL_LOCKS_EXCLUDED(load_db_mu_) {
+    absl::ReaderMutexLock rl(&load_db_mu_);
+    return embedding_data_.contains(std::string(key));
+  }
+
+  // Calls `lookup` on each of the given keys and then `done` with the results.
+  // Keys in memory are looked up in the calling thread, the rest are looked
+  // up in the I/O thread pool so that their DB reads overlap.
+  void RunBatchLookupAsync(
+      const std::vector<absl::string_view>& keys,
+      std::function<absl::Status(absl::string_view, EmbeddingVectorProto*)>
+          lookup,
+      BatchLookupCallback done) const;
+
+  // Reads the embedding of the given key from the DB into memory, used when
+  // lazy_load is true. `found` is set to false if the key is not in the DB.
+  // Concurrent reads of the same key are coalesced into a single one.
+  absl::Status LoadEmbeddingFromLevelDb(const std::string& key,
+                                        bool* found) const
+      ABSL_SHARED_LOCKS_REQUIRED(load_db_mu_);
+
+  // Makes the embedding of a key missing from memory available, by loading it
+  // from the DB or initializing a new one. `initialized` is set to true if a
+  // new embedding is created.
+  absl::Status LoadOrInitializeEmbedding(const std::string& key,
+                                         bool* initialized)
+      ABSL_SHARED_LOCKS_REQUIRED(load_db_mu_) ABSL_LOCKS_EXCLUDED(keys_mu_);
+
+  // Loads all the data into memory. With warm_start, only the hottest keys of
+  // the access profile are loaded before it returns, see StartWarmStart().
   absl::Status LoadDataFromLevelDb(const std::string& db_path,
                                    bool create_if_missing)
       ABSL_LOCKS_EXCLUDED(load_db_mu_, keys_mu_);
 
+  // Reads the first warm_start_fraction of the keys in the access profile of
+  // `db_path`, then starts reading the other embeddings in the background,
+  // the rest of the profile first.
+  absl::Status StartWarmStart(const std::string& db_path)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(load_db_mu_, keys_mu_);
+
+  // Stops the background reads started by StartWarmStart() and waits for them.
+  void StopWarmStart() ABSL_LOCKS_EXCLUDED(load_db_mu_);
+
+  // Writes the rows of `updated_keys` into the DB, and `keys` into the
+  // metadata file in `dir` and the access profile.
+  absl::Status ExportUpdatedRows(
+      const absl::flat_hash_set<std::string>& updated_keys,
+      const std::string& dir, const std::vector<absl::string_view>& keys)
+      ABSL_SHARED_LOCKS_REQUIRED(load_db_mu_) ABSL_LOCKS_EXCLUDED(keys_mu_);
+
+  // Saves the given keys that are in memory by decreasing weight into the
+  // access profile.
+  absl::Status WriteAccessProfile(const std::vector<absl::string_view>& keys)
+      ABSL_SHARED_LOCKS_REQUIRED(load_db_mu_);
+
   // LevelDB related.
   std::unique_ptr<leveldb::DB> leveldb_;
   const LeveldbKnowledgeBankConfig leveldb_config_;
@@ -130,6 +285,11 @@ class LeveldbKnowledgeBank : public KnowledgeBank {
   mutable async_node_hash_map<std::string, EmbeddingVectorProto> embedding_data_
       ABSL_GUARDED_BY(load_db_mu_);
 
+  // Locks striped by key, so that the read-modify-writes of the embedding of a
+  // key, e.g., of its version or weight, are atomic. Taken after load_db_mu_.
+  static constexpr int kNumKeyLocks = 64;
+  mutable absl::Mutex key_mu_[kNumKeyLocks];
+
   // The list of keys of the embedding, used for the Keys() method.
   mutable absl::Mutex keys_mu_;
   std::vector<absl::string_view> keys_ ABSL_GUARDED_BY(keys_mu_);
@@ -137,6 +297,22 @@ class LeveldbKnowledgeBank : public KnowledgeBank {
   absl::flat_hash_set<absl::string_view> keys_set_ ABSL_GUARDED_BY(keys_mu_);
   // The set of keys that are updated but not exported.
   absl::flat_hash_set<std::string> updated_keys_ ABSL_GUARDED_BY(keys_mu_);
+  // Owns the keys in the DB whose embeddings may not be loaded into memory yet,
+  // only used when lazy_load is true.
+  absl::node_hash_set<std::string> disk_keys_ ABSL_GUARDED_BY(keys_mu_);
+
+  // Coalesce the concurrent misses of a key, so that a cold key requested by
+  // many clients at once is only read from the DB, or initialized, once.
+  mutable SingleFlight<bool> load_flights_;
+  SingleFlight<bool> init_flights_;
+
+  // Reads the cold embeddings in the background after a warm start.
+  std::atomic<bool> stop_warm_start_{false};
+  std::unique_ptr<ThreadBundle> warm_start_bundle_;
+
+  // Thread pool for reading embeddings from the DB. Declared last so that it
+  // waits for pending reads before any other field is destroyed.
+  std::unique_ptr<ThreadBundle> io_bundle_;
 };
 
 REGISTER_KNOWLEDGE_BANK_FACTORY(
@@ -169,6 +345,17 @@ REGISTER_KNOWLEDGE_BANK_FACTORY(
                    << leveldb_config.max_in_memory_write_buffer_size();
         return nullptr;
       }
+      if (leveldb_config.num_io_threads() < 0) {
+        LOG(ERROR) << "Invalid num_io_threads: "
+                   << leveldb_config.num_io_threads();
+        return nullptr;
+      }
+      if (leveldb_config.warm_start_fraction() < 0 ||
+          leveldb_config.warm_start_fraction() > 1) {
+        LOG(ERROR) << "Invalid warm_start_fraction: "
+                   << leveldb_config.warm_start_fraction();
+        return nullptr;
+      }
       return std::unique_ptr<KnowledgeBank>(
           new LeveldbKnowledgeBank(config, dimension));
     });
@@ -177,7 +364,17 @@ absl::Status LeveldbKnowledgeBank::Lookup(const absl::string_view key,
                                           EmbeddingVectorProto* result) const {
   absl::ReaderMutexLock rl(&load_db_mu_);
   const std::string str_key(key);
-  const auto iter = embedding_data_.find(str_key);
+  auto iter = embedding_data_.find(str_key);
+  if (iter == embedding_data_.end() && LoadsOnDemand()) {
+    bool found = false;
+    auto status = LoadEmbeddingFromLevelDb(str_key, &found);
+    if (!status.ok()) {
+      return status;
+    }
+    if (found) {
+      iter = embedding_data_.find(str_key);
+    }
+  }
   if (iter == embedding_data_.end()) {
     return absl::InvalidArgumentError(
         absl::StrCat("Key is not found: ", str_key));
@@ -188,35 +385,174 @@ absl::Status LeveldbKnowledgeBank::Lookup(const absl::string_view key,
 
 absl::Status LeveldbKnowledgeBank::LookupWithUpdate(
     const absl::string_view key, EmbeddingVectorProto* result) {
+  bool inserted = false;
+  auto status = LookupWithUpdateInternal(key, result, &inserted);
+  if (status.ok()) {
+    NotifyChange(
+        inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+        key, *result);
+  }
+  return status;
+}
+
+absl::Status LeveldbKnowledgeBank::LookupWithUpdateInternal(
+    const absl::string_view key, EmbeddingVectorProto* result,
+    bool* inserted) {
   // Use a reader locker since embedding_data_ is thread-safe.
   absl::ReaderMutexLock rl(&load_db_mu_);
   std::string str_key(key);
-  if (embedding_data_.find(str_key) == embedding_data_.end()) {
-    // Insert a new embedding.
-    EmbeddingVectorProto embed =
-        InitializeEmbedding(embedding_dimension(), config().initializer());
-    embed.set_tag(str_key);
-    embedding_data_.insert_or_assign(str_key, std::move(embed));
-    absl::string_view strview_key = embedding_data_.find(str_key)->first;
-    absl::WriterMutexLock l(&keys_mu_);
-    if (keys_set_.find(strview_key) == keys_set_.end()) {
-      keys_.push_back(strview_key);
-      keys_set_.insert(strview_key);
+  if (!embedding_data_.contains(str_key)) {
+    // Only one of the threads missing the key loads or initializes it, the
+    // others wait and find it in memory afterwards.
+    bool initialized = false;
+    bool shared = false;
+    auto status = init_flights_.Do(
+        str_key,
+        [this, &str_key](bool* initialized) {
+          load_db_mu_.AssertReaderHeld();
+          return LoadOrInitializeEmbedding(str_key, initialized);
+        },
+        &initialized, &shared);
+    if (!status.ok()) {
+      return status;
     }
-    updated_keys_.insert(embedding_data_.find(str_key)->first);
+    *inserted = initialized && !shared;
   }
+  absl::MutexLock l(&KeyMutex(key));
   auto& embed = embedding_data_.find(str_key)->second;
   embed.set_weight(embed.weight() + 1);
-  *result = embedding_data_.find(str_key)->second;
+  *result = embed;
   return absl::OkStatus();
 }
 
 absl::Status LeveldbKnowledgeBank::Update(const absl::string_view key,
                                           const EmbeddingVectorProto& value) {
+  const bool observed = HasObservers();
+  bool inserted = false;
+  EmbeddingVectorProto updated;
+  auto status = UpdateInternal(key, value, /*keep_version=*/false, kAnyVersion,
+                               &inserted, observed ? &updated : nullptr);
+  if (status.ok() && observed) {
+    NotifyChange(
+        inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+        key, updated);
+  }
+  return status;
+}
+
+absl::Status LeveldbKnowledgeBank::UpdateIfVersionMatches(
+    const absl::string_view key, const int64_t expected_version,
+    const EmbeddingVectorProto& value, EmbeddingVectorProto* current) {
+  CHECK(current != nullptr);
+  bool inserted = false;
+  auto status = UpdateInternal(key, value, /*keep_version=*/false,
+                               expected_version, &inserted, current);
+  if (status.ok()) {
+    NotifyChange(
+        inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+        key, *current);
+  }
+  return status;
+}
+
+absl::Status LeveldbKnowledgeBank::Restore(const absl::string_view key,
+                                           const EmbeddingVectorProto& value) {
+  bool inserted = false;
+  auto status = UpdateInternal(key, value, /*keep_version=*/true, kAnyVersion,
+                               &inserted, /*updated=*/nullptr);
+  if (status.ok()) {
+    NotifyChange(
+        inserted ? KnowledgeBankChange::kInsert : KnowledgeBankChange::kUpdate,
+        key, value);
+  }
+  return status;
+}
+
+absl::Status LeveldbKnowledgeBank::Remove(
+    const std::vector<absl::string_view>& keys) {
+  std::vector<std::string> removed_keys;
+  {
+    // Use a write lock since the lookups and the exports hold views of the
+    // keys.
+    absl::WriterMutexLock wl(&load_db_mu_);
+    absl::MutexLock l(&keys_mu_);
+    absl::flat_hash_set<std::string> removed;
+    for (const auto& key : keys) {
+      if (keys_set_.contains(key)) {
+        removed.emplace(key);
+      }
+    }
+    if (removed.empty()) {
+      return absl::OkStatus();
+    }
+    leveldb::WriteBatch batch;
+    for (const auto& key : removed) {
+      batch.Delete(key);
+    }
+    const leveldb::Status status =
+        leveldb_->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok()) {
+      return absl::InternalError(status.ToString());
+    }
+    keys_.erase(std::remove_if(keys_.begin(), keys_.end(),
+                               [&removed](absl::string_view key) {
+                                 return removed.contains(key);
+                               }),
+                keys_.end());
+    // The views in keys_set_ are erased before the keys owning them.
+    for (const auto& key : removed) {
+      keys_set_.erase(key);
+      updated_keys_.erase(key);
+      disk_keys_.erase(key);
+      embedding_data_.erase(key);
+    }
+    removed_keys.assign(removed.begin(), removed.end());
+  }
+  for (const auto& key : removed_keys) {
+    NotifyChange(KnowledgeBankChange::kEvict, key, EmbeddingVectorProto());
+  }
+  return absl::OkStatus();
+}
+
+absl::Status LeveldbKnowledgeBank::UpdateInternal(
+    const absl::string_view key, const EmbeddingVectorProto& value,
+    const bool keep_version, const int64_t expected_version, bool* inserted,
+    EmbeddingVectorProto* updated) {
   // Use a reader locker since embedding_data_ is thread-safe.
   absl::ReaderMutexLock rl(&load_db_mu_);
   const std::string str_key(key);
-  embedding_data_.insert_or_assign(str_key, value);
+  // The previous version is read and replaced atomically.
+  absl::MutexLock l(&KeyMutex(key));
+  // Reads the previous version of the key, which may only be on disk.
+  auto iter = embedding_data_.find(str_key);
+  if (iter == embedding_data_.end() && LoadsOnDemand()) {
+    bool found = false;
+    auto status = LoadEmbeddingFromLevelDb(str_key, &found);
+    if (!status.ok()) {
+      return status;
+    }
+    iter = embedding_data_.find(str_key);
+  }
+  *inserted = iter == embedding_data_.end();
+  const int64_t previous_version = *inserted ? 0 : iter->second.version();
+  if (expected_version != kAnyVersion && previous_version != expected_version) {
+    if (*inserted) {
+      updated->Clear();
+    } else {
+      *updated = iter->second;
+    }
+    return absl::AbortedError(absl::StrCat(
+        "Version mismatch for key ", key, ": expected ", expected_version,
+        ", found ", previous_version));
+  }
+  EmbeddingVectorProto new_value = value;
+  if (!keep_version) {
+    new_value.set_version(previous_version + 1);
+  }
+  if (updated != nullptr) {
+    *updated = new_value;
+  }
+  embedding_data_.insert_or_assign(str_key, std::move(new_value));
   {
     absl::string_view strview_key = embedding_data_.find(str_key)->first;
     absl::WriterMutexLock l(&keys_mu_);
@@ -229,24 +565,237 @@ absl::Status LeveldbKnowledgeBank::Update(const absl::string_view key,
   return absl::OkStatus();
 }
 
+void LeveldbKnowledgeBank::LookupAsync(absl::string_view key,
+                                       LookupCallback done) const {
+  if (io_bundle_ == nullptr || IsResident(key)) {
+    KnowledgeBank::LookupAsync(key, std::move(done));
+    return;
+  }
+  io_bundle_->Add([this, str_key = std::string(key), done]() {
+    EmbeddingVectorProto result;
+    absl::Status status = Lookup(str_key, &result);
+    done(std::move(status), std::move(result));
+  });
+}
+
+void LeveldbKnowledgeBank::BatchLookupAsync(
+    const std::vector<absl::string_view>& keys,
+    BatchLookupCallback done) const {
+  RunBatchLookupAsync(
+      keys,
+      [this](absl::string_view key, EmbeddingVectorProto* result) {
+        return Lookup(key, result);
+      },
+      std::move(done));
+}
+
+void LeveldbKnowledgeBank::BatchLookupWithUpdateAsync(
+    const std::vector<absl::string_view>& keys, BatchLookupCallback done) {
+  RunBatchLookupAsync(
+      keys,
+      [this](absl::string_view key, EmbeddingVectorProto* result) {
+        return LookupWithUpdate(key, result);
+      },
+      std::move(done));
+}
+
+void LeveldbKnowledgeBank::RunBatchLookupAsync(
+    const std::vector<absl::string_view>& keys,
+    std::function<absl::Status(absl::string_view, EmbeddingVectorProto*)>
+        lookup,
+    BatchLookupCallback done) const {
+  // Shared by the pending lookups of the batch, the last one to finish calls
+  // `done`. Keys are copied so that the caller does not need to keep them.
+  struct BatchState {
+    std::vector<std::string> keys;
+    std::vector<absl::variant<EmbeddingVectorProto, std::string>>
+        value_or_errors;
+    std::atomic<int> num_pending{0};
+    BatchLookupCallback done;
+  };
+  auto state = std::make_shared<BatchState>();
+  state->value_or_errors.resize(keys.size());
+  state->done = std::move(done);
+  auto run_lookup = [state, lookup](size_t i, absl::string_view key) {
+    EmbeddingVectorProto result;
+    const auto status = lookup(key, &result);
+    if (!status.ok()) {
+      state->value_or_errors[i] = std::string(status.message());
+    } else {
+      state->value_or_errors[i] = std::move(result);
+    }
+  };
+
+  std::vector<size_t> pending_indices;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (io_bundle_ == nullptr || IsResident(keys[i])) {
+      run_lookup(i, keys[i]);
+    } else {
+      pending_indices.push_back(i);
+      state->keys.emplace_back(keys[i]);
+    }
+  }
+  if (pending_indices.empty()) {
+    state->done(std::move(state->value_or_errors));
+    return;
+  }
+  state->num_pending = pending_indices.size();
+  for (size_t j = 0; j < pending_indices.size(); ++j) {
+    io_bundle_->Add([state, run_lookup, i = pending_indices[j], j]() {
+      run_lookup(i, state->keys[j]);
+      if (state->num_pending.fetch_sub(1) == 1) {
+        state->done(std::move(state->value_or_errors));
+      }
+    });
+  }
+}
+
+absl::Status LeveldbKnowledgeBank::LoadEmbeddingFromLevelDb(
+    const std::string& key, bool* found) const {
+  return load_flights_.Do(
+      key,
+      [this, &key](bool* found) -> absl::Status {
+        load_db_mu_.AssertReaderHeld();
+        // The key may have been loaded by a read that finished after the
+        // caller missed it.
+        if (embedding_data_.contains(key)) {
+          *found = true;
+          return absl::OkStatus();
+        }
+        std::string value;
+        leveldb::Status status =
+            leveldb_->Get(leveldb::ReadOptions(), key, &value);
+        if (status.IsNotFound()) {
+          *found = false;
+          return absl::OkStatus();
+        }
+        if (!status.ok()) {
+          return absl::InternalError(status.ToString());
+        }
+        EmbeddingVectorProto proto;
+        if (!proto.ParseFromString(value)) {
+          return absl::InternalError(
+              "Parsing input data to EmbeddingVectorProto failed.");
+        }
+        // Keeps the value in memory if another thread has updated the key in
+        // the meantime.
+        embedding_data_.try_emplace(key, std::move(proto));
+        *found = true;
+        return absl::OkStatus();
+      },
+      found);
+}
+
+absl::Status LeveldbKnowledgeBank::LoadOrInitializeEmbedding(
+    const std::string& key, bool* initialized) {
+  *initialized = false;
+  if (embedding_data_.contains(key)) {
+    return absl::OkStatus();
+  }
+  if (LoadsOnDemand()) {
+    bool found = false;
+    auto status = LoadEmbeddingFromLevelDb(key, &found);
+    if (!status.ok() || found) {
+      return status;
+    }
+  }
+  // Insert a new embedding, unless a concurrent Update() has created one.
+  EmbeddingVectorProto embed =
+      InitializeEmbedding(embedding_dimension(), config().initializer());
+  embed.set_tag(key);
+  auto pair = embedding_data_.try_emplace(key, std::move(embed));
+  if (!pair.second) {
+    return absl::OkStatus();
+  }
+  absl::string_view strview_key = pair.first->first;
+  absl::WriterMutexLock l(&keys_mu_);
+  if (keys_set_.find(strview_key) == keys_set_.end()) {
+    keys_.push_back(strview_key);
+    keys_set_.insert(strview_key);
+  }
+  updated_keys_.insert(key);
+  *initialized = true;
+  return absl::OkStatus();
+}
+
 absl::Status LeveldbKnowledgeBank::ExportInternal(const std::string& dir,
                                                   std::string* exported_path) {
   absl::ReaderMutexLock rl(&load_db_mu_);
   *exported_path = leveldb_config_.leveldb_address();
-  absl::MutexLock l(&keys_mu_);
+  // Only the sets of keys are copied under keys_mu_, the rows are written
+  // without it so that the updates are not blocked by the writes of the
+  // checkpoint, which may be rate limited. The keys in memory stay valid under
+  // the reader lock of load_db_mu_.
+  absl::flat_hash_set<std::string> updated_keys;
+  std::vector<absl::string_view> keys;
+  {
+    absl::MutexLock l(&keys_mu_);
+    updated_keys.swap(updated_keys_);
+    keys = keys_;
+  }
+  auto status = ExportUpdatedRows(updated_keys, dir, keys);
+  if (!status.ok()) {
+    // The rows are exported again by the next export.
+    absl::MutexLock l(&keys_mu_);
+    updated_keys_.insert(updated_keys.begin(), updated_keys.end());
+  }
+  return status;
+}
+
+absl::Status LeveldbKnowledgeBank::ExportUpdatedRows(
+    const absl::flat_hash_set<std::string>& updated_keys,
+    const std::string& dir, const std::vector<absl::string_view>& keys) {
   leveldb::WriteOptions options;
-  for (const auto& key : updated_keys_) {
-    const std::string str_key(key);
-    leveldb_->Put(options, str_key,
-                  embedding_data_.find(str_key)->second.SerializeAsString());
+  EmbeddingVectorProto value;
+  for (const auto& key : updated_keys) {
+    {
+      absl::MutexLock l(&KeyMutex(key));
+      value = embedding_data_.find(key)->second;
+    }
+    TransformExportedRow(&value);
+    const leveldb::Status status =
+        leveldb_->Put(options, key, value.SerializeAsString());
+    if (!status.ok()) {
+      return absl::InternalError(status.ToString());
+    }
   }
   RET_CHECK_OK(WriteFileString(JoinPath(dir, kMetaDataOutputBaseName),
-                               absl::StrJoin(keys_, "\n"),
+                               absl::StrJoin(keys, "\n"),
                                /*can_overwrite=*/true));
-  updated_keys_.clear();
+  if (leveldb_config_.warm_start()) {
+    RET_CHECK_OK(WriteAccessProfile(keys));
+  }
   return absl::OkStatus();
 }
 
+absl::Status LeveldbKnowledgeBank::WriteAccessProfile(
+    const std::vector<absl::string_view>& keys) {
+  // Keys not in memory have not been accessed since the DB was loaded, so they
+  // are left to the background reads.
+  std::vector<std::pair<float, absl::string_view>> weighted_keys;
+  weighted_keys.reserve(keys.size());
+  for (const auto& key : keys) {
+    const std::string str_key(key);
+    if (embedding_data_.contains(str_key)) {
+      weighted_keys.emplace_back(embedding_data_.find(str_key)->second.weight(),
+                                 key);
+    }
+  }
+  std::stable_sort(weighted_keys.begin(), weighted_keys.end(),
+                   [](const std::pair<float, absl::string_view>& a,
+                      const std::pair<float, absl::string_view>& b) {
+                     return a.first > b.first;
+                   });
+  std::vector<absl::string_view> profile;
+  profile.reserve(weighted_keys.size());
+  for (const auto& pair : weighted_keys) {
+    profile.push_back(pair.second);
+  }
+  return WriteFileString(
+      JoinPath(leveldb_config_.leveldb_address(), kAccessProfileBaseName),
+      absl::StrJoin(profile, "\n"), /*can_overwrite=*/true);
+}
+
 absl::Status LeveldbKnowledgeBank::ImportInternal(
     const std::string& saved_path) {
   return LoadDataFromLevelDb(saved_path, /*create_if_missing=*/false);
@@ -270,6 +819,9 @@ absl::Status LeveldbKnowledgeBank::LoadDataFromLevelDb(
   }
   RET_CHECK_TRUE(db != nullptr);
 
+  // The background reads of a previous warm start use the DB being replaced.
+  StopWarmStart();
+
   // Use a write lock to prevent other methods from accessing the internal data
   // during loading.
   absl::WriterMutexLock wl(&load_db_mu_);
@@ -284,14 +836,20 @@ absl::Status LeveldbKnowledgeBank::LoadDataFromLevelDb(
   absl::MutexLock l(&keys_mu_);
   unsigned int count = 0;
   for (it->SeekToFirst(); it->Valid(); it->Next()) {
-    EmbeddingVectorProto proto;
-    if (!proto.ParseFromString(it->value().ToString())) {
-      return absl::InternalError(
-          "Parsing input data to EmbeddingVectorProto failed.");
-    }
     const std::string str_key = it->key().ToString();
-    embedding_data_.insert_or_assign(str_key, std::move(proto));
-    absl::string_view strview_key = embedding_data_.find(str_key)->first;
+    absl::string_view strview_key;
+    if (LoadsOnDemand()) {
+      // Only the key is loaded, its embedding is read on first access.
+      strview_key = *disk_keys_.insert(str_key).first;
+    } else {
+      EmbeddingVectorProto proto;
+      if (!proto.ParseFromString(it->value().ToString())) {
+        return absl::InternalError(
+            "Parsing input data to EmbeddingVectorProto failed.");
+      }
+      embedding_data_.insert_or_assign(str_key, std::move(proto));
+      strview_key = embedding_data_.find(str_key)->first;
+    }
     keys_.push_back(strview_key);
     keys_set_.insert(strview_key);
     ++count;
@@ -302,7 +860,69 @@ absl::Status LeveldbKnowledgeBank::LoadDataFromLevelDb(
     return absl::InternalError(absl::StrCat(
         "Scanning LevelDb failed with error: ", it->status().ToString()));
   }
+  if (leveldb_config_.warm_start()) {
+    return StartWarmStart(db_path);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status LeveldbKnowledgeBank::StartWarmStart(const std::string& db_path) {
+  auto start = absl::Now();
+  std::vector<std::string> hot_keys;
+  std::string content;
+  // A DB without a profile is read in key order.
+  if (ReadFileString(JoinPath(db_path, kAccessProfileBaseName), &content)
+          .ok()) {
+    for (absl::string_view key : absl::StrSplit(content, '\n')) {
+      if (keys_set_.contains(key)) {
+        hot_keys.emplace_back(key);
+      }
+    }
+  }
+  const size_t num_resident = std::min<size_t>(
+      hot_keys.size(),
+      std::ceil(leveldb_config_.warm_start_fraction() * hot_keys.size()));
+  for (size_t i = 0; i < num_resident; ++i) {
+    bool found = false;
+    RET_CHECK_OK(LoadEmbeddingFromLevelDb(hot_keys[i], &found));
+  }
+  LOG(INFO) << "Loading " << num_resident << " hot keys took "
+            << absl::Now() - start;
+
+  std::vector<std::string> cold_keys(hot_keys.begin() + num_resident,
+                                     hot_keys.end());
+  cold_keys.reserve(keys_.size());
+  for (const auto& key : keys_) {
+    cold_keys.emplace_back(key);
+  }
+  stop_warm_start_ = false;
+  warm_start_bundle_ =
+      absl::make_unique<ThreadBundle>(kWarmStartThreadPoolName, 1);
+  warm_start_bundle_->Add([this, cold_keys = std::move(cold_keys)]() {
+    auto start = absl::Now();
+    for (const auto& key : cold_keys) {
+      if (stop_warm_start_) {
+        return;
+      }
+      // Already loaded keys are skipped by LoadEmbeddingFromLevelDb(), and
+      // the lock is released between keys to let Import() in.
+      absl::ReaderMutexLock rl(&load_db_mu_);
+      bool found = false;
+      auto status = LoadEmbeddingFromLevelDb(key, &found);
+      if (!status.ok()) {
+        LOG(ERROR) << "Warm start failed: " << status;
+        return;
+      }
+    }
+    LOG(INFO) << "Loading the remaining keys took " << absl::Now() - start;
+  });
   return absl::OkStatus();
 }
 
+void LeveldbKnowledgeBank::StopWarmStart() {
+  stop_warm_start_ = true;
+  // The destructor of ThreadBundle waits for the reads to stop.
+  warm_start_bundle_.reset();
+}
+
 }  // namespace carls
@@ -16,8 +16,11 @@ limitations under the License.
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
 #include "leveldb/db.h"
 #include "research/carls/base/file_helper.h"
+#include "research/carls/base/io_rate_limiter.h"
 #include "research/carls/base/proto_helper.h"
 #include "research/carls/base/thread_bundle.h"
 #include "research/carls/embedding.pb.h"  // proto to pb
@@ -45,7 +48,8 @@ class LeveldbKnowledgeBankTest : public ::testing::Test {
   std::unique_ptr<KnowledgeBank> CreateKnowledgeBank(
       const int embedding_dimension, const std::string& leveldb_address,
       const int num_in_memory_partitions,
-      const int max_in_memory_write_buffer_size) {
+      const int max_in_memory_write_buffer_size, const bool lazy_load = false,
+      const int num_io_threads = 0) {
     KnowledgeBankConfig config;
     config.mutable_initializer()->mutable_zero_initializer();
     LeveldbKnowledgeBankConfig leveldb_config;
@@ -53,9 +57,28 @@ class LeveldbKnowledgeBankTest : public ::testing::Test {
     leveldb_config.set_num_in_memory_partitions(num_in_memory_partitions);
     leveldb_config.set_max_in_memory_write_buffer_size(
         max_in_memory_write_buffer_size);
+    leveldb_config.set_lazy_load(lazy_load);
+    leveldb_config.set_num_io_threads(num_io_threads);
     config.mutable_extension()->PackFrom(leveldb_config);
     return KnowledgeBankFactory::Make(config, embedding_dimension);
   }
+
+  // Writes the embeddings "key0", "key1", ... into a new DB at `db_address`.
+  void WriteEmbeddingsToLevelDb(const std::string& db_address, int num_keys) {
+    leveldb::DB* db;
+    leveldb::Options options;
+    options.create_if_missing = true;
+    ASSERT_OK(leveldb::DB::Open(options, db_address, &db));
+    std::unique_ptr<leveldb::DB> db_ptr(db);
+    leveldb::WriteOptions write_options;
+    for (int i = 0; i < num_keys; ++i) {
+      EmbeddingVectorProto proto;
+      proto.set_tag(absl::StrCat("key", i));
+      proto.add_value(2 * i);
+      proto.add_value(2 * i + 1);
+      ASSERT_OK(db->Put(write_options, proto.tag(), proto.SerializeAsString()));
+    }
+  }
 };
 
 TEST_F(LeveldbKnowledgeBankTest, Create) {
@@ -126,6 +149,7 @@ TEST_F(LeveldbKnowledgeBankTest, LookupWithUpdate) {
                 value: 2
                 value: 3
                 weight: 5
+                version: 1
               )pb"));
 
   EXPECT_OK(knowledge_bank->Lookup("first", &result));
@@ -229,13 +253,16 @@ TEST_F(LeveldbKnowledgeBankTest, Update) {
                 tag: "key1"
                 value: 1
                 value: 2
+                version: 1
               )pb"));
 
+  // The version is incremented by each update.
   ASSERT_OK(knowledge_bank->Lookup("key2", &result));
   EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(R"pb(
                 tag: "key2"
                 value: 3
                 value: 4
+                version: 2
               )pb"));
   EXPECT_NOT_OK(knowledge_bank->Lookup("key3", &result));
 
@@ -248,6 +275,106 @@ TEST_F(LeveldbKnowledgeBankTest, Update) {
   EXPECT_FALSE(knowledge_bank->Contains("key3"));
 }
 
+TEST_F(LeveldbKnowledgeBankTest, Restore) {
+  auto knowledge_bank = CreateKnowledgeBank(
+      /*embedding_dimension=*/2,
+      /*leveldb_address=*/JoinPath(TempDir(), UniqueFilename()),
+      /*num_in_memory_partitions=*/2,
+      /*max_in_memory_write_buffer_size=*/1);
+  EXPECT_OK(knowledge_bank->Update(
+      "key1", ParseTextProtoOrDie<EmbeddingVectorProto>("value: 1 value: 2")));
+
+  // The versions are kept for both existing and new keys.
+  EXPECT_OK(knowledge_bank->Restore(
+      "key1", ParseTextProtoOrDie<EmbeddingVectorProto>(
+                  "value: 3 value: 4 version: 7")));
+  EXPECT_OK(knowledge_bank->Restore(
+      "key2", ParseTextProtoOrDie<EmbeddingVectorProto>(
+                  "value: 5 value: 6 version: 3")));
+  EmbeddingVectorProto result;
+  ASSERT_OK(knowledge_bank->Lookup("key1", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(
+                          "value: 3 value: 4 version: 7"));
+  ASSERT_OK(knowledge_bank->Lookup("key2", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(
+                          "value: 5 value: 6 version: 3"));
+  EXPECT_EQ(2, knowledge_bank->Size());
+
+  // Later updates continue from the restored version.
+  EXPECT_OK(knowledge_bank->Update(
+      "key2", ParseTextProtoOrDie<EmbeddingVectorProto>("value: 0 value: 0")));
+  ASSERT_OK(knowledge_bank->Lookup("key2", &result));
+  EXPECT_EQ(4, result.version());
+}
+
+TEST_F(LeveldbKnowledgeBankTest, UpdateIfVersionMatches) {
+  auto knowledge_bank = CreateKnowledgeBank(
+      /*embedding_dimension=*/2,
+      /*leveldb_address=*/JoinPath(TempDir(), UniqueFilename()),
+      /*num_in_memory_partitions=*/2,
+      /*max_in_memory_write_buffer_size=*/3);
+  EmbeddingVectorProto proto = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    tag: "key1" value: 1 value: 2
+  )pb");
+  EmbeddingVectorProto current;
+  ASSERT_OK(knowledge_bank->UpdateIfVersionMatches("key1", 0, proto, &current));
+  EXPECT_EQ(1, current.version());
+  EXPECT_EQ(absl::StatusCode::kAborted,
+            knowledge_bank->UpdateIfVersionMatches("key1", 0, proto, &current)
+                .code());
+  EXPECT_EQ(1, current.version());
+
+  // Concurrent conditional updates with retries, no update is lost.
+  const int num_threads = 10;
+  std::atomic<int> num_conflicts(0);
+  {
+    ThreadBundle bundle("CasUpdate", num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+      bundle.Add([&knowledge_bank, &num_conflicts]() {
+        EmbeddingVectorProto current;
+        ASSERT_OK(knowledge_bank->Lookup("key1", &current));
+        while (true) {
+          EmbeddingVectorProto value = current;
+          value.set_value(0, value.value(0) + 1);
+          const auto status = knowledge_bank->UpdateIfVersionMatches(
+              "key1", current.version(), value, &current);
+          if (status.ok()) break;
+          ASSERT_EQ(absl::StatusCode::kAborted, status.code());
+          ++num_conflicts;
+        }
+      });
+    }
+    bundle.JoinAll();
+  }
+  ASSERT_OK(knowledge_bank->Lookup("key1", &current));
+  EXPECT_FLOAT_EQ(1 + num_threads, current.value(0));
+  EXPECT_EQ(1 + num_threads, current.version());
+  LOG(INFO) << "Number of conflicts: " << num_conflicts;
+
+  // Conditional updates concurrent with unconditional ones, each of them
+  // increments the version exactly once.
+  {
+    ThreadBundle bundle("MixedUpdate", 2 * num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+      bundle.Add([&knowledge_bank, &proto]() {
+        ASSERT_OK(knowledge_bank->Update("key1", proto));
+      });
+      bundle.Add([&knowledge_bank]() {
+        EmbeddingVectorProto current;
+        ASSERT_OK(knowledge_bank->Lookup("key1", &current));
+        while (!knowledge_bank
+                    ->UpdateIfVersionMatches("key1", current.version(),
+                                             current, &current)
+                    .ok()) {
+        }
+      });
+    }
+    bundle.JoinAll();
+  }
+  ASSERT_OK(knowledge_bank->Lookup("key1", &current));
+  EXPECT_EQ(1 + 3 * num_threads, current.version());
+}
+
 TEST_F(LeveldbKnowledgeBankTest, ExportAndImport) {
   auto knowledge_bank = CreateKnowledgeBank(
       /*embedding_dimension=*/2,
@@ -356,6 +483,292 @@ TEST_F(LeveldbKnowledgeBankTest, ExportAndImport) {
   EXPECT_NOT_OK(knowledge_bank->Import("fake DB"));
 }
 
+TEST_F(LeveldbKnowledgeBankTest, UpdateDuringThrottledExport) {
+  auto knowledge_bank = CreateKnowledgeBank(
+      /*embedding_dimension=*/2,
+      /*leveldb_address=*/JoinPath(TempDir(), UniqueFilename()),
+      /*num_in_memory_partitions=*/2,
+      /*max_in_memory_write_buffer_size=*/1);
+  EmbeddingVectorProto proto;
+  proto.add_value(1);
+  proto.add_value(2);
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_OK(knowledge_bank->Update(absl::StrCat("key", i), proto));
+  }
+  // Measures the bytes written by an export, then exports at a rate that takes
+  // about two seconds.
+  std::string ckpt_path;
+  IoRateLimiter unlimited(/*bytes_per_second=*/1e12, /*burst_bytes=*/0);
+  {
+    ScopedIoRateLimit scoped_limit(&unlimited);
+    ASSERT_OK(knowledge_bank->Export(TempDir(), "throttled", &ckpt_path));
+  }
+  IoRateLimiter limiter(/*bytes_per_second=*/unlimited.TotalBytes() / 2.0,
+                        /*burst_bytes=*/0);
+  absl::Notification export_done;
+  ThreadBundle bundle("exporter", 1);
+  bundle.Add([&]() {
+    ScopedIoRateLimit scoped_limit(&limiter);
+    std::string path;
+    EXPECT_OK(knowledge_bank->Export(TempDir(), "throttled", &path));
+    export_done.Notify();
+  });
+  while (limiter.TotalBytes() == 0) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+
+  // The updates are not blocked by the export.
+  ASSERT_OK(knowledge_bank->Update("key0", proto));
+  ASSERT_OK(knowledge_bank->LookupWithUpdate("new_key", &proto));
+  EXPECT_FALSE(export_done.HasBeenNotified());
+  bundle.JoinAll();
+  EXPECT_GT(limiter.TotalWaitTime(), absl::Seconds(1));
+}
+
+TEST_F(LeveldbKnowledgeBankTest, LazyLoad) {
+  const std::string db_address = JoinPath(TempDir(), UniqueFilename());
+  WriteEmbeddingsToLevelDb(db_address, /*num_keys=*/3);
+  auto knowledge_bank = CreateKnowledgeBank(
+      /*embedding_dimension=*/2, db_address,
+      /*num_in_memory_partitions=*/2,
+      /*max_in_memory_write_buffer_size=*/1, /*lazy_load=*/true);
+
+  // All the keys are visible before any of them is read.
+  EXPECT_EQ(3, knowledge_bank->Size());
+  EXPECT_THAT(knowledge_bank->Keys(),
+              Eq(std::vector<absl::string_view>{"key0", "key1", "key2"}));
+  EXPECT_TRUE(knowledge_bank->Contains("key1"));
+  EXPECT_FALSE(knowledge_bank->Contains("key3"));
+
+  EmbeddingVectorProto result;
+  ASSERT_OK(knowledge_bank->Lookup("key1", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(R"pb(
+                tag: "key1" value: 2 value: 3
+              )pb"));
+  EXPECT_NOT_OK(knowledge_bank->Lookup("key3", &result));
+
+  // An existing key is loaded from the DB instead of being initialized.
+  ASSERT_OK(knowledge_bank->LookupWithUpdate("key2", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(R"pb(
+                tag: "key2" value: 4 value: 5 weight: 1
+              )pb"));
+  ASSERT_OK(knowledge_bank->LookupWithUpdate("key3", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(R"pb(
+                tag: "key3" value: 0 value: 0 weight: 1
+              )pb"));
+  EXPECT_EQ(4, knowledge_bank->Size());
+
+  // An update is not overwritten by the value in the DB.
+  auto proto = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    tag: "key0" value: 10 value: 11
+  )pb");
+  ASSERT_OK(knowledge_bank->Update("key0", proto));
+  ASSERT_OK(knowledge_bank->Lookup("key0", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(R"pb(
+                tag: "key0" value: 10 value: 11 version: 1
+              )pb"));
+  EXPECT_EQ(4, knowledge_bank->Size());
+}
+
+TEST_F(LeveldbKnowledgeBankTest, Remove) {
+  const std::string db_address = JoinPath(TempDir(), UniqueFilename());
+  WriteEmbeddingsToLevelDb(db_address, /*num_keys=*/4);
+  auto knowledge_bank = CreateKnowledgeBank(
+      /*embedding_dimension=*/2, db_address,
+      /*num_in_memory_partitions=*/2,
+      /*max_in_memory_write_buffer_size=*/1, /*lazy_load=*/true);
+  EmbeddingVectorProto result;
+  ASSERT_OK(knowledge_bank->Lookup("key1", &result));
+  ASSERT_OK(knowledge_bank->Update(
+      "key4", ParseTextProtoOrDie<EmbeddingVectorProto>("value: 1 value: 2")));
+
+  // Keys in memory, on disk only and not exported yet are removed, missing
+  // keys are ignored.
+  ASSERT_OK(knowledge_bank->Remove({"key1", "key2", "key4", "key5"}));
+  EXPECT_EQ(2, knowledge_bank->Size());
+  EXPECT_THAT(knowledge_bank->Keys(),
+              Eq(std::vector<absl::string_view>{"key0", "key3"}));
+  EXPECT_FALSE(knowledge_bank->Contains("key1"));
+  EXPECT_FALSE(knowledge_bank->Contains("key2"));
+  EXPECT_NOT_OK(knowledge_bank->Lookup("key2", &result));
+  ASSERT_OK(knowledge_bank->Lookup("key3", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(R"pb(
+                tag: "key3" value: 6 value: 7
+              )pb"));
+
+  // The removed keys are deleted from the DB.
+  knowledge_bank.reset();
+  leveldb::DB* db;
+  ASSERT_OK(leveldb::DB::Open(leveldb::Options(), db_address, &db));
+  std::unique_ptr<leveldb::DB> db_ptr(db);
+  std::string value;
+  EXPECT_TRUE(db->Get(leveldb::ReadOptions(), "key1", &value).IsNotFound());
+  EXPECT_TRUE(db->Get(leveldb::ReadOptions(), "key2", &value).IsNotFound());
+  EXPECT_OK(db->Get(leveldb::ReadOptions(), "key0", &value));
+}
+
+TEST_F(LeveldbKnowledgeBankTest, ConcurrentMisses) {
+  const std::string db_address = JoinPath(TempDir(), UniqueFilename());
+  WriteEmbeddingsToLevelDb(db_address, /*num_keys=*/2);
+  KnowledgeBankConfig config;
+  config.mutable_initializer()->mutable_random_uniform_initializer()->set_low(
+      -1);
+  config.mutable_initializer()->mutable_random_uniform_initializer()->set_high(
+      1);
+  LeveldbKnowledgeBankConfig leveldb_config;
+  leveldb_config.set_leveldb_address(db_address);
+  leveldb_config.set_num_in_memory_partitions(2);
+  leveldb_config.set_max_in_memory_write_buffer_size(1);
+  leveldb_config.set_lazy_load(true);
+  config.mutable_extension()->PackFrom(leveldb_config);
+  auto knowledge_bank = KnowledgeBankFactory::Make(config, /*dimension=*/2);
+  ASSERT_NE(nullptr, knowledge_bank);
+
+  // Many threads miss the same cold key and the same new key at once, they
+  // all see the embedding in the DB and a single random initialization.
+  const int num_threads = 20;
+  std::vector<EmbeddingVectorProto> cold_results(num_threads);
+  std::vector<EmbeddingVectorProto> new_results(num_threads);
+  {
+    ThreadBundle bundle("ConcurrentMisses", num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+      bundle.Add([&, i]() {
+        ASSERT_OK(knowledge_bank->Lookup("key1", &cold_results[i]));
+        ASSERT_OK(knowledge_bank->LookupWithUpdate("key2", &new_results[i]));
+      });
+    }
+    bundle.JoinAll();
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    EXPECT_THAT(cold_results[i], EqualsProto<EmbeddingVectorProto>(R"pb(
+                  tag: "key1" value: 2 value: 3
+                )pb"));
+    ASSERT_EQ(2, new_results[i].value_size());
+    EXPECT_FLOAT_EQ(new_results[0].value(0), new_results[i].value(0));
+    EXPECT_FLOAT_EQ(new_results[0].value(1), new_results[i].value(1));
+  }
+  EXPECT_EQ(3, knowledge_bank->Size());
+  EXPECT_EQ(3, knowledge_bank->Keys().size());
+}
+
+TEST_F(LeveldbKnowledgeBankTest, WarmStart) {
+  KnowledgeBankConfig config;
+  config.mutable_initializer()->mutable_zero_initializer();
+  LeveldbKnowledgeBankConfig leveldb_config;
+  const std::string db_address = JoinPath(TempDir(), UniqueFilename());
+  leveldb_config.set_leveldb_address(db_address);
+  leveldb_config.set_num_in_memory_partitions(2);
+  leveldb_config.set_max_in_memory_write_buffer_size(1);
+  leveldb_config.set_warm_start(true);
+  leveldb_config.set_warm_start_fraction(0.5);
+  config.mutable_extension()->PackFrom(leveldb_config);
+  auto knowledge_bank = KnowledgeBankFactory::Make(config, /*dimension=*/2);
+  ASSERT_NE(nullptr, knowledge_bank);
+
+  // The weight of a key counts its lookups.
+  EmbeddingVectorProto result;
+  for (const auto& key : {"a", "b", "b", "c", "b", "c"}) {
+    ASSERT_OK(knowledge_bank->LookupWithUpdate(key, &result));
+  }
+  ASSERT_OK(knowledge_bank->Update(
+      "d", ParseTextProtoOrDie<EmbeddingVectorProto>("value: 1 value: 2")));
+  std::string ckpt_path;
+  ASSERT_OK(knowledge_bank->Export(TempDir(), "warm", &ckpt_path));
+  std::string profile;
+  ASSERT_OK(ReadFileString(JoinPath(db_address, "carls_access_profile.txt"),
+                           &profile));
+  EXPECT_EQ("b\nc\na\nd", profile);
+
+  // Reloads the DB, all the keys are served whether or not they have been
+  // read in the background yet.
+  knowledge_bank.reset();
+  knowledge_bank = KnowledgeBankFactory::Make(config, /*dimension=*/2);
+  ASSERT_NE(nullptr, knowledge_bank);
+  EXPECT_EQ(4, knowledge_bank->Size());
+  EXPECT_TRUE(knowledge_bank->Contains("d"));
+  EXPECT_FALSE(knowledge_bank->Contains("e"));
+  ASSERT_OK(knowledge_bank->Lookup("b", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(R"pb(
+                tag: "b" value: 0 value: 0 weight: 3
+              )pb"));
+  ASSERT_OK(knowledge_bank->Lookup("a", &result));
+  EXPECT_EQ(1, result.weight());
+  ASSERT_OK(knowledge_bank->LookupWithUpdate("d", &result));
+  EXPECT_THAT(result, EqualsProto<EmbeddingVectorProto>(R"pb(
+                value: 1 value: 2 version: 1 weight: 1
+              )pb"));
+
+  // Invalid fraction.
+  leveldb_config.set_warm_start_fraction(1.5);
+  config.mutable_extension()->PackFrom(leveldb_config);
+  EXPECT_EQ(nullptr, KnowledgeBankFactory::Make(config, /*dimension=*/2));
+}
+
+TEST_F(LeveldbKnowledgeBankTest, BatchLookupAsync) {
+  const std::string db_address = JoinPath(TempDir(), UniqueFilename());
+  WriteEmbeddingsToLevelDb(db_address, /*num_keys=*/100);
+  auto knowledge_bank = CreateKnowledgeBank(
+      /*embedding_dimension=*/2, db_address,
+      /*num_in_memory_partitions=*/10,
+      /*max_in_memory_write_buffer_size=*/1, /*lazy_load=*/true,
+      /*num_io_threads=*/8);
+
+  std::vector<std::string> str_keys;
+  for (int i = 0; i < 101; ++i) {
+    str_keys.push_back(absl::StrCat("key", i));
+  }
+  std::vector<absl::string_view> keys(str_keys.begin(), str_keys.end());
+  absl::Notification done;
+  knowledge_bank->BatchLookupAsync(
+      keys,
+      [&done](std::vector<absl::variant<EmbeddingVectorProto, std::string>>
+                  value_or_errors) {
+        ASSERT_EQ(101, value_or_errors.size());
+        for (int i = 0; i < 100; ++i) {
+          ASSERT_TRUE(absl::holds_alternative<EmbeddingVectorProto>(
+              value_or_errors[i]));
+          const auto& embedding =
+              absl::get<EmbeddingVectorProto>(value_or_errors[i]);
+          EXPECT_EQ(absl::StrCat("key", i), embedding.tag());
+          EXPECT_FLOAT_EQ(2 * i, embedding.value(0));
+        }
+        ASSERT_TRUE(absl::holds_alternative<std::string>(value_or_errors[100]));
+        EXPECT_EQ("Key is not found: key100",
+                  absl::get<std::string>(value_or_errors[100]));
+        done.Notify();
+      });
+  done.WaitForNotification();
+
+  // New keys are initialized by BatchLookupWithUpdateAsync().
+  absl::Notification updated;
+  knowledge_bank->BatchLookupWithUpdateAsync(
+      {"key99", "key100"},
+      [&updated](std::vector<absl::variant<EmbeddingVectorProto, std::string>>
+                     value_or_errors) {
+        ASSERT_EQ(2, value_or_errors.size());
+        ASSERT_TRUE(
+            absl::holds_alternative<EmbeddingVectorProto>(value_or_errors[0]));
+        EXPECT_EQ(1, absl::get<EmbeddingVectorProto>(value_or_errors[0])
+                         .weight());
+        ASSERT_TRUE(
+            absl::holds_alternative<EmbeddingVectorProto>(value_or_errors[1]));
+        EXPECT_EQ("key100",
+                  absl::get<EmbeddingVectorProto>(value_or_errors[1]).tag());
+        updated.Notify();
+      });
+  updated.WaitForNotification();
+  EXPECT_EQ(101, knowledge_bank->Size());
+
+  absl::Notification found;
+  knowledge_bank->LookupAsync(
+      "key100", [&found](absl::Status status, EmbeddingVectorProto result) {
+        EXPECT_OK(status);
+        EXPECT_EQ("key100", result.tag());
+        found.Notify();
+      });
+  found.WaitForNotification();
+}
+
 // This test is known to be flaky.
 TEST_F(LeveldbKnowledgeBankTest, AsyncLookupWithUpdate) {
   auto knowledge_bank = CreateKnowledgeBank(
@@ -15,13 +15,27 @@ limitations under the License.
 
 #include "research/carls/knowledge_bank_grpc_service.h"
 
+#include <algorithm>
+#include <chrono>  // NOLINT
 #include <cstddef>
 
+// Placeholder for internal channel credential  // net
+#include "grpcpp/client_context.h"  // third_party
+#include "grpcpp/create_channel.h"  // third_party
+#include "grpcpp/security/credentials.h"  // third_party
+#include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
+#include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "research/carls/base/file_helper.h"
 #include "research/carls/base/status_helper.h"
+#include "research/carls/knowledge_bank/copy_on_write_knowledge_bank.h"
+#include "research/carls/shard_map_helper.h"
 
 namespace carls {
 namespace {
@@ -29,11 +43,153 @@ namespace {
 using grpc::Status;
 using grpc::StatusCode;
 
+// Default number of rows per ImportRows call of a migration.
+constexpr int kDefaultMigrationBatchSize = 1000;
+
+// Default deadline of each RPC of a migration, which bounds how long the last
+// step of a migration blocks the requests.
+constexpr absl::Duration kDefaultMigrationRpcTimeout = absl::Seconds(10);
+
+// Maximum rounds of forwarding the rows written during a migration before the
+// last round that blocks the requests.
+constexpr int kMaxForwardingRounds = 3;
+
+constexpr char kHotKeySyncThreadName[] = "HotKeySync";
+
+// Deadline of each RPC of the hot key sync, so that an unreachable KBS does
+// not stall the sync of the other sessions.
+constexpr absl::Duration kHotKeySyncRpcTimeout = absl::Seconds(10);
+
+constexpr char kCheckpointThreadName[] = "Checkpoint";
+
+// How often the background thread checks if a checkpoint is due.
+constexpr absl::Duration kCheckpointPollInterval = absl::Seconds(1);
+
+// Sends the current embeddings of `keys` to another KBS in batches of
+// `batch_size`, each within `rpc_timeout`, and adds the size of the sent rows
+// to `num_bytes`. `transform`, if set, is applied to the sent copies.
+Status SendRows(KnowledgeBankService::Stub* stub,
+                const std::string& session_handle,
+                const KnowledgeBank& knowledge_bank,
+                const std::vector<std::string>& keys, const int batch_size,
+                const KnowledgeBank::RowTransform& transform,
+                const absl::Duration rpc_timeout, int64_t* num_bytes) {
+  for (size_t begin = 0; begin < keys.size(); begin += batch_size) {
+    const size_t end = std::min(keys.size(), begin + batch_size);
+    ImportRowsRequest request;
+    request.set_session_handle(session_handle);
+    auto& rows = *request.mutable_rows();
+    for (size_t i = begin; i < end; ++i) {
+      EmbeddingVectorProto value;
+      if (knowledge_bank.Lookup(keys[i], &value).ok()) {
+        if (transform != nullptr) {
+          transform(&value);
+        }
+        rows[keys[i]] = std::move(value);
+      }
+    }
+    *num_bytes += request.ByteSizeLong();
+    grpc::ClientContext context;
+    context.set_deadline(absl::ToChronoTime(absl::Now() + rpc_timeout));
+    ImportRowsResponse response;
+    const auto status = stub->ImportRows(&context, request, &response);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return Status::OK;
+}
+
+// Sends a shard map to another KBS within `rpc_timeout`.
+Status SendShardMap(KnowledgeBankService::Stub* stub,
+                    const SetShardMapRequest& request,
+                    const absl::Duration rpc_timeout) {
+  grpc::ClientContext context;
+  context.set_deadline(absl::ToChronoTime(absl::Now() + rpc_timeout));
+  SetShardMapResponse response;
+  return stub->SetShardMap(&context, request, &response);
+}
+
+// Returns the key of the knowledge bank for an integer key, which is its
+// decimal string so that it shares the embedding of the same string key. The
+// knowledge banks have no integer keyed storage, so every integer key of an
+// RPC is converted here on the server.
+std::string IntKeyToString(const int64_t key) { return absl::StrCat(key); }
+
+// Adds the rows of integer keys to the rows of string keys.
+void AddIntKeyedRows(
+    const google::protobuf::Map<int64_t, EmbeddingVectorProto>& int_rows,
+    google::protobuf::Map<std::string, EmbeddingVectorProto>* rows) {
+  for (const auto& pair : int_rows) {
+    (*rows)[IntKeyToString(pair.first)] = pair.second;
+  }
+}
+
+// Returns `request` with the rows of its integer keys moved to the rows of
+// their decimal strings in `string_keyed_request`, or `request` itself if it
+// has no integer keys.
+const UpdateRequest* ToStringKeyedUpdate(const UpdateRequest* request,
+                                         UpdateRequest* string_keyed_request) {
+  if (request->int_values().empty() && request->int_gradients().empty()) {
+    return request;
+  }
+  string_keyed_request->set_session_handle(request->session_handle());
+  *string_keyed_request->mutable_values() = request->values();
+  *string_keyed_request->mutable_gradients() = request->gradients();
+  *string_keyed_request->mutable_expected_versions() =
+      request->expected_versions();
+  AddIntKeyedRows(request->int_values(),
+                  string_keyed_request->mutable_values());
+  AddIntKeyedRows(request->int_gradients(),
+                  string_keyed_request->mutable_gradients());
+  return string_keyed_request;
+}
+
 }  // namespace
 
+class KnowledgeBankGrpcServiceImpl::RangeChangeTracker
+    : public KnowledgeBankObserver {
+ public:
+  RangeChangeTracker(const uint64_t first_hash, const uint64_t last_hash)
+      : first_hash_(first_hash), last_hash_(last_hash) {}
+
+  void OnChanges(const std::vector<KnowledgeBankChange>& changes) override {
+    absl::MutexLock l(&mu_);
+    for (const auto& change : changes) {
+      const uint64_t hash = ShardKeyHash(change.key);
+      if (hash >= first_hash_ && hash <= last_hash_) {
+        changed_keys_.insert(change.key);
+      }
+    }
+  }
+
+  // Returns the keys changed since the last call.
+  std::vector<std::string> TakeChangedKeys() {
+    absl::MutexLock l(&mu_);
+    std::vector<std::string> keys(changed_keys_.begin(), changed_keys_.end());
+    changed_keys_.clear();
+    return keys;
+  }
+
+ private:
+  const uint64_t first_hash_;
+  const uint64_t last_hash_;
+  absl::Mutex mu_;
+  absl::flat_hash_set<std::string> changed_keys_ ABSL_GUARDED_BY(mu_);
+};
+
 KnowledgeBankGrpcServiceImpl::KnowledgeBankGrpcServiceImpl() {}
 
-KnowledgeBankGrpcServiceImpl::~KnowledgeBankGrpcServiceImpl() {}
+KnowledgeBankGrpcServiceImpl::~KnowledgeBankGrpcServiceImpl() {
+  stop_checkpoint_.Notify();
+  checkpoint_bundle_.reset();
+  stop_hot_key_sync_.Notify();
+  hot_key_sync_bundle_.reset();
+  // Stops delivering changes to the samplers before they are destroyed.
+  for (const auto& pair : cs_observer_map_) {
+    kb_map_[pair.first]->RemoveObserver(pair.second.get());
+  }
+}
 
 Status KnowledgeBankGrpcServiceImpl::StartSession(
     grpc::ServerContext* context, const StartSessionRequest* request,
@@ -58,7 +214,7 @@ Status KnowledgeBankGrpcServiceImpl::Lookup(grpc::ServerContext* context,
   if (request->session_handle().empty()) {
     return Status(StatusCode::INVALID_ARGUMENT, "session_handle is empty.");
   }
-  if (request->key().empty()) {
+  if (request->key().empty() && request->int_key().empty()) {
     return Status(StatusCode::INVALID_ARGUMENT, "Empty input keys.");
   }
   const auto status = StartSessionIfNecessary(
@@ -67,29 +223,162 @@ Status KnowledgeBankGrpcServiceImpl::Lookup(grpc::ServerContext* context,
   if (!status.ok()) {
     return status;
   }
-  std::vector<absl::string_view> keys(request->key().begin(),
-                                      request->key().end());
+  return LookupInSession(context, request->session_handle(), *request,
+                         response);
+}
 
-  absl::ReaderMutexLock lock(&map_mu_);
-  std::vector<absl::variant<EmbeddingVectorProto, std::string>> value_or_errors;
-  if (request->update()) {
-    kb_map_[request->session_handle()]->BatchLookupWithUpdate(keys,
-                                                              &value_or_errors);
-  } else {
-    kb_map_[request->session_handle()]->BatchLookup(keys, &value_or_errors);
+Status KnowledgeBankGrpcServiceImpl::LookupInSession(
+    grpc::ServerContext* context, const std::string& session_handle,
+    const LookupRequest& request, LookupResponse* response) {
+  if (request.has_worker_clock()) {
+    absl::Duration wait_time;
+    const auto wait_status = WaitForStaleness(
+        context, session_handle, request.worker_clock(), &wait_time);
+    response->set_staleness_wait_seconds(absl::ToDoubleSeconds(wait_time));
+    if (!wait_status.ok()) {
+      return wait_status;
+    }
   }
-  if (value_or_errors.size() != keys.size()) {
-    return Status(StatusCode::INTERNAL,
-                  "Inconsistent result returned by BatchLookup()");
+  std::vector<std::string> int_key_strings;
+  int_key_strings.reserve(request.int_key_size());
+  for (const int64_t key : request.int_key()) {
+    int_key_strings.push_back(IntKeyToString(key));
   }
+  std::vector<absl::string_view> keys(request.key().begin(),
+                                      request.key().end());
+  keys.insert(keys.end(), int_key_strings.begin(), int_key_strings.end());
+
+  // The lookup is waited for without map_mu_, so that the reads from disk do
+  // not block the writers of all the sessions. lookups_mu_ is held instead so
+  // that MigrateRange() can wait for the lookups in flight, which may insert
+  // keys.
+  absl::ReaderMutexLock lookups_lock(&lookups_mu_);
   auto& embedding_table = *response->mutable_embedding_table();
-  for (size_t i = 0; i < keys.size(); ++i) {
-    if (!absl::holds_alternative<EmbeddingVectorProto>(value_or_errors[i])) {
-      continue;
+  std::shared_ptr<KnowledgeBank> knowledge_bank;
+  bool update = false;
+  const GradientDescentOptimizer* optimizer = nullptr;
+  {
+    absl::ReaderMutexLock lock(&map_mu_);
+    std::vector<absl::string_view> replicated_keys;
+    auto* replicator =
+        SplitReplicatedKeys(session_handle, &keys, &replicated_keys);
+    const auto assigned_status = CheckKeysAssigned(session_handle, keys);
+    if (!assigned_status.ok()) {
+      return assigned_status;
+    }
+    if (replicator != nullptr) {
+      replicator->RecordOwnedReads(keys);
+      for (const auto& key : replicated_keys) {
+        EmbeddingVectorProto value;
+        if (replicator->LookupReplica(key, &value)) {
+          embedding_table[std::string(key)] = std::move(value);
+        }
+      }
+    }
+    knowledge_bank = kb_map_[session_handle];
+    // A read-only session never adds new keys to its shared table.
+    update =
+        request.update() && !read_only_sessions_.contains(session_handle);
+    const auto gd_iter = gd_map_.find(session_handle);
+    if (gd_iter != gd_map_.end() && gd_iter->second->has_weight_decay()) {
+      optimizer = gd_iter->second.get();
+    }
+  }
+  if (!keys.empty()) {
+    // Uses the asynchronous lookup so that a knowledge bank backed by disk can
+    // read all the keys concurrently, the handler only waits once per
+    // request.
+    std::vector<absl::variant<EmbeddingVectorProto, std::string>>
+        value_or_errors;
+    absl::Notification lookup_done;
+    auto done =
+        [&value_or_errors, &lookup_done](
+            std::vector<absl::variant<EmbeddingVectorProto, std::string>>
+                results) {
+          value_or_errors = std::move(results);
+          lookup_done.Notify();
+        };
+    if (update) {
+      knowledge_bank->BatchLookupWithUpdateAsync(keys, done);
+    } else {
+      knowledge_bank->BatchLookupAsync(keys, done);
+    }
+    lookup_done.WaitForNotification();
+    if (value_or_errors.size() != keys.size()) {
+      return Status(StatusCode::INTERNAL,
+                    "Inconsistent result returned by BatchLookup()");
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (!absl::holds_alternative<EmbeddingVectorProto>(value_or_errors[i])) {
+        continue;
+      }
+      embedding_table[std::string(keys[i])] =
+          std::move(absl::get<EmbeddingVectorProto>(value_or_errors[i]));
     }
-    embedding_table[request->key(i)] =
-        std::move(absl::get<EmbeddingVectorProto>(value_or_errors[i]));
   }
+
+  // The weight decay since the rows were last updated is only applied to the
+  // returned values. It changes the values without changing their versions,
+  // so the decayed rows are always returned. The replicas are already decayed
+  // by their owners, whose steps differ from the steps here.
+  absl::flat_hash_set<std::string> decayed_keys;
+  if (optimizer != nullptr) {
+    for (const auto& key : keys) {
+      auto iter = embedding_table.find(std::string(key));
+      if (iter == embedding_table.end()) {
+        continue;
+      }
+      const int64_t decay_step = iter->second.decay_step();
+      optimizer->ApplyWeightDecay(&iter->second);
+      if (iter->second.decay_step() != decay_step) {
+        decayed_keys.insert(iter->first);
+      }
+    }
+  }
+
+  // Moves the embeddings of the integer keys into int_embedding_table, unless
+  // the same keys are also requested as strings. The embeddings unchanged
+  // since the versions known by the client are dropped.
+  int64_t num_not_modified = 0;
+  if (!int_key_strings.empty()) {
+    const absl::flat_hash_set<absl::string_view> string_keys(
+        request.key().begin(), request.key().end());
+    auto& int_embedding_table = *response->mutable_int_embedding_table();
+    for (int i = 0; i < request.int_key_size(); ++i) {
+      auto iter = embedding_table.find(int_key_strings[i]);
+      if (iter == embedding_table.end()) {
+        continue;
+      }
+      const auto version_iter =
+          request.known_int_versions().find(request.int_key(i));
+      const bool not_modified =
+          version_iter != request.known_int_versions().end() &&
+          version_iter->second == iter->second.version() &&
+          !decayed_keys.contains(int_key_strings[i]);
+      if (not_modified) {
+        response->add_not_modified_int_key(request.int_key(i));
+        ++num_not_modified;
+      } else if (string_keys.contains(int_key_strings[i])) {
+        int_embedding_table[request.int_key(i)] = iter->second;
+      } else {
+        int_embedding_table[request.int_key(i)] = std::move(iter->second);
+      }
+      if (!string_keys.contains(int_key_strings[i])) {
+        embedding_table.erase(iter);
+      }
+    }
+  }
+  for (const auto& pair : request.known_versions()) {
+    auto iter = embedding_table.find(pair.first);
+    if (iter != embedding_table.end() &&
+        iter->second.version() == pair.second &&
+        !decayed_keys.contains(pair.first)) {
+      response->add_not_modified_key(pair.first);
+      embedding_table.erase(iter);
+      ++num_not_modified;
+    }
+  }
+  num_not_modified_rows_ += num_not_modified;
   return Status::OK;
 }
 
@@ -99,6 +388,8 @@ Status KnowledgeBankGrpcServiceImpl::Update(grpc::ServerContext* context,
   if (request->session_handle().empty()) {
     return Status(StatusCode::INVALID_ARGUMENT, "session_handle is empty.");
   }
+  UpdateRequest string_keyed_request;
+  request = ToStringKeyedUpdate(request, &string_keyed_request);
   if (request->values().empty() && request->gradients().empty()) {
     return Status(StatusCode::INVALID_ARGUMENT, "input is empty.");
   }
@@ -108,47 +399,129 @@ Status KnowledgeBankGrpcServiceImpl::Update(grpc::ServerContext* context,
   if (!status.ok()) {
     return status;
   }
+  return UpdateInSession(request->session_handle(), *request, response);
+}
 
-  if (!request->values().empty()) {
+Status KnowledgeBankGrpcServiceImpl::UpdateInSession(
+    const std::string& session_handle, const UpdateRequest& request,
+    UpdateResponse* response) {
+  {
+    absl::ReaderMutexLock lock(&map_mu_);
+    const auto writable_status = CheckWritable(session_handle);
+    if (!writable_status.ok()) {
+      return writable_status;
+    }
+    const auto iter = checkpoint_map_.find(session_handle);
+    if (iter != checkpoint_map_.end()) {
+      ++iter->second->num_updates;
+    }
+  }
+
+  if (!request.values().empty()) {
     std::vector<absl::string_view> keys;
     std::vector<EmbeddingVectorProto> values;
-    keys.reserve(request->values_size());
-    values.reserve(request->values_size());
-    for (const auto& iter : request->values()) {
+    // Keys with expected versions are updated conditionally.
+    std::vector<absl::string_view> conditional_keys;
+    std::vector<EmbeddingVectorProto> conditional_values;
+    std::vector<int64_t> expected_versions;
+    keys.reserve(request.values_size());
+    values.reserve(request.values_size());
+    for (const auto& iter : request.values()) {
+      const auto version_iter = request.expected_versions().find(iter.first);
+      if (version_iter != request.expected_versions().end()) {
+        conditional_keys.push_back(iter.first);
+        conditional_values.push_back(iter.second);
+        expected_versions.push_back(version_iter->second);
+        continue;
+      }
       keys.push_back(iter.first);
       values.push_back(iter.second);
     }
 
-    absl::WriterMutexLock lock(&map_mu_);
-    kb_map_[request->session_handle()]->BatchUpdate(keys, values);
+    if (!keys.empty()) {
+      absl::WriterMutexLock lock(&map_mu_);
+      const auto assigned_status = CheckKeysAssigned(session_handle, keys);
+      if (!assigned_status.ok()) {
+        return assigned_status;
+      }
+      kb_map_[session_handle]->BatchUpdate(keys, values);
+    }
+    if (!conditional_keys.empty()) {
+      // Conflicts are detected by the knowledge bank, so a reader lock on the
+      // maps is sufficient.
+      absl::ReaderMutexLock lock(&map_mu_);
+      const auto assigned_status =
+          CheckKeysAssigned(session_handle, conditional_keys);
+      if (!assigned_status.ok()) {
+        return assigned_status;
+      }
+      std::vector<EmbeddingVectorProto> current_values;
+      const auto statuses =
+          kb_map_.find(session_handle)
+              ->second->BatchUpdateIfVersionMatches(
+                  conditional_keys, conditional_values, expected_versions,
+                  &current_values);
+      num_conditional_updates_ += conditional_keys.size();
+      for (size_t i = 0; i < conditional_keys.size(); ++i) {
+        if (statuses[i].code() == absl::StatusCode::kAborted) {
+          ++num_update_conflicts_;
+          (*response->mutable_conflicts())[std::string(conditional_keys[i])] =
+              std::move(current_values[i]);
+        } else if (!statuses[i].ok()) {
+          return ToGrpcStatus(statuses[i]);
+        }
+      }
+    }
   }
 
-  if (!request->gradients().empty()) {
+  if (!request.gradients().empty()) {
     // Collect variables and gradients.
     std::vector<absl::string_view> keys;
     std::vector<absl::string_view> valid_keys;
     std::vector<EmbeddingVectorProto> embeddings;
     std::vector<const EmbeddingVectorProto*> gradients;
-    keys.reserve(request->gradients().size());
-    valid_keys.reserve(request->gradients().size());
-    embeddings.reserve(request->gradients().size());
-    gradients.reserve(request->gradients().size());
-    for (auto& pair : request->gradients()) {
+    keys.reserve(request.gradients().size());
+    valid_keys.reserve(request.gradients().size());
+    embeddings.reserve(request.gradients().size());
+    gradients.reserve(request.gradients().size());
+    for (auto& pair : request.gradients()) {
       keys.push_back(pair.first);
       gradients.push_back(&pair.second);
     }
 
     absl::WriterMutexLock lock(&map_mu_);
-    if (!gd_map_.contains(request->session_handle())) {
+    if (!gd_map_.contains(session_handle)) {
       return Status(StatusCode::INTERNAL,
                     "Optimizer is not created, did you forget to add "
                     "gradient_descent_config in DynamicEmbeddingConfig?");
     }
+    // The gradients of the hot keys replicated here are applied by their
+    // owners at the next sync.
+    std::vector<absl::string_view> replicated_keys;
+    auto* replicator =
+        SplitReplicatedKeys(session_handle, &keys, &replicated_keys);
+    const auto assigned_status = CheckKeysAssigned(session_handle, keys);
+    if (!assigned_status.ok()) {
+      return assigned_status;
+    }
+    if (replicator != nullptr && !replicated_keys.empty()) {
+      gradients.clear();
+      for (const auto& key : replicated_keys) {
+        replicator->AddReplicaGradient(
+            key, request.gradients().at(std::string(key)));
+      }
+      for (const auto& key : keys) {
+        gradients.push_back(&request.gradients().at(std::string(key)));
+      }
+      if (keys.empty()) {
+        return Status::OK;
+      }
+    }
 
     // Step One: find the embeddings of given keys.
     std::vector<absl::variant<EmbeddingVectorProto, std::string>>
         value_or_errors;
-    kb_map_[request->session_handle()]->BatchLookup(keys, &value_or_errors);
+    kb_map_[session_handle]->BatchLookup(keys, &value_or_errors);
 
     if (value_or_errors.size() != keys.size()) {
       return Status(StatusCode::INTERNAL,
@@ -168,8 +541,8 @@ Status KnowledgeBankGrpcServiceImpl::Update(grpc::ServerContext* context,
 
     // Step Two: apply gradient update.
     std::string error_msg;
-    auto updated_embeddings = gd_map_[request->session_handle()]->Apply(
-        embeddings, gradients, &error_msg);
+    auto updated_embeddings =
+        gd_map_[session_handle]->Apply(embeddings, gradients, &error_msg);
     if (updated_embeddings.empty()) {
       return Status(
           StatusCode::INTERNAL,
@@ -177,12 +550,43 @@ Status KnowledgeBankGrpcServiceImpl::Update(grpc::ServerContext* context,
     }
 
     // Step Three: update the embeddings.
-    kb_map_[request->session_handle()]->BatchUpdate(valid_keys,
-                                                    updated_embeddings);
+    kb_map_[session_handle]->BatchUpdate(valid_keys, updated_embeddings);
   }
   return Status::OK;
 }
 
+Status KnowledgeBankGrpcServiceImpl::UpdateAndLookup(
+    grpc::ServerContext* context, const UpdateAndLookupRequest* request,
+    UpdateAndLookupResponse* response) {
+  if (request->session_handle().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "session_handle is empty.");
+  }
+  if (request->lookup().key().empty() && request->lookup().int_key().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "Empty input keys.");
+  }
+  const auto status = StartSessionIfNecessary(
+      request->session_handle(), /*require_candidate_sampler=*/false,
+      /*require_memory_store=*/false);
+  if (!status.ok()) {
+    return status;
+  }
+
+  // An empty update, e.g., when all the gradients are dropped by the client,
+  // is skipped.
+  UpdateRequest string_keyed_request;
+  const UpdateRequest* update =
+      ToStringKeyedUpdate(&request->update(), &string_keyed_request);
+  if (!update->values().empty() || !update->gradients().empty()) {
+    const auto update_status = UpdateInSession(
+        request->session_handle(), *update, response->mutable_update());
+    if (!update_status.ok()) {
+      return update_status;
+    }
+  }
+  return LookupInSession(context, request->session_handle(), request->lookup(),
+                         response->mutable_lookup());
+}
+
 grpc::Status KnowledgeBankGrpcServiceImpl::Sample(grpc::ServerContext* context,
                                                   const SampleRequest* request,
                                                   SampleResponse* response) {
@@ -200,8 +604,11 @@ grpc::Status KnowledgeBankGrpcServiceImpl::Sample(grpc::ServerContext* context,
   }
   absl::MutexLock lock(&map_mu_);
   auto& knowledge_bank = *kb_map_[request->session_handle()];
+  auto& sampler = *cs_map_[request->session_handle()];
+  const bool update = request->update() &&
+                      !read_only_sessions_.contains(request->session_handle());
   // Add new keys into the knowledge bank if necessary.
-  if (request->update()) {
+  if (update) {
     absl::flat_hash_set<absl::string_view> keys;
     for (const auto& context : request->sample_context()) {
       for (const auto& key : context.positive_key()) {
@@ -213,15 +620,34 @@ grpc::Status KnowledgeBankGrpcServiceImpl::Sample(grpc::ServerContext* context,
     if (!keys.empty()) {
       std::vector<absl::variant<EmbeddingVectorProto, std::string>> results;
       std::vector<absl::string_view> positive_keys(keys.begin(), keys.end());
+      const auto assigned_status =
+          CheckKeysAssigned(request->session_handle(), positive_keys);
+      if (!assigned_status.ok()) {
+        return assigned_status;
+      }
       knowledge_bank.BatchLookupWithUpdate(positive_keys, &results);
+      // The changes of the knowledge bank reach an incremental sampler
+      // asynchronously, so the new keys are inserted here to be sampled by
+      // this request already.
+      if (sampler.IsIncremental()) {
+        for (size_t i = 0; i < positive_keys.size(); ++i) {
+          if (absl::holds_alternative<EmbeddingVectorProto>(results[i])) {
+            const auto insert_status = sampler.InsertOrUpdate(
+                positive_keys[i], absl::get<EmbeddingVectorProto>(results[i]));
+            if (!insert_status.ok()) {
+              return ToGrpcStatus(insert_status);
+            }
+          }
+        }
+      }
     }
   }
 
   for (const auto& sample_context : request->sample_context()) {
     std::vector<std::pair<absl::string_view, candidate_sampling::SampledResult>>
         results;
-    auto status = cs_map_[request->session_handle()]->Sample(
-        knowledge_bank, sample_context, request->num_samples(), &results);
+    auto status = sampler.Sample(knowledge_bank, sample_context,
+                                 request->num_samples(), &results);
     if (!status.ok()) {
       return ToGrpcStatus(status);
     }
@@ -230,6 +656,9 @@ grpc::Status KnowledgeBankGrpcServiceImpl::Sample(grpc::ServerContext* context,
       *samples->add_sampled_result() = std::move(pair.second);
     }
   }
+  if (update) {
+    CreateHierarchicalSoftmaxNodes(&knowledge_bank, response);
+  }
   return Status::OK;
 }
 
@@ -298,12 +727,25 @@ Status KnowledgeBankGrpcServiceImpl::Export(grpc::ServerContext* context,
   }
   StartSessionRequest start_request;
   start_request.ParseFromString(request->session_handle());
-  absl::MutexLock lock(&map_mu_);
-  if (kb_map_.contains(request->session_handle())) {
-    return ToGrpcStatus(kb_map_[request->session_handle()]->Export(
+  std::shared_ptr<KnowledgeBank> knowledge_bank;
+  KnowledgeBank::RowTransform weight_decay;
+  {
+    absl::ReaderMutexLock lock(&map_mu_);
+    const auto kb_iter = kb_map_.find(request->session_handle());
+    if (kb_iter != kb_map_.end()) {
+      knowledge_bank = kb_iter->second;
+      weight_decay = WeightDecayTransform(request->session_handle());
+    }
+  }
+  // The knowledge bank is exported without holding map_mu_, which would block
+  // the requests of all the sessions.
+  if (knowledge_bank != nullptr) {
+    return ToGrpcStatus(knowledge_bank->Export(
         request->export_directory(), start_request.name(),
-        response->mutable_knowledge_bank_saved_path()));
-  } else if (ms_map_.contains(request->session_handle())) {
+        response->mutable_knowledge_bank_saved_path(), weight_decay));
+  }
+  absl::MutexLock lock(&map_mu_);
+  if (ms_map_.contains(request->session_handle())) {
     return ToGrpcStatus(ms_map_[request->session_handle()]->Export(
         request->export_directory(), start_request.name(),
         response->mutable_memory_store_saved_path()));
@@ -327,10 +769,15 @@ Status KnowledgeBankGrpcServiceImpl::Import(grpc::ServerContext* context,
   }
   absl::MutexLock lock(&map_mu_);
   if (kb_map_.contains(request->session_handle())) {
+    const auto writable_status = CheckWritable(request->session_handle());
+    if (!writable_status.ok()) {
+      return writable_status;
+    }
     if (request->knowledge_bank_saved_path().empty()) {
       return Status(StatusCode::INVALID_ARGUMENT,
                     "knowledge_bank_saved_path is empty.");
     }
+    // The exported rows carry no decay_step, see WeightDecayTransform().
     return ToGrpcStatus(kb_map_[request->session_handle()]->Import(
         request->knowledge_bank_saved_path()));
   } else if (ms_map_.contains(request->session_handle())) {
@@ -345,9 +792,703 @@ Status KnowledgeBankGrpcServiceImpl::Import(grpc::ServerContext* context,
                 "Neither KnowledgeStore nor MemoryStore is initialized.");
 }
 
+Status KnowledgeBankGrpcServiceImpl::GetShardMap(
+    grpc::ServerContext* context, const GetShardMapRequest* request,
+    GetShardMapResponse* response) {
+  if (request->session_handle().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "session_handle is empty.");
+  }
+  absl::ReaderMutexLock lock(&map_mu_);
+  const auto iter = shard_state_map_.find(request->session_handle());
+  if (iter != shard_state_map_.end()) {
+    *response->mutable_shard_map() = iter->second.shard_map;
+  }
+  const auto replicator_iter = hot_key_map_.find(request->session_handle());
+  if (replicator_iter != hot_key_map_.end()) {
+    const auto& replicator = *replicator_iter->second;
+    for (auto& key : replicator.HotKeys()) {
+      response->add_hot_key(std::move(key));
+    }
+    response->set_num_owned_reads(replicator.NumOwnedReads());
+    response->set_num_replica_reads(replicator.NumReplicaReads());
+  }
+  return Status::OK;
+}
+
+Status KnowledgeBankGrpcServiceImpl::SetShardMap(
+    grpc::ServerContext* context, const SetShardMapRequest* request,
+    SetShardMapResponse* response) {
+  if (request->session_handle().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "session_handle is empty.");
+  }
+  if (request->kbs_address().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "kbs_address is empty.");
+  }
+  const auto valid_status = ValidateShardMap(request->shard_map());
+  if (!valid_status.ok()) {
+    return ToGrpcStatus(valid_status);
+  }
+  const auto status = StartSessionIfNecessary(
+      request->session_handle(), /*require_candidate_sampler=*/false,
+      /*require_memory_store=*/false);
+  if (!status.ok()) {
+    return status;
+  }
+  absl::WriterMutexLock lock(&map_mu_);
+  auto& shard_state = shard_state_map_[request->session_handle()];
+  if (request->shard_map().version() < shard_state.shard_map.version()) {
+    return Status(StatusCode::FAILED_PRECONDITION,
+                  absl::StrCat("Shard map version ",
+                               request->shard_map().version(),
+                               " is older than the current version ",
+                               shard_state.shard_map.version()));
+  }
+  shard_state.shard_map = request->shard_map();
+  shard_state.kbs_address = request->kbs_address();
+  if (request->has_hot_key_config() &&
+      !hot_key_map_.contains(request->session_handle())) {
+    hot_key_map_[request->session_handle()] =
+        absl::make_unique<HotKeyReplicator>(request->hot_key_config());
+    const int64_t interval_ms = request->hot_key_config().sync_interval_ms();
+    if (interval_ms > 0 && hot_key_sync_bundle_ == nullptr) {
+      hot_key_sync_bundle_ = absl::make_unique<ThreadBundle>(
+          kHotKeySyncThreadName, /*num_threads=*/1);
+      hot_key_sync_bundle_->Add([this, interval_ms]() {
+        while (!stop_hot_key_sync_.WaitForNotificationWithTimeout(
+            absl::Milliseconds(interval_ms))) {
+          SyncHotKeys();
+        }
+      });
+    }
+  }
+  return Status::OK;
+}
+
+Status KnowledgeBankGrpcServiceImpl::MigrateRange(
+    grpc::ServerContext* context, const MigrateRangeRequest* request,
+    MigrateRangeResponse* response) {
+  if (request->session_handle().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "session_handle is empty.");
+  }
+  if (request->target_address().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "target_address is empty.");
+  }
+  if (request->first_hash() > request->last_hash()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "Invalid range of hashes.");
+  }
+  const std::string& session_handle = request->session_handle();
+  KnowledgeBank* knowledge_bank = nullptr;
+  KnowledgeBank::RowTransform weight_decay;
+  {
+    absl::WriterMutexLock lock(&map_mu_);
+    const auto iter = shard_state_map_.find(session_handle);
+    if (!kb_map_.contains(session_handle) || iter == shard_state_map_.end()) {
+      return Status(StatusCode::FAILED_PRECONDITION,
+                    "Session is not sharded, did you forget to call "
+                    "SetShardMap()?");
+    }
+    auto& shard_state = iter->second;
+    if (shard_state.kbs_address == request->target_address()) {
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    "Cannot migrate a range to the same KBS.");
+    }
+    if (!IsRangeAssignedTo(shard_state.shard_map, request->first_hash(),
+                           request->last_hash(), shard_state.kbs_address)) {
+      return Status(StatusCode::FAILED_PRECONDITION,
+                    "Range is not assigned to this KBS.");
+    }
+    if (shard_state.migrating) {
+      return Status(StatusCode::ABORTED,
+                    "Another migration of the session is in progress.");
+    }
+    shard_state.migrating = true;
+    knowledge_bank = kb_map_[session_handle].get();
+    weight_decay = WeightDecayTransform(session_handle);
+  }
+
+  // Tracks the writes before taking the snapshot of the keys, so that every
+  // row changed after the snapshot is forwarded again.
+  auto tracker = std::make_shared<RangeChangeTracker>(request->first_hash(),
+                                                      request->last_hash());
+  knowledge_bank->AddObserver(tracker);
+  const auto status = MigrateRangeInternal(*request, knowledge_bank,
+                                           weight_decay, tracker.get(),
+                                           response);
+  knowledge_bank->RemoveObserver(tracker.get());
+
+  absl::WriterMutexLock lock(&map_mu_);
+  shard_state_map_[session_handle].migrating = false;
+  return status;
+}
+
+Status KnowledgeBankGrpcServiceImpl::MigrateRangeInternal(
+    const MigrateRangeRequest& request, KnowledgeBank* knowledge_bank,
+    const KnowledgeBank::RowTransform& weight_decay,
+    RangeChangeTracker* tracker, MigrateRangeResponse* response) {
+  const absl::Time start_time = absl::Now();
+  const std::string& session_handle = request.session_handle();
+  const int batch_size = request.batch_size() > 0 ? request.batch_size()
+                                                  : kDefaultMigrationBatchSize;
+  const absl::Duration rpc_timeout =
+      request.rpc_timeout_ms() > 0
+          ? absl::Milliseconds(request.rpc_timeout_ms())
+          : kDefaultMigrationRpcTimeout;
+  std::unique_ptr</*grpc_gen::*/KnowledgeBankService::Stub> stub =
+      /*grpc_gen::*/KnowledgeBankService::NewStub(grpc::CreateChannel(
+          request.target_address(), grpc::InsecureChannelCredentials()));
+  int64_t num_bytes = 0;
+
+  // Step One: copy the rows in the range from a snapshot of the keys.
+  std::vector<std::string> keys;
+  for (const auto& key : knowledge_bank->Keys()) {
+    const uint64_t hash = ShardKeyHash(key);
+    if (hash >= request.first_hash() && hash <= request.last_hash()) {
+      keys.emplace_back(key);
+    }
+  }
+  auto status = SendRows(stub.get(), session_handle, *knowledge_bank, keys,
+                         batch_size, weight_decay, rpc_timeout, &num_bytes);
+  if (!status.ok()) {
+    return status;
+  }
+  response->set_num_copied_rows(keys.size());
+
+  // Step Two: forward the rows written during the previous round, until only
+  // a few of them are left.
+  int64_t num_forwarded_rows = 0;
+  for (int round = 0; round < kMaxForwardingRounds; ++round) {
+    knowledge_bank->FlushChanges();
+    keys = tracker->TakeChangedKeys();
+    if (keys.empty()) {
+      break;
+    }
+    status = SendRows(stub.get(), session_handle, *knowledge_bank, keys,
+                      batch_size, weight_decay, rpc_timeout, &num_bytes);
+    if (!status.ok()) {
+      return status;
+    }
+    num_forwarded_rows += keys.size();
+    if (keys.size() <= static_cast<size_t>(batch_size)) {
+      break;
+    }
+  }
+
+  // Step Three: switch the shard map of this KBS, which rejects the later
+  // writes to the range, once the writes and lookups in flight are done. Then
+  // forward the remaining rows and switch the shard map of the target without
+  // blocking the other requests. The range is not served for at most a few
+  // RPC deadlines. The migration is aborted if an RPC fails, the rows already
+  // sent to the target are not served by it until the range is assigned to
+  // it.
+  ShardMap original_map;
+  ShardMap shard_map;
+  std::string kbs_address;
+  {
+    absl::WriterMutexLock lock(&map_mu_);
+    auto& shard_state = shard_state_map_[session_handle];
+    if (!IsRangeAssignedTo(shard_state.shard_map, request.first_hash(),
+                           request.last_hash(), shard_state.kbs_address)) {
+      return Status(StatusCode::FAILED_PRECONDITION,
+                    "Shard map changed during the migration.");
+    }
+    original_map = shard_state.shard_map;
+    shard_map = original_map;
+    const auto assign_status =
+        AssignRange(request.first_hash(), request.last_hash(),
+                    request.target_address(), &shard_map);
+    if (!assign_status.ok()) {
+      return ToGrpcStatus(assign_status);
+    }
+    shard_state.shard_map = shard_map;
+    kbs_address = shard_state.kbs_address;
+  }
+  // Waits for the lookups in flight, which may have inserted keys of the range
+  // before the switch.
+  { absl::WriterMutexLock lock(&lookups_mu_); }
+
+  knowledge_bank->FlushChanges();
+  keys = tracker->TakeChangedKeys();
+  status = SendRows(stub.get(), session_handle, *knowledge_bank, keys,
+                    batch_size, weight_decay, rpc_timeout, &num_bytes);
+  SetShardMapRequest set_request;
+  set_request.set_session_handle(session_handle);
+  set_request.set_kbs_address(request.target_address());
+  bool shard_map_sent = false;
+  if (status.ok()) {
+    num_forwarded_rows += keys.size();
+    *set_request.mutable_shard_map() = shard_map;
+    shard_map_sent = true;
+    status = SendShardMap(stub.get(), set_request, rpc_timeout);
+  }
+  if (!status.ok()) {
+    // The target may have installed the new shard map before the failure,
+    // e.g., on a timeout, unless it rejected it. Then the range is assigned
+    // back to this KBS in a newer version on both KBS, so that they agree that
+    // it is still owned here.
+    ShardMap restored_map = original_map;
+    bool restored = true;
+    if (shard_map_sent &&
+        status.error_code() != StatusCode::INVALID_ARGUMENT &&
+        status.error_code() != StatusCode::FAILED_PRECONDITION) {
+      restored_map = shard_map;
+      const auto rollback_status =
+          AssignRange(request.first_hash(), request.last_hash(), kbs_address,
+                      &restored_map);
+      if (!rollback_status.ok()) {
+        return ToGrpcStatus(rollback_status);
+      }
+      *set_request.mutable_shard_map() = restored_map;
+      const auto rollback_rpc_status =
+          SendShardMap(stub.get(), set_request, rpc_timeout);
+      if (!rollback_rpc_status.ok()) {
+        LOG(ERROR) << "Rolling back the shard map of "
+                   << request.target_address() << " failed, the range ["
+                   << request.first_hash() << ", " << request.last_hash()
+                   << "] is not served here until the shard map is set: "
+                   << rollback_rpc_status.error_message();
+        restored = false;
+      }
+    }
+    if (restored) {
+      absl::WriterMutexLock lock(&map_mu_);
+      auto& shard_state = shard_state_map_[session_handle];
+      // Keeps a shard map set by SetShardMap() in the meantime.
+      if (shard_state.shard_map.version() == shard_map.version()) {
+        shard_state.shard_map = std::move(restored_map);
+      }
+    }
+    return Status(status.error_code(),
+                  absl::StrCat("Migration aborted: ", status.error_message()));
+  }
+  *response->mutable_shard_map() = std::move(shard_map);
+
+  // Step Four: remove the rows of the range, which are served by the target
+  // from now on. No row of the range is written here after the switch.
+  keys.clear();
+  for (const auto& key : knowledge_bank->Keys()) {
+    const uint64_t hash = ShardKeyHash(key);
+    if (hash >= request.first_hash() && hash <= request.last_hash()) {
+      keys.emplace_back(key);
+    }
+  }
+  const auto remove_status =
+      knowledge_bank->Remove(std::vector<absl::string_view>(keys.begin(),
+                                                            keys.end()));
+  if (!remove_status.ok()) {
+    LOG(WARNING) << "Failed to remove the " << keys.size()
+                 << " migrated rows, they are kept but not served: "
+                 << remove_status;
+  }
+
+  const double elapsed_seconds =
+      std::max(absl::ToDoubleSeconds(absl::Now() - start_time), 1e-9);
+  const int64_t num_rows = response->num_copied_rows() + num_forwarded_rows;
+  num_migrated_rows_ += num_rows;
+  response->set_num_forwarded_rows(num_forwarded_rows);
+  response->set_num_bytes(num_bytes);
+  response->set_elapsed_seconds(elapsed_seconds);
+  response->set_rows_per_second(num_rows / elapsed_seconds);
+  response->set_bytes_per_second(num_bytes / elapsed_seconds);
+  LOG(INFO) << "Migrated " << num_rows << " rows (" << num_bytes
+            << " bytes) of hash range [" << request.first_hash() << ", "
+            << request.last_hash() << "] to " << request.target_address()
+            << " in " << elapsed_seconds << "s: " << response->rows_per_second()
+            << " rows/s.";
+  return Status::OK;
+}
+
+Status KnowledgeBankGrpcServiceImpl::ImportRows(
+    grpc::ServerContext* context, const ImportRowsRequest* request,
+    ImportRowsResponse* response) {
+  if (request->session_handle().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "session_handle is empty.");
+  }
+  const auto status = StartSessionIfNecessary(
+      request->session_handle(), /*require_candidate_sampler=*/false,
+      /*require_memory_store=*/false);
+  if (!status.ok()) {
+    return status;
+  }
+  absl::ReaderMutexLock lock(&map_mu_);
+  const auto iter = kb_map_.find(request->session_handle());
+  if (iter == kb_map_.end()) {
+    return Status(StatusCode::FAILED_PRECONDITION,
+                  "KnowledgeBank is not initialized.");
+  }
+  const auto writable_status = CheckWritable(request->session_handle());
+  if (!writable_status.ok()) {
+    return writable_status;
+  }
+  for (const auto& row : request->rows()) {
+    const auto restore_status = iter->second->Restore(row.first, row.second);
+    if (!restore_status.ok()) {
+      return ToGrpcStatus(restore_status);
+    }
+  }
+  return Status::OK;
+}
+
+Status KnowledgeBankGrpcServiceImpl::ReplicateHotRows(
+    grpc::ServerContext* context, const ReplicateHotRowsRequest* request,
+    ReplicateHotRowsResponse* response) {
+  if (request->session_handle().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "session_handle is empty.");
+  }
+  if (request->owner_address().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "owner_address is empty.");
+  }
+  absl::ReaderMutexLock lock(&map_mu_);
+  const auto iter = hot_key_map_.find(request->session_handle());
+  if (iter == hot_key_map_.end()) {
+    return Status(StatusCode::FAILED_PRECONDITION,
+                  "Hot keys are not replicated in this session.");
+  }
+  iter->second->SetReplicatedRows(request->owner_address(), request->rows());
+  return Status::OK;
+}
+
+Status KnowledgeBankGrpcServiceImpl::PushHotKeyStats(
+    grpc::ServerContext* context, const PushHotKeyStatsRequest* request,
+    PushHotKeyStatsResponse* response) {
+  if (request->session_handle().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "session_handle is empty.");
+  }
+  {
+    absl::ReaderMutexLock lock(&map_mu_);
+    const auto iter = hot_key_map_.find(request->session_handle());
+    if (iter == hot_key_map_.end()) {
+      return Status(StatusCode::FAILED_PRECONDITION,
+                    "Hot keys are not replicated in this session.");
+    }
+    iter->second->AddReadCounts(request->read_counts());
+  }
+  if (request->gradients().empty()) {
+    return Status::OK;
+  }
+  // Applies the gradients as if they were sent by a client.
+  UpdateRequest update_request;
+  update_request.set_session_handle(request->session_handle());
+  *update_request.mutable_gradients() = request->gradients();
+  UpdateResponse update_response;
+  return Update(context, &update_request, &update_response);
+}
+
+void KnowledgeBankGrpcServiceImpl::SyncHotKeys() {
+  struct SyncTask {
+    std::string session_handle;
+    ShardMap shard_map;
+    std::string kbs_address;
+    HotKeyReplicator* replicator;
+    KnowledgeBank* knowledge_bank;
+    KnowledgeBank::RowTransform weight_decay;
+  };
+  // The replicators and knowledge banks are never removed, so their pointers
+  // stay valid without holding map_mu_ during the RPCs.
+  std::vector<SyncTask> tasks;
+  {
+    absl::ReaderMutexLock lock(&map_mu_);
+    for (const auto& pair : hot_key_map_) {
+      const auto shard_iter = shard_state_map_.find(pair.first);
+      const auto kb_iter = kb_map_.find(pair.first);
+      if (shard_iter == shard_state_map_.end() || kb_iter == kb_map_.end()) {
+        continue;
+      }
+      tasks.push_back({pair.first, shard_iter->second.shard_map,
+                       shard_iter->second.kbs_address, pair.second.get(),
+                       kb_iter->second.get(),
+                       WeightDecayTransform(pair.first)});
+    }
+  }
+
+  for (const auto& task : tasks) {
+    // Pushes the reads and gradients of the replicas to their owners.
+    for (auto& push : task.replicator->TakePendingPushes()) {
+      push.second.set_session_handle(task.session_handle);
+      auto* stub = PeerStub(push.first);
+      grpc::ClientContext context;
+      context.set_deadline(
+          absl::ToChronoTime(absl::Now() + kHotKeySyncRpcTimeout));
+      PushHotKeyStatsResponse response;
+      const auto status =
+          stub->PushHotKeyStats(&context, push.second, &response);
+      if (!status.ok()) {
+        // The stats are sent again with the next push instead of being lost.
+        LOG(WARNING) << "PushHotKeyStats to " << push.first
+                     << " failed: " << status.error_message();
+        task.replicator->RequeuePush(push.first, push.second);
+      }
+    }
+
+    // Broadcasts the current rows of the hot keys owned here. The request is
+    // sent even without hot keys, so that the replicas drop the old ones.
+    ReplicateHotRowsRequest request;
+    request.set_session_handle(task.session_handle);
+    request.set_owner_address(task.kbs_address);
+    for (const auto& key : task.replicator->UpdateHotKeys()) {
+      const auto* range = FindShard(task.shard_map, ShardKeyHash(key));
+      if (range == nullptr || range->kbs_address() != task.kbs_address) {
+        continue;
+      }
+      EmbeddingVectorProto value;
+      if (task.knowledge_bank->Lookup(key, &value).ok()) {
+        // The replicas are decayed by the owner only.
+        if (task.weight_decay != nullptr) {
+          task.weight_decay(&value);
+        }
+        (*request.mutable_rows())[key] = std::move(value);
+      }
+    }
+    absl::flat_hash_set<std::string> addresses;
+    for (const auto& range : task.shard_map.range()) {
+      if (range.kbs_address() != task.kbs_address) {
+        addresses.insert(range.kbs_address());
+      }
+    }
+    for (const auto& address : addresses) {
+      auto* stub = PeerStub(address);
+      grpc::ClientContext context;
+      context.set_deadline(
+          absl::ToChronoTime(absl::Now() + kHotKeySyncRpcTimeout));
+      ReplicateHotRowsResponse response;
+      const auto status = stub->ReplicateHotRows(&context, request, &response);
+      if (!status.ok()) {
+        LOG(WARNING) << "ReplicateHotRows to " << address
+                     << " failed: " << status.error_message();
+      }
+    }
+  }
+}
+
+/*grpc_gen::*/KnowledgeBankService::Stub*
+KnowledgeBankGrpcServiceImpl::PeerStub(const std::string& address) {
+  absl::MutexLock lock(&peer_stubs_mu_);
+  auto& stub = peer_stubs_[address];
+  if (stub == nullptr) {
+    stub = /*grpc_gen::*/KnowledgeBankService::NewStub(
+        grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+  }
+  return stub.get();
+}
+
+void KnowledgeBankGrpcServiceImpl::WriteDueCheckpoints() {
+  struct CheckpointTask {
+    std::string session_handle;
+    KnowledgeBank* knowledge_bank;
+    KnowledgeBank::RowTransform weight_decay;
+    memory_store::MemoryStore* memory_store;
+    CheckpointState* state;
+  };
+  absl::MutexLock checkpoint_lock(&checkpoint_mu_);
+  // The knowledge banks, memory stores and checkpoint states are never
+  // removed, so their pointers stay valid without holding map_mu_ during the
+  // writes, which would block the requests.
+  std::vector<CheckpointTask> tasks;
+  {
+    const absl::Time now = absl::Now();
+    absl::ReaderMutexLock lock(&map_mu_);
+    for (const auto& pair : checkpoint_map_) {
+      auto* state = pair.second.get();
+      const auto& config = state->config;
+      const bool interval_due =
+          config.interval_seconds() > 0 &&
+          now - state->last_checkpoint_time >=
+              absl::Seconds(config.interval_seconds());
+      const bool updates_due = config.update_interval() > 0 &&
+                               state->num_updates >= config.update_interval();
+      if (!interval_due && !updates_due) {
+        continue;
+      }
+      const auto kb_iter = kb_map_.find(pair.first);
+      const auto ms_iter = ms_map_.find(pair.first);
+      tasks.push_back(
+          {pair.first,
+           kb_iter == kb_map_.end() ? nullptr : kb_iter->second.get(),
+           WeightDecayTransform(pair.first),
+           ms_iter == ms_map_.end() ? nullptr : ms_iter->second.get(), state});
+    }
+  }
+
+  for (const auto& task : tasks) {
+    const auto status =
+        WriteCheckpoint(task.session_handle, task.knowledge_bank,
+                        task.weight_decay, task.memory_store, task.state);
+    if (!status.ok()) {
+      LOG(WARNING) << "Writing checkpoint to "
+                   << task.state->config.checkpoint_directory()
+                   << " failed: " << status;
+    }
+  }
+}
+
+KnowledgeBank::RowTransform KnowledgeBankGrpcServiceImpl::WeightDecayTransform(
+    const std::string& session_handle) {
+  const auto gd_iter = gd_map_.find(session_handle);
+  if (gd_iter == gd_map_.end() || !gd_iter->second->has_weight_decay()) {
+    return nullptr;
+  }
+  // The optimizers are never removed, so the pointer stays valid.
+  const GradientDescentOptimizer* optimizer = gd_iter->second.get();
+  return [optimizer](EmbeddingVectorProto* value) {
+    optimizer->FlushWeightDecay(value);
+  };
+}
+
+absl::Status KnowledgeBankGrpcServiceImpl::WriteCheckpoint(
+    const std::string& session_handle, KnowledgeBank* knowledge_bank,
+    const KnowledgeBank::RowTransform& weight_decay,
+    memory_store::MemoryStore* memory_store, CheckpointState* state) {
+  const absl::Time start_time = absl::Now();
+  // A failed checkpoint is retried at the next interval, not at every poll.
+  state->last_checkpoint_time = start_time;
+  state->num_updates = 0;
+  if (knowledge_bank == nullptr && memory_store == nullptr) {
+    return absl::FailedPreconditionError(
+        "Neither KnowledgeStore nor MemoryStore is initialized.");
+  }
+
+  // Checkpoints are named by their time, so that a restarted server does not
+  // overwrite the checkpoints written before.
+  StartSessionRequest start_request;
+  start_request.ParseFromString(session_handle);
+  const int64_t checkpoint_id = std::max(absl::ToUnixMillis(start_time),
+                                         state->last_checkpoint_id + 1);
+  state->last_checkpoint_id = checkpoint_id;
+  const std::string session_dir =
+      JoinPath(state->config.checkpoint_directory(), start_request.name());
+  const std::string subdir = absl::StrCat("ckpt-", checkpoint_id);
+  RET_CHECK_OK(RecursivelyCreateDir(session_dir));
+  std::string saved_path;
+  {
+    ScopedIoRateLimit scoped_limit(state->rate_limiter.get());
+    if (knowledge_bank != nullptr) {
+      RET_CHECK_OK(knowledge_bank->Export(session_dir, subdir, &saved_path,
+                                          weight_decay));
+    } else {
+      RET_CHECK_OK(memory_store->Export(session_dir, subdir, &saved_path));
+    }
+  }
+  ++num_checkpoints_;
+  state->checkpoints.emplace_back(JoinPath(session_dir, subdir), saved_path);
+  LOG(INFO) << "Wrote checkpoint " << saved_path << " in "
+            << absl::Now() - start_time << ".";
+
+  const int max_to_keep = state->config.max_to_keep();
+  while (max_to_keep > 0 &&
+         static_cast<int>(state->checkpoints.size()) > max_to_keep) {
+    const auto status = RecursivelyDeleteDir(state->checkpoints.front().first);
+    if (!status.ok()) {
+      LOG(WARNING) << "Deleting checkpoint "
+                   << state->checkpoints.front().first << " failed: " << status;
+    }
+    state->checkpoints.pop_front();
+  }
+  return absl::OkStatus();
+}
+
+std::vector<std::string> KnowledgeBankGrpcServiceImpl::CheckpointPaths(
+    const std::string& session_handle) {
+  absl::MutexLock checkpoint_lock(&checkpoint_mu_);
+  absl::ReaderMutexLock lock(&map_mu_);
+  std::vector<std::string> paths;
+  const auto iter = checkpoint_map_.find(session_handle);
+  if (iter != checkpoint_map_.end()) {
+    for (const auto& checkpoint : iter->second->checkpoints) {
+      paths.push_back(checkpoint.second);
+    }
+  }
+  return paths;
+}
+
+HotKeyReplicator* KnowledgeBankGrpcServiceImpl::SplitReplicatedKeys(
+    const std::string& session_handle, std::vector<absl::string_view>* keys,
+    std::vector<absl::string_view>* replicated_keys) {
+  const auto iter = hot_key_map_.find(session_handle);
+  const auto shard_iter = shard_state_map_.find(session_handle);
+  if (iter == hot_key_map_.end() || shard_iter == shard_state_map_.end()) {
+    return nullptr;
+  }
+  const auto& shard_state = shard_iter->second;
+  auto& replicator = *iter->second;
+  std::vector<absl::string_view> owned_keys;
+  owned_keys.reserve(keys->size());
+  for (const auto& key : *keys) {
+    const auto* range = FindShard(shard_state.shard_map, ShardKeyHash(key));
+    if (range != nullptr && range->kbs_address() != shard_state.kbs_address &&
+        replicator.IsReplicated(key)) {
+      replicated_keys->push_back(key);
+    } else {
+      owned_keys.push_back(key);
+    }
+  }
+  *keys = std::move(owned_keys);
+  return &replicator;
+}
+
+Status KnowledgeBankGrpcServiceImpl::CheckKeysAssigned(
+    const std::string& session_handle,
+    const std::vector<absl::string_view>& keys) {
+  const auto iter = shard_state_map_.find(session_handle);
+  if (iter == shard_state_map_.end()) {
+    return Status::OK;
+  }
+  const auto& shard_state = iter->second;
+  for (const auto& key : keys) {
+    const auto* range = FindShard(shard_state.shard_map, ShardKeyHash(key));
+    if (range == nullptr || range->kbs_address() != shard_state.kbs_address) {
+      return Status(
+          StatusCode::FAILED_PRECONDITION,
+          absl::StrCat("Key ", key, " is not assigned to this KBS by shard map "
+                       "version ", shard_state.shard_map.version(),
+                       ", please refresh the routing with GetShardMap()."));
+    }
+  }
+  return Status::OK;
+}
+
 size_t KnowledgeBankGrpcServiceImpl::KnowledgeBankSize() {
   absl::ReaderMutexLock lock(&map_mu_);
-  return kb_map_.size();
+  absl::flat_hash_set<const KnowledgeBank*> knowledge_banks;
+  for (const auto& pair : kb_map_) {
+    knowledge_banks.insert(pair.second.get());
+  }
+  return knowledge_banks.size();
+}
+
+Status KnowledgeBankGrpcServiceImpl::WaitForStaleness(
+    grpc::ServerContext* context, const std::string& session_handle,
+    const WorkerClock& worker_clock, absl::Duration* wait_time) {
+  *wait_time = absl::ZeroDuration();
+  if (worker_clock.worker_id().empty()) {
+    return Status(StatusCode::INVALID_ARGUMENT, "worker_id is empty.");
+  }
+  StalenessClock* clock = nullptr;
+  {
+    absl::ReaderMutexLock lock(&map_mu_);
+    auto iter = clock_map_.find(session_handle);
+    if (iter == clock_map_.end()) {
+      return Status::OK;
+    }
+    // The clocks are never removed, so the pointer stays valid.
+    clock = iter->second.get();
+  }
+  if (worker_clock.finished()) {
+    clock->Finish(worker_clock.worker_id());
+    return Status::OK;
+  }
+  absl::Time deadline = absl::InfiniteFuture();
+  if (context != nullptr &&
+      context->deadline() != std::chrono::system_clock::time_point::max()) {
+    deadline = absl::FromChrono(context->deadline());
+  }
+  // Waits without holding map_mu_, so that the slower workers can proceed.
+  const auto status = clock->Advance(worker_clock.worker_id(),
+                                     worker_clock.clock(), deadline, wait_time);
+  if (*wait_time > absl::ZeroDuration()) {
+    VLOG(1) << "Worker " << worker_clock.worker_id() << " at clock "
+            << worker_clock.clock() << " waited " << *wait_time
+            << " for the slowest worker.";
+  }
+  return ToGrpcStatus(status);
 }
 
 Status KnowledgeBankGrpcServiceImpl::StartSessionIfNecessary(
@@ -367,12 +1508,24 @@ Status KnowledgeBankGrpcServiceImpl::StartSessionIfNecessary(
   absl::MutexLock lock(&map_mu_);
   if (request.config().has_knowledge_bank_config() &&
       !kb_map_.contains(session_handle)) {
-    // Creates a new KnowledgeBank.
-    auto knowledge_bank =
-        KnowledgeBankFactory::Make(request.config().knowledge_bank_config(),
-                                   request.config().embedding_dimension());
-    if (knowledge_bank == nullptr) {
-      return Status(StatusCode::INTERNAL, "Creating KnowledgeBank failed.");
+    std::shared_ptr<KnowledgeBank> knowledge_bank;
+    if (request.shared_table().empty()) {
+      // Creates a new KnowledgeBank.
+      knowledge_bank =
+          KnowledgeBankFactory::Make(request.config().knowledge_bank_config(),
+                                     request.config().embedding_dimension());
+      if (knowledge_bank == nullptr) {
+        return Status(StatusCode::INTERNAL, "Creating KnowledgeBank failed.");
+      }
+    } else {
+      const auto attach_status =
+          AttachToSharedTable(request, &knowledge_bank);
+      if (!attach_status.ok()) {
+        return attach_status;
+      }
+      if (request.shared_table_mode() == StartSessionRequest::READ_ONLY) {
+        read_only_sessions_.insert(session_handle);
+      }
     }
     kb_map_[session_handle] = std::move(knowledge_bank);
   }
@@ -385,6 +1538,13 @@ Status KnowledgeBankGrpcServiceImpl::StartSessionIfNecessary(
       return Status(StatusCode::INTERNAL,
                     "Creating GradientDescentOptimizer failed.");
     }
+    if (!request.shared_table().empty()) {
+      auto& step = decay_step_map_[request.shared_table()];
+      if (step == nullptr) {
+        step = std::make_shared<std::atomic<int64_t>>(0);
+      }
+      optimizer->ShareStep(step);
+    }
     gd_map_[session_handle] = std::move(optimizer);
   }
   if (request.config().has_candidate_sampler_config() &&
@@ -394,6 +1554,13 @@ Status KnowledgeBankGrpcServiceImpl::StartSessionIfNecessary(
     if (sampler == nullptr) {
       return Status(StatusCode::INTERNAL, "Creating CandidateSampler failed.");
     }
+    // Keeps the index of an incremental sampler up to date with the changes of
+    // the knowledge bank, instead of rebuilding it from the whole bank.
+    if (sampler->IsIncremental() && kb_map_.contains(session_handle)) {
+      cs_observer_map_[session_handle] =
+          candidate_sampling::ConnectSamplerToKnowledgeBank(
+              sampler.get(), kb_map_[session_handle].get());
+    }
     cs_map_[session_handle] = std::move(sampler);
   }
   if (request.config().has_memory_store_config() &&
@@ -405,6 +1572,148 @@ Status KnowledgeBankGrpcServiceImpl::StartSessionIfNecessary(
     }
     ms_map_[session_handle] = std::move(memory_store);
   }
+  if (request.config().has_staleness_config() &&
+      !clock_map_.contains(session_handle)) {
+    const auto& staleness_config = request.config().staleness_config();
+    if (staleness_config.max_staleness() < 0) {
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    "max_staleness must be non-negative.");
+    }
+    clock_map_[session_handle] = absl::make_unique<StalenessClock>(
+        staleness_config.max_staleness(),
+        staleness_config.worker_timeout_seconds() > 0
+            ? absl::Seconds(staleness_config.worker_timeout_seconds())
+            : absl::InfiniteDuration());
+  }
+  if (request.config().has_checkpoint_config() &&
+      !checkpoint_map_.contains(session_handle)) {
+    const auto& config = request.config().checkpoint_config();
+    if (config.checkpoint_directory().empty()) {
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    "checkpoint_directory is empty.");
+    }
+    if (config.interval_seconds() <= 0 && config.update_interval() <= 0) {
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    "Either interval_seconds or update_interval must be "
+                    "positive.");
+    }
+    if (config.max_to_keep() < 0 || config.max_bytes_per_second() < 0 ||
+        config.max_burst_bytes() < 0) {
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    "max_to_keep, max_bytes_per_second and max_burst_bytes "
+                    "must be non-negative.");
+    }
+    auto state = absl::make_unique<CheckpointState>();
+    state->config = config;
+    if (config.max_bytes_per_second() > 0) {
+      state->rate_limiter = absl::make_unique<IoRateLimiter>(
+          config.max_bytes_per_second(), config.max_burst_bytes());
+    }
+    state->last_checkpoint_time = absl::Now();
+    checkpoint_map_[session_handle] = std::move(state);
+    if (checkpoint_bundle_ == nullptr) {
+      checkpoint_bundle_ = absl::make_unique<ThreadBundle>(
+          kCheckpointThreadName, /*num_threads=*/1);
+      checkpoint_bundle_->Add([this]() {
+        while (!stop_checkpoint_.WaitForNotificationWithTimeout(
+            kCheckpointPollInterval)) {
+          WriteDueCheckpoints();
+        }
+      });
+    }
+  }
+  return Status::OK;
+}
+
+Status KnowledgeBankGrpcServiceImpl::AttachToSharedTable(
+    const StartSessionRequest& request,
+    std::shared_ptr<KnowledgeBank>* knowledge_bank) {
+  const auto& config = request.config();
+  auto& shared_table = shared_table_map_[request.shared_table()];
+  if (shared_table == nullptr) {
+    shared_table = KnowledgeBankFactory::Make(config.knowledge_bank_config(),
+                                              config.embedding_dimension());
+    if (shared_table == nullptr) {
+      shared_table_map_.erase(request.shared_table());
+      return Status(StatusCode::INTERNAL, "Creating KnowledgeBank failed.");
+    }
+  }
+  if (shared_table->embedding_dimension() != config.embedding_dimension()) {
+    return Status(
+        StatusCode::INVALID_ARGUMENT,
+        absl::StrCat("Inconsistent embedding_dimension with shared_table ",
+                     request.shared_table(), ", expect ",
+                     shared_table->embedding_dimension(), ", got ",
+                     config.embedding_dimension(), "."));
+  }
+  if (request.shared_table_mode() == StartSessionRequest::COPY_ON_WRITE) {
+    auto fork = CopyOnWriteKnowledgeBank::Create(
+        shared_table, config.knowledge_bank_config(),
+        config.embedding_dimension());
+    if (fork == nullptr) {
+      return Status(StatusCode::INTERNAL,
+                    "Creating CopyOnWriteKnowledgeBank failed.");
+    }
+    *knowledge_bank = std::move(fork);
+    return Status::OK;
+  }
+  // The session handle is also based on the serialized config.
+  if (shared_table->config().SerializeAsString() !=
+      config.knowledge_bank_config().SerializeAsString()) {
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  absl::StrCat("Inconsistent knowledge_bank_config with "
+                               "shared_table ",
+                               request.shared_table(), "."));
+  }
+  *knowledge_bank = shared_table;
+  return Status::OK;
+}
+
+void KnowledgeBankGrpcServiceImpl::CreateHierarchicalSoftmaxNodes(
+    KnowledgeBank* knowledge_bank, SampleResponse* response) {
+  absl::flat_hash_set<absl::string_view> keys;
+  for (const auto& samples : response->samples()) {
+    for (const auto& result : samples.sampled_result()) {
+      if (result.has_hierarchical_softmax_result() &&
+          !result.hierarchical_softmax_result().has_embedding()) {
+        keys.insert(result.hierarchical_softmax_result().key());
+      }
+    }
+  }
+  if (keys.empty()) {
+    return;
+  }
+  std::vector<absl::string_view> node_keys(keys.begin(), keys.end());
+  std::vector<absl::variant<EmbeddingVectorProto, std::string>> embeddings;
+  knowledge_bank->BatchLookupWithUpdate(node_keys, &embeddings);
+  absl::flat_hash_map<absl::string_view, const EmbeddingVectorProto*>
+      embedding_map;
+  for (size_t i = 0; i < node_keys.size(); ++i) {
+    if (absl::holds_alternative<EmbeddingVectorProto>(embeddings[i])) {
+      embedding_map[node_keys[i]] =
+          &absl::get<EmbeddingVectorProto>(embeddings[i]);
+    }
+  }
+  for (auto& samples : *response->mutable_samples()) {
+    for (auto& result : *samples.mutable_sampled_result()) {
+      if (!result.has_hierarchical_softmax_result()) {
+        continue;
+      }
+      auto* node = result.mutable_hierarchical_softmax_result();
+      const auto iter = embedding_map.find(node->key());
+      if (!node->has_embedding() && iter != embedding_map.end()) {
+        *node->mutable_embedding() = *iter->second;
+      }
+    }
+  }
+}
+
+Status KnowledgeBankGrpcServiceImpl::CheckWritable(
+    const std::string& session_handle) {
+  if (read_only_sessions_.contains(session_handle)) {
+    return Status(StatusCode::FAILED_PRECONDITION,
+                  "The session is attached to its shared_table read-only.");
+  }
   return Status::OK;
 }
 
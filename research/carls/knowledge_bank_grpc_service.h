@@ -16,15 +16,27 @@ limitations under the License.
 #ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_KNOWLEDGE_BANK_GRPC_SERVICE_H_
 #define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_KNOWLEDGE_BANK_GRPC_SERVICE_H_
 
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "grpcpp/support/status.h"  // net
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "research/carls/base/io_rate_limiter.h"
+#include "research/carls/base/thread_bundle.h"
 #include "research/carls/candidate_sampling/candidate_sampler.h"
 #include "research/carls/gradient_descent/gradient_descent_optimizer.h"
+#include "research/carls/hot_key_replicator.h"
 #include "research/carls/knowledge_bank/knowledge_bank.h"
 #include "research/carls/knowledge_bank_service.grpc.pb.h"
 #include "research/carls/memory_store/memory_store.h"
+#include "research/carls/staleness_clock.h"
 
 namespace carls {
 
@@ -46,6 +58,9 @@ class KnowledgeBankGrpcServiceImpl final
                             StartSessionResponse* response) override;
 
   // Implements the Lookup method of KnowledgeBankService.
+  // For a session with a staleness_config, a request with a worker_clock first
+  // waits until the slowest worker of the session is within the staleness
+  // bound, or returns DEADLINE_EXCEEDED at the deadline of the request.
   grpc::Status Lookup(grpc::ServerContext* context,
                       const LookupRequest* request,
                       LookupResponse* response) override;
@@ -55,6 +70,12 @@ class KnowledgeBankGrpcServiceImpl final
                       const UpdateRequest* request,
                       UpdateResponse* response) override;
 
+  // Implements the UpdateAndLookup method of KnowledgeBankService, which
+  // resolves the session once and runs Update() then Lookup().
+  grpc::Status UpdateAndLookup(grpc::ServerContext* context,
+                               const UpdateAndLookupRequest* request,
+                               UpdateAndLookupResponse* response) override;
+
   // Implements the Sample method of KnowledgeBankService.
   grpc::Status Sample(grpc::ServerContext* context,
                       const SampleRequest* request,
@@ -75,29 +96,275 @@ class KnowledgeBankGrpcServiceImpl final
                       const ImportRequest* request,
                       ImportResponse* response) override;
 
-  // Returns the number of KnowledgeBank already loaded into KBS.
+  // Implements the GetShardMap method of KnowledgeBankService.
+  grpc::Status GetShardMap(grpc::ServerContext* context,
+                           const GetShardMapRequest* request,
+                           GetShardMapResponse* response) override;
+
+  // Implements the SetShardMap method of KnowledgeBankService.
+  grpc::Status SetShardMap(grpc::ServerContext* context,
+                           const SetShardMapRequest* request,
+                           SetShardMapResponse* response) override;
+
+  // Implements the MigrateRange method of KnowledgeBankService.
+  // The rows in the range are first copied to the target from a snapshot of
+  // the keys while the requests are still served, then the rows written
+  // meanwhile are forwarded again for a few rounds. Then the range is
+  // switched to the target here, which rejects its later writes, before the
+  // last round and the switch on the target, so no write to the range is lost
+  // and only the range is unavailable meanwhile. If any step fails, the range
+  // is assigned back to this KBS and keeps being served here. Otherwise its
+  // rows are removed from this KBS.
+  grpc::Status MigrateRange(grpc::ServerContext* context,
+                            const MigrateRangeRequest* request,
+                            MigrateRangeResponse* response) override;
+
+  // Implements the ImportRows method of KnowledgeBankService.
+  grpc::Status ImportRows(grpc::ServerContext* context,
+                          const ImportRowsRequest* request,
+                          ImportRowsResponse* response) override;
+
+  // Implements the ReplicateHotRows method of KnowledgeBankService.
+  grpc::Status ReplicateHotRows(grpc::ServerContext* context,
+                                const ReplicateHotRowsRequest* request,
+                                ReplicateHotRowsResponse* response) override;
+
+  // Implements the PushHotKeyStats method of KnowledgeBankService.
+  grpc::Status PushHotKeyStats(grpc::ServerContext* context,
+                               const PushHotKeyStatsRequest* request,
+                               PushHotKeyStatsResponse* response) override;
+
+  // Syncs the hot keys of all the sessions with a HotKeyConfig: pushes the
+  // reads and gradients of the replicated keys to their owners, then finds the
+  // hot keys owned here and broadcasts their rows to the other KBS. A push
+  // that fails is sent again with the next one. It is called periodically if
+  // HotKeyConfig.sync_interval_ms is set.
+  void SyncHotKeys();
+
+  // Writes a checkpoint of every session whose CheckpointConfig is due, with
+  // the writes limited by its rate limiter. Older checkpoints beyond
+  // max_to_keep are deleted. It is called periodically by a background thread
+  // once a session has a CheckpointConfig.
+  void WriteDueCheckpoints();
+
+  // Returns the saved paths of the checkpoints of a session kept on disk,
+  // oldest first, which can be restored by Import().
+  std::vector<std::string> CheckpointPaths(const std::string& session_handle);
+
+  // Returns the number of KnowledgeBank already loaded into KBS, where a
+  // shared table attached by several sessions is counted once.
   size_t KnowledgeBankSize();
 
+  // Returns the number of keys updated with an expected version, and the
+  // number of them rejected due to a version conflict.
+  int64_t NumConditionalUpdates() const { return num_conditional_updates_; }
+  int64_t NumUpdateConflicts() const { return num_update_conflicts_; }
+
+  // Returns the number of looked up rows not sent back since they are
+  // unchanged since the versions known by the clients.
+  int64_t NumNotModifiedRows() const { return num_not_modified_rows_; }
+
+  // Returns the number of rows sent to other KBS by MigrateRange().
+  int64_t NumMigratedRows() const { return num_migrated_rows_; }
+
+  // Returns the number of checkpoints written by WriteDueCheckpoints().
+  int64_t NumCheckpoints() const { return num_checkpoints_; }
+
  private:
+  // Collects the keys of a range changed during a migration.
+  class RangeChangeTracker;
+
+  // The shard map of a sharded session.
+  struct ShardState {
+    ShardMap shard_map;
+    // The address of this KBS in the shard map.
+    std::string kbs_address;
+    // True while a range of the session is being migrated.
+    bool migrating = false;
+  };
+
+  // The periodic checkpoints of a session with a CheckpointConfig.
+  struct CheckpointState {
+    CheckpointConfig config;
+    // Null if the writes are not rate limited.
+    std::unique_ptr<IoRateLimiter> rate_limiter;
+    // Number of Update requests since the last checkpoint.
+    std::atomic<int64_t> num_updates{0};
+    // Only accessed by WriteDueCheckpoints() under checkpoint_mu_.
+    absl::Time last_checkpoint_time;
+    int64_t last_checkpoint_id = 0;
+    // The (directory, saved path) of the checkpoints kept on disk, oldest
+    // first.
+    std::deque<std::pair<std::string, std::string>> checkpoints;
+  };
+
+  // Returns a FAILED_PRECONDITION error if any of the keys is assigned to
+  // another KBS by the shard map of the session. Requires map_mu_.
+  grpc::Status CheckKeysAssigned(const std::string& session_handle,
+                                 const std::vector<absl::string_view>& keys);
+
+  // Moves the keys assigned to other KBS but replicated here from `keys` to
+  // `replicated_keys`, and returns the HotKeyReplicator of the session, or
+  // nullptr if hot keys are not replicated. Requires map_mu_.
+  HotKeyReplicator* SplitReplicatedKeys(
+      const std::string& session_handle,
+      std::vector<absl::string_view>* keys,
+      std::vector<absl::string_view>* replicated_keys);
+
+  // Implementation of MigrateRange() after the changes of the range are
+  // tracked by `tracker`. `weight_decay` is applied to the sent rows, see
+  // WeightDecayTransform().
+  grpc::Status MigrateRangeInternal(
+      const MigrateRangeRequest& request, KnowledgeBank* knowledge_bank,
+      const KnowledgeBank::RowTransform& weight_decay,
+      RangeChangeTracker* tracker, MigrateRangeResponse* response);
+
+  // Records the clock of a worker in the StalenessClock of the session, if
+  // any, and waits until the worker is within the staleness bound.
+  grpc::Status WaitForStaleness(grpc::ServerContext* context,
+                                const std::string& session_handle,
+                                const WorkerClock& worker_clock,
+                                absl::Duration* wait_time);
+
+  // Returns the transform flushing the pending weight decay of the optimizer
+  // of a session into the rows leaving this KBS, i.e., exported, migrated or
+  // replicated, so that they are up to date at the current step and carry no
+  // decay_step of this KBS, while the rows of the knowledge bank are
+  // unchanged. Returns nullptr without weight decay. Requires map_mu_.
+  KnowledgeBank::RowTransform WeightDecayTransform(
+      const std::string& session_handle);
+
+  // Returns the stub of the KBS at `address` for the hot key syncs, created on
+  // first use and reused by the later syncs.
+  /*grpc_gen::*/KnowledgeBankService::Stub* PeerStub(
+      const std::string& address);
+
+  // Writes a new checkpoint of a session and deletes the old ones.
+  // Requires checkpoint_mu_.
+  absl::Status WriteCheckpoint(const std::string& session_handle,
+                               KnowledgeBank* knowledge_bank,
+                               const KnowledgeBank::RowTransform& weight_decay,
+                               memory_store::MemoryStore* memory_store,
+                               CheckpointState* state);
+
+  // Implementations of Lookup() and Update() for a session that is already
+  // started. The session_handle of `request` is ignored.
+  grpc::Status LookupInSession(grpc::ServerContext* context,
+                               const std::string& session_handle,
+                               const LookupRequest& request,
+                               LookupResponse* response);
+  grpc::Status UpdateInSession(const std::string& session_handle,
+                               const UpdateRequest& request,
+                               UpdateResponse* response);
+
   grpc::Status StartSessionIfNecessary(const std::string& session_handle,
                                        bool require_candidate_sampler,
                                        bool require_memory_store);
 
+  // Returns the knowledge bank of a new session with a shared_table in
+  // `knowledge_bank`: the table itself or a copy-on-write fork of it,
+  // depending on the shared_table_mode. The table is created if it does not
+  // exist. Requires map_mu_.
+  grpc::Status AttachToSharedTable(
+      const StartSessionRequest& request,
+      std::shared_ptr<KnowledgeBank>* knowledge_bank);
+
+  // Creates the rows of the hierarchical softmax nodes in `response` that are
+  // not in `knowledge_bank` yet, and fills in their embeddings, so that the
+  // nodes on the path of a new key are trained from its first sample.
+  void CreateHierarchicalSoftmaxNodes(KnowledgeBank* knowledge_bank,
+                                      SampleResponse* response);
+
+  // Returns a FAILED_PRECONDITION error if the session is attached to its
+  // shared table read-only. Requires map_mu_.
+  grpc::Status CheckWritable(const std::string& session_handle);
+
   // Protects maps lookup and update.
   absl::Mutex map_mu_;
 
-  // Maps from session_handle to KnowledgeBank.
-  absl::node_hash_map<std::string, std::unique_ptr<KnowledgeBank>> kb_map_;
+  // Held in reader mode by the lookups in flight, which wait for the
+  // knowledge bank without holding map_mu_. Taken before map_mu_.
+  absl::Mutex lookups_mu_ ABSL_ACQUIRED_BEFORE(map_mu_);
+
+  // Maps from session_handle to KnowledgeBank, which is shared by the
+  // sessions attached to the same shared table.
+  absl::node_hash_map<std::string, std::shared_ptr<KnowledgeBank>> kb_map_;
+  // Maps from the name of a shared table to its KnowledgeBank.
+  absl::node_hash_map<std::string, std::shared_ptr<KnowledgeBank>>
+      shared_table_map_;
+  // The sessions attached to their shared tables read-only.
+  absl::flat_hash_set<std::string> read_only_sessions_;
   // Maps from session_handle to GradientDescentOptimizer.
   absl::node_hash_map<std::string, std::unique_ptr<GradientDescentOptimizer>>
       gd_map_;
+  // Maps from the name of a shared table to the step of the weight decay
+  // shared by the optimizers of its sessions, including its copy-on-write
+  // forks whose rows come from the shared table.
+  absl::node_hash_map<std::string, std::shared_ptr<std::atomic<int64_t>>>
+      decay_step_map_;
   // Maps from session_handle to CandidateSampler.
   absl::node_hash_map<std::string,
                       std::unique_ptr<candidate_sampling::CandidateSampler>>
       cs_map_;
+  // Maps from session_handle to the observer keeping an incremental
+  // CandidateSampler up to date with the KnowledgeBank of the same session.
+  absl::node_hash_map<
+      std::string,
+      std::shared_ptr<candidate_sampling::CandidateSamplerObserver>>
+      cs_observer_map_;
   // Maps from session_handle to MemoryStore.
   absl::node_hash_map<std::string, std::unique_ptr<memory_store::MemoryStore>>
       ms_map_;
+
+  // Maps from session_handle to StalenessClock, only for sessions with a
+  // staleness_config.
+  absl::node_hash_map<std::string, std::unique_ptr<StalenessClock>>
+      clock_map_;
+
+  // Maps from session_handle to its ShardState, only for sharded sessions.
+  absl::node_hash_map<std::string, ShardState> shard_state_map_;
+
+  // Maps from session_handle to HotKeyReplicator, only for sharded sessions
+  // with a HotKeyConfig.
+  absl::node_hash_map<std::string, std::unique_ptr<HotKeyReplicator>>
+      hot_key_map_;
+
+  // Maps from session_handle to CheckpointState, only for sessions with a
+  // checkpoint_config.
+  absl::node_hash_map<std::string, std::unique_ptr<CheckpointState>>
+      checkpoint_map_;
+
+  // Serializes the checkpoints, which are written without holding map_mu_.
+  absl::Mutex checkpoint_mu_;
+
+  // Runs WriteDueCheckpoints() periodically once a session has a
+  // checkpoint_config, until stop_checkpoint_ is notified.
+  std::unique_ptr<ThreadBundle> checkpoint_bundle_;
+  absl::Notification stop_checkpoint_;
+
+  // Runs SyncHotKeys() periodically once a session sets sync_interval_ms,
+  // until stop_hot_key_sync_ is notified.
+  std::unique_ptr<ThreadBundle> hot_key_sync_bundle_;
+  absl::Notification stop_hot_key_sync_;
+
+  // Maps from the address of another KBS to its stub for the hot key syncs.
+  absl::Mutex peer_stubs_mu_;
+  absl::node_hash_map<std::string,
+                      std::unique_ptr</*grpc_gen::*/KnowledgeBankService::Stub>>
+      peer_stubs_ ABSL_GUARDED_BY(peer_stubs_mu_);
+
+  // Counters of the conditional updates, used for measuring conflict rates.
+  std::atomic<int64_t> num_conditional_updates_{0};
+  std::atomic<int64_t> num_update_conflicts_{0};
+
+  // Counter of the rows skipped by conditional lookups.
+  std::atomic<int64_t> num_not_modified_rows_{0};
+
+  // Counter of the rows sent by MigrateRange().
+  std::atomic<int64_t> num_migrated_rows_{0};
+
+  // Counter of the checkpoints written in the background.
+  std::atomic<int64_t> num_checkpoints_{0};
 };
 
 }  // namespace carls
@@ -15,23 +15,89 @@ limitations under the License.
 
 #include "research/carls/knowledge_bank_grpc_service.h"
 
+#include <cmath>
+#include <limits>
+#include <map>
+#include <thread>  // NOLINT
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "grpcpp/security/server_credentials.h"  // third_party
+#include "grpcpp/server.h"  // third_party
+#include "grpcpp/server_builder.h"  // third_party
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
 #include "research/carls/base/file_helper.h"
 #include "research/carls/base/proto_helper.h"
 #include "research/carls/embedding.pb.h"  // proto to pb
 #include "research/carls/knowledge_bank_service.pb.h"  // proto to pb
+#include "research/carls/shard_map_helper.h"
 #include "research/carls/testing/test_helper.h"
+#include "research/carls/testing/test_proto3.pb.h"  // proto to pb
 
 namespace carls {
 namespace {
 
 using candidate_sampling::BruteForceTopkSamplerConfig;
+using candidate_sampling::CandidateSampler;
+using candidate_sampling::CandidateSamplerConfig;
 using candidate_sampling::NegativeSamplerConfig;
 using candidate_sampling::SampledResult;
+using candidate_sampling::SampleContext;
 using ::grpc::ServerContext;
 
+// An incremental sampler that returns all the candidates in its own index,
+// which is only updated through InsertOrUpdate().
+class IndexedFakeSampler : public CandidateSampler {
+ public:
+  explicit IndexedFakeSampler(const CandidateSamplerConfig& config)
+      : CandidateSampler(config) {}
+
+  bool IsIncremental() const override { return true; }
+
+  absl::Status InsertOrUpdate(absl::string_view key,
+                              const EmbeddingVectorProto& embedding) override {
+    absl::MutexLock l(&mu_);
+    index_[std::string(key)] = embedding;
+    return absl::OkStatus();
+  }
+
+  int NumOfCandidates() override {
+    absl::MutexLock l(&mu_);
+    return index_.size();
+  }
+
+ private:
+  absl::Status SampleInternal(
+      const KnowledgeBank& knowledge_bank, const SampleContext& sample_context,
+      int num_samples,
+      std::vector<std::pair<absl::string_view, SampledResult>>* results)
+      const override {
+    absl::MutexLock l(&mu_);
+    for (const auto& pair : index_) {
+      SampledResult result;
+      result.mutable_topk_sampling_result()->set_key(pair.first);
+      *result.mutable_topk_sampling_result()->mutable_embedding() =
+          pair.second;
+      results->emplace_back(pair.first, std::move(result));
+    }
+    return absl::OkStatus();
+  }
+
+  mutable absl::Mutex mu_;
+  std::map<std::string, EmbeddingVectorProto> index_ ABSL_GUARDED_BY(mu_);
+};
+
+REGISTER_SAMPLER_FACTORY(TestExtendedProto3Def,
+                         [](const CandidateSamplerConfig& config)
+                             -> std::unique_ptr<CandidateSampler> {
+                           return std::unique_ptr<CandidateSampler>(
+                               new IndexedFakeSampler(config));
+                         });
+
 }  // namespace
 
 class KnowledgeBankGrpcServiceImplTest : public ::testing::Test {
@@ -272,7 +338,7 @@ TEST_F(KnowledgeBankGrpcServiceImplTest, UpdateEmbedding) {
   EXPECT_THAT(lookup_response, EqualsProto<LookupResponse>(R"pb(
                 embedding_table {
                   key: "key1"
-                  value { value: 1 value: 2 weight: 1 }
+                  value { value: 1 value: 2 weight: 1 version: 1 }
                 }
               )pb"));
 
@@ -290,11 +356,11 @@ TEST_F(KnowledgeBankGrpcServiceImplTest, UpdateEmbedding) {
   LookupResponse expected_response = ParseTextProtoOrDie<LookupResponse>(R"pb(
     embedding_table {
       key: "key1"
-      value { value: 1 value: 2 weight: 2 }
+      value { value: 1 value: 2 weight: 2 version: 1 }
     }
     embedding_table {
       key: "key2"
-      value { value: 3 value: 4 weight: 1 }
+      value { value: 3 value: 4 weight: 1 version: 1 }
     }
   )pb");
   ASSERT_EQ(2, lookup_response.embedding_table().size());
@@ -306,6 +372,194 @@ TEST_F(KnowledgeBankGrpcServiceImplTest, UpdateEmbedding) {
               EqualsProto(expected_response.embedding_table().at("key2")));
 }
 
+TEST_F(KnowledgeBankGrpcServiceImplTest, IntKeys) {
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  (*update_request.mutable_int_values())[42] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>("value: 1 value: 2");
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+
+  LookupRequest lookup_request = ParseTextProtoOrDie<LookupRequest>(R"pb(
+    update: true int_key: 42 int_key: -7
+  )pb");
+  lookup_request.set_session_handle(session_handle);
+  LookupResponse lookup_response;
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  EXPECT_TRUE(lookup_response.embedding_table().empty());
+  ASSERT_EQ(2, lookup_response.int_embedding_table().size());
+  ASSERT_TRUE(lookup_response.int_embedding_table().contains(42));
+  ASSERT_TRUE(lookup_response.int_embedding_table().contains(-7));
+  EXPECT_THAT(lookup_response.int_embedding_table().at(42),
+              EqualsProto<EmbeddingVectorProto>(
+                  "value: 1 value: 2 weight: 1 version: 1"));
+  EXPECT_THAT(lookup_response.int_embedding_table().at(-7),
+              EqualsProto<EmbeddingVectorProto>(
+                  "tag: '-7' value: 0 value: 0 weight: 1"));
+
+  // An integer key shares the embedding of its decimal string.
+  lookup_request = ParseTextProtoOrDie<LookupRequest>(R"pb(
+    key: "42" int_key: 42
+  )pb");
+  lookup_request.set_session_handle(session_handle);
+  lookup_response.Clear();
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  EXPECT_THAT(lookup_response, EqualsProto<LookupResponse>(R"pb(
+                embedding_table {
+                  key: "42"
+                  value { value: 1 value: 2 weight: 1 version: 1 }
+                }
+                int_embedding_table {
+                  key: 42
+                  value { value: 1 value: 2 weight: 1 version: 1 }
+                }
+              )pb"));
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, UpdateEmbedding_ExpectedVersions) {
+  // Starts a valid session.
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  // Creates two new keys, one of them with a wrong expected version.
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  (*update_request.mutable_values())["key1"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 1 value: 2
+      )pb");
+  (*update_request.mutable_values())["key2"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 3 value: 4
+      )pb");
+  (*update_request.mutable_expected_versions())["key1"] = 0;
+  (*update_request.mutable_expected_versions())["key2"] = 1;
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+  EXPECT_THAT(update_response, EqualsProto<UpdateResponse>(R"pb(
+                conflicts {
+                  key: "key2"
+                  value {}
+                }
+              )pb"));
+
+  // A stale version returns the current value.
+  update_request.clear_values();
+  (*update_request.mutable_values())["key1"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 5 value: 6
+      )pb");
+  update_response.Clear();
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+  EXPECT_THAT(update_response, EqualsProto<UpdateResponse>(R"pb(
+                conflicts {
+                  key: "key1"
+                  value { value: 1 value: 2 version: 1 }
+                }
+              )pb"));
+
+  // Retries with the current version.
+  (*update_request.mutable_expected_versions())["key1"] = 1;
+  update_response.Clear();
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+  EXPECT_TRUE(update_response.conflicts().empty());
+
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  lookup_request.add_key("key1");
+  lookup_request.add_key("key2");
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  EXPECT_THAT(lookup_response, EqualsProto<LookupResponse>(R"pb(
+                embedding_table {
+                  key: "key1"
+                  value { value: 5 value: 6 version: 2 }
+                }
+              )pb"));
+  EXPECT_EQ(4, kbs_server_.NumConditionalUpdates());
+  EXPECT_EQ(2, kbs_server_.NumUpdateConflicts());
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, Lookup_KnownVersions) {
+  // Starts a valid session.
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  (*update_request.mutable_values())["key1"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 1 value: 2
+      )pb");
+  (*update_request.mutable_values())["key2"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 3 value: 4
+      )pb");
+  (*update_request.mutable_int_values())[7] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 5 value: 6
+      )pb");
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+
+  // Only the rows whose version differs from the known one are returned.
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  lookup_request.add_key("key1");
+  lookup_request.add_key("key2");
+  lookup_request.add_int_key(7);
+  (*lookup_request.mutable_known_versions())["key1"] = 1;
+  (*lookup_request.mutable_known_versions())["key2"] = 0;
+  (*lookup_request.mutable_known_int_versions())[7] = 1;
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  EXPECT_THAT(lookup_response, EqualsProto<LookupResponse>(R"pb(
+                embedding_table {
+                  key: "key2"
+                  value { value: 3 value: 4 version: 1 }
+                }
+                not_modified_key: "key1"
+                not_modified_int_key: 7
+              )pb"));
+  EXPECT_EQ(2, kbs_server_.NumNotModifiedRows());
+
+  // An updated row is returned again.
+  update_request.clear_values();
+  update_request.clear_int_values();
+  (*update_request.mutable_values())["key1"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 7 value: 8
+      )pb");
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+  lookup_response.Clear();
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  EXPECT_THAT(lookup_response.embedding_table().at("key1"),
+              EqualsProto<EmbeddingVectorProto>(R"pb(
+                value: 7 value: 8 version: 2
+              )pb"));
+  EXPECT_THAT(lookup_response.not_modified_key(), testing::IsEmpty());
+  EXPECT_THAT(lookup_response.not_modified_int_key(),
+              testing::ElementsAre(7));
+}
+
 TEST_F(KnowledgeBankGrpcServiceImplTest, UpdateGradient) {
   // Starts a valid session.
   StartSessionRequest start_request;
@@ -361,6 +615,73 @@ TEST_F(KnowledgeBankGrpcServiceImplTest, UpdateGradient) {
   EXPECT_FLOAT_EQ(2, embed.weight());
 }
 
+TEST_F(KnowledgeBankGrpcServiceImplTest, UpdateAndLookup) {
+  // Starts a valid session.
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  de_config_.mutable_gradient_descent_config()->set_learning_rate(0.1);
+  de_config_.mutable_gradient_descent_config()->mutable_sgd();
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  // Empty lookup.
+  UpdateAndLookupRequest request;
+  UpdateAndLookupResponse response;
+  auto status = kbs_server_.UpdateAndLookup(&context_, &request, &response);
+  EXPECT_EQ("session_handle is empty.", status.error_message());
+  request.set_session_handle(session_handle);
+  status = kbs_server_.UpdateAndLookup(&context_, &request, &response);
+  EXPECT_EQ("Empty input keys.", status.error_message());
+
+  // A lookup without update creates the embedding of key1.
+  request.mutable_lookup()->set_update(true);
+  request.mutable_lookup()->add_key("key1");
+  ASSERT_OK(kbs_server_.UpdateAndLookup(&context_, &request, &response));
+  EXPECT_THAT(response, EqualsProto<UpdateAndLookupResponse>(R"pb(
+                lookup {
+                  embedding_table {
+                    key: "key1"
+                    value { tag: "key1" value: 0 value: 0 weight: 1 }
+                  }
+                }
+              )pb"));
+
+  // The lookup sees the gradients applied by the same request, and the keys
+  // are looked up as both strings and ints.
+  (*request.mutable_update()->mutable_gradients())["key1"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 0.1 value: 0.2
+      )pb");
+  request.mutable_lookup()->add_int_key(7);
+  response.Clear();
+  ASSERT_OK(kbs_server_.UpdateAndLookup(&context_, &request, &response));
+  ASSERT_TRUE(response.lookup().embedding_table().contains("key1"));
+  const auto embed = response.lookup().embedding_table().at("key1");
+  ASSERT_EQ(2, embed.value_size());
+  EXPECT_FLOAT_EQ(-0.01, embed.value(0));
+  EXPECT_FLOAT_EQ(-0.02, embed.value(1));
+  EXPECT_FLOAT_EQ(2, embed.weight());
+  ASSERT_TRUE(response.lookup().int_embedding_table().contains(7));
+  EXPECT_THAT(response.lookup().int_embedding_table().at(7),
+              EqualsProto<EmbeddingVectorProto>(R"pb(
+                tag: "7" value: 0 value: 0 weight: 1
+              )pb"));
+
+  // Errors of the update are returned without looking up.
+  request.mutable_update()->clear_gradients();
+  (*request.mutable_update()->mutable_gradients())["unknown"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 0.1 value: 0.2
+      )pb");
+  response.Clear();
+  status = kbs_server_.UpdateAndLookup(&context_, &request, &response);
+  EXPECT_EQ("No valid keys for gradient update.", status.error_message());
+  EXPECT_FALSE(response.has_lookup());
+}
+
 TEST_F(KnowledgeBankGrpcServiceImplTest, Sample_BruteForceTopK) {
   // Starts a valid session.
   StartSessionRequest start_request;
@@ -409,14 +730,14 @@ TEST_F(KnowledgeBankGrpcServiceImplTest, Sample_BruteForceTopK) {
                   sampled_result {
                     topk_sampling_result {
                       key: "key3"
-                      embedding { value: 5 value: 6 }
+                      embedding { value: 5 value: 6 version: 1 }
                       similarity: 17
                     }
                   }
                   sampled_result {
                     topk_sampling_result {
                       key: "key2"
-                      embedding { value: 3 value: 4 }
+                      embedding { value: 3 value: 4 version: 1 }
                       similarity: 11
                     }
                   }
@@ -424,80 +745,272 @@ TEST_F(KnowledgeBankGrpcServiceImplTest, Sample_BruteForceTopK) {
               )pb"));
 }
 
-TEST_F(KnowledgeBankGrpcServiceImplTest, Sample_LogUniformSample) {
-  // Starts a valid session.
+TEST_F(KnowledgeBankGrpcServiceImplTest, Sample_MetadataFilterAfterGradients) {
   StartSessionRequest start_request;
   StartSessionResponse start_response;
   start_request.set_name("emb1");
-  NegativeSamplerConfig neg_sample_config;
-  neg_sample_config.set_unique(true);
-  neg_sample_config.set_sampler(NegativeSamplerConfig::LOG_UNIFORM);
+  BruteForceTopkSamplerConfig topk_config;
+  topk_config.set_similarity_type(candidate_sampling::DOT_PRODUCT);
+  topk_config.set_index_metadata(true);
   de_config_.mutable_candidate_sampler_config()->mutable_extension()->PackFrom(
-      neg_sample_config);
+      topk_config);
+  de_config_.mutable_gradient_descent_config()->set_learning_rate(0.1);
+  de_config_.mutable_gradient_descent_config()->mutable_sgd();
   *start_request.mutable_config() = de_config_;
   ASSERT_OK(
       kbs_server_.StartSession(&context_, &start_request, &start_response));
-  ASSERT_TRUE(!start_response.session_handle().empty());
   const auto& session_handle = start_response.session_handle();
 
-  // Update a few keys.
+  // Adds a red key1 and a blue key2.
   UpdateRequest update_request;
   UpdateResponse update_response;
   update_request.set_session_handle(session_handle);
-  (*update_request.mutable_values())["key1"] =
+  for (const auto& key_and_color :
+       {std::make_pair("key1", "red"), std::make_pair("key2", "blue")}) {
+    (*update_request.mutable_values())[key_and_color.first] =
+        ParseTextProtoOrDie<EmbeddingVectorProto>(absl::StrFormat(
+            R"pb(
+              value: 1
+              value: 2
+              meta_data {
+                feature {
+                  key: "color"
+                  value { feature_value { bytes_feature { value: "%s" } } }
+                }
+              }
+            )pb",
+            key_and_color.second));
+  }
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+
+  // The metadata is kept by the gradient updates.
+  update_request.clear_values();
+  (*update_request.mutable_gradients())["key1"] =
       ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
-        value: 1 value: 2
+        value: 0.1 value: 0.2
+      )pb");
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+
+  SampleRequest sample_request;
+  SampleResponse sample_response;
+  sample_request.set_session_handle(session_handle);
+  sample_request.set_num_samples(2);
+  *sample_request.add_sample_context() =
+      ParseTextProtoOrDie<SampleContext>(R"pb(
+        activation { value: 1 value: 1 }
+        filter {
+          metadata_predicate {
+            feature_name: "color"
+            value { bytes_feature { value: "red" } }
+          }
+        }
       )pb");
+  // The changes reach the sampler's index asynchronously.
+  for (int i = 0; i < 1000; ++i) {
+    sample_response.Clear();
+    ASSERT_OK(kbs_server_.Sample(&context_, &sample_request, &sample_response));
+    if (sample_response.samples(0).sampled_result_size() == 1) break;
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  ASSERT_EQ(1, sample_response.samples(0).sampled_result_size());
+  const auto& result =
+      sample_response.samples(0).sampled_result(0).topk_sampling_result();
+  EXPECT_EQ("key1", result.key());
+  EXPECT_FLOAT_EQ(0.99, result.embedding().value(0));
+  EXPECT_TRUE(result.embedding().has_meta_data());
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, Sample_IncrementalSamplerIndex) {
+  // Starts a session with an incremental sampler.
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  de_config_.mutable_candidate_sampler_config()->mutable_extension()->PackFrom(
+      TestExtendedProto3Def());
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  // Adds key1 by a lookup and key2 by an update.
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  lookup_request.set_update(true);
+  lookup_request.add_key("key1");
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
   (*update_request.mutable_values())["key2"] =
       ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
         value: 3 value: 4
       )pb");
-  (*update_request.mutable_values())["key3"] =
-      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
-        value: 5 value: 6
-      )pb");
   ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
 
-  // Sample without update, all available keys {"key1", "key2", "key3"}
+  // The changes reach the sampler's index asynchronously.
   SampleRequest sample_request;
   SampleResponse sample_response;
   sample_request.set_session_handle(session_handle);
-  sample_request.set_num_samples(3);
-  sample_request.add_sample_context()->add_positive_key("key1");
-  ASSERT_OK(kbs_server_.Sample(&context_, &sample_request, &sample_response));
-  ASSERT_EQ(1, sample_response.samples_size());
-  auto comparator = [](const SampledResult& lhs,
-                       const SampledResult& rhs) -> bool {
-    return lhs.negative_sampling_result().key() <
-           rhs.negative_sampling_result().key();
-  };
-  std::sort(
-      sample_response.mutable_samples(0)->mutable_sampled_result()->begin(),
-      sample_response.mutable_samples(0)->mutable_sampled_result()->end(),
-      comparator);
+  sample_request.set_num_samples(2);
+  sample_request.add_sample_context();
+  for (int i = 0; i < 1000; ++i) {
+    sample_response.Clear();
+    ASSERT_OK(kbs_server_.Sample(&context_, &sample_request, &sample_response));
+    if (sample_response.samples(0).sampled_result_size() == 2) break;
+    absl::SleepFor(absl::Milliseconds(10));
+  }
   EXPECT_THAT(sample_response, EqualsProto<SampleResponse>(R"pb(
                 samples {
                   sampled_result {
-                    negative_sampling_result {
+                    topk_sampling_result {
                       key: "key1"
-                      embedding { value: 1 value: 2 }
-                      is_positive: true
-                      expected_count: 1
+                      embedding { tag: "key1" value: 0 value: 0 weight: 1 }
                     }
                   }
                   sampled_result {
-                    negative_sampling_result {
+                    topk_sampling_result {
                       key: "key2"
-                      embedding { value: 3 value: 4 }
-                      expected_count: 1
+                      embedding { value: 3 value: 4 version: 1 }
                     }
                   }
-                  sampled_result {
-                    negative_sampling_result {
-                      key: "key3"
-                      embedding { value: 5 value: 6 }
-                      expected_count: 1
-                    }
+                }
+              )pb"));
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, Sample_HierarchicalSoftmax) {
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  de_config_.mutable_candidate_sampler_config()->mutable_extension()->PackFrom(
+      candidate_sampling::HierarchicalSoftmaxSamplerConfig());
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+
+  // The first key is the root of the tree, whose path has no nodes.
+  SampleRequest sample_request;
+  SampleResponse sample_response;
+  sample_request.set_session_handle(start_response.session_handle());
+  sample_request.set_num_samples(10);
+  sample_request.set_update(true);
+  auto* sample_context = sample_request.add_sample_context();
+  sample_context->add_positive_key("key1");
+  sample_context->mutable_activation()->add_value(1);
+  sample_context->mutable_activation()->add_value(2);
+  ASSERT_OK(kbs_server_.Sample(&context_, &sample_request, &sample_response));
+  EXPECT_THAT(sample_response, EqualsProto<SampleResponse>("samples {}"));
+
+  // A new key is sampled by the same request, and the node on its path is
+  // added to the knowledge bank.
+  sample_response.Clear();
+  sample_context->set_positive_key(0, "key2");
+  ASSERT_OK(kbs_server_.Sample(&context_, &sample_request, &sample_response));
+  EXPECT_THAT(sample_response, EqualsProto<SampleResponse>(R"pb(
+                samples {
+                  sampled_result {
+                    hierarchical_softmax_result {
+                      key: "__hs_node__/0"
+                      embedding {
+                        tag: "__hs_node__/0"
+                        value: 0
+                        value: 0
+                        weight: 1
+                      }
+                      label: 1
+                      positive_key: "key2"
+                    }
+                  }
+                }
+              )pb"));
+
+  // Inference returns the keys by their log probabilities.
+  sample_response.Clear();
+  sample_request.set_update(false);
+  sample_context->clear_positive_key();
+  ASSERT_OK(kbs_server_.Sample(&context_, &sample_request, &sample_response));
+  ASSERT_EQ(1, sample_response.samples_size());
+  ASSERT_EQ(2, sample_response.samples(0).sampled_result_size());
+  EXPECT_FLOAT_EQ(std::log(0.5f), sample_response.samples(0)
+                                      .sampled_result(0)
+                                      .topk_sampling_result()
+                                      .similarity());
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, Sample_LogUniformSample) {
+  // Starts a valid session.
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  NegativeSamplerConfig neg_sample_config;
+  neg_sample_config.set_unique(true);
+  neg_sample_config.set_sampler(NegativeSamplerConfig::LOG_UNIFORM);
+  de_config_.mutable_candidate_sampler_config()->mutable_extension()->PackFrom(
+      neg_sample_config);
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  ASSERT_TRUE(!start_response.session_handle().empty());
+  const auto& session_handle = start_response.session_handle();
+
+  // Update a few keys.
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  (*update_request.mutable_values())["key1"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 1 value: 2
+      )pb");
+  (*update_request.mutable_values())["key2"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 3 value: 4
+      )pb");
+  (*update_request.mutable_values())["key3"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 5 value: 6
+      )pb");
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+
+  // Sample without update, all available keys {"key1", "key2", "key3"}
+  SampleRequest sample_request;
+  SampleResponse sample_response;
+  sample_request.set_session_handle(session_handle);
+  sample_request.set_num_samples(3);
+  sample_request.add_sample_context()->add_positive_key("key1");
+  ASSERT_OK(kbs_server_.Sample(&context_, &sample_request, &sample_response));
+  ASSERT_EQ(1, sample_response.samples_size());
+  auto comparator = [](const SampledResult& lhs,
+                       const SampledResult& rhs) -> bool {
+    return lhs.negative_sampling_result().key() <
+           rhs.negative_sampling_result().key();
+  };
+  std::sort(
+      sample_response.mutable_samples(0)->mutable_sampled_result()->begin(),
+      sample_response.mutable_samples(0)->mutable_sampled_result()->end(),
+      comparator);
+  EXPECT_THAT(sample_response, EqualsProto<SampleResponse>(R"pb(
+                samples {
+                  sampled_result {
+                    negative_sampling_result {
+                      key: "key1"
+                      embedding { value: 1 value: 2 version: 1 }
+                      is_positive: true
+                      expected_count: 1
+                    }
+                  }
+                  sampled_result {
+                    negative_sampling_result {
+                      key: "key2"
+                      embedding { value: 3 value: 4 version: 1 }
+                      expected_count: 1
+                    }
+                  }
+                  sampled_result {
+                    negative_sampling_result {
+                      key: "key3"
+                      embedding { value: 5 value: 6 version: 1 }
+                      expected_count: 1
+                    }
                   }
                 }
               )pb"));
@@ -521,7 +1034,7 @@ TEST_F(KnowledgeBankGrpcServiceImplTest, Sample_LogUniformSample) {
                   sampled_result {
                     negative_sampling_result {
                       key: "key1"
-                      embedding { value: 1 value: 2 }
+                      embedding { value: 1 value: 2 version: 1 }
                       is_positive: true
                       expected_count: 1
                     }
@@ -529,14 +1042,14 @@ TEST_F(KnowledgeBankGrpcServiceImplTest, Sample_LogUniformSample) {
                   sampled_result {
                     negative_sampling_result {
                       key: "key2"
-                      embedding { value: 3 value: 4 }
+                      embedding { value: 3 value: 4 version: 1 }
                       expected_count: 1
                     }
                   }
                   sampled_result {
                     negative_sampling_result {
                       key: "key3"
-                      embedding { value: 5 value: 6 }
+                      embedding { value: 5 value: 6 version: 1 }
                       expected_count: 1
                     }
                   }
@@ -822,4 +1335,987 @@ TEST_F(KnowledgeBankGrpcServiceImplTest, ExportAndImport) {
                   "tag: 'key2' value: 0 value: 0 weight: 2"));
 }
 
+TEST_F(KnowledgeBankGrpcServiceImplTest, WeightDecay) {
+  // Starts a session multiplying the embeddings by 0.9 at each step.
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  de_config_.mutable_gradient_descent_config()->set_learning_rate(0.1);
+  de_config_.mutable_gradient_descent_config()->set_weight_decay(1);
+  de_config_.mutable_gradient_descent_config()->mutable_sgd();
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  (*update_request.mutable_values())["key1"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 1 value: 2
+      )pb");
+  (*update_request.mutable_values())["key2"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 3 value: 4
+      )pb");
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+
+  // Applies zero gradients to both keys and then to key1 only.
+  const auto zero = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    value: 0 value: 0
+  )pb");
+  update_request.clear_values();
+  (*update_request.mutable_gradients())["key1"] = zero;
+  (*update_request.mutable_gradients())["key2"] = zero;
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+  update_request.clear_gradients();
+  (*update_request.mutable_gradients())["key1"] = zero;
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+
+  // key2 is decayed for the second step when it is read.
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  lookup_request.add_key("key1");
+  lookup_request.add_key("key2");
+  auto expect_values = [&lookup_response](const std::string& key,
+                                          float value0, float value1) {
+    ASSERT_TRUE(lookup_response.embedding_table().contains(key));
+    const auto& embedding = lookup_response.embedding_table().at(key);
+    ASSERT_EQ(2, embedding.value_size());
+    EXPECT_FLOAT_EQ(value0, embedding.value(0));
+    EXPECT_FLOAT_EQ(value1, embedding.value(1));
+  };
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  expect_values("key1", 0.81, 1.62);
+  expect_values("key2", 2.43, 3.24);
+
+  // The export brings all the rows up to date and clears their decay_step,
+  // the imported rows are decayed again from their next gradient on.
+  ExportRequest export_request;
+  ExportResponse export_response;
+  export_request.set_session_handle(session_handle);
+  export_request.set_export_directory(testing::TempDir());
+  ASSERT_OK(kbs_server_.Export(&context_, &export_request, &export_response));
+  ImportRequest import_request;
+  ImportResponse import_response;
+  import_request.set_session_handle(session_handle);
+  import_request.set_knowledge_bank_saved_path(
+      export_response.knowledge_bank_saved_path());
+  ASSERT_OK(kbs_server_.Import(&context_, &import_request, &import_response));
+  lookup_response.Clear();
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  expect_values("key1", 0.81, 1.62);
+  expect_values("key2", 2.43, 3.24);
+  EXPECT_EQ(0, lookup_response.embedding_table().at("key2").decay_step());
+
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+  lookup_response.Clear();
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  expect_values("key1", 0.729, 1.458);
+  expect_values("key2", 2.43, 3.24);
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, WeightDecay_MigrateRange) {
+  KnowledgeBankGrpcServiceImpl target_service;
+  int port = 0;
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                           &port);
+  builder.RegisterService(&target_service);
+  std::unique_ptr<grpc::Server> target_server = builder.BuildAndStart();
+  ASSERT_NE(nullptr, target_server);
+  const std::string target_address = absl::StrCat("localhost:", port);
+
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  de_config_.mutable_gradient_descent_config()->set_learning_rate(0.1);
+  de_config_.mutable_gradient_descent_config()->set_weight_decay(1);
+  de_config_.mutable_gradient_descent_config()->mutable_sgd();
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+  SetShardMapRequest set_request;
+  SetShardMapResponse set_response;
+  set_request.set_session_handle(session_handle);
+  set_request.set_kbs_address("source");
+  *set_request.mutable_shard_map() = CreateUniformShardMap({"source"});
+  ASSERT_OK(kbs_server_.SetShardMap(&context_, &set_request, &set_response));
+
+  // Applies zero gradients to key1 at the first step of the source, then to
+  // key2 for four more steps.
+  const auto zero = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    value: 0 value: 0
+  )pb");
+  auto apply_gradients = [&](KnowledgeBankGrpcServiceImpl* service,
+                             const std::string& key, float value0,
+                             int num_steps) {
+    UpdateRequest update_request;
+    UpdateResponse update_response;
+    update_request.set_session_handle(session_handle);
+    auto& value = (*update_request.mutable_values())[key];
+    value.add_value(value0);
+    value.add_value(2 * value0);
+    ASSERT_OK(service->Update(&context_, &update_request, &update_response));
+    update_request.clear_values();
+    (*update_request.mutable_gradients())[key] = zero;
+    for (int i = 0; i < num_steps; ++i) {
+      ASSERT_OK(service->Update(&context_, &update_request, &update_response));
+    }
+  };
+  apply_gradients(&kbs_server_, "key1", 1, 1);
+  apply_gradients(&kbs_server_, "key2", 1, 4);
+  // The target has its own row at its first step.
+  apply_gradients(&target_service, "local", 1, 1);
+
+  MigrateRangeRequest migrate_request;
+  MigrateRangeResponse migrate_response;
+  migrate_request.set_session_handle(session_handle);
+  migrate_request.set_first_hash(0);
+  migrate_request.set_last_hash(std::numeric_limits<uint64_t>::max());
+  migrate_request.set_target_address(target_address);
+  ASSERT_OK(
+      kbs_server_.MigrateRange(&context_, &migrate_request, &migrate_response));
+
+  // The migrated rows are decayed up to the step of the source, and the step
+  // of the target is unchanged by them.
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  lookup_request.add_key("key1");
+  lookup_request.add_key("local");
+  auto expect_value = [&lookup_response](const std::string& key,
+                                         float value0) {
+    ASSERT_TRUE(lookup_response.embedding_table().contains(key));
+    const auto& embedding = lookup_response.embedding_table().at(key);
+    ASSERT_EQ(2, embedding.value_size());
+    EXPECT_FLOAT_EQ(value0, embedding.value(0));
+    EXPECT_FLOAT_EQ(2 * value0, embedding.value(1));
+  };
+  ASSERT_OK(
+      target_service.Lookup(&context_, &lookup_request, &lookup_response));
+  expect_value("key1", 0.59049);
+  expect_value("local", 0.9);
+  EXPECT_EQ(0, lookup_response.embedding_table().at("key1").decay_step());
+
+  // A gradient on key1 at the second step of the target decays both rows by
+  // one step only.
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  (*update_request.mutable_gradients())["key1"] = zero;
+  ASSERT_OK(
+      target_service.Update(&context_, &update_request, &update_response));
+  lookup_response.Clear();
+  ASSERT_OK(
+      target_service.Lookup(&context_, &lookup_request, &lookup_response));
+  expect_value("key1", 0.531441);
+  expect_value("local", 0.81);
+  EXPECT_EQ(2, lookup_response.embedding_table().at("key1").decay_step());
+  target_server->Shutdown();
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, WeightDecay_KnownVersions) {
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  de_config_.mutable_gradient_descent_config()->set_learning_rate(0.1);
+  de_config_.mutable_gradient_descent_config()->set_weight_decay(1);
+  de_config_.mutable_gradient_descent_config()->mutable_sgd();
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  (*update_request.mutable_values())["key1"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 1 value: 2
+      )pb");
+  (*update_request.mutable_values())["key2"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 3 value: 4
+      )pb");
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+  const auto zero = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    value: 0 value: 0
+  )pb");
+  update_request.clear_values();
+  (*update_request.mutable_gradients())["key1"] = zero;
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+
+  // key1 is unchanged since its known version at the same step.
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  lookup_request.add_key("key1");
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  ASSERT_TRUE(lookup_response.embedding_table().contains("key1"));
+  (*lookup_request.mutable_known_versions())["key1"] =
+      lookup_response.embedding_table().at("key1").version();
+  lookup_response.Clear();
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  EXPECT_THAT(lookup_response.not_modified_key(), testing::ElementsAre("key1"));
+
+  // A gradient on key2 advances the step, so key1 is decayed and returned
+  // although its version is unchanged.
+  update_request.clear_gradients();
+  (*update_request.mutable_gradients())["key2"] = zero;
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+  lookup_response.Clear();
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  EXPECT_THAT(lookup_response.not_modified_key(), testing::IsEmpty());
+  ASSERT_TRUE(lookup_response.embedding_table().contains("key1"));
+  const auto& embedding = lookup_response.embedding_table().at("key1");
+  ASSERT_EQ(2, embedding.value_size());
+  EXPECT_FLOAT_EQ(0.81, embedding.value(0));
+  EXPECT_FLOAT_EQ(1.62, embedding.value(1));
+  EXPECT_EQ(2, embedding.decay_step());
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, SharedTable) {
+  auto start_session = [this](const std::string& name,
+                              StartSessionRequest::SharedTableMode mode,
+                              std::string* session_handle) {
+    StartSessionRequest start_request;
+    StartSessionResponse start_response;
+    start_request.set_name(name);
+    start_request.set_shared_table("table");
+    start_request.set_shared_table_mode(mode);
+    *start_request.mutable_config() = de_config_;
+    const auto status =
+        kbs_server_.StartSession(&context_, &start_request, &start_response);
+    *session_handle = start_response.session_handle();
+    return status;
+  };
+  auto update = [this](const std::string& session_handle, float value) {
+    UpdateRequest update_request;
+    UpdateResponse update_response;
+    update_request.set_session_handle(session_handle);
+    auto& embedding = (*update_request.mutable_values())["key1"];
+    embedding.add_value(value);
+    embedding.add_value(value);
+    return kbs_server_.Update(&context_, &update_request, &update_response);
+  };
+  auto lookup = [this](const std::string& session_handle,
+                       const std::string& key) {
+    LookupRequest lookup_request;
+    LookupResponse lookup_response;
+    lookup_request.set_session_handle(session_handle);
+    lookup_request.set_update(true);
+    lookup_request.add_key(key);
+    EXPECT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+    return lookup_response;
+  };
+
+  std::string train_handle;
+  ASSERT_OK(start_session("train", StartSessionRequest::READ_WRITE,
+                          &train_handle));
+  ASSERT_OK(update(train_handle, 1));
+
+  // An eval session reads the same table under another name.
+  std::string eval_handle;
+  ASSERT_OK(
+      start_session("eval", StartSessionRequest::READ_ONLY, &eval_handle));
+  EXPECT_NE(train_handle, eval_handle);
+  EXPECT_EQ(1, kbs_server_.KnowledgeBankSize());
+  auto response = lookup(eval_handle, "key1");
+  ASSERT_TRUE(response.embedding_table().contains("key1"));
+  EXPECT_EQ(1, response.embedding_table().at("key1").value(0));
+  EXPECT_TRUE(lookup(eval_handle, "key2").embedding_table().empty());
+  EXPECT_EQ(grpc::StatusCode::FAILED_PRECONDITION,
+            update(eval_handle, 2).error_code());
+  ASSERT_OK(update(train_handle, 2));
+  EXPECT_EQ(2, lookup(eval_handle, "key1").embedding_table().at("key1").value(
+                   0));
+
+  // A fork shares the rows until it writes them.
+  std::string fork_handle;
+  ASSERT_OK(start_session("experiment", StartSessionRequest::COPY_ON_WRITE,
+                          &fork_handle));
+  EXPECT_EQ(2, kbs_server_.KnowledgeBankSize());
+  EXPECT_EQ(2, lookup(fork_handle, "key1").embedding_table().at("key1").value(
+                   0));
+  ASSERT_OK(update(fork_handle, 3));
+  response = lookup(fork_handle, "key1");
+  EXPECT_EQ(3, response.embedding_table().at("key1").value(0));
+  EXPECT_EQ(3, response.embedding_table().at("key1").version());
+  EXPECT_EQ(2, lookup(train_handle, "key1").embedding_table().at("key1").value(
+                   0));
+
+  // The config must be consistent with the table.
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("other");
+  start_request.set_shared_table("table");
+  *start_request.mutable_config() = de_config_;
+  start_request.mutable_config()
+      ->mutable_knowledge_bank_config()
+      ->mutable_initializer()
+      ->mutable_random_uniform_initializer();
+  EXPECT_EQ(grpc::StatusCode::INVALID_ARGUMENT,
+            kbs_server_.StartSession(&context_, &start_request, &start_response)
+                .error_code());
+  start_request.set_shared_table_mode(StartSessionRequest::COPY_ON_WRITE);
+  start_request.mutable_config()->set_embedding_dimension(3);
+  EXPECT_EQ(grpc::StatusCode::INVALID_ARGUMENT,
+            kbs_server_.StartSession(&context_, &start_request, &start_response)
+                .error_code());
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, WeightDecay_SharedTable) {
+  de_config_.mutable_gradient_descent_config()->set_learning_rate(0.1);
+  de_config_.mutable_gradient_descent_config()->set_weight_decay(1);
+  de_config_.mutable_gradient_descent_config()->mutable_sgd();
+  auto start_session = [this](const std::string& name,
+                              StartSessionRequest::SharedTableMode mode,
+                              std::string* session_handle) {
+    StartSessionRequest start_request;
+    StartSessionResponse start_response;
+    start_request.set_name(name);
+    start_request.set_shared_table("table");
+    start_request.set_shared_table_mode(mode);
+    *start_request.mutable_config() = de_config_;
+    const auto status =
+        kbs_server_.StartSession(&context_, &start_request, &start_response);
+    *session_handle = start_response.session_handle();
+    return status;
+  };
+  auto lookup_value = [this](const std::string& session_handle) {
+    LookupRequest lookup_request;
+    LookupResponse lookup_response;
+    lookup_request.set_session_handle(session_handle);
+    lookup_request.add_key("key1");
+    EXPECT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+    return lookup_response.embedding_table().at("key1").value(0);
+  };
+
+  std::string train1_handle;
+  std::string train2_handle;
+  std::string eval_handle;
+  std::string fork_handle;
+  ASSERT_OK(start_session("train1", StartSessionRequest::READ_WRITE,
+                          &train1_handle));
+  ASSERT_OK(start_session("train2", StartSessionRequest::READ_WRITE,
+                          &train2_handle));
+  ASSERT_OK(
+      start_session("eval", StartSessionRequest::READ_ONLY, &eval_handle));
+  ASSERT_OK(start_session("experiment", StartSessionRequest::COPY_ON_WRITE,
+                          &fork_handle));
+
+  // A step of each training session on different keys.
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(train1_handle);
+  (*update_request.mutable_values())["key1"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>("value: 1 value: 2");
+  (*update_request.mutable_values())["key2"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>("value: 3 value: 4");
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+  const auto zero =
+      ParseTextProtoOrDie<EmbeddingVectorProto>("value: 0 value: 0");
+  update_request.clear_values();
+  (*update_request.mutable_gradients())["key1"] = zero;
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+  update_request.set_session_handle(train2_handle);
+  update_request.clear_gradients();
+  (*update_request.mutable_gradients())["key2"] = zero;
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+
+  // All the sessions of the table see key1 decayed for the two steps.
+  EXPECT_FLOAT_EQ(0.81, lookup_value(train1_handle));
+  EXPECT_FLOAT_EQ(0.81, lookup_value(train2_handle));
+  EXPECT_FLOAT_EQ(0.81, lookup_value(eval_handle));
+  EXPECT_FLOAT_EQ(0.81, lookup_value(fork_handle));
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, ShardMap_RejectsKeysOfOtherShards) {
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  // Not sharded yet.
+  GetShardMapRequest get_request;
+  GetShardMapResponse get_response;
+  get_request.set_session_handle(session_handle);
+  ASSERT_OK(kbs_server_.GetShardMap(&context_, &get_request, &get_response));
+  EXPECT_TRUE(get_response.shard_map().range().empty());
+
+  // Assigns key2 to another KBS.
+  SetShardMapRequest set_request;
+  SetShardMapResponse set_response;
+  set_request.set_session_handle(session_handle);
+  set_request.set_kbs_address("kbs1");
+  *set_request.mutable_shard_map() = CreateUniformShardMap({"kbs1"});
+  const uint64_t hash = ShardKeyHash("key2");
+  ASSERT_OK(AssignRange(hash, hash, "kbs2", set_request.mutable_shard_map()));
+  ASSERT_OK(kbs_server_.SetShardMap(&context_, &set_request, &set_response));
+  ASSERT_OK(kbs_server_.GetShardMap(&context_, &get_request, &get_response));
+  EXPECT_THAT(get_response.shard_map(), EqualsProto(set_request.shard_map()));
+
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  lookup_request.set_update(true);
+  lookup_request.add_key("key1");
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  lookup_request.add_key("key2");
+  EXPECT_EQ(grpc::StatusCode::FAILED_PRECONDITION,
+            kbs_server_.Lookup(&context_, &lookup_request, &lookup_response)
+                .error_code());
+
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  (*update_request.mutable_values())["key2"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 1 value: 2
+      )pb");
+  EXPECT_EQ(grpc::StatusCode::FAILED_PRECONDITION,
+            kbs_server_.Update(&context_, &update_request, &update_response)
+                .error_code());
+
+  // An older shard map is rejected.
+  set_request.mutable_shard_map()->set_version(1);
+  EXPECT_EQ(grpc::StatusCode::FAILED_PRECONDITION,
+            kbs_server_.SetShardMap(&context_, &set_request, &set_response)
+                .error_code());
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, ImportRows_KeepsVersions) {
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  ImportRowsRequest import_request;
+  ImportRowsResponse import_response;
+  import_request.set_session_handle(session_handle);
+  (*import_request.mutable_rows())["key1"] =
+      ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+        value: 1 value: 2 weight: 3 version: 5
+      )pb");
+  ASSERT_OK(
+      kbs_server_.ImportRows(&context_, &import_request, &import_response));
+
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  lookup_request.add_key("key1");
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  EXPECT_THAT(lookup_response, EqualsProto<LookupResponse>(R"pb(
+                embedding_table {
+                  key: "key1"
+                  value { value: 1 value: 2 weight: 3 version: 5 }
+                }
+              )pb"));
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, MigrateRange) {
+  // Starts the target KBS.
+  KnowledgeBankGrpcServiceImpl target_service;
+  int port = 0;
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                           &port);
+  builder.RegisterService(&target_service);
+  std::unique_ptr<grpc::Server> target_server = builder.BuildAndStart();
+  ASSERT_NE(nullptr, target_server);
+  const std::string target_address = absl::StrCat("localhost:", port);
+
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  // Migration requires a shard map.
+  MigrateRangeRequest migrate_request;
+  MigrateRangeResponse migrate_response;
+  migrate_request.set_session_handle(session_handle);
+  migrate_request.set_first_hash(0);
+  migrate_request.set_last_hash(std::numeric_limits<uint64_t>::max() / 2);
+  migrate_request.set_target_address(target_address);
+  migrate_request.set_batch_size(7);
+  EXPECT_EQ(grpc::StatusCode::FAILED_PRECONDITION,
+            kbs_server_.MigrateRange(&context_, &migrate_request,
+                                     &migrate_response)
+                .error_code());
+
+  SetShardMapRequest set_request;
+  SetShardMapResponse set_response;
+  set_request.set_session_handle(session_handle);
+  set_request.set_kbs_address("source");
+  *set_request.mutable_shard_map() = CreateUniformShardMap({"source"});
+  ASSERT_OK(kbs_server_.SetShardMap(&context_, &set_request, &set_response));
+
+  constexpr int kNumKeys = 100;
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  for (int i = 0; i < kNumKeys; ++i) {
+    auto& value = (*update_request.mutable_values())[absl::StrCat("key", i)];
+    value.add_value(i);
+    value.add_value(0);
+  }
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+
+  // Keeps updating the keys during the migration until they are rejected.
+  absl::Mutex mu;
+  std::map<std::string, int> last_written;
+  bool migration_done = false;
+  std::thread writer([&]() {
+    ServerContext context;
+    for (int round = 1;; ++round) {
+      {
+        absl::MutexLock l(&mu);
+        if (migration_done) {
+          break;
+        }
+      }
+      for (int i = 0; i < kNumKeys; ++i) {
+        const std::string key = absl::StrCat("key", i);
+        UpdateRequest request;
+        UpdateResponse response;
+        request.set_session_handle(session_handle);
+        auto& value = (*request.mutable_values())[key];
+        value.add_value(i);
+        value.add_value(round);
+        if (kbs_server_.Update(&context, &request, &response).ok()) {
+          absl::MutexLock l(&mu);
+          last_written[key] = round;
+        }
+      }
+    }
+  });
+  ASSERT_OK(
+      kbs_server_.MigrateRange(&context_, &migrate_request, &migrate_response));
+  {
+    absl::MutexLock l(&mu);
+    migration_done = true;
+  }
+  writer.join();
+
+  std::vector<std::string> moved_keys;
+  for (int i = 0; i < kNumKeys; ++i) {
+    const std::string key = absl::StrCat("key", i);
+    if (ShardKeyHash(key) <= migrate_request.last_hash()) {
+      moved_keys.push_back(key);
+    }
+  }
+  ASSERT_FALSE(moved_keys.empty());
+  EXPECT_EQ(moved_keys.size(), migrate_response.num_copied_rows());
+  EXPECT_GT(migrate_response.num_bytes(), 0);
+  EXPECT_GT(migrate_response.rows_per_second(), 0);
+  EXPECT_EQ(kbs_server_.NumMigratedRows(),
+            migrate_response.num_copied_rows() +
+                migrate_response.num_forwarded_rows());
+
+  // Both KBS have the new shard map.
+  ShardMap expected_shard_map = set_request.shard_map();
+  ASSERT_OK(AssignRange(0, migrate_request.last_hash(), target_address,
+                        &expected_shard_map));
+  EXPECT_THAT(migrate_response.shard_map(), EqualsProto(expected_shard_map));
+  GetShardMapRequest get_request;
+  GetShardMapResponse get_response;
+  get_request.set_session_handle(session_handle);
+  ASSERT_OK(target_service.GetShardMap(&context_, &get_request, &get_response));
+  EXPECT_THAT(get_response.shard_map(), EqualsProto(expected_shard_map));
+
+  // The moved keys are rejected by the source, and the target has their last
+  // written values with the versions of the source.
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  lookup_request.add_key(moved_keys[0]);
+  EXPECT_EQ(grpc::StatusCode::FAILED_PRECONDITION,
+            kbs_server_.Lookup(&context_, &lookup_request, &lookup_response)
+                .error_code());
+  lookup_request.clear_key();
+  for (const auto& key : moved_keys) {
+    lookup_request.add_key(key);
+  }
+  ASSERT_OK(
+      target_service.Lookup(&context_, &lookup_request, &lookup_response));
+  ASSERT_EQ(moved_keys.size(), lookup_response.embedding_table_size());
+  for (const auto& key : moved_keys) {
+    const auto& embedding = lookup_response.embedding_table().at(key);
+    const int round = last_written.count(key) ? last_written[key] : 0;
+    EXPECT_EQ(round, embedding.value(1)) << key;
+    EXPECT_EQ(round + 1, embedding.version()) << key;
+  }
+
+  // The source removed the moved keys, they are missing once the range is
+  // assigned back to it.
+  set_request.mutable_shard_map()->set_version(
+      migrate_response.shard_map().version() + 1);
+  ASSERT_OK(kbs_server_.SetShardMap(&context_, &set_request, &set_response));
+  lookup_request.clear_key();
+  lookup_request.add_key(moved_keys[0]);
+  LookupResponse source_lookup_response;
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request,
+                               &source_lookup_response));
+  EXPECT_TRUE(source_lookup_response.embedding_table().empty());
+  target_server->Shutdown();
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, MigrateRange_Aborted) {
+  // Starts a target KBS that rejects the shard map of the migration, since it
+  // already has a newer one.
+  KnowledgeBankGrpcServiceImpl target_service;
+  int port = 0;
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                           &port);
+  builder.RegisterService(&target_service);
+  std::unique_ptr<grpc::Server> target_server = builder.BuildAndStart();
+  ASSERT_NE(nullptr, target_server);
+  const std::string target_address = absl::StrCat("localhost:", port);
+
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  *start_request.mutable_config() = de_config_;
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  SetShardMapRequest set_request;
+  SetShardMapResponse set_response;
+  set_request.set_session_handle(session_handle);
+  set_request.set_kbs_address("source");
+  *set_request.mutable_shard_map() = CreateUniformShardMap({"source"});
+  ASSERT_OK(kbs_server_.SetShardMap(&context_, &set_request, &set_response));
+  SetShardMapRequest target_set_request = set_request;
+  target_set_request.set_kbs_address(target_address);
+  target_set_request.mutable_shard_map()->set_version(
+      set_request.shard_map().version() + 100);
+  ASSERT_OK(target_service.SetShardMap(&context_, &target_set_request,
+                                       &set_response));
+
+  constexpr int kNumKeys = 10;
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  for (int i = 0; i < kNumKeys; ++i) {
+    auto& value = (*update_request.mutable_values())[absl::StrCat("key", i)];
+    value.add_value(i);
+    value.add_value(0);
+  }
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+
+  MigrateRangeRequest migrate_request;
+  MigrateRangeResponse migrate_response;
+  migrate_request.set_session_handle(session_handle);
+  migrate_request.set_first_hash(0);
+  migrate_request.set_last_hash(std::numeric_limits<uint64_t>::max());
+  migrate_request.set_target_address(target_address);
+  migrate_request.set_rpc_timeout_ms(1000);
+  EXPECT_EQ(grpc::StatusCode::FAILED_PRECONDITION,
+            kbs_server_.MigrateRange(&context_, &migrate_request,
+                                     &migrate_response)
+                .error_code());
+
+  // The source still owns the range and serves the keys.
+  GetShardMapRequest get_request;
+  GetShardMapResponse get_response;
+  get_request.set_session_handle(session_handle);
+  ASSERT_OK(kbs_server_.GetShardMap(&context_, &get_request, &get_response));
+  EXPECT_THAT(get_response.shard_map(), EqualsProto(set_request.shard_map()));
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  for (int i = 0; i < kNumKeys; ++i) {
+    lookup_request.add_key(absl::StrCat("key", i));
+  }
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  EXPECT_EQ(kNumKeys, lookup_response.embedding_table_size());
+  ASSERT_OK(kbs_server_.Update(&context_, &update_request, &update_response));
+  target_server->Shutdown();
+
+  // A migration to an unreachable KBS fails within its RPC deadline, and
+  // another migration can start after it.
+  const absl::Time start_time = absl::Now();
+  EXPECT_FALSE(kbs_server_
+                   .MigrateRange(&context_, &migrate_request,
+                                 &migrate_response)
+                   .ok());
+  EXPECT_LT(absl::Now() - start_time, absl::Seconds(5));
+  EXPECT_NE(grpc::StatusCode::ABORTED,
+            kbs_server_.MigrateRange(&context_, &migrate_request,
+                                     &migrate_response)
+                .error_code());
+  ASSERT_OK(kbs_server_.GetShardMap(&context_, &get_request, &get_response));
+  EXPECT_THAT(get_response.shard_map(), EqualsProto(set_request.shard_map()));
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, Lookup_BoundedStaleness) {
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  *start_request.mutable_config() = de_config_;
+  start_request.mutable_config()->mutable_staleness_config()->set_max_staleness(
+      1);
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  LookupRequest slow_request;
+  LookupResponse slow_response;
+  slow_request.set_session_handle(session_handle);
+  slow_request.set_update(true);
+  slow_request.add_key("key1");
+  slow_request.mutable_worker_clock()->set_worker_id("slow");
+  ASSERT_OK(kbs_server_.Lookup(&context_, &slow_request, &slow_response));
+  EXPECT_EQ(0, slow_response.staleness_wait_seconds());
+
+  // The fast worker is 3 clocks ahead and waits for the slow one.
+  absl::Notification fast_done;
+  LookupResponse fast_response;
+  std::thread fast([&]() {
+    LookupRequest fast_request;
+    fast_request.set_session_handle(session_handle);
+    fast_request.add_key("key1");
+    fast_request.mutable_worker_clock()->set_worker_id("fast");
+    fast_request.mutable_worker_clock()->set_clock(3);
+    ServerContext context;
+    EXPECT_OK(kbs_server_.Lookup(&context, &fast_request, &fast_response));
+    fast_done.Notify();
+  });
+  EXPECT_FALSE(fast_done.WaitForNotificationWithTimeout(absl::Seconds(0.2)));
+
+  slow_request.mutable_worker_clock()->set_clock(2);
+  ASSERT_OK(kbs_server_.Lookup(&context_, &slow_request, &slow_response));
+  fast.join();
+  EXPECT_GE(fast_response.staleness_wait_seconds(), 0.2);
+  EXPECT_EQ(1, fast_response.embedding_table_size());
+
+  // A finished worker no longer holds back the others.
+  slow_request.mutable_worker_clock()->set_finished(true);
+  ASSERT_OK(kbs_server_.Lookup(&context_, &slow_request, &slow_response));
+  LookupRequest fast_request;
+  fast_request.set_session_handle(session_handle);
+  fast_request.add_key("key1");
+  fast_request.mutable_worker_clock()->set_worker_id("fast");
+  fast_request.mutable_worker_clock()->set_clock(10);
+  ASSERT_OK(kbs_server_.Lookup(&context_, &fast_request, &fast_response));
+  EXPECT_EQ(0, fast_response.staleness_wait_seconds());
+
+  // Missing worker_id.
+  fast_request.mutable_worker_clock()->clear_worker_id();
+  EXPECT_EQ(grpc::StatusCode::INVALID_ARGUMENT,
+            kbs_server_.Lookup(&context_, &fast_request, &fast_response)
+                .error_code());
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, PeriodicCheckpoints) {
+  const std::string checkpoint_dir = JoinPath(testing::TempDir(), "ckpts");
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  *start_request.mutable_config() = de_config_;
+  *start_request.mutable_config()->mutable_checkpoint_config() =
+      ParseTextProtoOrDie<CheckpointConfig>(absl::StrFormat(
+          R"pb(
+            checkpoint_directory: '%s'
+            update_interval: 2
+            max_to_keep: 2
+            max_bytes_per_second: 1000000000
+            max_burst_bytes: 1000000
+          )pb",
+          checkpoint_dir));
+  ASSERT_OK(
+      kbs_server_.StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  auto update = [&](float value) {
+    (*update_request.mutable_values())["key1"].clear_value();
+    (*update_request.mutable_values())["key1"].add_value(value);
+    (*update_request.mutable_values())["key1"].add_value(value);
+    ASSERT_OK(
+        kbs_server_.Update(&context_, &update_request, &update_response));
+  };
+
+  // Not due after a single update.
+  update(1);
+  kbs_server_.WriteDueCheckpoints();
+  EXPECT_EQ(0, kbs_server_.NumCheckpoints());
+
+  // A checkpoint every two updates, only the last two are kept.
+  for (int i = 2; i <= 6; ++i) {
+    update(i);
+    kbs_server_.WriteDueCheckpoints();
+  }
+  EXPECT_EQ(3, kbs_server_.NumCheckpoints());
+  const auto paths = kbs_server_.CheckpointPaths(session_handle);
+  ASSERT_EQ(2, paths.size());
+  EXPECT_NE(paths[0], paths[1]);
+
+  // Restores the last checkpoint.
+  update(7);
+  ImportRequest import_request;
+  ImportResponse import_response;
+  import_request.set_session_handle(session_handle);
+  import_request.set_knowledge_bank_saved_path(paths[1]);
+  ASSERT_OK(kbs_server_.Import(&context_, &import_request, &import_response));
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  lookup_request.add_key("key1");
+  ASSERT_OK(kbs_server_.Lookup(&context_, &lookup_request, &lookup_response));
+  ASSERT_TRUE(lookup_response.embedding_table().contains("key1"));
+  EXPECT_EQ(6, lookup_response.embedding_table().at("key1").value(0));
+
+  // Invalid config.
+  start_request.set_name("emb2");
+  start_request.mutable_config()
+      ->mutable_checkpoint_config()
+      ->clear_update_interval();
+  EXPECT_EQ(grpc::StatusCode::INVALID_ARGUMENT,
+            kbs_server_.StartSession(&context_, &start_request, &start_response)
+                .error_code());
+}
+
+TEST_F(KnowledgeBankGrpcServiceImplTest, HotKeyReplication) {
+  // Starts two KBS sharing the keys of a session.
+  KnowledgeBankGrpcServiceImpl services[2];
+  std::unique_ptr<grpc::Server> servers[2];
+  std::string addresses[2];
+  for (int i = 0; i < 2; ++i) {
+    int port = 0;
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                             &port);
+    builder.RegisterService(&services[i]);
+    servers[i] = builder.BuildAndStart();
+    ASSERT_NE(nullptr, servers[i]);
+    addresses[i] = absl::StrCat("localhost:", port);
+  }
+
+  StartSessionRequest start_request;
+  StartSessionResponse start_response;
+  start_request.set_name("emb1");
+  *start_request.mutable_config() = de_config_;
+  auto* gd_config =
+      start_request.mutable_config()->mutable_gradient_descent_config();
+  gd_config->set_learning_rate(0.1);
+  gd_config->mutable_sgd();
+  ASSERT_OK(
+      services[0].StartSession(&context_, &start_request, &start_response));
+  const auto& session_handle = start_response.session_handle();
+  const auto shard_map = CreateUniformShardMap({addresses[0], addresses[1]});
+  for (int i = 0; i < 2; ++i) {
+    SetShardMapRequest set_request;
+    SetShardMapResponse set_response;
+    set_request.set_session_handle(session_handle);
+    set_request.set_kbs_address(addresses[i]);
+    *set_request.mutable_shard_map() = shard_map;
+    set_request.mutable_hot_key_config()->set_min_read_fraction(0.2);
+    ASSERT_OK(services[i].SetShardMap(&context_, &set_request, &set_response));
+  }
+
+  // Keys owned by the first KBS, the first one is hot.
+  std::vector<std::string> keys;
+  for (int i = 0; keys.size() < 5; ++i) {
+    const std::string key = absl::StrCat("key", i);
+    if (FindShard(shard_map, ShardKeyHash(key))->kbs_address() ==
+        addresses[0]) {
+      keys.push_back(key);
+    }
+  }
+  const std::string& hot_key = keys[0];
+  LookupRequest lookup_request;
+  LookupResponse lookup_response;
+  lookup_request.set_session_handle(session_handle);
+  lookup_request.set_update(true);
+  for (int i = 0; i < 20; ++i) {
+    lookup_request.clear_key();
+    lookup_request.add_key(hot_key);
+    lookup_request.add_key(keys[1 + i % 4]);
+    ASSERT_OK(
+        services[0].Lookup(&context_, &lookup_request, &lookup_response));
+  }
+
+  // The hot key is not served by the second KBS yet.
+  lookup_request.clear_key();
+  lookup_request.add_key(hot_key);
+  EXPECT_EQ(grpc::StatusCode::FAILED_PRECONDITION,
+            services[1]
+                .Lookup(&context_, &lookup_request, &lookup_response)
+                .error_code());
+  GetShardMapRequest get_request;
+  GetShardMapResponse get_responses[2];
+  get_request.set_session_handle(session_handle);
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_OK(
+        services[i].GetShardMap(&context_, &get_request, &get_responses[i]));
+  }
+  EXPECT_EQ(40, get_responses[0].num_owned_reads());
+  EXPECT_EQ(0, get_responses[1].num_owned_reads());
+
+  // After a sync, the hot key is replicated to the second KBS.
+  services[0].SyncHotKeys();
+  ASSERT_OK(services[0].GetShardMap(&context_, &get_request,
+                                    &get_responses[0]));
+  EXPECT_THAT(get_responses[0].hot_key(), ::testing::ElementsAre(hot_key));
+  ASSERT_OK(services[1].Lookup(&context_, &lookup_request, &lookup_response));
+  EXPECT_THAT(lookup_response.embedding_table().at(hot_key),
+              EqualsProto<EmbeddingVectorProto>(absl::StrFormat(
+                  R"pb(tag: "%s" value: 0 value: 0 weight: 20)pb", hot_key)));
+
+  // Gradients sent to the replica are applied by the owner after the next
+  // sync of the replica, then broadcast back after the next sync of the owner.
+  UpdateRequest update_request;
+  UpdateResponse update_response;
+  update_request.set_session_handle(session_handle);
+  auto& gradient = (*update_request.mutable_gradients())[hot_key];
+  gradient.add_value(1);
+  gradient.add_value(2);
+  ASSERT_OK(services[1].Update(&context_, &update_request, &update_response));
+  ASSERT_OK(services[1].Update(&context_, &update_request, &update_response));
+  services[1].SyncHotKeys();
+  lookup_request.set_update(false);
+  ASSERT_OK(services[0].Lookup(&context_, &lookup_request, &lookup_response));
+  ASSERT_EQ(2, lookup_response.embedding_table().at(hot_key).value_size());
+  EXPECT_FLOAT_EQ(-0.2, lookup_response.embedding_table().at(hot_key).value(0));
+  EXPECT_FLOAT_EQ(-0.4, lookup_response.embedding_table().at(hot_key).value(1));
+  services[0].SyncHotKeys();
+  ASSERT_OK(services[1].Lookup(&context_, &lookup_request, &lookup_response));
+  ASSERT_EQ(2, lookup_response.embedding_table().at(hot_key).value_size());
+  EXPECT_FLOAT_EQ(-0.2, lookup_response.embedding_table().at(hot_key).value(0));
+  EXPECT_FLOAT_EQ(-0.4, lookup_response.embedding_table().at(hot_key).value(1));
+
+  // The reads of the hot key are now spread over both KBS.
+  for (int i = 0; i < 20; ++i) {
+    ASSERT_OK(services[i % 2].Lookup(&context_, &lookup_request,
+                                     &lookup_response));
+  }
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_OK(
+        services[i].GetShardMap(&context_, &get_request, &get_responses[i]));
+  }
+  EXPECT_EQ(51, get_responses[0].num_owned_reads());
+  EXPECT_EQ(12, get_responses[1].num_replica_reads());
+
+  for (auto& server : servers) {
+    server->Shutdown();
+  }
+}
 }  // namespace carls
@@ -13,16 +13,23 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
 #include <cstdint>
+#include <functional>
 #include <list>
+#include <utility>
 
 #include "google/protobuf/any.pb.h"  // proto to pb
 #include "absl/status/status.h"
+#include "absl/strings/match.h"
 #include "third_party/eigen3/Eigen/Core"
+#include "research/carls/base/compressed_block_file.h"
 #include "research/carls/base/embedding_helper.h"
+#include "research/carls/base/embedding_kernels.h"
 #include "research/carls/base/file_helper.h"
 #include "research/carls/base/proto_helper.h"
 #include "research/carls/base/status_helper.h"
+#include "research/carls/base/thread_bundle.h"
 #include "research/carls/memory_store/distance_helper.h"
 #include "research/carls/memory_store/gaussian_memory_config.pb.h"  // proto to pb
 #include "research/carls/memory_store/memory_store.h"
@@ -41,6 +48,50 @@ struct InMemoryClusterData {
 };
 
 constexpr char kDataOutput[] = "gaussian_memory_metadata.pbtext";
+constexpr char kBlockDataOutput[] = "gaussian_memory_data.blk";
+
+// Writes the clusters as a compressed block file, one cluster per record.
+absl::Status WriteCheckpointBlockFile(
+    const std::string& filepath, const CompressedBlockFileOptions& options,
+    const GaussianMemoryCheckpointMetaData& meta_data) {
+  std::unique_ptr<CompressedBlockFileWriter> writer;
+  RET_CHECK_OK(CompressedBlockFileWriter::Open(filepath, options, &writer));
+  std::string record;
+  for (const auto& cluster_data : meta_data.cluster_data()) {
+    RET_CHECK_TRUE(cluster_data.SerializeToString(&record))
+        << "Serializing cluster data failed.";
+    RET_CHECK_OK(writer->Append(record));
+  }
+  return writer->Close();
+}
+
+// Reads the clusters from a compressed block file, the blocks are parsed in
+// parallel and the order of the clusters is kept.
+absl::Status ReadCheckpointBlockFile(
+    const std::string& filepath, int parallelism,
+    GaussianMemoryCheckpointMetaData* meta_data) {
+  std::unique_ptr<CompressedBlockFileReader> reader;
+  RET_CHECK_OK(CompressedBlockFileReader::Open(filepath, &reader));
+  std::vector<GaussianMemoryCheckpointMetaData> blocks(reader->num_blocks());
+  RET_CHECK_OK(reader->ForEachBlock(
+      parallelism,
+      [&blocks](int block_index, const std::vector<absl::string_view>& records)
+          -> absl::Status {
+        for (const auto& record : records) {
+          RET_CHECK_TRUE(blocks[block_index].add_cluster_data()->ParseFromArray(
+              record.data(), record.size()))
+              << "Corrupted record in block " << block_index;
+        }
+        return absl::OkStatus();
+      }));
+  meta_data->Clear();
+  for (auto& block : blocks) {
+    for (auto& cluster_data : *block.mutable_cluster_data()) {
+      *meta_data->add_cluster_data() = std::move(cluster_data);
+    }
+  }
+  return absl::OkStatus();
+}
 
 }  // namespace
 
@@ -77,6 +128,15 @@ class GaussianMemory : public MemoryStore {
   // Internal implementation of the Import() method.
   absl::Status ImportInternal(const std::string& saved_path) override;
 
+  // Two-phase implementation of BatchLookupWithGrow, used when
+  // grow_parallelism > 1. The inputs are first assigned to the existing
+  // clusters in parallel, then the new clusters are created sequentially for
+  // the inputs far from all of them, and the remaining inputs are moved to a
+  // closer new cluster created by an earlier input, if any.
+  absl::Status BatchLookupWithTwoPhaseGrow(
+      const google::protobuf::RepeatedPtrField<EmbeddingVectorProto>& inputs,/*proto2*/
+      std::vector<MemoryLookupResult>* results);
+
   // Converts given inputs and cluster indices into an array of
   // MemoryLookupResult.
   absl::Status ProcessResults(
@@ -94,6 +154,17 @@ class GaussianMemory : public MemoryStore {
   DistanceToNearestCluster FindNearestCluster(
       const EmbeddingVectorProto& input);
 
+  // Returns the (index, distance) of the closest cluster to the given input
+  // among cluster_list_[begin_index, end_index), the index is -1 if the range
+  // is empty.
+  std::pair<int, float> FindNearestClusterInRange(
+      const EmbeddingVectorProto& input, int begin_index, int end_index)
+      ABSL_SHARED_LOCKS_REQUIRED(mu_);
+
+  // Calls fn(begin, end) for about grow_parallelism shards of [0, size) in
+  // parallel and waits for them to finish.
+  void ParallelForShards(int size, const std::function<void(int, int)>& fn);
+
   // Creates a new cluster based on given input.
   // Returns the index of the new cluster.
   int AddNewCluster(const EmbeddingVectorProto& input);
@@ -156,6 +227,11 @@ REGISTER_MEMORY_STORE_FACTORY(
         LOG(ERROR) << "Unknown distance_type.";
         return nullptr;
       }
+      if (gm_config.grow_parallelism() < 0) {
+        LOG(ERROR) << "Invalid grow_parallelism: "
+                   << gm_config.grow_parallelism();
+        return nullptr;
+      }
 
       return absl::make_unique<GaussianMemory>(config);
     });
@@ -211,6 +287,9 @@ absl::Status GaussianMemory::BatchLookupWithUpdateInternal(
 absl::Status GaussianMemory::BatchLookupWithGrowInternal(
     const google::protobuf::RepeatedPtrField<EmbeddingVectorProto>& inputs,/*proto2*/
     std::vector<MemoryLookupResult>* results) {
+  if (gm_config_.grow_parallelism() > 1) {
+    return BatchLookupWithTwoPhaseGrow(inputs, results);
+  }
   std::vector<int> cluster_indices;
   cluster_indices.reserve(inputs.size());
   for (const auto& input : inputs) {
@@ -241,8 +320,147 @@ absl::Status GaussianMemory::BatchLookupWithGrowInternal(
   return ProcessResults(inputs, cluster_indices, results);
 }
 
+absl::Status GaussianMemory::BatchLookupWithTwoPhaseGrow(
+    const google::protobuf::RepeatedPtrField<EmbeddingVectorProto>& inputs,/*proto2*/
+    std::vector<MemoryLookupResult>* results) {
+  const auto distance_type = gm_config_.distance_type();
+  const float threshold = gm_config_.distance_to_cluster_threshold();
+  std::vector<int> cluster_indices(inputs.size(), -1);
+  std::vector<float> distances(inputs.size(), furthest_distance_);
+  // True if the input created its cluster, which already contains it.
+  std::vector<bool> created_cluster(inputs.size(), false);
+  if (inputs.empty()) {
+    return ProcessResults(inputs, cluster_indices, results);
+  }
+  if (cluster_counter_ == 0) {
+    cluster_indices[0] = std::get<0>(FindNearestCluster(inputs[0]));
+    created_cluster[0] = true;
+  }
+
+  // Phase 1: assigns the inputs to the clusters existing before this batch.
+  int num_clusters = 0;
+  {
+    absl::ReaderMutexLock l(&mu_);
+    num_clusters = cluster_list_.size();
+  }
+  ParallelForShards(inputs.size(), [&](int begin, int end) {
+    absl::ReaderMutexLock l(&mu_);
+    for (int i = begin; i < end; ++i) {
+      if (created_cluster[i]) {
+        continue;
+      }
+      std::tie(cluster_indices[i], distances[i]) =
+          FindNearestClusterInRange(inputs[i], 0, num_clusters);
+      QCHECK_GE(cluster_indices[i], 0) << "Possible nan values encountered.";
+    }
+  });
+
+  // Phase 2: the inputs too far away from the existing clusters either join
+  // the closest new cluster within the threshold or create a new cluster, in
+  // the order of the inputs.
+  const bool can_grow =
+      update_steps_counter_ > gm_config_.bootstrap_steps();
+  // The (cluster index, input index) of the clusters created in this batch.
+  std::vector<std::pair<int, int>> new_clusters;
+  // The inputs within the threshold of an existing cluster, which are only
+  // moved if a new cluster created by an earlier input is closer.
+  std::vector<int> inputs_to_reassign;
+  for (int i = 0; i < inputs.size(); ++i) {
+    if (created_cluster[i]) {
+      continue;
+    }
+    if (!IsFurther(distance_type, distances[i], threshold)) {
+      inputs_to_reassign.push_back(i);
+      continue;
+    }
+    int closest_new_cluster = -1;
+    float closest_distance = furthest_distance_;
+    {
+      absl::ReaderMutexLock l(&mu_);
+      for (const auto& new_cluster : new_clusters) {
+        const float dist =
+            ComputeDistance(inputs[i], cluster_list_[new_cluster.first]);
+        if (IsFurther(distance_type, closest_distance, dist)) {
+          closest_distance = dist;
+          closest_new_cluster = new_cluster.first;
+        }
+      }
+    }
+    if (closest_new_cluster >= 0 &&
+        !IsFurther(distance_type, closest_distance, threshold)) {
+      // A near-identical outlier shares the new cluster.
+      cluster_indices[i] = closest_new_cluster;
+      distances[i] = closest_distance;
+    } else if (can_grow && cluster_counter_ < gm_config_.max_num_clusters()) {
+      cluster_indices[i] = AddNewCluster(inputs[i]);
+      created_cluster[i] = true;
+      new_clusters.emplace_back(cluster_indices[i], i);
+    } else if (closest_new_cluster >= 0 &&
+               IsFurther(distance_type, distances[i], closest_distance)) {
+      cluster_indices[i] = closest_new_cluster;
+      distances[i] = closest_distance;
+    }
+  }
+
+  // Phase 3: moves the remaining inputs to a closer new cluster.
+  if (!new_clusters.empty() && !inputs_to_reassign.empty()) {
+    ParallelForShards(inputs_to_reassign.size(), [&](int begin, int end) {
+      absl::ReaderMutexLock l(&mu_);
+      for (int j = begin; j < end; ++j) {
+        const int i = inputs_to_reassign[j];
+        for (const auto& new_cluster : new_clusters) {
+          // Clusters created by later inputs are not seen, as in the
+          // sequential mode.
+          if (new_cluster.second > i) {
+            break;
+          }
+          const float dist =
+              ComputeDistance(inputs[i], cluster_list_[new_cluster.first]);
+          if (IsFurther(distance_type, distances[i], dist)) {
+            distances[i] = dist;
+            cluster_indices[i] = new_cluster.first;
+          }
+        }
+      }
+    });
+  }
+
+  // Updates the clusters in the order of the inputs.
+  for (int i = 0; i < inputs.size(); ++i) {
+    if (!created_cluster[i]) {
+      AddInputToCluster(inputs[i], cluster_indices[i]);
+    }
+  }
+
+  ++update_steps_counter_;
+  return ProcessResults(inputs, cluster_indices, results);
+}
+
+void GaussianMemory::ParallelForShards(
+    int size, const std::function<void(int, int)>& fn) {
+  const int num_shards = std::min(gm_config_.grow_parallelism(), size);
+  if (num_shards <= 1) {
+    fn(0, size);
+    return;
+  }
+  const int shard_size = (size + num_shards - 1) / num_shards;
+  ThreadBundle bundle;
+  for (int begin = 0; begin < size; begin += shard_size) {
+    const int end = std::min(begin + shard_size, size);
+    bundle.Add([&fn, begin, end]() { fn(begin, end); });
+  }
+  bundle.JoinAll();
+}
+
 absl::Status GaussianMemory::ExportInternal(const std::string& dirname,
                                             std::string* exported_path) {
+  if (gm_config_.has_checkpoint_file_options()) {
+    *exported_path = JoinPath(dirname, kBlockDataOutput);
+    RET_CHECK_OK(WriteCheckpointBlockFile(*exported_path,
+                                          gm_config_.checkpoint_file_options(),
+                                          ConvertToCheckpointMetaData()));
+    return absl::OkStatus();
+  }
   *exported_path = JoinPath(dirname, kDataOutput);
   RET_CHECK_OK(WriteTextProto(*exported_path, ConvertToCheckpointMetaData(),
                               /*can_overwrite=*/true));
@@ -272,6 +490,13 @@ absl::Status GaussianMemory::ProcessResults(
 
 float GaussianMemory::ComputeDistance(const EmbeddingVectorProto& input,
                                       const InMemoryClusterData& cluster) {
+  if (gm_config_.distance_type() == MemoryDistanceConfig::SQUARED_L2) {
+    // Compute the L2 distance between input and the mean vector.
+    CHECK_EQ(input.value_size(), cluster.mean.size());
+    return GetEmbeddingKernels(input.value_size())
+        .squared_distance(input.value().data(), cluster.mean.data(),
+                          input.value_size());
+  }
   VectorXf input_vec = std::move(ToInMemoryEmbeddingVector(input).vec);
   if (gm_config_.distance_type() == MemoryDistanceConfig::CWISE_MEAN_GAUSSIAN) {
     // Computes the probability based on the following formula:
@@ -282,11 +507,6 @@ float GaussianMemory::ComputeDistance(const EmbeddingVectorProto& input,
     }
     return std::exp(-dist.mean() / 2);
   }
-  if (gm_config_.distance_type() == MemoryDistanceConfig::SQUARED_L2) {
-    // Compute the L2 distance between input and the mean vector.
-    VectorXf dist = input_vec - cluster.mean;
-    return dist.squaredNorm();
-  }
   LOG(FATAL) << "Unknown distance type: " << gm_config_.distance_type();
 }
 
@@ -300,18 +520,24 @@ GaussianMemory::DistanceToNearestCluster GaussianMemory::FindNearestCluster(
   }
 
   absl::MutexLock l(&mu_);
+  const auto closest =
+      FindNearestClusterInRange(input, 0, cluster_list_.size());
+  QCHECK_GE(closest.first, 0) << "Possible nan values encountered.";
+  return std::make_tuple(closest.first, closest.second, /*is_first*/ false);
+}
+
+std::pair<int, float> GaussianMemory::FindNearestClusterInRange(
+    const EmbeddingVectorProto& input, int begin_index, int end_index) {
   int closest_cluster_index = -1;
   float closest_distance = furthest_distance_;
-  for (int i = 0; i < cluster_list_.size(); ++i) {
+  for (int i = begin_index; i < end_index; ++i) {
     float dist = ComputeDistance(input, cluster_list_[i]);
     if (IsFurther(gm_config_.distance_type(), closest_distance, dist)) {
       closest_distance = dist;
       closest_cluster_index = i;
     }
   }
-  QCHECK_GE(closest_cluster_index, 0) << "Possible nan values encountered.";
-  return std::make_tuple(closest_cluster_index, closest_distance,
-                         /*is_first*/ false);
+  return std::make_pair(closest_cluster_index, closest_distance);
 }
 
 int GaussianMemory::AddNewCluster(const EmbeddingVectorProto& input) {
@@ -399,7 +625,13 @@ GaussianMemoryCheckpointMetaData GaussianMemory::ConvertToCheckpointMetaData() {
 
 absl::Status GaussianMemory::ImportInternal(const std::string& saved_path) {
   GaussianMemoryCheckpointMetaData meta_data;
-  RET_CHECK_OK(ReadTextProto(saved_path, &meta_data));
+  if (absl::EndsWith(saved_path, ".blk")) {
+    RET_CHECK_OK(ReadCheckpointBlockFile(
+        saved_path, gm_config_.checkpoint_file_options().parallelism(),
+        &meta_data));
+  } else {
+    RET_CHECK_OK(ReadTextProto(saved_path, &meta_data));
+  }
   RET_CHECK_TRUE(meta_data.cluster_data_size() <= gm_config_.max_num_clusters())
       << "Too many clusters.";
   absl::MutexLock l(&mu_);
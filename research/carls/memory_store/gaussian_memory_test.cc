@@ -37,7 +37,8 @@ class GaussianMemoryTest : public ::testing::Test {
       const int per_cluster_buffer_size,
       const float distance_to_cluster_threshold, const int max_num_clusters,
       const int bootstrap_steps, const float min_variance,
-      const MemoryDistanceConfig::DistanceType distance_type) {
+      const MemoryDistanceConfig::DistanceType distance_type,
+      const int grow_parallelism = 0) {
     MemoryStoreConfig config;
     GaussianMemoryConfig gm_config;
     gm_config.set_per_cluster_buffer_size(per_cluster_buffer_size);
@@ -46,6 +47,7 @@ class GaussianMemoryTest : public ::testing::Test {
     gm_config.set_bootstrap_steps(bootstrap_steps);
     gm_config.set_min_variance(min_variance);
     gm_config.set_distance_type(distance_type);
+    gm_config.set_grow_parallelism(grow_parallelism);
     config.mutable_extension()->PackFrom(gm_config);
     return MemoryStoreFactory::Make(config);
   }
@@ -101,6 +103,15 @@ TEST_F(GaussianMemoryTest, Create) {
           /*min_variance=*/0,
           /*distance_type=*/MemoryDistanceConfig::CWISE_MEAN_GAUSSIAN) ==
       nullptr);
+  // Invalid grow_parallelism.
+  EXPECT_TRUE(
+      CreateGaussianMemoryStore(
+          /*per_cluster_buffer_size=*/1,
+          /*distance_to_cluster_threshold=*/0.5, /*max_num_clusters=*/1,
+          /*bootstrap_steps=*/1,
+          /*min_variance=*/1,
+          /*distance_type=*/MemoryDistanceConfig::CWISE_MEAN_GAUSSIAN,
+          /*grow_parallelism=*/-1) == nullptr);
   EXPECT_TRUE(
       CreateGaussianMemoryStore(
           /*per_cluster_buffer_size=*/1,
@@ -752,6 +763,84 @@ TEST_F(GaussianMemoryTest, BatchLookupWithGrow_MultiInput_MultiCluster) {
                                    )pb")));
 }
 
+TEST_F(GaussianMemoryTest, BatchLookupWithGrow_TwoPhaseSameAsSequential) {
+  google::protobuf::RepeatedPtrField<EmbeddingVectorProto> bootstrap_inputs;/*proto2*/
+  *bootstrap_inputs.Add() = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    value: 0
+    value: 0
+  )pb");
+  // [11, 0] creates a new cluster that is closer to [8, 0] but not to [3, 0].
+  // [0, -21] shares the new cluster of [0, -20].
+  google::protobuf::RepeatedPtrField<EmbeddingVectorProto> inputs;/*proto2*/
+  for (const auto& value : std::vector<std::pair<float, float>>{
+           {11, 0}, {8, 0}, {3, 0}, {0, -20}, {0, -21}, {0, 30}}) {
+    auto* input = inputs.Add();
+    input->add_value(value.first);
+    input->add_value(value.second);
+  }
+
+  std::vector<MemoryLookupResult> sequential_results;
+  std::vector<MemoryLookupResult> two_phase_results;
+  for (int grow_parallelism : {0, 4}) {
+    auto memory_store = CreateGaussianMemoryStore(
+        /*per_cluster_buffer_size=*/10,
+        /*distance_to_cluster_threshold=*/100, /*max_num_clusters=*/4,
+        /*bootstrap_steps=*/0,
+        /*min_variance=*/1,
+        /*distance_type=*/MemoryDistanceConfig::SQUARED_L2, grow_parallelism);
+    std::vector<MemoryLookupResult> results;
+    ASSERT_OK(memory_store->BatchLookupWithUpdate(bootstrap_inputs, &results));
+    ASSERT_OK(memory_store->BatchLookupWithGrow(
+        inputs,
+        grow_parallelism > 1 ? &two_phase_results : &sequential_results));
+  }
+
+  ASSERT_EQ(inputs.size(), sequential_results.size());
+  ASSERT_EQ(inputs.size(), two_phase_results.size());
+  for (int i = 0; i < inputs.size(); ++i) {
+    EXPECT_THAT(two_phase_results[i], EqualsProto(sequential_results[i]));
+  }
+  EXPECT_EQ(1, two_phase_results[0].cluster_index());
+  EXPECT_EQ(1, two_phase_results[1].cluster_index());
+  EXPECT_EQ(0, two_phase_results[2].cluster_index());
+  EXPECT_EQ(2, two_phase_results[3].cluster_index());
+  EXPECT_EQ(2, two_phase_results[4].cluster_index());
+  EXPECT_EQ(3, two_phase_results[5].cluster_index());
+}
+
+TEST_F(GaussianMemoryTest, BatchLookupWithGrow_TwoPhaseMaxNumClusters) {
+  auto memory_store = CreateGaussianMemoryStore(
+      /*per_cluster_buffer_size=*/10,
+      /*distance_to_cluster_threshold=*/100, /*max_num_clusters=*/2,
+      /*bootstrap_steps=*/0,
+      /*min_variance=*/1,
+      /*distance_type=*/MemoryDistanceConfig::SQUARED_L2,
+      /*grow_parallelism=*/4);
+  google::protobuf::RepeatedPtrField<EmbeddingVectorProto> inputs;/*proto2*/
+  *inputs.Add() = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    value: 0
+    value: 0
+  )pb");
+  std::vector<MemoryLookupResult> results;
+  ASSERT_OK(memory_store->BatchLookupWithUpdate(inputs, &results));
+
+  // Only [11, 0] creates a new cluster, the other outliers are added into the
+  // closest cluster.
+  inputs.Clear();
+  for (const auto& value : std::vector<std::pair<float, float>>{
+           {11, 0}, {0, -20}, {11, 30}, {0, 30}}) {
+    auto* input = inputs.Add();
+    input->add_value(value.first);
+    input->add_value(value.second);
+  }
+  ASSERT_OK(memory_store->BatchLookupWithGrow(inputs, &results));
+  ASSERT_EQ(4, results.size());
+  EXPECT_EQ(1, results[0].cluster_index());
+  EXPECT_EQ(0, results[1].cluster_index());
+  EXPECT_EQ(1, results[2].cluster_index());
+  EXPECT_EQ(0, results[3].cluster_index());
+}
+
 TEST_F(GaussianMemoryTest, Export) {
   auto memory_store = CreateGaussianMemoryStore(
       /*per_cluster_buffer_size=*/3,
@@ -882,6 +971,55 @@ TEST_F(GaussianMemoryTest, Import) {
               )pb")));
 }
 
+TEST_F(GaussianMemoryTest, ExportAndImportBlockFile) {
+  MemoryStoreConfig config;
+  auto gm_config = ParseTextProtoOrDie<GaussianMemoryConfig>(R"pb(
+    per_cluster_buffer_size: 3
+    distance_to_cluster_threshold: 0.7
+    max_num_clusters: 3
+    min_variance: 1
+    distance_type: CWISE_MEAN_GAUSSIAN
+    checkpoint_file_options { compression: ZLIB block_size: 1 }
+  )pb");
+  config.mutable_extension()->PackFrom(gm_config);
+  auto memory_store = MemoryStoreFactory::Make(config);
+  ASSERT_TRUE(memory_store != nullptr);
+
+  google::protobuf::RepeatedPtrField<EmbeddingVectorProto> inputs;/*proto2*/
+  *inputs.Add() = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    value: 0
+    value: 0
+  )pb");
+  std::vector<MemoryLookupResult> results;
+  // Increases the update_steps_counter_ by 1, then grows a new cluster.
+  ASSERT_OK(memory_store->BatchLookupWithUpdate(inputs, &results));
+  *inputs.Add() = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    value: 100
+    value: 0
+  )pb");
+  ASSERT_OK(memory_store->BatchLookupWithGrow(inputs, &results));
+
+  std::string checkpoint_path;
+  ASSERT_OK(memory_store->Export(TempDir(), "block", &checkpoint_path));
+  EXPECT_EQ(JoinPath(TempDir(), "block", "gaussian_memory_data.blk"),
+            checkpoint_path);
+
+  // Imports into a new memory store, the order of the clusters is kept.
+  auto new_memory_store = MemoryStoreFactory::Make(config);
+  ASSERT_OK(new_memory_store->Import(checkpoint_path));
+  inputs.RemoveLast();
+  ASSERT_OK(new_memory_store->BatchLookup(inputs, &results));
+  ASSERT_EQ(1, results.size());
+  EXPECT_EQ(0, results[0].cluster_index());
+  *inputs.Mutable(0) = ParseTextProtoOrDie<EmbeddingVectorProto>(R"pb(
+    value: 100
+    value: 0
+  )pb");
+  ASSERT_OK(new_memory_store->BatchLookup(inputs, &results));
+  ASSERT_EQ(1, results.size());
+  EXPECT_EQ(1, results[0].cluster_index());
+}
+
 TEST_F(GaussianMemoryTest, Import_FailedTooManyClusters) {
   // Save a checkpoint with too many clusters.
   auto meta_data = ParseTextProtoOrDie<GaussianMemoryCheckpointMetaData>(R"pb(
@@ -0,0 +1,387 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Benchmarks the MemoryStore implementations on synthetic mixtures of
+// Gaussians, e.g.,
+//   bazel run -c opt //research/carls/memory_store:memory_store_benchmark
+//
+// Each memory store is first grown on samples of the mixture, then every
+// operation of the MemoryStore interface is measured and reports
+// - items_per_second: the inputs (or clusters for export and import)
+//   processed per second,
+// - p50_us and p99_us: the latency of a batch,
+// - memory_bytes: the heap memory of the store after it is grown,
+// - checkpoint_bytes: the size of an exported checkpoint.
+// The lookups run with one or more threads sharing the store. A new memory
+// store is benchmarked on equal footing by adding a function from
+// MemoryStoreParams to its config with REGISTER_MEMORY_STORE_BENCHMARKS().
+
+#include <malloc.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "absl/synchronization/mutex.h"
+#include "research/carls/embedding.pb.h"  // proto to pb
+#include "research/carls/memory_store/gaussian_memory_config.pb.h"  // proto to pb
+#include "research/carls/memory_store/memory_distance_config.pb.h"  // proto to pb
+#include "research/carls/memory_store/memory_store.h"
+
+namespace carls {
+namespace memory_store {
+namespace {
+
+using ::google::protobuf::RepeatedPtrField;/*proto2*/
+
+// Parameters shared by all the benchmarked memory stores.
+struct MemoryStoreParams {
+  int dimension;
+  int num_clusters;
+  int per_cluster_buffer_size;
+};
+
+using ConfigFn = MemoryStoreConfig (*)(const MemoryStoreParams&);
+
+// Samples inputs from a mixture of `num_clusters` Gaussians with unit variance,
+// whose centers are apart enough to be told from each other.
+class GaussianMixture {
+ public:
+  GaussianMixture(int dimension, int num_clusters, int seed)
+      : dimension_(dimension), rng_(seed), cluster_(0, num_clusters - 1) {
+    std::normal_distribution<float> center_distribution(0, 10);
+    centers_.resize(num_clusters);
+    for (auto& center : centers_) {
+      for (int i = 0; i < dimension; ++i) {
+        center.push_back(center_distribution(rng_));
+      }
+    }
+  }
+
+  RepeatedPtrField<EmbeddingVectorProto> Sample(int batch_size) {
+    RepeatedPtrField<EmbeddingVectorProto> inputs;
+    for (int i = 0; i < batch_size; ++i) {
+      const auto& center = centers_[cluster_(rng_)];
+      auto* input = inputs.Add();
+      for (int j = 0; j < dimension_; ++j) {
+        input->add_value(center[j] + noise_(rng_));
+      }
+    }
+    return inputs;
+  }
+
+ private:
+  const int dimension_;
+  std::mt19937 rng_;
+  std::uniform_int_distribution<int> cluster_;
+  std::normal_distribution<float> noise_;
+  std::vector<std::vector<float>> centers_;
+};
+
+// Returns the heap memory in use by the process, including the chunks mapped
+// by malloc() directly.
+int64_t HeapBytesInUse() {
+  const auto info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+// A memory store grown on the mixture, shared by the benchmarks.
+struct GrownMemoryStore {
+  std::unique_ptr<MemoryStore> store;
+  // Heap memory allocated while creating and growing the store, the other
+  // threads wait on the lock of GetMemoryStore() meanwhile.
+  int64_t memory_bytes = 0;
+};
+
+GrownMemoryStore& GetMemoryStore(ConfigFn config_fn,
+                                 const MemoryStoreParams& params) {
+  static absl::Mutex mu(absl::kConstInit);
+  static auto* stores =
+      new std::map<std::tuple<ConfigFn, int, int, int>, GrownMemoryStore>();
+  absl::MutexLock l(&mu);
+  auto& grown = (*stores)[{config_fn, params.dimension, params.num_clusters,
+                           params.per_cluster_buffer_size}];
+  if (grown.store != nullptr) {
+    return grown;
+  }
+  const int64_t heap_bytes_begin = HeapBytesInUse();
+  grown.store = MemoryStoreFactory::Make(config_fn(params));
+  CHECK(grown.store != nullptr);
+  // Enough inputs to find the clusters and fill most of their buffers.
+  GaussianMixture mixture(params.dimension, params.num_clusters, /*seed=*/0);
+  const int num_inputs =
+      params.num_clusters * std::min(params.per_cluster_buffer_size, 32) * 2;
+  std::vector<MemoryLookupResult> results;
+  // New clusters are only forked after the first batch, which hence has a
+  // single input so that it does not blend the clusters.
+  CHECK(grown.store->BatchLookupWithGrow(mixture.Sample(1), &results).ok());
+  for (int i = 0; i < num_inputs; i += 64) {
+    CHECK(grown.store->BatchLookupWithGrow(mixture.Sample(64), &results).ok());
+  }
+  results.clear();
+  results.shrink_to_fit();
+  grown.memory_bytes = HeapBytesInUse() - heap_bytes_begin;
+  return grown;
+}
+
+std::string OutputDir() {
+  const char* dir = std::getenv("TEST_TMPDIR");
+  return dir != nullptr ? dir : "/tmp";
+}
+
+// Adds the latency percentiles of the batches to `state`.
+void ReportLatencies(std::vector<double> latencies_us,
+                     benchmark::State* state) {
+  if (latencies_us.empty()) {
+    return;
+  }
+  std::sort(latencies_us.begin(), latencies_us.end());
+  state->counters["p50_us"] = benchmark::Counter(
+      latencies_us[latencies_us.size() / 2], benchmark::Counter::kAvgThreads);
+  state->counters["p99_us"] =
+      benchmark::Counter(latencies_us[latencies_us.size() * 99 / 100],
+                         benchmark::Counter::kAvgThreads);
+}
+
+double MicrosecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+MemoryStoreParams ParamsFromState(const benchmark::State& state) {
+  return {static_cast<int>(state.range(0)), static_cast<int>(state.range(1)),
+          static_cast<int>(state.range(2))};
+}
+
+enum class LookupMode { kLookup, kLookupWithUpdate, kLookupWithGrow };
+
+// Args are {dimension, num_clusters, per_cluster_buffer_size, batch_size}.
+void LookupArgs(benchmark::internal::Benchmark* b) {
+  for (int dimension : {16, 128}) {
+    for (int num_clusters : {16, 256}) {
+      for (int per_cluster_buffer_size : {8, 128}) {
+        for (int batch_size : {16, 256}) {
+          b->Args(
+              {dimension, num_clusters, per_cluster_buffer_size, batch_size});
+        }
+      }
+    }
+  }
+}
+
+// Args are {dimension, num_clusters, per_cluster_buffer_size}.
+void CheckpointArgs(benchmark::internal::Benchmark* b) {
+  for (int dimension : {16, 128}) {
+    for (int num_clusters : {16, 256}) {
+      for (int per_cluster_buffer_size : {8, 128}) {
+        b->Args({dimension, num_clusters, per_cluster_buffer_size});
+      }
+    }
+  }
+}
+
+void BM_Lookup(benchmark::State& state, ConfigFn config_fn, LookupMode mode) {
+  const auto params = ParamsFromState(state);
+  const int batch_size = state.range(3);
+  auto& grown = GetMemoryStore(config_fn, params);
+  // The same mixture as the one the store was grown on.
+  GaussianMixture mixture(params.dimension, params.num_clusters, /*seed=*/0);
+  constexpr int kNumBatches = 16;
+  std::vector<RepeatedPtrField<EmbeddingVectorProto>> batches;
+  for (int i = 0; i < kNumBatches; ++i) {
+    batches.push_back(mixture.Sample(batch_size));
+  }
+
+  std::vector<MemoryLookupResult> results;
+  std::vector<double> latencies_us;
+  int batch_index = 0;
+  for (auto _ : state) {
+    const auto& inputs = batches[batch_index];
+    batch_index = (batch_index + 1) % kNumBatches;
+    const auto start = std::chrono::steady_clock::now();
+    absl::Status status;
+    switch (mode) {
+      case LookupMode::kLookup:
+        status = grown.store->BatchLookup(inputs, &results);
+        break;
+      case LookupMode::kLookupWithUpdate:
+        status = grown.store->BatchLookupWithUpdate(inputs, &results);
+        break;
+      case LookupMode::kLookupWithGrow:
+        status = grown.store->BatchLookupWithGrow(inputs, &results);
+        break;
+    }
+    if (!status.ok()) {
+      state.SkipWithError(std::string(status.message()).c_str());
+      break;
+    }
+    latencies_us.push_back(MicrosecondsSince(start));
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+  state.counters["memory_bytes"] = benchmark::Counter(
+      grown.memory_bytes, benchmark::Counter::kAvgThreads);
+  ReportLatencies(std::move(latencies_us), &state);
+}
+
+void BM_Export(benchmark::State& state, ConfigFn config_fn) {
+  const auto params = ParamsFromState(state);
+  auto& grown = GetMemoryStore(config_fn, params);
+  std::string exported_path;
+  std::vector<double> latencies_us;
+  for (auto _ : state) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto status = grown.store->Export(
+        OutputDir(), "memory_store_benchmark_export", &exported_path);
+    if (!status.ok()) {
+      state.SkipWithError(std::string(status.message()).c_str());
+      break;
+    }
+    latencies_us.push_back(MicrosecondsSince(start));
+  }
+  struct stat file_stat;
+  if (!exported_path.empty() && stat(exported_path.c_str(), &file_stat) == 0) {
+    state.counters["checkpoint_bytes"] = file_stat.st_size;
+  }
+  state.counters["memory_bytes"] = grown.memory_bytes;
+  state.SetItemsProcessed(state.iterations() * params.num_clusters);
+  ReportLatencies(std::move(latencies_us), &state);
+}
+
+void BM_Import(benchmark::State& state, ConfigFn config_fn) {
+  const auto params = ParamsFromState(state);
+  auto& grown = GetMemoryStore(config_fn, params);
+  std::string exported_path;
+  const auto export_status = grown.store->Export(
+      OutputDir(), "memory_store_benchmark_import", &exported_path);
+  if (!export_status.ok()) {
+    state.SkipWithError(std::string(export_status.message()).c_str());
+    return;
+  }
+  // Imports into a new store so that the shared one is left untouched.
+  auto store = MemoryStoreFactory::Make(config_fn(params));
+  std::vector<double> latencies_us;
+  for (auto _ : state) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto status = store->Import(exported_path);
+    if (!status.ok()) {
+      state.SkipWithError(std::string(status.message()).c_str());
+      break;
+    }
+    latencies_us.push_back(MicrosecondsSince(start));
+  }
+  state.SetItemsProcessed(state.iterations() * params.num_clusters);
+  ReportLatencies(std::move(latencies_us), &state);
+}
+
+// Registers the benchmarks of all the MemoryStore operations for the memory
+// store configured by `config_fn`.
+#define REGISTER_MEMORY_STORE_BENCHMARKS(name, config_fn)                \
+  BENCHMARK_CAPTURE(BM_Lookup, name##_lookup, config_fn,                 \
+                    LookupMode::kLookup)                                 \
+      ->Apply(LookupArgs)                                                \
+      ->Threads(1)                                                       \
+      ->Threads(4)                                                       \
+      ->UseRealTime();                                                   \
+  BENCHMARK_CAPTURE(BM_Lookup, name##_lookup_with_update, config_fn,     \
+                    LookupMode::kLookupWithUpdate)                       \
+      ->Apply(LookupArgs)                                                \
+      ->Threads(1)                                                       \
+      ->Threads(4)                                                       \
+      ->UseRealTime();                                                   \
+  BENCHMARK_CAPTURE(BM_Lookup, name##_lookup_with_grow, config_fn,       \
+                    LookupMode::kLookupWithGrow)                         \
+      ->Apply(LookupArgs)                                                \
+      ->Threads(1)                                                       \
+      ->Threads(4)                                                       \
+      ->UseRealTime();                                                   \
+  BENCHMARK_CAPTURE(BM_Export, name##_export, config_fn)                 \
+      ->Apply(CheckpointArgs);                                           \
+  BENCHMARK_CAPTURE(BM_Import, name##_import, config_fn)                 \
+      ->Apply(CheckpointArgs)
+
+GaussianMemoryConfig BaseGaussianMemoryConfig(const MemoryStoreParams& params) {
+  GaussianMemoryConfig gm_config;
+  gm_config.set_per_cluster_buffer_size(params.per_cluster_buffer_size);
+  gm_config.set_max_num_clusters(params.num_clusters);
+  gm_config.set_bootstrap_steps(0);
+  gm_config.set_min_variance(1);
+  return gm_config;
+}
+
+MemoryStoreConfig GaussianMemoryL2(const MemoryStoreParams& params) {
+  auto gm_config = BaseGaussianMemoryConfig(params);
+  gm_config.set_distance_type(MemoryDistanceConfig::SQUARED_L2);
+  // The squared distance to the center of an input is about `dimension`, and
+  // about 200 * `dimension` between the centers.
+  gm_config.set_distance_to_cluster_threshold(20 * params.dimension);
+  MemoryStoreConfig config;
+  config.mutable_extension()->PackFrom(gm_config);
+  return config;
+}
+
+MemoryStoreConfig GaussianMemoryCwiseMeanGaussian(
+    const MemoryStoreParams& params) {
+  auto gm_config = BaseGaussianMemoryConfig(params);
+  gm_config.set_distance_type(MemoryDistanceConfig::CWISE_MEAN_GAUSSIAN);
+  // The mean Gaussian similarity of an input to its own center is about
+  // 1/sqrt(2), and below 0.1 to the other centers.
+  gm_config.set_distance_to_cluster_threshold(0.3);
+  MemoryStoreConfig config;
+  config.mutable_extension()->PackFrom(gm_config);
+  return config;
+}
+
+MemoryStoreConfig GaussianMemoryL2BlockCheckpoint(
+    const MemoryStoreParams& params) {
+  auto config = GaussianMemoryL2(params);
+  GaussianMemoryConfig gm_config;
+  config.extension().UnpackTo(&gm_config);
+  auto* options = gm_config.mutable_checkpoint_file_options();
+  options->set_compression(CompressedBlockFileOptions::SNAPPY);
+  options->set_parallelism(4);
+  config.mutable_extension()->PackFrom(gm_config);
+  return config;
+}
+
+MemoryStoreConfig GaussianMemoryL2TwoPhaseGrow(
+    const MemoryStoreParams& params) {
+  auto config = GaussianMemoryL2(params);
+  GaussianMemoryConfig gm_config;
+  config.extension().UnpackTo(&gm_config);
+  gm_config.set_grow_parallelism(8);
+  config.mutable_extension()->PackFrom(gm_config);
+  return config;
+}
+
+REGISTER_MEMORY_STORE_BENCHMARKS(gaussian_l2, GaussianMemoryL2);
+REGISTER_MEMORY_STORE_BENCHMARKS(gaussian_cwise_mean_gaussian,
+                                 GaussianMemoryCwiseMeanGaussian);
+REGISTER_MEMORY_STORE_BENCHMARKS(gaussian_l2_block_checkpoint,
+                                 GaussianMemoryL2BlockCheckpoint);
+REGISTER_MEMORY_STORE_BENCHMARKS(gaussian_l2_two_phase_grow,
+                                 GaussianMemoryL2TwoPhaseGrow);
+
+}  // namespace
+}  // namespace memory_store
+}  // namespace carls
@@ -0,0 +1,202 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/shard_map_helper.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <glog/logging.h>
+#include "absl/strings/str_cat.h"
+
+namespace carls {
+namespace {
+
+constexpr uint64_t kMaxHash = std::numeric_limits<uint64_t>::max();
+
+// Parameters of the 64-bit FNV-1a hash.
+constexpr uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+constexpr uint64_t kFnvPrime = 0x100000001b3ULL;
+
+ShardMap::Range MakeRange(uint64_t first_hash, uint64_t last_hash,
+                          const std::string& kbs_address) {
+  ShardMap::Range range;
+  range.set_first_hash(first_hash);
+  range.set_last_hash(last_hash);
+  range.set_kbs_address(kbs_address);
+  return range;
+}
+
+}  // namespace
+
+uint64_t ShardKeyHash(absl::string_view key) {
+  uint64_t hash = kFnvOffsetBasis;
+  for (const char c : key) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= kFnvPrime;
+  }
+  // Finalizer of SplitMix64, which spreads similar keys over the whole range
+  // of hashes.
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ULL;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebULL;
+  hash ^= hash >> 31;
+  return hash;
+}
+
+absl::Status ValidateShardMap(const ShardMap& shard_map) {
+  if (shard_map.range().empty()) {
+    return absl::InvalidArgumentError("Shard map has no range.");
+  }
+  if (shard_map.range(0).first_hash() != 0) {
+    return absl::InvalidArgumentError("Shard map does not start from hash 0.");
+  }
+  for (int i = 0; i < shard_map.range_size(); ++i) {
+    const auto& range = shard_map.range(i);
+    if (range.first_hash() > range.last_hash()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid range: [", range.first_hash(), ", ",
+                       range.last_hash(), "]"));
+    }
+    if (range.kbs_address().empty()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Empty address for range ", i));
+    }
+    if (i > 0 &&
+        (shard_map.range(i - 1).last_hash() == kMaxHash ||
+         shard_map.range(i - 1).last_hash() + 1 != range.first_hash())) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Range ", i, " does not follow the previous one."));
+    }
+  }
+  if (shard_map.range(shard_map.range_size() - 1).last_hash() != kMaxHash) {
+    return absl::InvalidArgumentError("Shard map does not cover all hashes.");
+  }
+  return absl::OkStatus();
+}
+
+ShardMap CreateUniformShardMap(const std::vector<std::string>& kbs_addresses) {
+  ShardMap shard_map;
+  if (kbs_addresses.empty()) {
+    return shard_map;
+  }
+  shard_map.set_version(1);
+  const uint64_t step = kMaxHash / kbs_addresses.size();
+  for (size_t i = 0; i < kbs_addresses.size(); ++i) {
+    const uint64_t last_hash =
+        i + 1 == kbs_addresses.size() ? kMaxHash : (i + 1) * step - 1;
+    *shard_map.add_range() = MakeRange(i * step, last_hash, kbs_addresses[i]);
+  }
+  return shard_map;
+}
+
+const ShardMap::Range* FindShard(const ShardMap& shard_map, uint64_t hash) {
+  if (shard_map.range().empty()) {
+    return nullptr;
+  }
+  // Finds the first range starting after `hash`, the previous one contains it.
+  auto iter = std::upper_bound(
+      shard_map.range().begin(), shard_map.range().end(), hash,
+      [](uint64_t value, const ShardMap::Range& range) {
+        return value < range.first_hash();
+      });
+  if (iter == shard_map.range().begin()) {
+    return nullptr;
+  }
+  return &*(--iter);
+}
+
+bool IsRangeAssignedTo(const ShardMap& shard_map, uint64_t first_hash,
+                       uint64_t last_hash, absl::string_view kbs_address) {
+  if (shard_map.range().empty() || first_hash > last_hash) {
+    return false;
+  }
+  for (const auto& range : shard_map.range()) {
+    if (range.last_hash() < first_hash || range.first_hash() > last_hash) {
+      continue;
+    }
+    if (range.kbs_address() != kbs_address) {
+      return false;
+    }
+  }
+  return true;
+}
+
+absl::Status AssignRange(uint64_t first_hash, uint64_t last_hash,
+                         const std::string& kbs_address, ShardMap* shard_map) {
+  CHECK(shard_map != nullptr);
+  if (first_hash > last_hash) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Invalid range: [", first_hash, ", ", last_hash, "]"));
+  }
+  if (kbs_address.empty()) {
+    return absl::InvalidArgumentError("kbs_address is empty.");
+  }
+  auto status = ValidateShardMap(*shard_map);
+  if (!status.ok()) {
+    return status;
+  }
+
+  std::vector<ShardMap::Range> ranges;
+  bool assigned = false;
+  for (const auto& range : shard_map->range()) {
+    if (range.last_hash() < first_hash || range.first_hash() > last_hash) {
+      ranges.push_back(range);
+      continue;
+    }
+    if (range.first_hash() < first_hash) {
+      ranges.push_back(
+          MakeRange(range.first_hash(), first_hash - 1, range.kbs_address()));
+    }
+    if (!assigned) {
+      ranges.push_back(MakeRange(first_hash, last_hash, kbs_address));
+      assigned = true;
+    }
+    if (range.last_hash() > last_hash) {
+      ranges.push_back(
+          MakeRange(last_hash + 1, range.last_hash(), range.kbs_address()));
+    }
+  }
+
+  // Merges the adjacent ranges of the same address.
+  shard_map->clear_range();
+  for (auto& range : ranges) {
+    const int size = shard_map->range_size();
+    if (size > 0 &&
+        shard_map->range(size - 1).kbs_address() == range.kbs_address()) {
+      shard_map->mutable_range(size - 1)->set_last_hash(range.last_hash());
+      continue;
+    }
+    *shard_map->add_range() = std::move(range);
+  }
+  shard_map->set_version(shard_map->version() + 1);
+  return absl::OkStatus();
+}
+
+absl::flat_hash_map<std::string, std::vector<int>> PartitionKeysByShard(
+    const ShardMap& shard_map, const std::vector<absl::string_view>& keys) {
+  absl::flat_hash_map<std::string, std::vector<int>> key_indices;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    const auto* range = FindShard(shard_map, ShardKeyHash(keys[i]));
+    if (range == nullptr) {
+      continue;
+    }
+    key_indices[range->kbs_address()].push_back(i);
+  }
+  return key_indices;
+}
+
+}  // namespace carls
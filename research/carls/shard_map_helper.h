@@ -0,0 +1,63 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_SHARD_MAP_HELPER_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_SHARD_MAP_HELPER_H_
+
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "research/carls/knowledge_bank_service.pb.h"  // proto to pb
+
+namespace carls {
+
+// Returns the hash of a key used for sharding. Unlike absl::Hash, it is stable
+// across processes and platforms, so that clients and KBS instances agree on
+// the shard of a key.
+uint64_t ShardKeyHash(absl::string_view key);
+
+// Returns an error if the ranges of the shard map are not sorted, disjoint and
+// covering all the hashes, or if any of them has no address.
+absl::Status ValidateShardMap(const ShardMap& shard_map);
+
+// Returns a shard map of version 1 that splits all the hashes evenly among the
+// given addresses.
+ShardMap CreateUniformShardMap(const std::vector<std::string>& kbs_addresses);
+
+// Returns the range containing `hash`, or nullptr if the shard map is empty.
+// The shard map must be valid.
+const ShardMap::Range* FindShard(const ShardMap& shard_map, uint64_t hash);
+
+// Returns true if all the hashes in [first_hash, last_hash] are assigned to
+// `kbs_address`.
+bool IsRangeAssignedTo(const ShardMap& shard_map, uint64_t first_hash,
+                       uint64_t last_hash, absl::string_view kbs_address);
+
+// Assigns the hashes in [first_hash, last_hash] to `kbs_address`, splitting and
+// merging the existing ranges as needed, and increases the version.
+absl::Status AssignRange(uint64_t first_hash, uint64_t last_hash,
+                         const std::string& kbs_address, ShardMap* shard_map);
+
+// Groups the indices of the keys by the address of their shard, for clients
+// sending a batch of keys to a sharded session.
+absl::flat_hash_map<std::string, std::vector<int>> PartitionKeysByShard(
+    const ShardMap& shard_map, const std::vector<absl::string_view>& keys);
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_SHARD_MAP_HELPER_H_
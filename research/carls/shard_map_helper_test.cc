@@ -0,0 +1,170 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/shard_map_helper.h"
+
+#include <limits>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "research/carls/base/proto_helper.h"
+#include "research/carls/testing/test_helper.h"
+
+namespace carls {
+namespace {
+
+constexpr uint64_t kMaxHash = std::numeric_limits<uint64_t>::max();
+
+using ::testing::ElementsAre;
+using ::testing::UnorderedElementsAre;
+
+TEST(ShardMapHelperTest, ShardKeyHash) {
+  // The hash must never change since clients and servers depend on it.
+  EXPECT_EQ(5223813793542995580ULL, ShardKeyHash("key"));
+  EXPECT_EQ(ShardKeyHash("key"), ShardKeyHash(std::string("key")));
+  EXPECT_NE(ShardKeyHash("key1"), ShardKeyHash("key2"));
+
+  // Similar keys are spread evenly.
+  int num_upper_half = 0;
+  for (int i = 0; i < 1000; ++i) {
+    if (ShardKeyHash(absl::StrCat("key", i)) > kMaxHash / 2) {
+      ++num_upper_half;
+    }
+  }
+  EXPECT_GT(num_upper_half, 400);
+  EXPECT_LT(num_upper_half, 600);
+}
+
+TEST(ShardMapHelperTest, ValidateShardMap) {
+  EXPECT_FALSE(ValidateShardMap(ShardMap()).ok());
+  EXPECT_OK(ValidateShardMap(CreateUniformShardMap({"a", "b", "c"})));
+
+  // Gap between ranges.
+  auto shard_map = ParseTextProtoOrDie<ShardMap>(R"pb(
+    range { first_hash: 0 last_hash: 10 kbs_address: "a" }
+    range {
+      first_hash: 12
+      last_hash: 18446744073709551615
+      kbs_address: "b"
+    }
+  )pb");
+  EXPECT_FALSE(ValidateShardMap(shard_map).ok());
+
+  // Not covering all the hashes.
+  shard_map = ParseTextProtoOrDie<ShardMap>(R"pb(
+    range { first_hash: 0 last_hash: 10 kbs_address: "a" }
+  )pb");
+  EXPECT_FALSE(ValidateShardMap(shard_map).ok());
+
+  // Empty address.
+  shard_map = ParseTextProtoOrDie<ShardMap>(R"pb(
+    range { first_hash: 0 last_hash: 18446744073709551615 }
+  )pb");
+  EXPECT_FALSE(ValidateShardMap(shard_map).ok());
+}
+
+TEST(ShardMapHelperTest, CreateUniformShardMap) {
+  EXPECT_TRUE(CreateUniformShardMap({}).range().empty());
+  EXPECT_THAT(CreateUniformShardMap({"a"}), EqualsProto<ShardMap>(R"pb(
+                version: 1
+                range {
+                  first_hash: 0
+                  last_hash: 18446744073709551615
+                  kbs_address: "a"
+                }
+              )pb"));
+  const auto shard_map = CreateUniformShardMap({"a", "b"});
+  ASSERT_EQ(2, shard_map.range_size());
+  EXPECT_EQ(kMaxHash / 2 - 1, shard_map.range(0).last_hash());
+  EXPECT_EQ(kMaxHash / 2, shard_map.range(1).first_hash());
+}
+
+TEST(ShardMapHelperTest, FindShard) {
+  EXPECT_EQ(nullptr, FindShard(ShardMap(), 0));
+  const auto shard_map = CreateUniformShardMap({"a", "b", "c"});
+  EXPECT_EQ("a", FindShard(shard_map, 0)->kbs_address());
+  EXPECT_EQ("a", FindShard(shard_map, shard_map.range(0).last_hash())
+                     ->kbs_address());
+  EXPECT_EQ("b", FindShard(shard_map, shard_map.range(1).first_hash())
+                     ->kbs_address());
+  EXPECT_EQ("c", FindShard(shard_map, kMaxHash)->kbs_address());
+}
+
+TEST(ShardMapHelperTest, AssignRange) {
+  auto shard_map = CreateUniformShardMap({"a"});
+  EXPECT_TRUE(IsRangeAssignedTo(shard_map, 0, kMaxHash, "a"));
+
+  // Splits the only range.
+  ASSERT_OK(AssignRange(100, 199, "b", &shard_map));
+  EXPECT_THAT(shard_map, EqualsProto<ShardMap>(R"pb(
+                version: 2
+                range { first_hash: 0 last_hash: 99 kbs_address: "a" }
+                range { first_hash: 100 last_hash: 199 kbs_address: "b" }
+                range {
+                  first_hash: 200
+                  last_hash: 18446744073709551615
+                  kbs_address: "a"
+                }
+              )pb"));
+  EXPECT_TRUE(IsRangeAssignedTo(shard_map, 100, 199, "b"));
+  EXPECT_FALSE(IsRangeAssignedTo(shard_map, 100, 200, "b"));
+  EXPECT_FALSE(IsRangeAssignedTo(shard_map, 0, kMaxHash, "a"));
+
+  // Overlaps two ranges.
+  ASSERT_OK(AssignRange(50, 149, "c", &shard_map));
+  EXPECT_THAT(shard_map, EqualsProto<ShardMap>(R"pb(
+                version: 3
+                range { first_hash: 0 last_hash: 49 kbs_address: "a" }
+                range { first_hash: 50 last_hash: 149 kbs_address: "c" }
+                range { first_hash: 150 last_hash: 199 kbs_address: "b" }
+                range {
+                  first_hash: 200
+                  last_hash: 18446744073709551615
+                  kbs_address: "a"
+                }
+              )pb"));
+
+  // Merges the adjacent ranges of the same address.
+  ASSERT_OK(AssignRange(50, 199, "a", &shard_map));
+  EXPECT_THAT(shard_map, EqualsProto<ShardMap>(R"pb(
+                version: 4
+                range {
+                  first_hash: 0
+                  last_hash: 18446744073709551615
+                  kbs_address: "a"
+                }
+              )pb"));
+
+  // Invalid inputs.
+  EXPECT_FALSE(AssignRange(10, 9, "a", &shard_map).ok());
+  EXPECT_FALSE(AssignRange(0, 9, "", &shard_map).ok());
+  ShardMap empty_shard_map;
+  EXPECT_FALSE(AssignRange(0, 9, "a", &empty_shard_map).ok());
+}
+
+TEST(ShardMapHelperTest, PartitionKeysByShard) {
+  auto shard_map = CreateUniformShardMap({"a"});
+  ASSERT_OK(AssignRange(ShardKeyHash("key2"), ShardKeyHash("key2"), "b",
+                        &shard_map));
+  const auto key_indices =
+      PartitionKeysByShard(shard_map, {"key1", "key2", "key3", "key2"});
+  ASSERT_EQ(2, key_indices.size());
+  EXPECT_THAT(key_indices.at("a"), ElementsAre(0, 2));
+  EXPECT_THAT(key_indices.at("b"), UnorderedElementsAre(1, 3));
+}
+
+}  // namespace
+}  // namespace carls
@@ -0,0 +1,168 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/staleness_clock.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <glog/logging.h>
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+
+namespace carls {
+
+StalenessClock::StalenessClock(const int max_staleness,
+                               const absl::Duration worker_timeout)
+    : max_staleness_(max_staleness), worker_timeout_(worker_timeout) {
+  CHECK_GE(max_staleness_, 0);
+  CHECK_GT(worker_timeout_, absl::ZeroDuration());
+}
+
+absl::Status StalenessClock::Advance(const std::string& worker_id,
+                                     const int64_t clock,
+                                     const absl::Time deadline,
+                                     absl::Duration* wait_time) {
+  if (wait_time != nullptr) {
+    *wait_time = absl::ZeroDuration();
+  }
+  absl::MutexLock l(&mu_);
+  const absl::Time start = absl::Now();
+  absl::Time next_expiry = ExpireWorkersLocked(start);
+  auto iter = clocks_.find(worker_id);
+  if (iter == clocks_.end()) {
+    // A new worker starts at the clock of the slowest active worker.
+    const int64_t min_clock = MinClockLocked();
+    iter = clocks_.emplace(worker_id, WorkerState()).first;
+    iter->second.clock = min_clock;
+  }
+  WorkerState& state = iter->second;
+  state.last_active = start;
+  if (clock > state.clock) {
+    state.clock = clock;
+    // The slowest worker may have moved forward.
+    cv_.SignalAll();
+  }
+  const int64_t current_clock = state.clock;
+  if (current_clock - MinClockLocked() <= max_staleness_) {
+    return absl::OkStatus();
+  }
+
+  bool timed_out = false;
+  ++state.num_waiting;
+  // A finished worker is removed from clocks_, its waiters are released. The
+  // wait also wakes up when an inactive worker expires.
+  while (current_clock - MinClockLocked() > max_staleness_) {
+    if (cv_.WaitWithDeadline(&mu_, std::min(deadline, next_expiry)) &&
+        absl::Now() >= deadline) {
+      timed_out = current_clock - MinClockLocked() > max_staleness_;
+      break;
+    }
+    // The worker may have called Finish() meanwhile.
+    if (!clocks_.contains(worker_id)) {
+      break;
+    }
+    next_expiry = ExpireWorkersLocked(absl::Now());
+  }
+  iter = clocks_.find(worker_id);
+  if (iter != clocks_.end()) {
+    --iter->second.num_waiting;
+    iter->second.last_active = absl::Now();
+  }
+  const absl::Duration waited = absl::Now() - start;
+  ++num_waits_;
+  total_wait_time_ += waited;
+  if (wait_time != nullptr) {
+    *wait_time = waited;
+  }
+  if (timed_out) {
+    return absl::DeadlineExceededError(absl::StrCat(
+        "Worker ", worker_id, " at clock ", current_clock,
+        " timed out waiting for the slowest worker at clock ",
+        MinClockLocked(), " with max_staleness ", max_staleness_));
+  }
+  return absl::OkStatus();
+}
+
+void StalenessClock::Finish(const std::string& worker_id) {
+  absl::MutexLock l(&mu_);
+  if (clocks_.erase(worker_id) > 0) {
+    cv_.SignalAll();
+  }
+}
+
+int64_t StalenessClock::MinClock() const {
+  absl::MutexLock l(&mu_);
+  return MinClockLocked();
+}
+
+int StalenessClock::NumWorkers() const {
+  absl::MutexLock l(&mu_);
+  return clocks_.size();
+}
+
+int64_t StalenessClock::NumWaits() const {
+  absl::MutexLock l(&mu_);
+  return num_waits_;
+}
+
+absl::Duration StalenessClock::TotalWaitTime() const {
+  absl::MutexLock l(&mu_);
+  return total_wait_time_;
+}
+
+int64_t StalenessClock::MinClockLocked() const {
+  if (clocks_.empty()) {
+    return 0;
+  }
+  int64_t min_clock = std::numeric_limits<int64_t>::max();
+  for (const auto& pair : clocks_) {
+    min_clock = std::min(min_clock, pair.second.clock);
+  }
+  return min_clock;
+}
+
+absl::Time StalenessClock::ExpireWorkersLocked(const absl::Time now) {
+  if (worker_timeout_ == absl::InfiniteDuration()) {
+    return absl::InfiniteFuture();
+  }
+  absl::Time next_expiry = absl::InfiniteFuture();
+  bool expired = false;
+  for (auto iter = clocks_.begin(); iter != clocks_.end();) {
+    const WorkerState& state = iter->second;
+    if (state.num_waiting > 0) {
+      ++iter;
+      continue;
+    }
+    const absl::Time expiry = state.last_active + worker_timeout_;
+    if (expiry <= now) {
+      LOG(WARNING) << "Worker " << iter->first << " at clock " << state.clock
+                   << " expired after " << worker_timeout_
+                   << " without advancing.";
+      clocks_.erase(iter++);
+      expired = true;
+    } else {
+      next_expiry = std::min(next_expiry, expiry);
+      ++iter;
+    }
+  }
+  if (expired) {
+    // The slowest worker may have been removed.
+    cv_.SignalAll();
+  }
+  return next_expiry;
+}
+
+}  // namespace carls
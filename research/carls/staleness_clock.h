@@ -0,0 +1,102 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_STALENESS_CLOCK_H_
+#define NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_STALENESS_CLOCK_H_
+
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace carls {
+
+// Keeps the clocks (training steps) of the workers of a session and bounds how
+// far a worker can run ahead of the slowest one, i.e., the
+// Stale-Synchronous-Parallel (SSP) consistency model. A worker at clock c can
+// only proceed when all the other workers reached c - max_staleness, so
+// max_staleness = 0 is fully synchronous training and a large value is close to
+// fully asynchronous training.
+//
+// A worker that has not called Advance() for `worker_timeout`, e.g., because
+// it crashed, is removed as if it had called Finish(), unless it is waiting in
+// Advance(). A new worker starts at the smallest clock of the active workers,
+// so that a worker joining late does not hold back the others.
+//
+// This class is thread-safe.
+class StalenessClock {
+ public:
+  explicit StalenessClock(
+      int max_staleness,
+      absl::Duration worker_timeout = absl::InfiniteDuration());
+
+  // Records that `worker_id` reached `clock` and blocks until the slowest
+  // worker is at most max_staleness clocks behind it, or until `deadline`.
+  // Clocks of a worker never go backward, a smaller clock is ignored. Returns
+  // DeadlineExceededError if the deadline is reached first, and outputs the
+  // time spent waiting in `wait_time` if it is not null.
+  absl::Status Advance(const std::string& worker_id, int64_t clock,
+                       absl::Time deadline, absl::Duration* wait_time);
+
+  // Removes a worker that stopped training, so that it no longer holds back
+  // the others.
+  void Finish(const std::string& worker_id);
+
+  // Returns the smallest clock of the active workers, or 0 if there is none.
+  int64_t MinClock() const;
+
+  int NumWorkers() const;
+
+  int max_staleness() const { return max_staleness_; }
+
+  // Returns the number of Advance() calls that had to wait and their total
+  // waiting time.
+  int64_t NumWaits() const;
+  absl::Duration TotalWaitTime() const;
+
+ private:
+  struct WorkerState {
+    // Latest clock of the worker.
+    int64_t clock = 0;
+    // Time of the latest Advance() of the worker.
+    absl::Time last_active;
+    // Number of the Advance() calls of the worker that are waiting.
+    int num_waiting = 0;
+  };
+
+  int64_t MinClockLocked() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Removes the workers that are not waiting and have been inactive for
+  // worker_timeout_ at `now`. Returns the time at which the next worker would
+  // expire, or InfiniteFuture() if none would.
+  absl::Time ExpireWorkersLocked(absl::Time now)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const int max_staleness_;
+  const absl::Duration worker_timeout_;
+
+  mutable absl::Mutex mu_;
+  absl::CondVar cv_;
+  // Maps from the id of a worker to its state.
+  absl::flat_hash_map<std::string, WorkerState> clocks_ ABSL_GUARDED_BY(mu_);
+  int64_t num_waits_ ABSL_GUARDED_BY(mu_) = 0;
+  absl::Duration total_wait_time_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace carls
+
+#endif  // NEURAL_STRUCTURED_LEARNING_RESEARCH_CARLS_STALENESS_CLOCK_H_
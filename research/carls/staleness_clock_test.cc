@@ -0,0 +1,130 @@
+/*Copyright 2021 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "research/carls/staleness_clock.h"
+
+#include "gtest/gtest.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "research/carls/base/thread_bundle.h"
+
+namespace carls {
+namespace {
+
+TEST(StalenessClockTest, WithinBoundDoesNotWait) {
+  StalenessClock clock(/*max_staleness=*/2);
+  absl::Duration wait_time;
+  EXPECT_TRUE(
+      clock.Advance("w1", 0, absl::InfiniteFuture(), &wait_time).ok());
+  EXPECT_TRUE(
+      clock.Advance("w2", 0, absl::InfiniteFuture(), &wait_time).ok());
+  EXPECT_TRUE(
+      clock.Advance("w1", 2, absl::InfiniteFuture(), &wait_time).ok());
+  EXPECT_EQ(absl::ZeroDuration(), wait_time);
+  EXPECT_EQ(0, clock.MinClock());
+  EXPECT_EQ(2, clock.NumWorkers());
+  EXPECT_EQ(0, clock.NumWaits());
+
+  // Clocks never go backward.
+  EXPECT_TRUE(clock.Advance("w1", 1, absl::InfiniteFuture(), nullptr).ok());
+  EXPECT_TRUE(clock.Advance("w2", 2, absl::InfiniteFuture(), nullptr).ok());
+  EXPECT_EQ(2, clock.MinClock());
+}
+
+TEST(StalenessClockTest, TimesOutBeyondBound) {
+  StalenessClock clock(/*max_staleness=*/1);
+  ASSERT_TRUE(clock.Advance("w1", 0, absl::InfiniteFuture(), nullptr).ok());
+  absl::Duration wait_time;
+  const auto status = clock.Advance(
+      "w2", 2, absl::Now() + absl::Milliseconds(50), &wait_time);
+  EXPECT_TRUE(absl::IsDeadlineExceeded(status));
+  EXPECT_GE(wait_time, absl::Milliseconds(50));
+  EXPECT_EQ(1, clock.NumWaits());
+  EXPECT_GE(clock.TotalWaitTime(), absl::Milliseconds(50));
+}
+
+TEST(StalenessClockTest, FastWorkerWaitsForSlowWorker) {
+  StalenessClock clock(/*max_staleness=*/1);
+  ASSERT_TRUE(clock.Advance("slow", 0, absl::InfiniteFuture(), nullptr).ok());
+
+  absl::Notification fast_done;
+  absl::Duration wait_time;
+  ThreadBundle fast;
+  fast.Add([&clock, &fast_done, &wait_time]() {
+    EXPECT_TRUE(
+        clock.Advance("fast", 3, absl::InfiniteFuture(), &wait_time).ok());
+    fast_done.Notify();
+  });
+  EXPECT_FALSE(fast_done.WaitForNotificationWithTimeout(absl::Seconds(0.2)));
+
+  // Still more than 1 clock behind.
+  ASSERT_TRUE(clock.Advance("slow", 1, absl::InfiniteFuture(), nullptr).ok());
+  EXPECT_FALSE(fast_done.WaitForNotificationWithTimeout(absl::Seconds(0.2)));
+
+  ASSERT_TRUE(clock.Advance("slow", 2, absl::InfiniteFuture(), nullptr).ok());
+  fast.JoinAll();
+  EXPECT_TRUE(fast_done.HasBeenNotified());
+  EXPECT_GE(wait_time, absl::Seconds(0.4));
+  EXPECT_EQ(1, clock.NumWaits());
+}
+
+TEST(StalenessClockTest, FinishReleasesWaiters) {
+  StalenessClock clock(/*max_staleness=*/0);
+  ASSERT_TRUE(clock.Advance("w1", 0, absl::InfiniteFuture(), nullptr).ok());
+
+  ThreadBundle waiter;
+  waiter.Add([&clock]() {
+    EXPECT_TRUE(clock.Advance("w2", 5, absl::InfiniteFuture(), nullptr).ok());
+  });
+  absl::SleepFor(absl::Milliseconds(50));
+  clock.Finish("w1");
+  waiter.JoinAll();
+  EXPECT_EQ(1, clock.NumWorkers());
+  EXPECT_EQ(5, clock.MinClock());
+
+  // Finishing an unknown worker is a no-op.
+  clock.Finish("unknown");
+  EXPECT_EQ(1, clock.NumWorkers());
+}
+
+TEST(StalenessClockTest, InactiveWorkerExpires) {
+  StalenessClock clock(/*max_staleness=*/0,
+                       /*worker_timeout=*/absl::Milliseconds(100));
+  ASSERT_TRUE(
+      clock.Advance("crashed", 0, absl::InfiniteFuture(), nullptr).ok());
+
+  // The waiting worker is released once the other one expires, and is not
+  // expired itself while it waits.
+  absl::Duration wait_time;
+  EXPECT_TRUE(
+      clock.Advance("w1", 1, absl::InfiniteFuture(), &wait_time).ok());
+  EXPECT_GE(wait_time, absl::Milliseconds(50));
+  EXPECT_EQ(1, clock.NumWorkers());
+  EXPECT_EQ(1, clock.MinClock());
+}
+
+TEST(StalenessClockTest, NewWorkerStartsAtMinClock) {
+  StalenessClock clock(/*max_staleness=*/1);
+  ASSERT_TRUE(clock.Advance("w1", 5, absl::InfiniteFuture(), nullptr).ok());
+  ASSERT_TRUE(clock.Advance("w2", 6, absl::InfiniteFuture(), nullptr).ok());
+
+  // A worker joining at clock 0 does not hold back the others.
+  ASSERT_TRUE(clock.Advance("w3", 0, absl::InfiniteFuture(), nullptr).ok());
+  EXPECT_EQ(5, clock.MinClock());
+  EXPECT_TRUE(clock.Advance("w2", 6, absl::Now(), nullptr).ok());
+}
+
+}  // namespace
+}  // namespace carls